@@ -10,8 +10,15 @@
 #include <SPI.h>
 #include <SD.h>
 #include <ArduinoJson.h>
+#include <SDNArchive.h>
+#include <SDNJsonStream.h>
+#include <SDNStorage.h>
+#include <MD5Builder.h>
 #include <HTTPClient.h>
 #include <vector>
+#include <algorithm>
+#include <time.h>
+#include <sys/time.h>
 
 // SD Card Pins
 #define SD_CS 5
@@ -19,6 +26,31 @@
 #define SD_MISO 19
 #define SD_SCK 18
 
+// Uncomment to expose /api/bench (hot path micro-benchmarks). The suite runs
+// on the device: the sketch needs the ESP32 core, SD and WebServer, and has
+// no host build.
+// #define SDN_ENABLE_BENCHMARKS
+
+#ifdef SDN_ENABLE_BENCHMARKS
+#include <esp_heap_caps.h>
+#endif
+
+// Types used in function signatures ahead of their definition. The Arduino
+// builder puts generated prototypes above the first function in the sketch.
+struct ChunkedWriter;
+struct CompiledRule;
+struct BenchResult;
+struct RollupSeries;
+struct ChartPoint;
+struct StoredFile;
+struct ExportWriter;
+struct FirmwareSlot;
+enum MaintenancePhase : uint8_t;
+enum JsonEdit : uint8_t;
+struct DeviceLiveness;
+struct SensorReading;
+struct SensorPayload;
+
 // Login credentials
 const char* username = "admin";
 const char* password = "admin";
@@ -43,6 +75,343 @@ struct DiscoveredDevice {
 // Global variables
 std::vector<DiscoveredDevice> discoveredDevices;
 
+// ==================== METRICS ====================
+// Hot path updates are plain integer adds; rendering happens only when
+// /api/metrics is scraped.
+#define LATENCY_BUCKET_COUNT 8
+#define MAX_ROUTE_METRICS 40
+
+const unsigned long LATENCY_BUCKETS_US[LATENCY_BUCKET_COUNT] = {
+  1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000
+};
+const char* LATENCY_BUCKET_LABELS[LATENCY_BUCKET_COUNT] = {
+  "0.001", "0.005", "0.01", "0.05", "0.1", "0.5", "1", "5"
+};
+
+struct LatencyHistogram {
+  uint32_t buckets[LATENCY_BUCKET_COUNT + 1]; // Last slot is +Inf
+  uint32_t count;
+  uint64_t sumMicros;
+
+  void observe(unsigned long elapsedMicros) {
+    int i = 0;
+    while (i < LATENCY_BUCKET_COUNT && elapsedMicros > LATENCY_BUCKETS_US[i]) i++;
+    buckets[i]++;
+    count++;
+    sumMicros += elapsedMicros;
+  }
+};
+
+struct RouteMetrics {
+  const char* uri;
+  LatencyHistogram latency;
+};
+
+struct ControlPlaneMetrics {
+  RouteMetrics routes[MAX_ROUTE_METRICS];
+  int routeCount;
+  LatencyHistogram sdRead;
+  LatencyHistogram sdWrite;
+  uint64_t sdReadBytes;
+  uint64_t sdWriteBytes;
+  uint32_t jsonParseFailuresFile;
+  uint32_t jsonParseFailuresRequest;
+  LatencyHistogram loopTime;
+  uint32_t ruleEvaluations;
+  uint32_t ruleFirings;
+  LatencyHistogram maintenanceSlice;
+  uint32_t duplicatePayloads;  // Numbered sensor payloads dropped as seen
+  uint32_t payloadGaps;        // Payload numbers jumped over
+  uint32_t deliveryEvictions;  // Devices dropped from the delivery table
+  uint32_t timestampsRejected; // Device stamps replaced by the receive time
+  uint32_t readingsHeld;       // Readings held until the clock was seeded
+};
+
+ControlPlaneMetrics metrics;
+
+// Per-device metrics: latest data plane stage timings from the heartbeat
+// and the distribution of command actuation latency (accept to execution
+// finish). Payload delivery is tracked for the whole fleet apart from this
+// (see DeviceDelivery).
+#define MAX_DEVICE_METRICS 32
+#define DEVICE_STAGE_COUNT 6
+const char* DEVICE_STAGE_NAMES[DEVICE_STAGE_COUNT] = {
+  "read", "encode", "post", "heartbeat", "command", "cycle"
+};
+const char* DEVICE_STAGE_STATS[4] = {"min", "avg", "max", "p95"};
+
+struct DeviceMetrics {
+  char deviceId[24];
+  uint32_t stageStats[DEVICE_STAGE_COUNT][4]; // Microseconds, in DEVICE_STAGE_STATS order
+  bool stageReported[DEVICE_STAGE_COUNT];
+  LatencyHistogram actuation;
+  bool clockReported;       // Heartbeat "clock": the device's own estimate
+  bool clockSynced;
+  uint32_t clockErrorMs;    // Half the round-trip of its best sample
+  float clockDriftPpm;
+};
+
+DeviceMetrics deviceMetrics[MAX_DEVICE_METRICS];
+int deviceMetricsCount = 0;
+
+// Wraps a route handler so every call is counted and timed
+WebServer::THandlerFunction instrumentRoute(const char* uri, WebServer::THandlerFunction handler) {
+  if (metrics.routeCount >= MAX_ROUTE_METRICS) {
+    return handler;
+  }
+  RouteMetrics* route = &metrics.routes[metrics.routeCount++];
+  route->uri = uri;
+  return [route, handler]() {
+    unsigned long start = micros();
+    handler();
+    route->latency.observe(micros() - start);
+  };
+}
+
+// Finds a device's metrics slot, claiming a free one on first use.
+// Returns nullptr once the table is full.
+DeviceMetrics* findDeviceMetrics(const String& deviceId) {
+  for (int i = 0; i < deviceMetricsCount; i++) {
+    if (deviceId == deviceMetrics[i].deviceId) {
+      return &deviceMetrics[i];
+    }
+  }
+  if (deviceMetricsCount >= MAX_DEVICE_METRICS) return nullptr;
+  DeviceMetrics* entry = &deviceMetrics[deviceMetricsCount++];
+  strlcpy(entry->deviceId, deviceId.c_str(), sizeof(entry->deviceId));
+  return entry;
+}
+
+// Keeps the "timing" object of a heartbeat: {"stage":[min,avg,max,p95],...}
+void recordStageTimings(const String& deviceId, JsonObject timing) {
+  if (timing.isNull()) return;
+
+  DeviceMetrics* entry = findDeviceMetrics(deviceId);
+  if (!entry) return;
+
+  for (int stage = 0; stage < DEVICE_STAGE_COUNT; stage++) {
+    JsonArray stats = timing[DEVICE_STAGE_NAMES[stage]].as<JsonArray>();
+    entry->stageReported[stage] = stats.size() == 4;
+    if (!entry->stageReported[stage]) continue;
+    for (int i = 0; i < 4; i++) {
+      entry->stageStats[stage][i] = stats[i];
+    }
+  }
+}
+
+// Keeps the "clock" object of a heartbeat: {"synced","errorMs","driftPpm"}
+void recordClockEstimate(const String& deviceId, JsonObject clock) {
+  if (clock.isNull()) return;
+
+  DeviceMetrics* entry = findDeviceMetrics(deviceId);
+  if (!entry) return;
+  entry->clockReported = true;
+  entry->clockSynced = clock["synced"] | false;
+  entry->clockErrorMs = clock["errorMs"] | 0UL;
+  entry->clockDriftPpm = clock["driftPpm"] | 0.0f;
+}
+
+void addRoute(const char* uri, WebServer::THandlerFunction handler) {
+  server.on(uri, instrumentRoute(uri, handler));
+}
+
+void addRoute(const char* uri, HTTPMethod method, WebServer::THandlerFunction handler) {
+  server.on(uri, method, instrumentRoute(uri, handler));
+}
+
+// Reads a JSON document from an open SD file, recording latency and bytes
+DeserializationError readJson(JsonDocument& doc, File& file) {
+  unsigned long start = micros();
+  DeserializationError error = deserializeJson(doc, file);
+  metrics.sdRead.observe(micros() - start);
+  metrics.sdReadBytes += file.size();
+  if (error) metrics.jsonParseFailuresFile++;
+  return error;
+}
+
+// Writes a JSON document to an open SD file, recording latency and bytes
+size_t writeJson(const JsonDocument& doc, File& file) {
+  unsigned long start = micros();
+  size_t written = serializeJson(doc, file);
+  metrics.sdWrite.observe(micros() - start);
+  metrics.sdWriteBytes += written;
+  return written;
+}
+
+// Parses a request or device response body, counting failures
+DeserializationError parseJson(JsonDocument& doc, const String& body) {
+  DeserializationError error = deserializeJson(doc, body);
+  if (error) metrics.jsonParseFailuresRequest++;
+  return error;
+}
+
+// Streams an SD file to the client, recording read latency and bytes
+void streamSdFile(File& file, const String& contentType) {
+  unsigned long start = micros();
+  size_t sent = server.streamFile(file, contentType);
+  metrics.sdRead.observe(micros() - start);
+  metrics.sdReadBytes += sent;
+}
+
+// Buffers a chunked response body and sends it in pieces of up to 1 KB.
+// It is a Print, so serializeJson() can stream into it.
+struct ChunkedWriter : public Print {
+  char buffer[1024];
+  size_t length = 0;
+
+  size_t write(uint8_t c) override {
+    if (length >= sizeof(buffer)) flush();
+    buffer[length++] = c;
+    return 1;
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    for (size_t i = 0; i < size; i++) write(data[i]);
+    return size;
+  }
+
+  void printf(const char* format, ...) {
+    char line[192];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (n <= 0) return;
+    if ((size_t)n >= sizeof(line)) n = sizeof(line) - 1;
+
+    if (length + n > sizeof(buffer)) flush();
+    memcpy(buffer + length, line, n);
+    length += n;
+  }
+
+  void flush() {
+    if (length > 0) {
+      server.sendContent(buffer, length);
+      length = 0;
+    }
+  }
+};
+
+// ==================== STREAMED DOCUMENTS ====================
+// The registry and command files are {"<key>":[...]} documents of any
+// length. They are read and rewritten one element at a time with
+// SDNJsonStream, so memory stays at one element whatever the fleet size.
+#define JSON_ELEMENT_CAPACITY 1024
+
+enum JsonEdit : uint8_t {JSON_KEEP, JSON_CHANGED, JSON_DROP};
+
+// Visits the elements of an SD document's `key` array until `visit`
+// returns false. A missing file or array reads as empty. Returns false if
+// the document is corrupt or an element does not fit. `filter` may be
+// nullptr.
+bool scanJsonArray(const char* path, const char* key, JsonDocument* filter,
+                   std::function<bool(JsonObject element)> visit) {
+  File file = SD.open(path, FILE_READ);
+  if (!file) return true;
+
+  unsigned long start = micros();
+  JsonArrayReader reader(file);
+  StaticJsonDocument<JSON_ELEMENT_CAPACITY> element;
+  if (reader.begin(key)) {
+    while (filter ? reader.next(element, *filter) : reader.next(element)) {
+      if (!visit(element.as<JsonObject>())) break;
+    }
+  }
+  metrics.sdRead.observe(micros() - start);
+  metrics.sdReadBytes += file.position();
+  file.close();
+
+  if (reader.error()) {
+    metrics.jsonParseFailuresFile++;
+    return false;
+  }
+  return true;
+}
+
+// Rewrites an SD document's `key` array through <path>.tmp: `visit` keeps,
+// changes or drops each element, then `append` may add more. The file is
+// only replaced if something changed and every element was read, so a
+// corrupt or oversized document is never written back truncated. Members
+// other than `key` are not kept. Returns false if the document could not
+// be read or written.
+bool rewriteJsonArray(const char* path, const char* key,
+                      std::function<JsonEdit(JsonObject element)> visit,
+                      std::function<void(JsonArrayWriter& writer)> append) {
+  String tempPath = String(path) + ".tmp";
+  File out = SD.open(tempPath, FILE_WRITE);
+  if (!out) return false;
+
+  unsigned long start = micros();
+  JsonArrayWriter writer(out);
+  writer.beginArray(key);
+  bool changed = false;
+  bool complete = true;
+
+  File in = SD.open(path, FILE_READ);
+  if (in) {
+    JsonArrayReader reader(in);
+    StaticJsonDocument<JSON_ELEMENT_CAPACITY> element;
+    if (reader.begin(key)) {
+      while (reader.next(element)) {
+        JsonEdit edit = visit ? visit(element.as<JsonObject>()) : JSON_KEEP;
+        if (edit != JSON_KEEP) changed = true;
+        if (edit != JSON_DROP) writer.add(element);
+      }
+    }
+    complete = !reader.error();
+    metrics.sdReadBytes += in.position();
+    in.close();
+  }
+
+  size_t kept = writer.count;
+  if (complete && append) append(writer);
+  changed = changed || writer.count != kept;
+  writer.end();
+  out.close();
+  metrics.sdWrite.observe(micros() - start);
+  metrics.sdWriteBytes += writer.written;
+
+  if (!complete || !changed) {
+    if (!complete) metrics.jsonParseFailuresFile++;
+    SD.remove(tempPath);
+    return complete;
+  }
+  SD.remove(path);
+  return SD.rename(tempPath, path);
+}
+
+// Adds one element to the end of an SD document's `key` array, in place
+// when the file already ends with that array
+bool appendJsonArray(const char* path, const char* key, JsonVariantConst element) {
+  File file = SD.open(path, "r+");
+  if (file) {
+    unsigned long start = micros();
+    size_t written = appendJsonArrayElement(file, element);
+    file.close();
+    if (written > 0) {
+      metrics.sdWrite.observe(micros() - start);
+      metrics.sdWriteBytes += written;
+      return true;
+    }
+  }
+  return rewriteJsonArray(path, key, nullptr, [&](JsonArrayWriter& writer) {
+    writer.add(element);
+  });
+}
+
+// Elements in an SD document's `key` array, counted without parsing them
+int countJsonArray(const char* path, const char* key) {
+  File file = SD.open(path, FILE_READ);
+  if (!file) return 0;
+  JsonArrayReader reader(file);
+  if (reader.begin(key)) {
+    while (reader.skip()) {}
+  }
+  metrics.sdReadBytes += file.position();
+  file.close();
+  return reader.count;
+}
+
 // ==================== WIFI AP MODE ====================
 void setupWiFiAP() {
   WiFi.softAP("ESP32-IoT-Server", "12345678");
@@ -52,16 +421,164 @@ void setupWiFiAP() {
 }
 
 // ==================== SD CARD INIT ====================
+// The files written on every payload (day file, partition log and index,
+// rollups, cloud queue) go through `storage` (see SDNStorage): kept open
+// and written in whole sectors. A power cut loses at most
+// STORAGE_FLUSH_MS + STORAGE_SYNC_MS of readings. Code reading one of them
+// calls storage.sync() first; code renaming or removing one storage.close().
+#define SD_FREQUENCY 4000000
+#define SD_MAX_FILES 12        // Storage handles plus archive, trim and request files
+#define STORAGE_FLUSH_MS 2000
+#define STORAGE_SYNC_MS 5000
+#define STORAGE_IDLE_MS 60000
+
+StorageCache storage(SD, {STORAGE_FLUSH_MS, STORAGE_SYNC_MS, STORAGE_IDLE_MS});
+
 void initSDCard() {
   SPI.begin(SD_SCK, SD_MISO, SD_MOSI, SD_CS);
-  if (!SD.begin(SD_CS)) {
+  if (!SD.begin(SD_CS, SPI, SD_FREQUENCY, "/sd", SD_MAX_FILES)) {
     Serial.println("SD Card Mount Failed");
     return;
   }
   Serial.println("SD Card Initialized.");
 }
 
+// ==================== CLOCK ====================
+// Stored data is stamped with UTC epoch seconds. In AP mode there is no
+// network time, so the clock is seeded with the dashboard browser's clock
+// (POST /api/time) and then kept by the ESP32 RTC, which survives soft
+// resets. Until it is seeded, time() counts from boot: readings stamped by
+// a synced data plane keep their stamp, the others are held (see UNSYNCED
+// READINGS) and dated once the clock is seeded. Data planes estimate their
+// own offset from the heartbeat round-trip (see handleHeartbeat()).
+#define CLOCK_VALID_EPOCH 1704067200UL // 2024-01-01; floor of clockValidEpoch()
+#define CLOCK_RESEED_MS 2000           // Smaller browser offsets are left alone
+
+enum ClockSource : uint8_t { CLOCK_NONE, CLOCK_RTC, CLOCK_BROWSER };
+const char* CLOCK_SOURCE_NAMES[] = {"none", "rtc", "browser"};
+
+struct ControlClock {
+  ClockSource source = CLOCK_NONE;
+  uint32_t seededAt = 0;        // Epoch of the last seed
+  int32_t lastCorrectionMs = 0; // Step applied by the last seed
+  uint32_t seeds = 0;
+};
+
+ControlClock controlClock;
+int32_t heldShift = 0; // Seconds from boot-relative time() to epoch, set by the first seed
+
+// Build date of this firmware: a clock or stamp before it was never set
+uint32_t clockValidEpoch() {
+  static uint32_t epoch = 0;
+  if (epoch == 0) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4] = "";
+    struct tm day = {};
+    const char* found;
+    if (sscanf(__DATE__, "%3s %d %d", month, &day.tm_mday, &day.tm_year) == 3 && (found = strstr(months, month))) {
+      day.tm_mon = (found - months) / 3;
+      day.tm_year -= 1900;
+      epoch = mktime(&day);
+    }
+    epoch = std::max<uint32_t>(epoch, CLOCK_VALID_EPOCH);
+  }
+  return epoch;
+}
+
+bool clockSynced() {
+  return time(nullptr) >= (time_t)clockValidEpoch();
+}
+
+uint32_t epochNow() {
+  return time(nullptr);
+}
+
+uint64_t epochMillisNow() {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// Epoch of an earlier millis() reading
+uint32_t epochAt(unsigned long ms) {
+  return epochNow() - (millis() - ms) / 1000;
+}
+
+String dateString(uint32_t epoch) {
+  time_t seconds = epoch;
+  struct tm day;
+  gmtime_r(&seconds, &day);
+  char buffer[11];
+  strftime(buffer, sizeof(buffer), "%Y-%m-%d", &day);
+  return buffer;
+}
+
+void initClock() {
+  if (clockSynced()) {
+    controlClock.source = CLOCK_RTC;
+    Serial.printf("Clock kept by RTC: %s\n", dateString(epochNow()).c_str());
+  }
+}
+
+// Steps the clock to epochMs unless it is already within CLOCK_RESEED_MS
+bool seedClock(uint64_t epochMs, ClockSource source) {
+  if (epochMs < (uint64_t)clockValidEpoch() * 1000) return false;
+  int64_t correction = (int64_t)(epochMs - epochMillisNow());
+  if (!clockSynced()) heldShift = (correction + 500) / 1000; // Dates the held readings
+  if (clockSynced() && llabs(correction) < CLOCK_RESEED_MS) return false;
+
+  struct timeval seed;
+  seed.tv_sec = epochMs / 1000;
+  seed.tv_usec = (epochMs % 1000) * 1000;
+  settimeofday(&seed, nullptr);
+  controlClock.source = source;
+  controlClock.seededAt = seed.tv_sec;
+  controlClock.lastCorrectionMs = constrain(correction, (int64_t)INT32_MIN, (int64_t)INT32_MAX);
+  controlClock.seeds++;
+  Serial.printf("Clock set from %s: %s\n", CLOCK_SOURCE_NAMES[source], dateString(seed.tv_sec).c_str());
+  return true;
+}
+
+// GET /api/time reports the clock; POST {"epochMs":<Date.now()>} seeds it
+void handleTime() {
+  if (server.method() == HTTP_POST) {
+    StaticJsonDocument<128> request;
+    if (parseJson(request, server.arg("plain"))) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
+      return;
+    }
+    // Sent as a number; doubles hold epoch milliseconds exactly
+    double epochMs = request["epochMs"] | 0.0;
+    if (epochMs < (double)clockValidEpoch() * 1000) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid epochMs\"}");
+      return;
+    }
+    seedClock((uint64_t)epochMs, CLOCK_BROWSER);
+  } else if (server.method() != HTTP_GET) {
+    server.send(405, "text/plain", "Method Not Allowed");
+    return;
+  }
+
+  StaticJsonDocument<192> response;
+  response["epoch"] = epochNow();
+  response["synced"] = clockSynced();
+  response["source"] = CLOCK_SOURCE_NAMES[controlClock.source];
+  response["seededAt"] = controlClock.seededAt;
+  response["lastCorrectionMs"] = controlClock.lastCorrectionMs;
+  String body;
+  serializeJson(response, body);
+  server.send(200, "application/json", body);
+}
+
 // ==================== OFFLINE STORAGE ====================
+// First <stem>.<n><extension>, counting n from 1, that does not exist
+String freePath(const String& stem, const char* extension) {
+  for (int n = 1;; n++) {
+    String path = stem + "." + n + extension;
+    if (!SD.exists(path)) return path;
+  }
+}
+
 bool createDirectoryIfNotExists(const char* path) {
   if (!SD.exists(path)) {
     return SD.mkdir(path);
@@ -74,17 +591,10 @@ void initOfflineStorage() {
   createDirectoryIfNotExists("/data/sensors");
   createDirectoryIfNotExists("/data/commands");
   createDirectoryIfNotExists("/data/cloud");
+  createDirectoryIfNotExists("/data/devices");
+  createDirectoryIfNotExists("/data/archive");
   createDirectoryIfNotExists("/config");
   
-  // Initialize cloud queue if not exists
-  if (!SD.exists("/data/cloud/queue.json")) {
-    File file = SD.open("/data/cloud/queue.json", FILE_WRITE);
-    if (file) {
-      file.print("{\"queue\":[]}");
-      file.close();
-    }
-  }
-  
   // Initialize devices config if not exists
   if (!SD.exists("/config/devices.json")) {
     File file = SD.open("/config/devices.json", FILE_WRITE);
@@ -95,1241 +605,5358 @@ void initOfflineStorage() {
   }
 }
 
+// UTC date of the control plane clock
 String getTodayDateString() {
-  // Simple date implementation - in production use RTC
-  static int dayCounter = 1;
-  return "2024-01-" + String(dayCounter < 10 ? "0" : "") + String(dayCounter);
+  return dateString(epochNow());
 }
 
-bool saveSensorData(String deviceId, String deviceName, String sensorType, 
-                   float value, String unit, String timestamp) {
-  String dateStr = getTodayDateString();
+// One normalized element of a data plane payload's readings[] array
+#define INGEST_MAX_READINGS 16
+
+struct SensorReading {
+  char type[16];
+  float value;
+  char unit[12];
+  char status[8];
+  uint32_t timestamp; // Epoch seconds, see normalizeTimestamp()
+};
+
+struct SensorPayload {
+  String deviceId;
+  String deviceName;
+  bool sequenced;          // Carries "seq" (data planes since sequence numbering)
+  uint32_t sequence;
+  bool sequenceRestart;    // First payload of the device's boot
+  SensorReading readings[INGEST_MAX_READINGS];
+  int count = 0;
+};
+
+// Appends readings of one payload, all of day `dateStr`, to the day file in
+// a single write
+bool saveSensorData(const String& dateStr, const String& deviceId, const String& deviceName,
+                    const SensorReading* readings, int count) {
   String filename = "/data/sensors/" + dateStr + ".json";
   
-  StaticJsonDocument<1024> dayData;
-  
-  // Load existing data if file exists
-  if (SD.exists(filename)) {
-    File file = SD.open(filename, FILE_READ);
-    if (file) {
-      DeserializationError error = deserializeJson(dayData, file);
-      file.close();
-      if (error) {
-        dayData["date"] = dateStr;
-        dayData["data"] = JsonArray();
-      }
-    }
-  } else {
-    dayData["date"] = dateStr;
-    dayData["data"] = JsonArray();
-  }
-  
-  // Add new data point
-  JsonArray dataArray = dayData["data"].as<JsonArray>();
-  JsonObject newData = dataArray.createNestedObject();
-  newData["timestamp"] = timestamp;
-  newData["deviceId"] = deviceId;
-  newData["deviceName"] = deviceName;
-  newData["type"] = sensorType;
-  newData["value"] = value;
-  newData["unit"] = unit;
-  newData["status"] = "ok";
-  
-  // Save back to file
-  File file = SD.open(filename, FILE_WRITE);
-  if (file) {
-    serializeJson(dayData, file);
-    file.close();
-    return true;
+  DynamicJsonDocument newData(64 + count * 160);
+  JsonArray rows = newData.to<JsonArray>();
+  for (int i = 0; i < count; i++) {
+    JsonObject row = rows.createNestedObject();
+    row["timestamp"] = readings[i].timestamp;
+    row["deviceId"] = deviceId;
+    row["deviceName"] = deviceName;
+    row["type"] = readings[i].type;
+    row["value"] = readings[i].value;
+    row["unit"] = readings[i].unit;
+    row["status"] = readings[i].status;
   }
-  return false;
-}
-
-void addToCloudQueue(JsonObject sensorData) {
-  File file = SD.open("/data/cloud/queue.json", FILE_READ);
-  StaticJsonDocument<2048> queueData;
   
+  // Appended in place through a handle kept open, so a payload costs the
+  // same however full the day is. Either way fewer bytes than the rows
+  // serialize to is a failed write.
+  unsigned long start = micros();
+  size_t expected = measureJson(rows);
+  size_t written = 0;
+  File* file = storage.edit(filename.c_str(), false);
   if (file) {
-    DeserializationError error = deserializeJson(queueData, file);
-    file.close();
-    if (error) {
-      queueData["queue"] = JsonArray();
+    bool empty = file->size() == 0;
+    written = appendJsonArrayElements(*file, rows);
+    if (written == 0) {
+      // Not a complete day document (torn write); keep it aside. An empty
+      // file is just recreated.
+      storage.close(filename.c_str());
+      if (!empty) SD.rename(filename, freePath(filename, ".bad"));
     }
-  } else {
-    queueData["queue"] = JsonArray();
   }
   
-  JsonArray queue = queueData["queue"].as<JsonArray>();
-  queue.add(sensorData);
-  
-  // Save back
-  File saveFile = SD.open("/data/cloud/queue.json", FILE_WRITE);
-  if (saveFile) {
-    serializeJson(queueData, saveFile);
-    saveFile.close();
+  if (written == 0) {
+    file = storage.edit(filename.c_str(), true);
+    if (!file) return false;
+    StaticJsonDocument<64> day;
+    day["date"] = dateStr;
+    JsonArrayWriter writer(*file);
+    writer.member("date", day["date"]);
+    writer.beginArray("data");
+    for (JsonVariantConst row : rows) {
+      writer.add(row);
+    }
+    writer.end();
+    written = writer.written;
+    expected += measureJson(day) + 8; // {"date":...,"data":[...]}
   }
+  metrics.sdWrite.observe(micros() - start);
+  metrics.sdWriteBytes += written;
+  return written >= expected;
 }
 
-// ==================== FILE SERVING ====================
-String getContentType(String filename) {
-  if (filename.endsWith(".html")) return "text/html";
-  if (filename.endsWith(".css")) return "text/css";
-  if (filename.endsWith(".js")) return "application/javascript";
-  return "text/plain";
+// ==================== DEVICE PARTITIONS ====================
+// Besides the day file, each reading is appended to its device's partition
+// /data/devices/<id>/<date>.log (NDJSON, one reading per line, oldest first).
+// <date>.idx is a sparse index of fixed {timestamp, offset} entries: one for
+// the record crossing each SENSOR_INDEX_STRIDE bytes of log. A range query
+// binary-searches the index and reads forward from there, so it costs about
+// the rows returned plus one stride, whatever the rest of the fleet sends.
+#define SENSOR_INDEX_STRIDE 4096
+#define SENSOR_QUERY_LIMIT 1000
+#define TIMESTAMP_PREFIX "{\"timestamp\":"
+
+struct SensorIndexEntry {
+  uint32_t timestamp;
+  uint32_t offset;
+};
+
+// Control plane clock used to order and index readings, in epoch seconds
+unsigned long readingTimestamp() {
+  return epochNow();
 }
 
-bool handleFileRead(String path) {
-  if (path.endsWith("/")) path += "login.html";
-  String contentType = getContentType(path);
-  String fullPath = "/web" + path;
-  if (SD.exists(fullPath)) {
-    File file = SD.open(fullPath, FILE_READ);
-    server.streamFile(file, contentType);
-    file.close();
-    return true;
+// Device IDs and dates become path components, so only allow safe characters
+bool isSafePathPart(const String& part) {
+  if (part.isEmpty() || part.length() > 32) return false;
+  for (unsigned int i = 0; i < part.length(); i++) {
+    char c = part[i];
+    if (!isalnum(c) && c != '_' && c != '-') return false;
   }
-  return false;
+  return true;
 }
 
-// ==================== AUTHENTICATION ====================
-void handleLogin() {
-  if (server.method() == HTTP_POST) {
-    String user = server.arg("username");
-    String pass = server.arg("password");
-    if (user == username && pass == password) {
-      server.send(200, "application/json", "{\"success\":true, \"token\":\"dummy-token\"}");
+String partitionPath(const String& deviceId, const String& date, const char* extension) {
+  return "/data/devices/" + deviceId + "/" + date + extension;
+}
+
+// Appends a payload's readings of one day to the device's partition, and to
+// the index if a record crosses a stride boundary. Both stay open and
+// buffered in `storage`.
+bool appendDeviceReadings(const String& deviceId, const String& date, const SensorReading* readings,
+                          int count) {
+  if (!isSafePathPart(deviceId)) return false;
+
+  String logPath = partitionPath(deviceId, date, ".log");
+  unsigned long start = micros();
+  uint32_t offset = storage.size(logPath.c_str());
+  if (offset == 0 && !SD.exists(logPath)) {
+    createDirectoryIfNotExists("/data/devices");
+    createDirectoryIfNotExists(("/data/devices/" + deviceId).c_str());
+  }
+
+  SensorIndexEntry entries[INGEST_MAX_READINGS];
+  int indexed = 0;
+  size_t written = 0;
+  for (int i = 0; i < count; i++) {
+    StaticJsonDocument<192> record;
+    record["timestamp"] = readings[i].timestamp; // Must stay first, see TIMESTAMP_PREFIX
+    record["type"] = readings[i].type;
+    record["value"] = readings[i].value;
+    record["unit"] = readings[i].unit;
+    char line[160];
+    size_t length = serializeJson(record, line, sizeof(line) - 1);
+    line[length++] = '\n';
+    if (!storage.append(logPath.c_str(), (const uint8_t*)line, length)) return false;
+
+    // Index this record if a stride boundary falls inside it
+    if (offset == 0 || (offset - 1) / SENSOR_INDEX_STRIDE != (offset + length - 1) / SENSOR_INDEX_STRIDE) {
+      entries[indexed++] = {readings[i].timestamp, offset};
+    }
+    offset += length;
+    written += length;
+  }
+  if (indexed > 0) {
+    storage.append(partitionPath(deviceId, date, ".idx").c_str(), (const uint8_t*)entries,
+                   indexed * sizeof(SensorIndexEntry));
+  }
+  metrics.sdWrite.observe(micros() - start);
+  metrics.sdWriteBytes += written;
+  return true;
+}
+
+// Offset of the last indexed record older than `from` (0 if none). Every
+// record before it is older too, so a query can start reading there.
+uint32_t findPartitionOffset(const String& indexPath, uint32_t from) {
+  storage.sync(indexPath.c_str());
+  File index = SD.open(indexPath, FILE_READ);
+  if (!index) return 0;
+
+  uint32_t offset = 0;
+  size_t low = 0;
+  size_t high = index.size() / sizeof(SensorIndexEntry);
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    SensorIndexEntry entry;
+    index.seek(mid * sizeof(entry));
+    index.read((uint8_t*)&entry, sizeof(entry));
+    if (entry.timestamp < from) {
+      offset = entry.offset;
+      low = mid + 1;
     } else {
-      server.send(401, "application/json", "{\"success\":false, \"message\":\"Invalid credentials\"}");
+      high = mid;
     }
-  } else {
-    server.send(405, "text/plain", "Method Not Allowed");
   }
+  index.close();
+  return offset;
 }
 
-void handleLogout() {
-  if (server.method() == HTTP_POST) {
-    server.send(200, "application/json", "{\"success\":true,\"message\":\"Logged out\"}");
-  } else {
-    server.send(405, "text/plain", "Method Not Allowed");
+// Calls visit() for each of a device's log lines in [from, to] for a day,
+// oldest first, until it returns false
+void scanDevicePartition(const String& deviceId, const String& date, uint32_t from, uint32_t to,
+                         std::function<bool(const char* line, size_t length, uint32_t timestamp)> visit) {
+  String logPath = partitionPath(deviceId, date, ".log");
+  storage.sync(logPath.c_str());
+  File log = SD.open(logPath, FILE_READ);
+  if (!log) return;
+
+  unsigned long start = micros();
+  log.setTimeout(0); // Stream reads would otherwise wait a second at EOF
+  log.seek(findPartitionOffset(partitionPath(deviceId, date, ".idx"), from));
+
+  char line[160];
+  const size_t prefixLength = strlen(TIMESTAMP_PREFIX);
+  size_t bytesRead = 0;
+  while (true) {
+    size_t length = log.readBytesUntil('\n', line, sizeof(line) - 1);
+    if (length == 0) break;
+    bytesRead += length + 1;
+    if (length <= prefixLength || strncmp(line, TIMESTAMP_PREFIX, prefixLength) != 0) continue;
+
+    uint32_t timestamp = strtoul(line + prefixLength, nullptr, 10);
+    if (timestamp < from) continue;
+    if (timestamp > to) break;
+
+    line[length] = '\0';
+    if (!visit(line, length, timestamp)) break;
   }
+  log.close();
+  metrics.sdRead.observe(micros() - start);
+  metrics.sdReadBytes += bytesRead;
 }
 
-// ==================== DEVICE DISCOVERY ====================
-bool getDeviceInfo(String ssid, DiscoveredDevice& device) {
-  Serial.println("Connecting to " + ssid + " to get device info...");
-  
-  // Connect to device AP
-  WiFi.begin(ssid.c_str(), "12345678");
-  
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 10) {
-    delay(500);
-    attempts++;
+// Streams one device's readings in [from, to] for a day as chunked JSON
+void streamDeviceHistory(const String& deviceId, const String& date, uint32_t from, uint32_t to, int limit) {
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  ChunkedWriter out;
+  out.printf("{\"deviceId\":\"%s\",\"date\":\"%s\",\"data\":[", deviceId.c_str(), date.c_str());
+
+  int rows = 0;
+  scanDevicePartition(deviceId, date, from, to, [&](const char* line, size_t length, uint32_t timestamp) {
+    if (rows >= limit) return false;
+    if (rows++ > 0) out.write(',');
+    out.write((const uint8_t*)line, length);
+    return true;
+  });
+
+  out.printf("]}");
+  out.flush();
+  server.sendContent("");
+}
+
+// ==================== ROLLUPS ====================
+// Minute, hour and day min/max/sum/count per device and sensor type, kept
+// incrementally on ingest. Each level's open bucket lives in RAM and is
+// appended to /data/devices/<id>/<type>.<level> (fixed RollupBucket records,
+// oldest first) when a reading lands in the next bucket. Charts read these
+// instead of raw points, so long ranges cost one record per bucket.
+//
+// The open buckets are checkpointed to ROLLUP_CHECKPOINT_PATH every
+// ROLLUP_CHECKPOINT_MS and restored at boot, so a restart costs at most
+// that much of the current minute, hour and day. A restored bucket that was
+// appended after its checkpoint is dropped rather than counted twice.
+#define ROLLUP_LEVELS 3
+#define MAX_ROLLUP_SERIES 64
+#define ROLLUP_CHECKPOINT_MS 60000
+#define ROLLUP_CHECKPOINT_PATH "/data/devices/rollups.open"
+#define ROLLUP_CHECKPOINT_MAGIC 0x31525053 // "SPR1"
+#define CHART_DEFAULT_POINTS 500
+#define CHART_MAX_RAW_POINTS 4096
+#define CHART_MAX_RAW_DAYS 31
+
+const uint32_t ROLLUP_WIDTHS[ROLLUP_LEVELS] = {60, 3600, 86400}; // Seconds; day buckets are UTC days
+const char* ROLLUP_NAMES[ROLLUP_LEVELS] = {"1m", "1h", "1d"};
+
+struct RollupBucket {
+  uint32_t start;
+  float min;
+  float max;
+  float sum;
+  uint32_t count;
+};
+
+struct RollupSeries {
+  char deviceId[24];
+  char sensorType[16];
+  RollupBucket open[ROLLUP_LEVELS];
+  uint32_t flushedStart[ROLLUP_LEVELS]; // Last record this series appended
+  uint32_t flushedCount[ROLLUP_LEVELS];
+  unsigned long lastUpdate;
+};
+
+RollupSeries rollupSeries[MAX_ROLLUP_SERIES];
+int rollupSeriesCount = 0;
+bool rollupsDirty = false; // Open buckets changed since the checkpoint
+unsigned long rollupCheckpointAt = 0;
+
+struct ChartPoint {
+  uint32_t timestamp;
+  float value;
+};
+
+String rollupPath(const char* deviceId, const char* sensorType, int level) {
+  return "/data/devices/" + String(deviceId) + "/" + sensorType + "." + ROLLUP_NAMES[level];
+}
+
+void flushRollupBucket(RollupSeries& series, int level) {
+  const RollupBucket& bucket = series.open[level];
+  if (bucket.count == 0) return;
+
+  unsigned long start = micros();
+  if (!storage.append(rollupPath(series.deviceId, series.sensorType, level).c_str(), (const uint8_t*)&bucket,
+                      sizeof(bucket))) {
+    return;
   }
-  
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("Failed to connect to " + ssid);
-    WiFi.softAP("ESP32-IoT-Server", "12345678");
-    return false;
+  series.flushedStart[level] = bucket.start;
+  series.flushedCount[level] = bucket.count;
+  metrics.sdWrite.observe(micros() - start);
+  metrics.sdWriteBytes += sizeof(bucket);
+}
+
+// Finds a series, claiming a slot on first use if `create` is set. When the
+// table is full, the series updated longest ago is flushed and reused.
+RollupSeries* findRollupSeries(const String& deviceId, const String& sensorType, bool create) {
+  RollupSeries* oldest = nullptr;
+  for (int i = 0; i < rollupSeriesCount; i++) {
+    RollupSeries& series = rollupSeries[i];
+    if (deviceId == series.deviceId && sensorType == series.sensorType) return &series;
+    if (!oldest || series.lastUpdate < oldest->lastUpdate) oldest = &series;
   }
-  
-  // Get device info via HTTP
-  HTTPClient http;
-  String url = "http://192.168.4.1/api/info";
-  
-  http.begin(url);
-  http.setTimeout(5000);
-  
-  int httpCode = http.GET();
-  
-  if (httpCode == 200) {
-    String payload = http.getString();
-    
-    StaticJsonDocument<1024> deviceInfo;
-    DeserializationError error = deserializeJson(deviceInfo, payload);
-    
-    if (!error) {
-      device.ssid = ssid;
-      // Fixed: Explicitly convert JsonVariant to String
-      device.deviceId = deviceInfo["deviceId"].as<String>();
-      device.deviceType = deviceInfo["deviceType"].as<String>();
-      device.description = deviceInfo["description"].as<String>();
-      device.firmwareVersion = deviceInfo["firmwareVersion"].as<String>();
-      device.hardwareVersion = deviceInfo["hardwareVersion"].as<String>();
-      device.configured = deviceInfo["configured"];
-      device.rssi = WiFi.RSSI();
-      
-      Serial.println("Device info retrieved successfully");
-      http.end();
-      
-      WiFi.disconnect();
-      WiFi.softAP("ESP32-IoT-Server", "12345678");
-      
-      return true;
+  if (!create) return nullptr;
+
+  RollupSeries* series;
+  if (rollupSeriesCount < MAX_ROLLUP_SERIES) {
+    series = &rollupSeries[rollupSeriesCount++];
+  } else {
+    series = oldest;
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+      flushRollupBucket(*series, level);
     }
   }
-  
-  http.end();
-  WiFi.disconnect();
-  WiFi.softAP("ESP32-IoT-Server", "12345678");
-  
-  return false;
+  memset(series, 0, sizeof(*series));
+  strlcpy(series->deviceId, deviceId.c_str(), sizeof(series->deviceId));
+  strlcpy(series->sensorType, sensorType.c_str(), sizeof(series->sensorType));
+  return series;
 }
 
-// ==================== DEVICE DISCOVERY (FIXED) ====================
-void handleAdvancedWiFiScan() {
-  Serial.println("Starting advanced WiFi scan for SDN devices...");
-  
-  discoveredDevices.clear();
-  
-  // Save current WiFi mode
-  wifi_mode_t currentMode = WiFi.getMode();
-  
-  // Switch to STA mode for scanning
-  WiFi.mode(WIFI_STA);
-  delay(100); // Let mode change settle
-  
-  int networkCount = WiFi.scanNetworks();
-  
-  if (networkCount == 0) {
-    // Restore AP mode before returning
-    WiFi.mode(WIFI_AP);
-    WiFi.softAP("ESP32-IoT-Server", "12345678");
-    server.send(200, "application/json", "{\"devices\":[]}");
-    return;
-  }
-  
-  // First, collect all ESP32_Device SSIDs
-  std::vector<String> deviceSSIDs;
-  for (int i = 0; i < networkCount; i++) {
-    String ssid = WiFi.SSID(i);
-    if (ssid.startsWith("ESP32_Device_")) {
-      deviceSSIDs.push_back(ssid);
-      Serial.println("Found potential SDN device: " + ssid);
+void updateRollups(const String& deviceId, const String& sensorType, float value, uint32_t timestamp) {
+  if (!isSafePathPart(deviceId) || !isSafePathPart(sensorType)) return;
+
+  RollupSeries* series = findRollupSeries(deviceId, sensorType, true);
+  series->lastUpdate = millis();
+  rollupsDirty = true;
+
+  for (int level = 0; level < ROLLUP_LEVELS; level++) {
+    RollupBucket& bucket = series->open[level];
+    uint32_t start = timestamp - timestamp % ROLLUP_WIDTHS[level];
+    if (bucket.count > 0 && bucket.start != start) {
+      flushRollupBucket(*series, level);
+      bucket.count = 0;
     }
-  }
-  
-  // Clear scan results to free memory
-  WiFi.scanDelete();
-  
-  // Now connect to each device to get info
-  StaticJsonDocument<2048> response;
-  JsonArray devices = response.createNestedArray("devices");
-  
-  for (const String& ssid : deviceSSIDs) {
-    // Switch to STA mode to connect
-    WiFi.mode(WIFI_STA);
-    
-    DiscoveredDevice device;
-    if (getDeviceInfo(ssid, device)) {
-      discoveredDevices.push_back(device);
-      
-      JsonObject deviceJson = devices.createNestedObject();
-      deviceJson["ssid"] = device.ssid;
-      deviceJson["deviceId"] = device.deviceId;
-      deviceJson["deviceType"] = device.deviceType;
-      deviceJson["description"] = device.description;
-      deviceJson["configured"] = device.configured;
-      deviceJson["rssi"] = device.rssi;
-      deviceJson["firmwareVersion"] = device.firmwareVersion;
+    if (bucket.count == 0) {
+      bucket.start = start;
+      bucket.min = value;
+      bucket.max = value;
+      bucket.sum = 0;
     }
+    if (value < bucket.min) bucket.min = value;
+    if (value > bucket.max) bucket.max = value;
+    bucket.sum += value;
+    bucket.count++;
   }
-  
-  // Restore AP mode
-  WiFi.mode(WIFI_AP);
-  WiFi.softAP("ESP32-IoT-Server", "12345678");
-  
-  String jsonResponse;
-  serializeJson(response, jsonResponse);
-  server.send(200, "application/json", jsonResponse);
 }
 
-// Alternative: Two-phase discovery for better UX
-void handleQuickScan() {
-  Serial.println("Quick scan for SDN devices...");
-  
-  // Switch to STA mode
-  WiFi.mode(WIFI_STA);
-  delay(100);
-  
-  int networkCount = WiFi.scanNetworks();
-  
-  StaticJsonDocument<1024> response;
-  JsonArray devices = response.createNestedArray("devices");
-  
-  for (int i = 0; i < networkCount; i++) {
-    String ssid = WiFi.SSID(i);
-    if (ssid.startsWith("ESP32_Device_")) {
-      JsonObject device = devices.createNestedObject();
-      device["ssid"] = ssid;
-      device["rssi"] = WiFi.RSSI(i);
-      device["configured"] = false; // Unknown until we connect
-      device["needsInfo"] = true;
-    }
+// Writes the series table, open buckets included, through a temp file
+void checkpointRollups() {
+  String tempPath = String(ROLLUP_CHECKPOINT_PATH) + ".tmp";
+  File out = SD.open(tempPath, FILE_WRITE);
+  if (!out) return;
+
+  unsigned long start = micros();
+  uint32_t header[2] = {ROLLUP_CHECKPOINT_MAGIC, (uint32_t)rollupSeriesCount};
+  size_t length = rollupSeriesCount * sizeof(RollupSeries);
+  bool written = out.write((const uint8_t*)header, sizeof(header)) == sizeof(header) &&
+                 out.write((const uint8_t*)rollupSeries, length) == length;
+  out.close();
+  if (!written) {
+    SD.remove(tempPath);
+    requestMaintenance();
+    return;
   }
-  
-  WiFi.scanDelete();
-  
-  // Restore AP mode
-  WiFi.mode(WIFI_AP);
-  WiFi.softAP("ESP32-IoT-Server", "12345678");
-  
-  String jsonResponse;
-  serializeJson(response, jsonResponse);
-  server.send(200, "application/json", jsonResponse);
+  SD.remove(ROLLUP_CHECKPOINT_PATH);
+  SD.rename(tempPath, ROLLUP_CHECKPOINT_PATH);
+  metrics.sdWrite.observe(micros() - start);
+  metrics.sdWriteBytes += sizeof(header) + length;
+  rollupsDirty = false;
 }
 
-// Get info for specific device
-void handleGetDeviceInfo() {
-  String targetSSID = server.arg("ssid");
-  
-  if (targetSSID.isEmpty()) {
-    server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing SSID\"}");
+// Checkpoints the open buckets at most every ROLLUP_CHECKPOINT_MS; call
+// from loop()
+void runRollupCheckpoint() {
+  if (!rollupsDirty || millis() - rollupCheckpointAt < ROLLUP_CHECKPOINT_MS) return;
+  rollupCheckpointAt = millis();
+  checkpointRollups();
+}
+
+// Last record of a rollup file; false if it has none
+bool readLastRollup(const String& path, RollupBucket& bucket) {
+  File file = SD.open(path, FILE_READ);
+  if (!file) return false;
+  size_t records = file.size() / sizeof(RollupBucket);
+  bool found = records > 0 && file.seek((records - 1) * sizeof(RollupBucket)) &&
+               file.read((uint8_t*)&bucket, sizeof(bucket)) == sizeof(bucket);
+  file.close();
+  return found;
+}
+
+// Reloads the series table from the checkpoint at boot. An open bucket is
+// kept unless its file gained a record for it, or a later one, after the
+// checkpoint (the bucket closed and only the checkpoint went stale).
+void restoreRollups() {
+  File file = SD.open(ROLLUP_CHECKPOINT_PATH, FILE_READ);
+  if (!file) return;
+
+  uint32_t header[2];
+  if (file.read((uint8_t*)header, sizeof(header)) != sizeof(header) || header[0] != ROLLUP_CHECKPOINT_MAGIC ||
+      header[1] > MAX_ROLLUP_SERIES) {
+    file.close();
+    Serial.println("Rollup checkpoint unreadable, ignored");
     return;
   }
-  
-  // Switch to STA mode
-  WiFi.mode(WIFI_STA);
-  
-  DiscoveredDevice device;
-  if (getDeviceInfo(targetSSID, device)) {
-    StaticJsonDocument<512> deviceInfo;
-    deviceInfo["success"] = true;
-    deviceInfo["deviceId"] = device.deviceId;
-    deviceInfo["deviceType"] = device.deviceType;
-    deviceInfo["description"] = device.description;
-    deviceInfo["firmwareVersion"] = device.firmwareVersion;
-    deviceInfo["configured"] = device.configured;
-    
-    String response;
-    serializeJson(deviceInfo, response);
-    
-    // Restore AP mode
-    WiFi.mode(WIFI_AP);
-    WiFi.softAP("ESP32-IoT-Server", "12345678");
-    
-    server.send(200, "application/json", response);
-  } else {
-    // Restore AP mode
-    WiFi.mode(WIFI_AP);
-    WiFi.softAP("ESP32-IoT-Server", "12345678");
-    
-    server.send(500, "application/json", "{\"success\":false,\"message\":\"Failed to get device info\"}");
+  size_t length = header[1] * sizeof(RollupSeries);
+  if (file.read((uint8_t*)rollupSeries, length) != length) {
+    file.close();
+    Serial.println("Rollup checkpoint truncated, ignored");
+    return;
+  }
+  file.close();
+  rollupSeriesCount = header[1];
+
+  int restored = 0;
+  for (int i = 0; i < rollupSeriesCount; i++) {
+    RollupSeries& series = rollupSeries[i];
+    series.lastUpdate = 0;
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+      RollupBucket& open = series.open[level];
+      if (open.count == 0) continue;
+      RollupBucket last;
+      if (readLastRollup(rollupPath(series.deviceId, series.sensorType, level), last) &&
+          (last.start > open.start ||
+           (last.start == open.start &&
+            (series.flushedStart[level] != last.start || series.flushedCount[level] != last.count)))) {
+        open.count = 0;
+        continue;
+      }
+      restored++;
+    }
   }
+  Serial.printf("Restored %d open rollup buckets\n", restored);
 }
 
-// ==================== LEGACY WIFI SCAN ====================
-void handleWiFiScan() {
-  int n = WiFi.scanNetworks();
-  if (n == 0) {
-    server.send(200, "application/json", "{\"devices\":[]}");
+// Largest-Triangle-Three-Buckets: keeps `threshold` points that preserve
+// the visual shape of the series. First and last points are always kept.
+void downsampleLttb(const std::vector<ChartPoint>& data, size_t threshold, std::vector<ChartPoint>& sampled) {
+  sampled.clear();
+  if (threshold >= data.size() || threshold < 3) {
+    sampled = data;
     return;
   }
+  sampled.reserve(threshold);
 
-  String json = "{\"devices\":[";
-  for (int i = 0; i < n; i++) {
-    json += "{";
-    json += "\"name\":\"" + WiFi.SSID(i) + "\",";
-    json += "\"ip\":\"192.168.4.1\"";
-    json += "}";
-    if (i < n - 1) json += ",";
+  double every = (double)(data.size() - 2) / (threshold - 2);
+  size_t previous = 0;
+  sampled.push_back(data[0]);
+
+  for (size_t i = 0; i < threshold - 2; i++) {
+    // Average of the next bucket is the third triangle vertex
+    size_t averageStart = (size_t)((i + 1) * every) + 1;
+    size_t averageEnd = std::min((size_t)((i + 2) * every) + 1, data.size());
+    double averageTime = 0;
+    double averageValue = 0;
+    for (size_t j = averageStart; j < averageEnd; j++) {
+      averageTime += data[j].timestamp;
+      averageValue += data[j].value;
+    }
+    averageTime /= averageEnd - averageStart;
+    averageValue /= averageEnd - averageStart;
+
+    // Keep the point of this bucket forming the largest triangle
+    size_t rangeStart = (size_t)(i * every) + 1;
+    size_t rangeEnd = (size_t)((i + 1) * every) + 1;
+    double pointTime = data[previous].timestamp;
+    double pointValue = data[previous].value;
+    double maxArea = -1;
+    size_t chosen = rangeStart;
+    for (size_t j = rangeStart; j < rangeEnd; j++) {
+      double area = fabs((pointTime - averageTime) * (data[j].value - pointValue) -
+                         (pointTime - data[j].timestamp) * (averageValue - pointValue));
+      if (area > maxArea) {
+        maxArea = area;
+        chosen = j;
+      }
+    }
+    sampled.push_back(data[chosen]);
+    previous = chosen;
   }
-  json += "]}";
 
-  WiFi.scanDelete();
-  server.send(200, "application/json", json);
+  sampled.push_back(data.back());
 }
-// ==================== SECURITY ENHANCEMENTS ====================
 
-// Generate unique password based on device ID
-String generateDevicePassword(String deviceId) {
-  // Use last 6 characters of device ID for simple hash
-  String idPart = deviceId.substring(deviceId.length() - 6);
-  
-  // Simple hash calculation
-  uint32_t hash = 0;
-  for (char c : idPart) {
-    hash = hash * 31 + c;
-  }
-  
-  // Create password with prefix and hash
-  return "IOT_" + String(hash % 100000); // 5-digit number
+void writeRollupPoint(ChunkedWriter& out, const RollupBucket& bucket, bool& first) {
+  out.printf("%s[%lu,%.3f,%.3f,%.3f,%lu]", first ? "" : ",", (unsigned long)bucket.start,
+             bucket.min, bucket.sum / bucket.count, bucket.max, (unsigned long)bucket.count);
+  first = false;
 }
 
-// Store known device passwords
-struct KnownDevice {
-  String deviceId;
-  String password;
-};
+// Streams the buckets of one level overlapping [from, to] as
+// [start,min,avg,max,count]. Records sharing a start (a bucket flushed on
+// eviction of its series, then reopened) are merged, and the open bucket
+// from RAM comes last.
+void streamRollups(ChunkedWriter& out, const String& deviceId, const String& sensorType,
+                   int level, uint32_t from, uint32_t to) {
+  uint32_t width = ROLLUP_WIDTHS[level];
+  uint32_t firstStart = from - from % width;
+  RollupBucket pending = {0, 0, 0, 0, 0};
+  bool first = true;
 
-std::vector<KnownDevice> knownDevices;
+  auto emit = [&](const RollupBucket& bucket) {
+    if (pending.count > 0 && pending.start == bucket.start) {
+      pending.min = min(pending.min, bucket.min);
+      pending.max = max(pending.max, bucket.max);
+      pending.sum += bucket.sum;
+      pending.count += bucket.count;
+      return;
+    }
+    if (pending.count > 0) writeRollupPoint(out, pending, first);
+    pending = bucket;
+  };
 
-// Enhanced device info retrieval with dynamic password
-bool getDeviceInfoSecure(String ssid, DiscoveredDevice& device) {
-  Serial.println("Connecting to " + ssid + " to get device info...");
-  
-  // Extract device ID hint from SSID (last part)
-  String deviceIdHint = ssid.substring(13); // After "ESP32_Device_"
-  
-  // Try known passwords first
-  String password = "";
-  bool found = false;
-  
-  for (auto& known : knownDevices) {
-    if (known.deviceId.endsWith(deviceIdHint)) {
-      password = known.password;
-      found = true;
-      break;
+  String path = rollupPath(deviceId.c_str(), sensorType.c_str(), level);
+  storage.sync(path.c_str());
+  File file = SD.open(path, FILE_READ);
+  if (file) {
+    unsigned long start = micros();
+    size_t low = 0;
+    size_t high = file.size() / sizeof(RollupBucket);
+    size_t count = high;
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      RollupBucket bucket;
+      file.seek(mid * sizeof(bucket));
+      file.read((uint8_t*)&bucket, sizeof(bucket));
+      if (bucket.start < firstStart) low = mid + 1;
+      else high = mid;
+    }
+
+    file.seek(low * sizeof(RollupBucket));
+    for (size_t i = low; i < count; i++) {
+      RollupBucket bucket;
+      if (file.read((uint8_t*)&bucket, sizeof(bucket)) != sizeof(bucket)) break;
+      if (bucket.start > to) break;
+      emit(bucket);
     }
+    metrics.sdRead.observe(micros() - start);
+    metrics.sdReadBytes += (count - low) * sizeof(RollupBucket);
+    file.close();
   }
-  
-  // If not found, try default password for first-time devices
-  if (!found) {
-    password = "12345678"; // Default for unconfigured devices
+
+  RollupSeries* series = findRollupSeries(deviceId, sensorType, false);
+  if (series) {
+    const RollupBucket& open = series->open[level];
+    if (open.count > 0 && open.start >= firstStart && open.start <= to) {
+      emit(open);
+    }
   }
-  
-  // Try to connect
-  WiFi.begin(ssid.c_str(), password.c_str());
-  
-  int attempts = 0;
+  if (pending.count > 0) writeRollupPoint(out, pending, first);
+}
+
+// Appends one sensor's readings in [from, to] for a day to `raw`, from the
+// day's archive and the device partition. False once `raw` holds
+// CHART_MAX_RAW_POINTS.
+bool collectRawPoints(const String& deviceId, const String& sensorType, const String& date,
+                      uint32_t from, uint32_t to, std::vector<ChartPoint>& raw) {
+  scanStoredDay(date, deviceId.c_str(), {deviceId}, from, to,
+                [&](const char*, const char* type, const char*, uint32_t timestamp, float value) {
+    if (sensorType != type) return true;
+    raw.push_back({timestamp, value});
+    return raw.size() < CHART_MAX_RAW_POINTS;
+  });
+  return raw.size() < CHART_MAX_RAW_POINTS;
+}
+
+// GET /api/history?deviceId=&type=&from=&to=[&points=&res=&lttb=1&date=]
+// Chart series for one sensor. res=auto picks the finest rollup level that
+// fits in `points` buckets; with lttb=1 a range short enough for raw data
+// is read and decimated to `points` with LTTB. from/to are epoch seconds.
+// Raw data is read day by day over the range (at most CHART_MAX_RAW_DAYS),
+// from the archive and the partition; `date` limits it to one day.
+void handleHistory() {
+  String deviceId = server.arg("deviceId");
+  String sensorType = server.arg("type");
+  String date = server.arg("date");
+  if (!isSafePathPart(deviceId) || !isSafePathPart(sensorType) || (!date.isEmpty() && !isSafePathPart(date))) {
+    server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid deviceId, type or date\"}");
+    return;
+  }
+
+  uint32_t from = server.hasArg("from") ? strtoul(server.arg("from").c_str(), nullptr, 10) : 0;
+  uint32_t to = server.hasArg("to") ? strtoul(server.arg("to").c_str(), nullptr, 10) : readingTimestamp();
+  int points = server.hasArg("points") ? server.arg("points").toInt() : CHART_DEFAULT_POINTS;
+  points = constrain(points, 3, CHART_MAX_RAW_POINTS);
+  String resolution = server.hasArg("res") ? server.arg("res") : "auto";
+  bool lttb = server.arg("lttb") == "1";
+  uint32_t range = to > from ? to - from : 0;
+
+  int level = -1; // Raw
+  if (resolution == "auto") {
+    if (!(lttb && range / ROLLUP_WIDTHS[0] <= (uint32_t)points)) {
+      level = ROLLUP_LEVELS - 1;
+      for (int i = 0; i < ROLLUP_LEVELS; i++) {
+        if (range / ROLLUP_WIDTHS[i] <= (uint32_t)points) {
+          level = i;
+          break;
+        }
+      }
+    }
+  } else if (resolution != "raw") {
+    for (int i = 0; i < ROLLUP_LEVELS; i++) {
+      if (resolution == ROLLUP_NAMES[i]) level = i;
+    }
+    if (level < 0) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Unknown res\"}");
+      return;
+    }
+  }
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  ChunkedWriter out;
+  out.printf("{\"deviceId\":\"%s\",\"type\":\"%s\",\"resolution\":\"%s\",\"points\":[",
+             deviceId.c_str(), sensorType.c_str(), level < 0 ? "raw" : ROLLUP_NAMES[level]);
+
+  if (level >= 0) {
+    streamRollups(out, deviceId, sensorType, level, from, to);
+  } else {
+    std::vector<ChartPoint> raw;
+    String day = date.isEmpty() ? dateString(from) : date;
+    String lastDay = date.isEmpty() ? dateString(to) : date;
+    for (int days = 0; days < CHART_MAX_RAW_DAYS && day <= lastDay; days++, day = shiftDate(day, 1)) {
+      if (!collectRawPoints(deviceId, sensorType, day, from, to, raw)) break;
+    }
+    // Archived days come in series order (one per unit the sensor used),
+    // then any readings that arrived after the day was archived
+    std::stable_sort(raw.begin(), raw.end(), [](const ChartPoint& a, const ChartPoint& b) {
+      return a.timestamp < b.timestamp;
+    });
+
+    std::vector<ChartPoint> sampled;
+    if (lttb) {
+      downsampleLttb(raw, points, sampled);
+    }
+    const std::vector<ChartPoint>& series = lttb ? sampled : raw;
+    for (size_t i = 0; i < series.size(); i++) {
+      out.printf("%s[%lu,%.3f]", i == 0 ? "" : ",", (unsigned long)series[i].timestamp, series[i].value);
+    }
+  }
+
+  out.printf("]}");
+  out.flush();
+  server.sendContent("");
+}
+
+// ==================== ARCHIVE ====================
+// Closed days of the device partitions are compacted into
+// /data/archive/<date>.sdb (format in SDNArchive.h): a dictionary entry per
+// device/sensor/unit series and compressed blocks of its points. Once the
+// archive is written, the day's partition logs and their indexes are
+// removed. The day file goes too, but only if it holds no more readings than
+// the archive: readings of devices whose id cannot be a partition, or whose
+// partition write failed, are only in the day file. /api/logdata decodes
+// archived days as it streams them.
+//
+// Readings can still arrive for an archived day (held readings dated once
+// the clock is set, backdated batches, device stamps up to
+// INGEST_MAX_PAST_S old) and recreate its partition logs. Readers take
+// such a day from the archive and the partitions both, and the next pass
+// archives it again: the new archive starts with a copy of the old one,
+// followed by the late readings as series of their own.
+#define ARCHIVE_MAX_OPEN_SERIES 8 // Sensor types of one device encoded at once
+
+String archivePath(const String& date) {
+  return "/data/archive/" + date + ".sdb";
+}
+
+// Base name of a directory entry (older SD cores return the full path)
+String entryName(File& entry) {
+  String name = entry.name();
+  int slash = name.lastIndexOf('/');
+  return slash >= 0 ? name.substring(slash + 1) : name;
+}
+
+// Compaction of one closed day into its archive, one reading per step so
+// the maintenance task can stop between any two (see MAINTENANCE)
+struct ArchiveSlot {
+  char sensorType[16];
+  char unit[12];
+  SeriesEncoder* encoder;
+  size_t usedAt; // Points archived when the slot was last appended to
+};
+
+struct ArchiveJob {
+  bool active;
+  String date;
+  std::vector<String> devices; // Devices with a partition log for the day
+  size_t deviceIndex;
+  File previous;               // Archive of the day so far, copied first
+  File out;
+  File log;
+  ArchiveSlot open[ARCHIVE_MAX_OPEN_SERIES];
+  int openCount;
+  uint16_t nextSeriesId;
+  size_t points;
+  File day;                   // Day file, counted once the partitions are done
+  JsonArrayReader* dayReader;
+  bool dayCounted;            // Day file counted to the end, or absent
+  size_t dayReadings;
+};
+
+ArchiveJob archiveJob;
+
+bool startArchiveJob(const String& date, const std::vector<String>& devices) {
+  archiveJob.out = SD.open(archivePath(date) + ".tmp", FILE_WRITE);
+  if (!archiveJob.out) return false;
+
+  // An unreadable archive has nothing to keep and is replaced
+  archiveJob.previous = SD.open(archivePath(date), FILE_READ);
+  if (archiveJob.previous && !ArchiveReader(archiveJob.previous).begin()) {
+    archiveJob.previous.close();
+  }
+  if (archiveJob.previous) {
+    archiveJob.previous.seek(0);
+  } else {
+    ArchiveWriter(archiveJob.out).begin();
+  }
+  archiveJob.active = true;
+  archiveJob.date = date;
+  archiveJob.devices = devices;
+  archiveJob.deviceIndex = 0;
+  archiveJob.openCount = 0;
+  archiveJob.nextSeriesId = 0;
+  archiveJob.points = 0;
+  archiveJob.dayReader = nullptr;
+  archiveJob.dayCounted = false;
+  archiveJob.dayReadings = 0;
+  return true;
+}
+
+// Writes the last blocks of the current device and moves to the next one
+void closeArchiveDevice() {
+  for (int i = 0; i < archiveJob.openCount; i++) {
+    ArchiveWriter(archiveJob.out).writeBlock(*archiveJob.open[i].encoder);
+    delete archiveJob.open[i].encoder;
+  }
+  archiveJob.openCount = 0;
+  archiveJob.log.close();
+  archiveJob.deviceIndex++;
+}
+
+void archiveReading(const String& deviceId, const char* line, size_t length, uint32_t timestamp) {
+  StaticJsonDocument<192> record;
+  if (deserializeJson(record, line, length)) return;
+  const char* sensorType = record["type"] | "";
+  const char* unit = record["unit"] | "";
+  float value = record["value"];
+
+  ArchiveSlot* slot = nullptr;
+  for (int i = 0; i < archiveJob.openCount; i++) {
+    if (strcmp(archiveJob.open[i].sensorType, sensorType) == 0 && strcmp(archiveJob.open[i].unit, unit) == 0) {
+      slot = &archiveJob.open[i];
+      break;
+    }
+  }
+  if (!slot) {
+    if (archiveJob.openCount < ARCHIVE_MAX_OPEN_SERIES) {
+      slot = &archiveJob.open[archiveJob.openCount++];
+      slot->encoder = new SeriesEncoder();
+    } else {
+      // Close the series used longest ago; if it comes back it is defined
+      // again under a new id, which readers take as more of the same
+      slot = &archiveJob.open[0];
+      for (int i = 1; i < archiveJob.openCount; i++) {
+        if (archiveJob.open[i].usedAt < slot->usedAt) slot = &archiveJob.open[i];
+      }
+      ArchiveWriter(archiveJob.out).writeBlock(*slot->encoder);
+    }
+    strlcpy(slot->sensorType, sensorType, sizeof(slot->sensorType));
+    strlcpy(slot->unit, unit, sizeof(slot->unit));
+    slot->encoder->begin(archiveJob.nextSeriesId);
+    ArchiveWriter(archiveJob.out).defineSeries(archiveJob.nextSeriesId++, deviceId.c_str(),
+                                               slot->sensorType, slot->unit);
+  }
+
+  if (!slot->encoder->append(timestamp, value)) {
+    ArchiveWriter(archiveJob.out).writeBlock(*slot->encoder);
+    slot->encoder->append(timestamp, value);
+  }
+  slot->usedAt = ++archiveJob.points;
+}
+
+// Publishes the archive and removes the day's raw files. A day without any
+// readable point keeps its raw files.
+void finishArchiveJob() {
+  String tempPath = archivePath(archiveJob.date) + ".tmp";
+  size_t archiveBytes = archiveJob.out.size();
+  archiveJob.out.close();
+  archiveJob.active = false;
+  metrics.sdWriteBytes += archiveBytes;
+
+  if (archiveJob.points == 0) {
+    SD.remove(tempPath);
+    return;
+  }
+
+  SD.remove(archivePath(archiveJob.date));
+  SD.rename(tempPath, archivePath(archiveJob.date));
+  for (const String& deviceId : archiveJob.devices) {
+    for (const char* extension : {".log", ".idx"}) {
+      String path = partitionPath(deviceId, archiveJob.date, extension);
+      storage.close(path.c_str());
+      SD.remove(path);
+    }
+  }
+  if (archiveJob.dayCounted && archiveJob.dayReadings <= archiveJob.points) {
+    String dayPath = "/data/sensors/" + archiveJob.date + ".json";
+    storage.close(dayPath.c_str());
+    SD.remove(dayPath);
+  } else {
+    Serial.printf("Day file of %s kept: %u readings, %u archived\n", archiveJob.date.c_str(),
+                  (unsigned)archiveJob.dayReadings, (unsigned)archiveJob.points);
+  }
+
+  Serial.printf("Archived %s: %u points in %u bytes\n", archiveJob.date.c_str(),
+                (unsigned)archiveJob.points, (unsigned)archiveBytes);
+}
+
+// Counts the readings of the day file, one per step, after the partitions
+// are encoded. A day file that cannot be read to the end is never removed.
+bool countArchiveDayStep() {
+  if (!archiveJob.dayReader) {
+    String dayPath = "/data/sensors/" + archiveJob.date + ".json";
+    storage.close(dayPath.c_str());
+    archiveJob.day = SD.open(dayPath, FILE_READ);
+    if (!archiveJob.day) {
+      archiveJob.dayCounted = !SD.exists(dayPath);
+      finishArchiveJob();
+      return false;
+    }
+    archiveJob.dayReader = new JsonArrayReader(archiveJob.day);
+    if (archiveJob.dayReader->begin("data")) return true;
+  } else if (archiveJob.dayReader->skip()) {
+    return true;
+  }
+
+  archiveJob.dayCounted = !archiveJob.dayReader->error();
+  archiveJob.dayReadings = archiveJob.dayReader->count;
+  metrics.sdReadBytes += archiveJob.day.position();
+  delete archiveJob.dayReader;
+  archiveJob.dayReader = nullptr;
+  archiveJob.day.close();
+  finishArchiveJob();
+  return false;
+}
+
+// Copies the next chunk of an earlier archive of the day, or encodes the
+// next reading. Returns false once the job is done.
+bool archiveJobStep() {
+  if (!archiveJob.active) return false;
+
+  if (archiveJob.previous) {
+    uint8_t chunk[512];
+    size_t length = archiveJob.previous.read(chunk, sizeof(chunk));
+    if (length > 0) {
+      archiveJob.out.write(chunk, length);
+      metrics.sdReadBytes += length;
+    } else {
+      archiveJob.previous.close();
+    }
+    return true;
+  }
+
+  if (!archiveJob.log) {
+    if (archiveJob.deviceIndex >= archiveJob.devices.size()) {
+      return countArchiveDayStep();
+    }
+    String logPath = partitionPath(archiveJob.devices[archiveJob.deviceIndex], archiveJob.date, ".log");
+    storage.close(logPath.c_str());
+    archiveJob.log = SD.open(logPath, FILE_READ);
+    if (!archiveJob.log) {
+      archiveJob.deviceIndex++;
+      return true;
+    }
+    archiveJob.log.setTimeout(0); // Stream reads would otherwise wait a second at EOF
+    return true;
+  }
+
+  char line[160];
+  size_t length = archiveJob.log.readBytesUntil('\n', line, sizeof(line) - 1);
+  if (length == 0) {
+    closeArchiveDevice();
+    return true;
+  }
+  metrics.sdReadBytes += length + 1;
+
+  const size_t prefixLength = strlen(TIMESTAMP_PREFIX);
+  if (length > prefixLength && strncmp(line, TIMESTAMP_PREFIX, prefixLength) == 0) {
+    uint32_t timestamp = strtoul(line + prefixLength, nullptr, 10);
+    line[length] = '\0';
+    archiveReading(archiveJob.devices[archiveJob.deviceIndex], line, length, timestamp);
+  }
+  return true;
+}
+
+// Visits a day's readings in [from, to]: those in its archive, in archive
+// order (per device and sensor), then those in the partitions of `devices`
+// (for a day not archived yet, or readings that came after). deviceId
+// limits the archive to one device, or is nullptr for every device. Stops
+// when visit() returns false.
+void scanStoredDay(const String& date, const char* deviceId, const std::vector<String>& devices,
+                   uint32_t from, uint32_t to,
+                   std::function<bool(const char* deviceId, const char* sensorType, const char* unit,
+                                      uint32_t timestamp, float value)> visit) {
+  bool more = true;
+  File archive = SD.open(archivePath(date), FILE_READ);
+  if (archive) {
+    unsigned long start = micros();
+    ArchiveReader reader(archive);
+    if (reader.begin()) {
+      reader.read(from, to, deviceId, [&](const ArchiveSeries& series, uint32_t timestamp, float value) {
+        more = visit(series.deviceId, series.sensorType, series.unit, timestamp, value);
+        return more;
+      });
+    }
+    metrics.sdRead.observe(micros() - start);
+    metrics.sdReadBytes += archive.position();
+    archive.close();
+  }
+
+  for (size_t i = 0; i < devices.size() && more; i++) {
+    scanDevicePartition(devices[i], date, from, to, [&](const char* line, size_t length, uint32_t timestamp) {
+      StaticJsonDocument<192> record;
+      if (deserializeJson(record, line, length)) return true;
+      more = visit(devices[i].c_str(), record["type"] | "", record["unit"] | "", timestamp,
+                   record["value"].as<float>());
+      return more;
+    });
+  }
+}
+
+// Streams an archived day in the /api/logdata shape: the archive, then any
+// readings its partitions got since. deviceId may be nullptr for every
+// device.
+void streamArchivedDay(const String& date, const char* deviceId, uint32_t from, uint32_t to, int limit) {
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  ChunkedWriter out;
+  if (deviceId) {
+    out.printf("{\"deviceId\":\"%s\",\"date\":\"%s\",\"data\":[", deviceId, date.c_str());
+  } else {
+    out.printf("{\"date\":\"%s\",\"data\":[", date.c_str());
+  }
+
+  std::vector<String> devices;
+  if (deviceId) {
+    devices.push_back(deviceId);
+  } else {
+    devices = listPartitionDevices();
+  }
+  int rows = 0;
+  scanStoredDay(date, deviceId, devices, from, to,
+                [&](const char* device, const char* sensorType, const char* unit, uint32_t timestamp, float value) {
+    if (rows >= limit) return false;
+    StaticJsonDocument<192> row;
+    row["timestamp"] = timestamp;
+    row["deviceId"] = device;
+    row["type"] = sensorType;
+    row["value"] = value;
+    row["unit"] = unit;
+    row["status"] = "ok";
+    if (rows++ > 0) out.write(',');
+    serializeJson(row, out);
+    return true;
+  });
+
+  out.printf("]}");
+  out.flush();
+  server.sendContent("");
+}
+
+// ==================== MAINTENANCE ====================
+// Retention, compaction and SD quota, run in the background. loop() calls
+// runMaintenance(), which works in slices of at most MAINTENANCE_SLICE_US
+// made of small steps (one directory entry, one archived reading, one
+// copied chunk, one removal), so ingest never waits on a whole pass. A pass
+// runs every MAINTENANCE_INTERVAL, or on the next loop after a failed write:
+//   scan       list the data directories and size each storage class
+//   archive    compact closed partition days (see ARCHIVE)
+//   trim       cut minute and hour rollup files down to their retention
+//   retention  delete day files and archives older than their retention
+//   quota      evict the cloud queue, then the oldest days, while the
+//              card is above its quota
+// Retention is set in /config/retention.json (see POST /api/storage).
+// Today's files are never removed. Files dated before the firmware build
+// (1970-01-01, from a clock that was never set) have no known age:
+// retention keeps them and quota evicts them last. Until the clock is
+// seeded there is no today, so no day is closed or past its retention, and
+// quota spares the newest day.
+#define MAINTENANCE_INTERVAL 600000UL
+#define MAINTENANCE_SLICE_US 4000
+#define ROLLUP_TRIM_CHUNK 512
+
+enum StorageClass {
+  STORAGE_SENSORS,    // /data/sensors day files
+  STORAGE_PARTITIONS, // /data/devices/<id>/<date>.log and .idx
+  STORAGE_ROLLUPS,    // /data/devices/<id>/<type>.<level>
+  STORAGE_ARCHIVE,    // /data/archive/<date>.sdb
+  STORAGE_COMMANDS,
+  STORAGE_CLOUD,
+  STORAGE_CLASS_COUNT
+};
+const char* STORAGE_CLASS_NAMES[STORAGE_CLASS_COUNT] = {
+  "sensors", "partitions", "rollups", "archive", "commands", "cloud"
+};
+
+struct RetentionConfig {
+  uint16_t sensorDays;       // Day files and unarchived partitions
+  uint16_t archiveDays;
+  uint16_t minuteRollupDays; // Records kept in each 1m rollup file
+  uint16_t hourRollupDays;   // Records kept in each 1h rollup file
+  uint8_t quotaPercent;      // Of the card
+};
+
+RetentionConfig retention = {7, 365, 7, 365, 90};
+
+// A file that retention, eviction or trimming may act on
+struct StoredFile {
+  String path;
+  char date[11];             // Empty for rollups
+  StorageClass storageClass;
+  uint32_t size;
+};
+
+enum MaintenancePhase : uint8_t {
+  MAINTENANCE_IDLE,
+  MAINTENANCE_SCAN,
+  MAINTENANCE_ARCHIVE,
+  MAINTENANCE_TRIM,
+  MAINTENANCE_RETENTION,
+  MAINTENANCE_QUOTA
+};
+const char* MAINTENANCE_PHASE_NAMES[] = {"idle", "scan", "archive", "trim", "retention", "quota"};
+
+struct MaintenanceState {
+  MaintenancePhase phase;
+  bool due;
+  bool rescanned;
+  unsigned long lastPass;
+  unsigned long passStarted;
+  String today;              // Empty until the clock is seeded
+  String validFrom;          // Earliest date a set clock stamps
+
+  // Scan
+  std::vector<String> pendingDirs;
+  File dir;
+  String dirPath;
+  uint64_t scanBytes[STORAGE_CLASS_COUNT];
+  std::vector<StoredFile> files;
+  std::vector<String> closedDays; // Partition days not yet archived
+
+  // Phase progress
+  size_t cursor;
+  File trimSource;
+  File trimTarget;
+
+  // Report of the last completed scan and pass
+  uint64_t classBytes[STORAGE_CLASS_COUNT];
+  uint64_t totalBytes;
+  uint64_t usedBytes;
+  unsigned long lastPassMs;
+  uint32_t filesRemoved;
+  uint64_t bytesRemoved;
+  uint32_t daysArchived;
+  uint32_t rollupsTrimmed;
+  uint32_t generation;       // Bumped whenever closed days change
+};
+
+MaintenanceState maintenance;
+
+// Runs a maintenance pass on the next loop, e.g. after a write failed
+void requestMaintenance() {
+  maintenance.due = true;
+}
+
+bool isDateName(const String& name) {
+  return name.length() == 10 && name[4] == '-' && name[7] == '-';
+}
+
+// Date `days` away from a YYYY-MM-DD date
+String shiftDate(const String& date, int days) {
+  struct tm day = {};
+  day.tm_year = date.substring(0, 4).toInt() - 1900;
+  day.tm_mon = date.substring(5, 7).toInt() - 1;
+  day.tm_mday = date.substring(8, 10).toInt() + days;
+  day.tm_hour = 12;
+  mktime(&day); // Normalizes the day of month
+  char buffer[11];
+  strftime(buffer, sizeof(buffer), "%Y-%m-%d", &day);
+  return buffer;
+}
+
+void loadRetentionConfig() {
+  File file = SD.open("/config/retention.json", FILE_READ);
+  if (!file) return;
+  StaticJsonDocument<256> config;
+  if (!readJson(config, file)) {
+    retention.sensorDays = config["sensorDays"] | retention.sensorDays;
+    retention.archiveDays = config["archiveDays"] | retention.archiveDays;
+    retention.minuteRollupDays = config["minuteRollupDays"] | retention.minuteRollupDays;
+    retention.hourRollupDays = config["hourRollupDays"] | retention.hourRollupDays;
+    retention.quotaPercent = constrain(config["quotaPercent"] | retention.quotaPercent, 10, 99);
+  }
+  file.close();
+}
+
+void removeStoredFile(StoredFile& file) {
+  if (file.size == UINT32_MAX) return; // Already removed
+  storage.close(file.path.c_str());
+  if (SD.remove(file.path)) {
+    maintenance.generation++;
+    maintenance.filesRemoved++;
+    maintenance.bytesRemoved += file.size;
+    maintenance.classBytes[file.storageClass] -= std::min<uint64_t>(file.size, maintenance.classBytes[file.storageClass]);
+    maintenance.usedBytes -= std::min<uint64_t>(file.size, maintenance.usedBytes);
+  }
+  file.size = UINT32_MAX;
+}
+
+// Records one file found by the scan
+void classifyStoredFile(const String& path, const String& name, uint32_t size) {
+  StorageClass storageClass;
+  String date;
+  int dot = name.indexOf('.');
+  String stem = dot >= 0 ? name.substring(0, dot) : name;
+  String extension = dot >= 0 ? name.substring(dot) : "";
+
+  if (path.startsWith("/data/sensors/")) {
+    storageClass = STORAGE_SENSORS;
+    if (isDateName(stem)) date = stem;
+  } else if (path.startsWith("/data/archive/")) {
+    if (extension.endsWith(".tmp")) {
+      SD.remove(path); // Left by a job cut short by a restart
+      return;
+    }
+    storageClass = STORAGE_ARCHIVE;
+    if (isDateName(stem)) date = stem;
+  } else if (path.startsWith("/data/devices/")) {
+    if (isDateName(stem)) {
+      storageClass = STORAGE_PARTITIONS;
+      date = stem;
+      if (extension == ".log" && !maintenance.today.isEmpty() && stem != maintenance.today &&
+          std::find(maintenance.closedDays.begin(), maintenance.closedDays.end(), stem) == maintenance.closedDays.end()) {
+        maintenance.closedDays.push_back(stem);
+      }
+    } else {
+      storageClass = STORAGE_ROLLUPS;
+    }
+  } else if (path.startsWith("/data/commands/")) {
+    storageClass = STORAGE_COMMANDS;
+  } else {
+    storageClass = STORAGE_CLOUD;
+  }
+  maintenance.scanBytes[storageClass] += size;
+
+  // Keep only what a later phase may act on
+  uint32_t minuteCap = retention.minuteRollupDays * 1440UL * sizeof(RollupBucket);
+  uint32_t hourCap = retention.hourRollupDays * 24UL * sizeof(RollupBucket);
+  bool trimmable = storageClass == STORAGE_ROLLUPS &&
+                   ((extension == ".1m" && size > minuteCap + minuteCap / 4) ||
+                    (extension == ".1h" && size > hourCap + hourCap / 4));
+  if (date.isEmpty() && !trimmable) return;
+
+  StoredFile file;
+  file.path = path;
+  strlcpy(file.date, date.c_str(), sizeof(file.date));
+  file.storageClass = storageClass;
+  file.size = size;
+  maintenance.files.push_back(file);
+}
+
+void startMaintenancePass() {
+  maintenance.phase = MAINTENANCE_SCAN;
+  maintenance.due = false;
+  maintenance.rescanned = false;
+  maintenance.passStarted = millis();
+  maintenance.today = clockSynced() ? getTodayDateString() : "";
+  maintenance.validFrom = dateString(clockValidEpoch());
+  maintenance.pendingDirs = {"/data/sensors", "/data/devices", "/data/archive", "/data/commands", "/data/cloud"};
+  maintenance.files.clear();
+  maintenance.closedDays.clear();
+  memset(maintenance.scanBytes, 0, sizeof(maintenance.scanBytes));
+}
+
+void enterMaintenancePhase(MaintenancePhase phase) {
+  maintenance.phase = phase;
+  maintenance.cursor = 0;
+}
+
+// Lists one directory entry
+void scanStep() {
+  if (!maintenance.dir) {
+    if (maintenance.pendingDirs.empty()) {
+      memcpy(maintenance.classBytes, maintenance.scanBytes, sizeof(maintenance.classBytes));
+      std::sort(maintenance.closedDays.begin(), maintenance.closedDays.end());
+      enterMaintenancePhase(MAINTENANCE_ARCHIVE);
+      return;
+    }
+    maintenance.dirPath = maintenance.pendingDirs.back();
+    maintenance.pendingDirs.pop_back();
+    maintenance.dir = SD.open(maintenance.dirPath);
+    return;
+  }
+
+  File entry = maintenance.dir.openNextFile();
+  if (!entry) {
+    maintenance.dir.close();
+    return;
+  }
+  String name = entryName(entry);
+  String path = maintenance.dirPath + "/" + name;
+  if (entry.isDirectory()) {
+    maintenance.pendingDirs.push_back(path);
+  } else {
+    classifyStoredFile(path, name, entry.size());
+  }
+  entry.close();
+}
+
+// Archives closed days one reading at a time, oldest day first
+void archiveStep() {
+  if (archiveJob.active) {
+    if (!archiveJobStep() && SD.exists(archivePath(archiveJob.date))) {
+      maintenance.generation++;
+      maintenance.daysArchived++;
+    }
+    return;
+  }
+
+  if (maintenance.cursor >= maintenance.closedDays.size()) {
+    // Archiving removed and created files, so list them again once
+    if (maintenance.cursor > 0 && !maintenance.rescanned) {
+      maintenance.rescanned = true;
+      maintenance.phase = MAINTENANCE_SCAN;
+      maintenance.pendingDirs = {"/data/sensors", "/data/devices", "/data/archive", "/data/commands", "/data/cloud"};
+      maintenance.files.clear();
+      maintenance.closedDays.clear();
+      memset(maintenance.scanBytes, 0, sizeof(maintenance.scanBytes));
+      return;
+    }
+    enterMaintenancePhase(MAINTENANCE_TRIM);
+    return;
+  }
+
+  const String& date = maintenance.closedDays[maintenance.cursor++];
+  std::vector<String> devices;
+  for (const StoredFile& file : maintenance.files) {
+    if (file.storageClass == STORAGE_PARTITIONS && date == file.date && file.path.endsWith(".log")) {
+      int start = strlen("/data/devices/");
+      devices.push_back(file.path.substring(start, file.path.indexOf('/', start)));
+    }
+  }
+  startArchiveJob(date, devices);
+}
+
+// Copies one chunk of the newest records of an oversized rollup file.
+// Buckets closed meanwhile are appended to the file through `storage`,
+// past the size the source handle saw when it was opened, so the last
+// step copies them from a new handle before the file is replaced.
+void trimStep() {
+  while (maintenance.cursor < maintenance.files.size() &&
+         maintenance.files[maintenance.cursor].storageClass != STORAGE_ROLLUPS) {
+    maintenance.cursor++;
+  }
+  if (maintenance.cursor >= maintenance.files.size()) {
+    enterMaintenancePhase(MAINTENANCE_RETENTION);
+    return;
+  }
+
+  StoredFile& file = maintenance.files[maintenance.cursor];
+  String tempPath = file.path + ".trim";
+  storage.close(file.path.c_str()); // Buffered records get copied too
+  if (!maintenance.trimSource) {
+    uint32_t keepRecords = file.path.endsWith(".1m") ? retention.minuteRollupDays * 1440UL
+                                                     : retention.hourRollupDays * 24UL;
+    maintenance.trimSource = SD.open(file.path, FILE_READ);
+    maintenance.trimTarget = SD.open(tempPath, FILE_WRITE);
+    if (!maintenance.trimSource || !maintenance.trimTarget) {
+      maintenance.trimSource.close();
+      maintenance.trimTarget.close();
+      maintenance.cursor++;
+      return;
+    }
+    size_t records = maintenance.trimSource.size() / sizeof(RollupBucket);
+    maintenance.trimSource.seek(records > keepRecords ? (records - keepRecords) * sizeof(RollupBucket) : 0);
+    return;
+  }
+
+  uint8_t chunk[ROLLUP_TRIM_CHUNK];
+  size_t length = maintenance.trimSource.read(chunk, sizeof(chunk));
+  if (length > 0) {
+    maintenance.trimTarget.write(chunk, length);
+    metrics.sdReadBytes += length;
+    metrics.sdWriteBytes += length;
+  }
+  if (length < sizeof(chunk)) {
+    uint32_t copied = maintenance.trimSource.position();
+    maintenance.trimSource.close();
+    File tail = SD.open(file.path, FILE_READ);
+    if (!tail) {
+      maintenance.trimTarget.close();
+      SD.remove(tempPath);
+      maintenance.cursor++;
+      return;
+    }
+    tail.seek(copied);
+    while ((length = tail.read(chunk, sizeof(chunk))) > 0) {
+      maintenance.trimTarget.write(chunk, length);
+      metrics.sdReadBytes += length;
+      metrics.sdWriteBytes += length;
+    }
+    tail.close();
+
+    size_t kept = maintenance.trimTarget.size();
+    maintenance.trimTarget.close();
+    SD.remove(file.path);
+    SD.rename(tempPath, file.path);
+    maintenance.rollupsTrimmed++;
+    maintenance.bytesRemoved += file.size > kept ? file.size - kept : 0;
+    maintenance.cursor++;
+  }
+}
+
+// Dated before any date a set clock gives, so of unknown age
+bool isUndated(const StoredFile& file) {
+  return file.date[0] != '\0' && strcmp(file.date, maintenance.validFrom.c_str()) < 0;
+}
+
+// Deletes one file past its class retention
+void retentionStep() {
+  if (maintenance.cursor >= maintenance.files.size()) {
+    maintenance.totalBytes = SD.totalBytes();
+    maintenance.usedBytes = SD.usedBytes();
+    // Oldest first, undated files last; on the same day raw files go
+    // before the archive
+    std::sort(maintenance.files.begin(), maintenance.files.end(), [](const StoredFile& a, const StoredFile& b) {
+      if (isUndated(a) != isUndated(b)) return isUndated(b);
+      int order = strcmp(a.date, b.date);
+      return order != 0 ? order < 0 : a.storageClass < b.storageClass;
+    });
+    if (maintenance.today.isEmpty()) {
+      // No clock: the newest day may be the one being written
+      for (const StoredFile& file : maintenance.files) {
+        if (!isUndated(file) && maintenance.today < file.date) maintenance.today = file.date;
+      }
+    }
+    enterMaintenancePhase(MAINTENANCE_QUOTA);
+    return;
+  }
+
+  StoredFile& file = maintenance.files[maintenance.cursor++];
+  if (file.date[0] == '\0' || maintenance.today.isEmpty() || isUndated(file)) return;
+  uint16_t days = file.storageClass == STORAGE_ARCHIVE ? retention.archiveDays : retention.sensorDays;
+  if (shiftDate(file.date, days) < maintenance.today) {
+    removeStoredFile(file);
+  }
+}
+
+// Evicts one cloud queue segment, then one file, oldest first, while
+// usage is above the quota
+void quotaStep() {
+  uint64_t quotaBytes = maintenance.totalBytes / 100 * retention.quotaPercent;
+  if (maintenance.usedBytes <= quotaBytes || maintenance.cursor >= maintenance.files.size()) {
+    maintenance.phase = MAINTENANCE_IDLE;
+    maintenance.files.clear();
+    maintenance.files.shrink_to_fit();
+    maintenance.lastPass = millis();
+    maintenance.lastPassMs = maintenance.lastPass - maintenance.passStarted;
+    return;
+  }
+
+  // An unsent cloud queue goes before any history
+  uint32_t freed;
+  if (cloudQuotaStep(freed)) {
+    maintenance.filesRemoved++;
+    maintenance.bytesRemoved += freed;
+    maintenance.classBytes[STORAGE_CLOUD] -= std::min<uint64_t>(freed, maintenance.classBytes[STORAGE_CLOUD]);
+    maintenance.usedBytes -= std::min<uint64_t>(freed, maintenance.usedBytes);
+    return;
+  }
+
+  StoredFile& file = maintenance.files[maintenance.cursor++];
+  if (file.date[0] == '\0' || maintenance.today == file.date) return;
+  removeStoredFile(file);
+}
+
+void runMaintenance() {
+  if (maintenance.phase == MAINTENANCE_IDLE) {
+    if (!maintenance.due && maintenance.lastPass != 0 && millis() - maintenance.lastPass < MAINTENANCE_INTERVAL) {
+      return;
+    }
+    startMaintenancePass();
+  }
+
+  unsigned long start = micros();
+  while (maintenance.phase != MAINTENANCE_IDLE && micros() - start < MAINTENANCE_SLICE_US) {
+    switch (maintenance.phase) {
+      case MAINTENANCE_SCAN: scanStep(); break;
+      case MAINTENANCE_ARCHIVE: archiveStep(); break;
+      case MAINTENANCE_TRIM: trimStep(); break;
+      case MAINTENANCE_RETENTION: retentionStep(); break;
+      case MAINTENANCE_QUOTA: quotaStep(); break;
+      default: break;
+    }
+  }
+  metrics.maintenanceSlice.observe(micros() - start);
+}
+
+// GET /api/storage reports usage and headroom; POST sets retention, e.g.
+// {"sensorDays":7,"archiveDays":365,"minuteRollupDays":7,"hourRollupDays":365,"quotaPercent":90}
+void handleStorage() {
+  if (server.method() == HTTP_POST) {
+    StaticJsonDocument<256> config;
+    if (parseJson(config, server.arg("plain"))) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
+      return;
+    }
+    File saveFile = SD.open("/config/retention.json", FILE_WRITE);
+    if (!saveFile) {
+      server.send(500, "application/json", "{\"success\":false,\"message\":\"Save failed\"}");
+      return;
+    }
+    writeJson(config, saveFile);
+    saveFile.close();
+    loadRetentionConfig();
+    requestMaintenance();
+  } else if (server.method() != HTTP_GET) {
+    server.send(405, "text/plain", "Method Not Allowed");
+    return;
+  }
+
+  DynamicJsonDocument response(1024);
+  uint64_t quotaBytes = maintenance.totalBytes / 100 * retention.quotaPercent;
+  response["totalBytes"] = maintenance.totalBytes;
+  response["usedBytes"] = maintenance.usedBytes;
+  response["quotaBytes"] = quotaBytes;
+  response["headroomBytes"] = quotaBytes > maintenance.usedBytes ? quotaBytes - maintenance.usedBytes : 0;
+
+  JsonObject classes = response.createNestedObject("classes");
+  for (int i = 0; i < STORAGE_CLASS_COUNT; i++) {
+    classes[STORAGE_CLASS_NAMES[i]] = maintenance.classBytes[i];
+  }
+
+  JsonObject config = response.createNestedObject("retention");
+  config["sensorDays"] = retention.sensorDays;
+  config["archiveDays"] = retention.archiveDays;
+  config["minuteRollupDays"] = retention.minuteRollupDays;
+  config["hourRollupDays"] = retention.hourRollupDays;
+  config["quotaPercent"] = retention.quotaPercent;
+
+  JsonObject pass = response.createNestedObject("maintenance");
+  pass["phase"] = MAINTENANCE_PHASE_NAMES[maintenance.phase];
+  pass["lastPassMs"] = maintenance.lastPassMs;
+  pass["filesRemoved"] = maintenance.filesRemoved;
+  pass["bytesRemoved"] = maintenance.bytesRemoved;
+  pass["daysArchived"] = maintenance.daysArchived;
+  pass["rollupsTrimmed"] = maintenance.rollupsTrimmed;
+
+  String responseStr;
+  serializeJson(response, responseStr);
+  server.send(200, "application/json", responseStr);
+}
+
+// ==================== EXPORT ====================
+// GET /api/export?from=&to=[&deviceId=&format=csv|ndjson&asOf=&offset=]
+// Streams every reading of the days from..to (YYYY-MM-DD, default today)
+// as one chunked response, day by day from the archive or, for days not
+// archived yet, the device partitions. Rows carry date, timestamp,
+// deviceId, type, value and unit.
+//
+// An interrupted download resumes with "Range: bytes=N-" (or ?offset=N):
+// the export is generated again and its first N bytes are dropped. For
+// that to give the same bytes, readings stamped after asOf are left out
+// on every day (X-Export-As-Of; send it back as ?asOf= or via If-Range),
+// and the ETag changes whenever maintenance archives or removes data. A
+// Range request whose If-Range no longer matches gets the whole export
+// with a 200. Readings are filtered by stamp, not arrival, so one that
+// arrives late but is stamped before asOf (a device back after an outage,
+// held readings dated once the clock is seeded) still shifts the bytes
+// after it: a resume under the same ETag is not guaranteed byte-stable.
+#define EXPORT_CHUNK_BYTES 4096
+#define EXPORT_MAX_DAYS 366
+
+char exportBuffer[EXPORT_CHUNK_BYTES]; // One export runs at a time
+
+// Drops the first `skip` bytes of the body, then sends it in chunks of
+// EXPORT_CHUNK_BYTES
+struct ExportWriter : public Print {
+  uint64_t skip;
+  uint64_t position = 0;
+  size_t length = 0;
+
+  ExportWriter(uint64_t skipBytes) : skip(skipBytes) {}
+
+  using Print::write;
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    size_t consumed = 0;
+    if (position < skip) {
+      consumed = std::min<uint64_t>(size, skip - position);
+      position += consumed;
+    }
+    while (consumed < size) {
+      if (length >= sizeof(exportBuffer)) flush();
+      size_t n = std::min(size - consumed, sizeof(exportBuffer) - length);
+      memcpy(exportBuffer + length, data + consumed, n);
+      length += n;
+      consumed += n;
+      position += n;
+    }
+    return size;
+  }
+
+  void flush() {
+    if (length > 0) {
+      server.sendContent(exportBuffer, length);
+      length = 0;
+    }
+  }
+
+  bool connected() {
+    return server.client().connected();
+  }
+};
+
+void writeCsvField(Print& out, const char* text) {
+  if (!strpbrk(text, ",\"\r\n")) {
+    out.write(text, strlen(text));
+    return;
+  }
+  out.write('"');
+  for (const char* p = text; *p; p++) {
+    if (*p == '"') out.write('"');
+    out.write(*p);
+  }
+  out.write('"');
+}
+
+void writeExportRow(ExportWriter& out, bool csv, const String& date, uint32_t timestamp,
+                    const char* deviceId, const char* sensorType, float value, const char* unit) {
+  if (!csv) {
+    StaticJsonDocument<256> row;
+    row["date"] = date;
+    row["timestamp"] = timestamp;
+    row["deviceId"] = deviceId;
+    row["type"] = sensorType;
+    row["value"] = value;
+    row["unit"] = unit;
+    serializeJson(row, out);
+    out.write('\n');
+    return;
+  }
+
+  char fields[48];
+  int length = snprintf(fields, sizeof(fields), "%s,%lu,", date.c_str(), (unsigned long)timestamp);
+  out.write(fields, length);
+  writeCsvField(out, deviceId);
+  out.write(',');
+  writeCsvField(out, sensorType);
+  length = snprintf(fields, sizeof(fields), ",%.6g,", value);
+  out.write(fields, length);
+  writeCsvField(out, unit);
+  out.write('\n');
+}
+
+// Device IDs with a partition directory, sorted so exports are repeatable
+std::vector<String> listPartitionDevices() {
+  std::vector<String> devices;
+  File root = SD.open("/data/devices");
+  if (!root) return devices;
+  for (File entry = root.openNextFile(); entry; entry = root.openNextFile()) {
+    if (entry.isDirectory()) devices.push_back(entryName(entry));
+    entry.close();
+  }
+  root.close();
+  std::sort(devices.begin(), devices.end());
+  return devices;
+}
+
+void handleExport() {
+  static uint32_t bootTag = esp_random() & 0xFFFFFF;
+
+  String today = getTodayDateString();
+  String from = server.hasArg("from") ? server.arg("from") : today;
+  String to = server.hasArg("to") ? server.arg("to") : today;
+  String deviceId = server.arg("deviceId");
+  String format = server.hasArg("format") ? server.arg("format") : "csv";
+  bool csv = format == "csv";
+  if (!isDateName(from) || !isDateName(to) || !isSafePathPart(from) || !isSafePathPart(to) ||
+      (!deviceId.isEmpty() && !isSafePathPart(deviceId)) || (!csv && format != "ndjson")) {
+    server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid from, to, deviceId or format\"}");
+    return;
+  }
+
+  uint32_t asOf = server.hasArg("asOf") ? strtoul(server.arg("asOf").c_str(), nullptr, 10) : readingTimestamp();
+  uint64_t offset = server.hasArg("offset") ? strtoull(server.arg("offset").c_str(), nullptr, 10) : 0;
+  bool ranged = false;
+  String range = server.header("Range");
+  if (range.startsWith("bytes=") && range.endsWith("-")) {
+    offset = strtoull(range.c_str() + 6, nullptr, 10);
+    ranged = true;
+
+    // If-Range carries the ETag of the first response: "<boot>-<generation>-<asOf>"
+    String ifRange = server.header("If-Range");
+    if (!ifRange.isEmpty()) {
+      unsigned long tag = 0, generation = 0, taggedAsOf = 0;
+      if (sscanf(ifRange.c_str(), "\"%lx-%lu-%lu\"", &tag, &generation, &taggedAsOf) == 3 &&
+          tag == bootTag && generation == maintenance.generation) {
+        asOf = taggedAsOf;
+      } else {
+        offset = 0;
+        ranged = false;
+      }
+    }
+  }
+
+  char etag[40];
+  snprintf(etag, sizeof(etag), "\"%06lx-%lu-%lu\"", (unsigned long)bootTag,
+           (unsigned long)maintenance.generation, (unsigned long)asOf);
+  server.sendHeader("ETag", etag);
+  server.sendHeader("Accept-Ranges", "bytes");
+  server.sendHeader("X-Export-As-Of", String(asOf));
+  server.sendHeader("Content-Disposition", "attachment; filename=\"export." + format + "\"");
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(ranged ? 206 : 200, csv ? "text/csv" : "application/x-ndjson", "");
+
+  ExportWriter out(offset);
+  if (csv) out.print("date,timestamp,deviceId,type,value,unit\n");
+
+  std::vector<String> devices;
+  if (deviceId.isEmpty()) {
+    devices = listPartitionDevices();
+  } else {
+    devices.push_back(deviceId);
+  }
+
+  String date = from;
+  for (int day = 0; day < EXPORT_MAX_DAYS && date <= to && out.connected(); day++, date = shiftDate(date, 1)) {
+    scanStoredDay(date, deviceId.isEmpty() ? nullptr : deviceId.c_str(), devices, 0, asOf,
+                  [&](const char* device, const char* sensorType, const char* unit, uint32_t timestamp, float value) {
+      writeExportRow(out, csv, date, timestamp, device, sensorType, value, unit);
+      return out.connected();
+    });
+  }
+
+  out.flush();
+  server.sendContent("");
+}
+
+// ==================== CLOUD UPLINK ====================
+// While an endpoint is configured, readings bound for the cloud are
+// appended to /data/cloud/queue-<generation>.log, one JSON line each (the
+// partition line plus deviceId). A segment is closed at
+// CLOUD_SEGMENT_BYTES and the next generation started; beyond
+// CLOUD_QUEUE_SEGMENTS the oldest is dropped unsent, so an outage costs
+// the oldest readings rather than the card. Under SD quota, maintenance
+// drops queue segments before any history (cloudQuotaStep()).
+//
+// runCloudUplink() sends them from a durable cursor: a batch of up to
+// batchSize lines is encoded in the archive format (SDNArchive.h), a few
+// bytes per reading instead of ~100, and POSTed to the configured endpoint
+// as application/x-sdn-archive. X-Batch-Id is "<generation>-<offset>" so
+// the receiver can drop a batch it already has: the cursor in
+// /data/cloud/cursor only moves on a 2xx, so delivery is at least once.
+// A segment is removed once sent or dropped, always after the cursor has
+// moved past it on the card, and init removes any segment older than the
+// cursor or shorter than its offset; so a batch id never names other
+// bytes than it did before a reset. Failures back off exponentially up to
+// CLOUD_BACKOFF_MAX_MS. The POST blocks loop(), so it gets short timeouts
+// and one batch goes out per loop pass: while a backlog remains, ingest
+// and commands are served between batches.
+// /config/cloud.json: {"endpoint":"http://192.168.4.2:8080/ingest","batchSize":200}
+// tools/cloud_stub.py is a receiver for tests on a LAN host.
+#define CLOUD_CURSOR_PATH "/data/cloud/cursor"
+#define CLOUD_SEGMENT_BYTES 262144UL
+#define CLOUD_QUEUE_SEGMENTS 8 // Queue limit: 2 MB
+#define CLOUD_BATCH_DEFAULT 200
+#define CLOUD_BATCH_MAX 1000
+#define CLOUD_MAX_SERIES 16 // Series per batch
+#define CLOUD_CONNECT_TIMEOUT_MS 500
+#define CLOUD_TIMEOUT_MS 1500
+#define CLOUD_BACKOFF_MIN_MS 1000
+#define CLOUD_BACKOFF_MAX_MS 300000UL
+#define CLOUD_IDLE_INTERVAL 1000
+
+struct CloudCursor {
+  uint32_t generation; // Of the segment being sent
+  uint32_t offset;     // First unsent byte of that segment
+};
+
+struct CloudSegment {
+  uint32_t bytes;
+  uint32_t records; // Not yet sent
+};
+
+struct CloudUplink {
+  String endpoint;
+  uint16_t batchSize;
+  CloudCursor cursor;
+  std::vector<CloudSegment> segments; // From the cursor's to the one appended to
+  uint32_t backlogRecords;
+  uint64_t droppedRecords;
+  unsigned long nextAttempt;
+  unsigned long backoffMs;
+  uint64_t sentRecords;
+  uint64_t sentBytes; // Encoded batches
+  uint64_t rawBytes;  // Queue lines those batches carried
+  uint32_t batchesOk;
+  uint32_t batchesFailed;
+  LatencyHistogram uploadTime;
+};
+
+CloudUplink uplink;
+
+// Collects a batch in RAM
+struct BufferWriter : public Print {
+  std::vector<uint8_t> data;
+
+  size_t write(uint8_t c) override {
+    data.push_back(c);
+    return 1;
+  }
+
+  size_t write(const uint8_t* buffer, size_t size) override {
+    data.insert(data.end(), buffer, buffer + size);
+    return size;
+  }
+};
+
+String cloudSegmentPath(uint32_t generation) {
+  return "/data/cloud/queue-" + String(generation) + ".log";
+}
+
+uint32_t cloudHeadGeneration() {
+  return uplink.cursor.generation + uplink.segments.size() - 1;
+}
+
+uint32_t cloudBacklogBytes() {
+  uint32_t bytes = 0;
+  for (const CloudSegment& segment : uplink.segments) bytes += segment.bytes;
+  return bytes - std::min(uplink.cursor.offset, bytes);
+}
+
+bool saveCloudCursor() {
+  File file = SD.open(CLOUD_CURSOR_PATH, FILE_WRITE);
+  if (!file) return false;
+  size_t written = file.write((const uint8_t*)&uplink.cursor, sizeof(uplink.cursor));
+  file.close();
+  metrics.sdWriteBytes += written;
+  return written == sizeof(uplink.cursor);
+}
+
+// Moves the cursor to the next segment and removes the one it was in,
+// counting its unsent records as dropped. The cursor is saved first, so
+// after a reset in between init removes the segment as older than the
+// cursor. False if the cursor could not be saved.
+bool retireCloudSegment() {
+  CloudSegment retired = uplink.segments.front();
+  String path = cloudSegmentPath(uplink.cursor.generation);
+  CloudCursor previous = uplink.cursor;
+  uplink.cursor.generation++;
+  uplink.cursor.offset = 0;
+  if (!saveCloudCursor()) {
+    uplink.cursor = previous;
+    return false;
+  }
+
+  storage.close(path.c_str());
+  SD.remove(path);
+  uplink.segments.erase(uplink.segments.begin());
+  if (uplink.segments.empty()) uplink.segments.push_back({0, 0});
+  uplink.backlogRecords -= std::min(retired.records, uplink.backlogRecords);
+  uplink.droppedRecords += retired.records;
+  return true;
+}
+
+void loadCloudConfig() {
+  uplink.batchSize = CLOUD_BATCH_DEFAULT;
+  File file = SD.open("/config/cloud.json", FILE_READ);
+  if (!file) return;
+  StaticJsonDocument<256> config;
+  if (!readJson(config, file)) {
+    uplink.endpoint = config["endpoint"] | "";
+    uplink.batchSize = constrain(config["batchSize"] | CLOUD_BATCH_DEFAULT, 1, CLOUD_BATCH_MAX);
+  }
+  file.close();
+}
+
+// Queues a payload's readings for the cloud with one append to the head
+// segment. Without an endpoint nothing would ever send them.
+void addToCloudQueue(const String& deviceId, const SensorReading* readings, int count) {
+  if (uplink.endpoint.isEmpty()) return;
+  if (uplink.segments.back().bytes >= CLOUD_SEGMENT_BYTES) {
+    storage.close(cloudSegmentPath(cloudHeadGeneration()).c_str());
+    uplink.segments.push_back({0, 0});
+    if (uplink.segments.size() > CLOUD_QUEUE_SEGMENTS) retireCloudSegment();
+  }
+
+  String path = cloudSegmentPath(cloudHeadGeneration());
+  CloudSegment& head = uplink.segments.back();
+  size_t written = 0;
+  unsigned long start = micros();
+  for (int i = 0; i < count; i++) {
+    StaticJsonDocument<192> record;
+    record["timestamp"] = readings[i].timestamp;
+    record["deviceId"] = deviceId;
+    record["type"] = readings[i].type;
+    record["value"] = readings[i].value;
+    record["unit"] = readings[i].unit;
+    char line[192];
+    size_t length = serializeJson(record, line, sizeof(line) - 1);
+    line[length++] = '\n';
+    if (!storage.append(path.c_str(), (const uint8_t*)line, length)) {
+      requestMaintenance();
+      break;
+    }
+    written += length;
+    head.records++;
+    uplink.backlogRecords++;
+  }
+  metrics.sdWrite.observe(micros() - start);
+  metrics.sdWriteBytes += written;
+  head.bytes += written;
+}
+
+// Counts the lines of a segment from `offset`
+uint32_t countCloudRecords(File& segment, uint32_t offset) {
+  uint32_t records = 0;
+  segment.seek(offset);
+  uint8_t chunk[512];
+  size_t length;
+  while ((length = segment.read(chunk, sizeof(chunk))) > 0) {
+    for (size_t i = 0; i < length; i++) {
+      if (chunk[i] == '\n') records++;
+    }
+  }
+  metrics.sdReadBytes += segment.position() - offset;
+  return records;
+}
+
+// Loads the config and cursor and counts the backlog. Segments the cursor
+// has passed are removed. If the cursor's segment is gone, or shorter than
+// its offset (bytes lost in a reset), the cursor moves to the next segment,
+// or a new generation, so its batch ids are never reused. The queue.log of
+// earlier firmware becomes the cursor's segment, and entries of the older
+// queue.json are moved to the queue.
+void initCloudUplink() {
+  loadCloudConfig();
+
+  memset(&uplink.cursor, 0, sizeof(uplink.cursor));
+  File cursorFile = SD.open(CLOUD_CURSOR_PATH, FILE_READ);
+  if (cursorFile) {
+    cursorFile.read((uint8_t*)&uplink.cursor, sizeof(uplink.cursor));
+    cursorFile.close();
+  }
+  if (SD.exists("/data/cloud/queue.log")) {
+    SD.rename("/data/cloud/queue.log", cloudSegmentPath(uplink.cursor.generation));
+  }
+
+  std::vector<String> stale;
+  bool found = false;
+  uint32_t first = 0;
+  uint32_t last = 0;
+  File dir = SD.open("/data/cloud");
+  if (dir) {
+    for (File entry = dir.openNextFile(); entry; entry = dir.openNextFile()) {
+      String name = entryName(entry);
+      unsigned long generation;
+      int used = 0;
+      if (sscanf(name.c_str(), "queue-%lu.log%n", &generation, &used) == 1 && used == (int)name.length()) {
+        bool passed = generation < uplink.cursor.generation ||
+                      (generation == uplink.cursor.generation && entry.size() < uplink.cursor.offset);
+        if (passed) {
+          stale.push_back("/data/cloud/" + name);
+        } else {
+          first = found ? std::min<uint32_t>(first, generation) : generation;
+          last = found ? std::max<uint32_t>(last, generation) : generation;
+          found = true;
+        }
+      }
+      entry.close();
+    }
+    dir.close();
+  }
+  for (const String& path : stale) SD.remove(path);
+
+  if (!found) first = last = uplink.cursor.generation + 1;
+  if (first != uplink.cursor.generation) {
+    uplink.cursor.generation = first;
+    uplink.cursor.offset = 0;
+    saveCloudCursor();
+  }
+
+  uplink.segments.clear();
+  uplink.backlogRecords = 0;
+  for (uint32_t generation = first; generation <= last; generation++) {
+    CloudSegment segment = {0, 0};
+    File file = SD.open(cloudSegmentPath(generation), FILE_READ);
+    if (file) {
+      segment.bytes = file.size();
+      segment.records = countCloudRecords(file, generation == first ? uplink.cursor.offset : 0);
+      file.close();
+    }
+    uplink.segments.push_back(segment);
+    uplink.backlogRecords += segment.records;
+  }
+
+  if (SD.exists("/data/cloud/queue.json")) {
+    scanJsonArray("/data/cloud/queue.json", "queue", nullptr, [](JsonObject entry) {
+      SensorReading reading = {};
+      strlcpy(reading.type, entry["type"] | "", sizeof(reading.type));
+      reading.value = entry["value"];
+      strlcpy(reading.unit, entry["unit"] | "", sizeof(reading.unit));
+      reading.timestamp = readingTimestamp();
+      addToCloudQueue(entry["deviceId"] | "", &reading, 1);
+      return true;
+    });
+    SD.remove("/data/cloud/queue.json");
+  }
+}
+
+// Drops the oldest queue segment for the SD quota, before any history is
+// evicted. False once the queue is empty.
+bool cloudQuotaStep(uint32_t& freed) {
+  freed = uplink.segments.front().bytes;
+  if (uplink.segments.size() == 1 && freed == 0) return false;
+  return retireCloudSegment();
+}
+
+struct CloudSeries {
+  char deviceId[24];
+  char sensorType[16];
+  char unit[12];
+  SeriesEncoder* encoder;
+};
+
+// Encodes the next batch from the cursor and POSTs it. Returns false if
+// the endpoint did not accept it.
+bool sendCloudBatch() {
+  String path = cloudSegmentPath(uplink.cursor.generation);
+  storage.sync(path.c_str());
+  File log = SD.open(path, FILE_READ);
+  if (!log) return false;
+  log.setTimeout(0); // Stream reads would otherwise wait a second at EOF
+  log.seek(uplink.cursor.offset);
+
+  BufferWriter batch;
+  ArchiveWriter writer(batch);
+  writer.begin();
+  CloudSeries series[CLOUD_MAX_SERIES];
+  int seriesCount = 0;
+  uint32_t end = uplink.cursor.offset;
+  uint32_t lines = 0;
+  uint32_t records = 0;
+
+  unsigned long start = micros();
+  char line[192];
+  while (records < uplink.batchSize) {
+    size_t length = log.readBytesUntil('\n', line, sizeof(line) - 1);
+    if (length == 0) break;
+
+    StaticJsonDocument<256> record;
+    if (deserializeJson(record, line, length)) {
+      end += length + 1; // Skip a damaged line
+      lines++;
+      continue;
+    }
+    const char* deviceId = record["deviceId"] | "";
+    const char* sensorType = record["type"] | "";
+    const char* unit = record["unit"] | "";
+
+    CloudSeries* target = nullptr;
+    for (int i = 0; i < seriesCount; i++) {
+      if (strcmp(series[i].deviceId, deviceId) == 0 && strcmp(series[i].sensorType, sensorType) == 0 &&
+          strcmp(series[i].unit, unit) == 0) {
+        target = &series[i];
+        break;
+      }
+    }
+    if (!target) {
+      if (seriesCount >= CLOUD_MAX_SERIES) break; // Goes in the next batch
+      target = &series[seriesCount];
+      strlcpy(target->deviceId, deviceId, sizeof(target->deviceId));
+      strlcpy(target->sensorType, sensorType, sizeof(target->sensorType));
+      strlcpy(target->unit, unit, sizeof(target->unit));
+      target->encoder = new SeriesEncoder();
+      target->encoder->begin(seriesCount);
+      writer.defineSeries(seriesCount++, target->deviceId, target->sensorType, target->unit);
+    }
+
+    uint32_t timestamp = record["timestamp"];
+    float value = record["value"];
+    if (!target->encoder->append(timestamp, value)) {
+      writer.writeBlock(*target->encoder);
+      target->encoder->append(timestamp, value);
+    }
+    end += length + 1;
+    lines++;
+    records++;
+  }
+  log.close();
+  metrics.sdRead.observe(micros() - start);
+  metrics.sdReadBytes += end - uplink.cursor.offset;
+
+  for (int i = 0; i < seriesCount; i++) {
+    writer.writeBlock(*series[i].encoder);
+    delete series[i].encoder;
+  }
+
+  if (records > 0) {
+    char batchId[24];
+    snprintf(batchId, sizeof(batchId), "%lu-%lu", (unsigned long)uplink.cursor.generation,
+             (unsigned long)uplink.cursor.offset);
+
+    start = micros();
+    httpClient.begin(uplink.endpoint);
+    httpClient.setConnectTimeout(CLOUD_CONNECT_TIMEOUT_MS);
+    httpClient.setTimeout(CLOUD_TIMEOUT_MS);
+    httpClient.addHeader("Content-Type", "application/x-sdn-archive");
+    httpClient.addHeader("X-Batch-Id", batchId);
+    int httpCode = httpClient.POST(batch.data.data(), batch.data.size());
+    httpClient.end();
+    httpClient.setConnectTimeout(HTTPCLIENT_DEFAULT_TCP_TIMEOUT);
+    uplink.uploadTime.observe(micros() - start);
+
+    if (httpCode < 200 || httpCode >= 300) {
+      uplink.batchesFailed++;
+      return false;
+    }
+    uplink.batchesOk++;
+    uplink.sentRecords += records;
+    uplink.sentBytes += batch.data.size();
+    uplink.rawBytes += end - uplink.cursor.offset;
+  }
+
+  uplink.cursor.offset = end;
+  CloudSegment& segment = uplink.segments.front();
+  segment.bytes = std::max(segment.bytes, end); // A failed append may have left more than was counted
+  segment.records -= std::min(lines, segment.records);
+  uplink.backlogRecords -= std::min(lines, uplink.backlogRecords);
+  saveCloudCursor();
+  return true;
+}
+
+void runCloudUplink() {
+  if (uplink.endpoint.isEmpty() || (long)(millis() - uplink.nextAttempt) < 0) return;
+
+  if (uplink.cursor.offset >= uplink.segments.front().bytes) {
+    // Sent in full; a next segment goes on the next loop pass
+    bool more = uplink.segments.size() > 1;
+    if ((more || uplink.segments.front().bytes > 0) && retireCloudSegment() && more) {
+      uplink.nextAttempt = millis();
+      return;
+    }
+    uplink.nextAttempt = millis() + CLOUD_IDLE_INTERVAL;
+    return;
+  }
+
+  if (sendCloudBatch()) {
+    uplink.backoffMs = 0;
+    uplink.nextAttempt = millis(); // The next batch on the next loop pass
+  } else {
+    uplink.backoffMs = uplink.backoffMs == 0 ? CLOUD_BACKOFF_MIN_MS : std::min(uplink.backoffMs * 2, CLOUD_BACKOFF_MAX_MS);
+    uplink.nextAttempt = millis() + uplink.backoffMs + esp_random() % (uplink.backoffMs / 4 + 1);
+  }
+}
+
+// GET /api/cloud reports uplink state; POST sets the endpoint and batch size
+void handleCloud() {
+  if (server.method() == HTTP_POST) {
+    StaticJsonDocument<256> config;
+    if (parseJson(config, server.arg("plain"))) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
+      return;
+    }
+    File saveFile = SD.open("/config/cloud.json", FILE_WRITE);
+    if (!saveFile) {
+      server.send(500, "application/json", "{\"success\":false,\"message\":\"Save failed\"}");
+      return;
+    }
+    writeJson(config, saveFile);
+    saveFile.close();
+    loadCloudConfig();
+    uplink.backoffMs = 0;
+    uplink.nextAttempt = millis();
+  } else if (server.method() != HTTP_GET) {
+    server.send(405, "text/plain", "Method Not Allowed");
+    return;
+  }
+
+  StaticJsonDocument<512> response;
+  response["endpoint"] = uplink.endpoint;
+  response["batchSize"] = uplink.batchSize;
+  response["backlogRecords"] = uplink.backlogRecords;
+  response["backlogBytes"] = cloudBacklogBytes();
+  response["droppedRecords"] = uplink.droppedRecords;
+  response["segments"] = uplink.segments.size();
+  response["sentRecords"] = uplink.sentRecords;
+  response["sentBytes"] = uplink.sentBytes;
+  response["rawBytes"] = uplink.rawBytes;
+  response["batchesOk"] = uplink.batchesOk;
+  response["batchesFailed"] = uplink.batchesFailed;
+  response["backoffMs"] = uplink.backoffMs;
+
+  String responseStr;
+  serializeJson(response, responseStr);
+  server.send(200, "application/json", responseStr);
+}
+
+// ==================== FILE SERVING ====================
+String getContentType(String filename) {
+  if (filename.endsWith(".html")) return "text/html";
+  if (filename.endsWith(".css")) return "text/css";
+  if (filename.endsWith(".js")) return "application/javascript";
+  return "text/plain";
+}
+
+bool handleFileRead(String path) {
+  if (path.endsWith("/")) path += "login.html";
+  String contentType = getContentType(path);
+  String fullPath = "/web" + path;
+  if (SD.exists(fullPath)) {
+    File file = SD.open(fullPath, FILE_READ);
+    streamSdFile(file, contentType);
+    file.close();
+    return true;
+  }
+  return false;
+}
+
+// ==================== AUTHENTICATION ====================
+void handleLogin() {
+  if (server.method() == HTTP_POST) {
+    String user = server.arg("username");
+    String pass = server.arg("password");
+    if (user == username && pass == password) {
+      server.send(200, "application/json", "{\"success\":true, \"token\":\"dummy-token\"}");
+    } else {
+      server.send(401, "application/json", "{\"success\":false, \"message\":\"Invalid credentials\"}");
+    }
+  } else {
+    server.send(405, "text/plain", "Method Not Allowed");
+  }
+}
+
+void handleLogout() {
+  if (server.method() == HTTP_POST) {
+    server.send(200, "application/json", "{\"success\":true,\"message\":\"Logged out\"}");
+  } else {
+    server.send(405, "text/plain", "Method Not Allowed");
+  }
+}
+
+// ==================== DEVICE DISCOVERY ====================
+bool getDeviceInfo(String ssid, DiscoveredDevice& device) {
+  Serial.println("Connecting to " + ssid + " to get device info...");
+  
+  // Connect to device AP
+  WiFi.begin(ssid.c_str(), "12345678");
+  
+  int attempts = 0;
+  while (WiFi.status() != WL_CONNECTED && attempts < 10) {
+    delay(500);
+    attempts++;
+  }
+  
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("Failed to connect to " + ssid);
+    WiFi.softAP("ESP32-IoT-Server", "12345678");
+    return false;
+  }
+  
+  // Get device info via HTTP
+  HTTPClient http;
+  String url = "http://192.168.4.1/api/info";
+  
+  http.begin(url);
+  http.setTimeout(5000);
+  
+  int httpCode = http.GET();
+  
+  if (httpCode == 200) {
+    String payload = http.getString();
+    
+    StaticJsonDocument<1024> deviceInfo;
+    DeserializationError error = parseJson(deviceInfo, payload);
+    
+    if (!error) {
+      device.ssid = ssid;
+      // Fixed: Explicitly convert JsonVariant to String
+      device.deviceId = deviceInfo["deviceId"].as<String>();
+      device.deviceType = deviceInfo["deviceType"].as<String>();
+      device.description = deviceInfo["description"].as<String>();
+      device.firmwareVersion = deviceInfo["firmwareVersion"].as<String>();
+      device.hardwareVersion = deviceInfo["hardwareVersion"].as<String>();
+      device.configured = deviceInfo["configured"];
+      device.rssi = WiFi.RSSI();
+      
+      Serial.println("Device info retrieved successfully");
+      http.end();
+      
+      WiFi.disconnect();
+      WiFi.softAP("ESP32-IoT-Server", "12345678");
+      
+      return true;
+    }
+  }
+  
+  http.end();
+  WiFi.disconnect();
+  WiFi.softAP("ESP32-IoT-Server", "12345678");
+  
+  return false;
+}
+
+// ==================== DEVICE DISCOVERY (FIXED) ====================
+void handleAdvancedWiFiScan() {
+  Serial.println("Starting advanced WiFi scan for SDN devices...");
+  
+  discoveredDevices.clear();
+  
+  // Save current WiFi mode
+  wifi_mode_t currentMode = WiFi.getMode();
+  
+  // Switch to STA mode for scanning
+  WiFi.mode(WIFI_STA);
+  delay(100); // Let mode change settle
+  
+  int networkCount = WiFi.scanNetworks();
+  
+  if (networkCount == 0) {
+    // Restore AP mode before returning
+    WiFi.mode(WIFI_AP);
+    WiFi.softAP("ESP32-IoT-Server", "12345678");
+    server.send(200, "application/json", "{\"devices\":[]}");
+    return;
+  }
+  
+  // First, collect all ESP32_Device SSIDs
+  std::vector<String> deviceSSIDs;
+  for (int i = 0; i < networkCount; i++) {
+    String ssid = WiFi.SSID(i);
+    if (ssid.startsWith("ESP32_Device_")) {
+      deviceSSIDs.push_back(ssid);
+      Serial.println("Found potential SDN device: " + ssid);
+    }
+  }
+  
+  // Clear scan results to free memory
+  WiFi.scanDelete();
+  
+  // Now connect to each device to get info
+  StaticJsonDocument<2048> response;
+  JsonArray devices = response.createNestedArray("devices");
+  
+  for (const String& ssid : deviceSSIDs) {
+    // Switch to STA mode to connect
+    WiFi.mode(WIFI_STA);
+    
+    DiscoveredDevice device;
+    if (getDeviceInfo(ssid, device)) {
+      discoveredDevices.push_back(device);
+      
+      JsonObject deviceJson = devices.createNestedObject();
+      deviceJson["ssid"] = device.ssid;
+      deviceJson["deviceId"] = device.deviceId;
+      deviceJson["deviceType"] = device.deviceType;
+      deviceJson["description"] = device.description;
+      deviceJson["configured"] = device.configured;
+      deviceJson["rssi"] = device.rssi;
+      deviceJson["firmwareVersion"] = device.firmwareVersion;
+    }
+  }
+  
+  // Restore AP mode
+  WiFi.mode(WIFI_AP);
+  WiFi.softAP("ESP32-IoT-Server", "12345678");
+  
+  String jsonResponse;
+  serializeJson(response, jsonResponse);
+  server.send(200, "application/json", jsonResponse);
+}
+
+// Alternative: Two-phase discovery for better UX
+void handleQuickScan() {
+  Serial.println("Quick scan for SDN devices...");
+  
+  // Switch to STA mode
+  WiFi.mode(WIFI_STA);
+  delay(100);
+  
+  int networkCount = WiFi.scanNetworks();
+  
+  StaticJsonDocument<1024> response;
+  JsonArray devices = response.createNestedArray("devices");
+  
+  for (int i = 0; i < networkCount; i++) {
+    String ssid = WiFi.SSID(i);
+    if (ssid.startsWith("ESP32_Device_")) {
+      JsonObject device = devices.createNestedObject();
+      device["ssid"] = ssid;
+      device["rssi"] = WiFi.RSSI(i);
+      device["configured"] = false; // Unknown until we connect
+      device["needsInfo"] = true;
+    }
+  }
+  
+  WiFi.scanDelete();
+  
+  // Restore AP mode
+  WiFi.mode(WIFI_AP);
+  WiFi.softAP("ESP32-IoT-Server", "12345678");
+  
+  String jsonResponse;
+  serializeJson(response, jsonResponse);
+  server.send(200, "application/json", jsonResponse);
+}
+
+// Get info for specific device
+void handleGetDeviceInfo() {
+  String targetSSID = server.arg("ssid");
+  
+  if (targetSSID.isEmpty()) {
+    server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing SSID\"}");
+    return;
+  }
+  
+  // Switch to STA mode
+  WiFi.mode(WIFI_STA);
+  
+  DiscoveredDevice device;
+  if (getDeviceInfo(targetSSID, device)) {
+    StaticJsonDocument<512> deviceInfo;
+    deviceInfo["success"] = true;
+    deviceInfo["deviceId"] = device.deviceId;
+    deviceInfo["deviceType"] = device.deviceType;
+    deviceInfo["description"] = device.description;
+    deviceInfo["firmwareVersion"] = device.firmwareVersion;
+    deviceInfo["configured"] = device.configured;
+    
+    String response;
+    serializeJson(deviceInfo, response);
+    
+    // Restore AP mode
+    WiFi.mode(WIFI_AP);
+    WiFi.softAP("ESP32-IoT-Server", "12345678");
+    
+    server.send(200, "application/json", response);
+  } else {
+    // Restore AP mode
+    WiFi.mode(WIFI_AP);
+    WiFi.softAP("ESP32-IoT-Server", "12345678");
+    
+    server.send(500, "application/json", "{\"success\":false,\"message\":\"Failed to get device info\"}");
+  }
+}
+
+// ==================== LEGACY WIFI SCAN ====================
+void handleWiFiScan() {
+  int n = WiFi.scanNetworks();
+  if (n == 0) {
+    server.send(200, "application/json", "{\"devices\":[]}");
+    return;
+  }
+
+  String json = "{\"devices\":[";
+  for (int i = 0; i < n; i++) {
+    json += "{";
+    json += "\"name\":\"" + WiFi.SSID(i) + "\",";
+    json += "\"ip\":\"192.168.4.1\"";
+    json += "}";
+    if (i < n - 1) json += ",";
+  }
+  json += "]}";
+
+  WiFi.scanDelete();
+  server.send(200, "application/json", json);
+}
+// ==================== SECURITY ENHANCEMENTS ====================
+
+// Generate unique password based on device ID
+String generateDevicePassword(String deviceId) {
+  // Use last 6 characters of device ID for simple hash
+  String idPart = deviceId.substring(deviceId.length() - 6);
+  
+  // Simple hash calculation
+  uint32_t hash = 0;
+  for (char c : idPart) {
+    hash = hash * 31 + c;
+  }
+  
+  // Create password with prefix and hash
+  return "IOT_" + String(hash % 100000); // 5-digit number
+}
+
+// Store known device passwords
+struct KnownDevice {
+  String deviceId;
+  String password;
+};
+
+std::vector<KnownDevice> knownDevices;
+
+// Enhanced device info retrieval with dynamic password
+bool getDeviceInfoSecure(String ssid, DiscoveredDevice& device) {
+  Serial.println("Connecting to " + ssid + " to get device info...");
+  
+  // Extract device ID hint from SSID (last part)
+  String deviceIdHint = ssid.substring(13); // After "ESP32_Device_"
+  
+  // Try known passwords first
+  String password = "";
+  bool found = false;
+  
+  for (auto& known : knownDevices) {
+    if (known.deviceId.endsWith(deviceIdHint)) {
+      password = known.password;
+      found = true;
+      break;
+    }
+  }
+  
+  // If not found, try default password for first-time devices
+  if (!found) {
+    password = "12345678"; // Default for unconfigured devices
+  }
+  
+  // Try to connect
+  WiFi.begin(ssid.c_str(), password.c_str());
+  
+  int attempts = 0;
+  while (WiFi.status() != WL_CONNECTED && attempts < 10) {
+    delay(500);
+    attempts++;
+  }
+  
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("Failed to connect to " + ssid);
+    WiFi.disconnect();
+    return false;
+  }
+  
+  // Get device info via HTTP
+  HTTPClient http;
+  String url = "http://192.168.4.1/api/info";
+  
+  http.begin(url);
+  http.setTimeout(5000);
+  
+  int httpCode = http.GET();
+  
+  if (httpCode == 200) {
+    String payload = http.getString();
+    
+    StaticJsonDocument<1024> deviceInfo;
+    DeserializationError error = parseJson(deviceInfo, payload);
+    
+    if (!error) {
+      device.ssid = ssid;
+      device.deviceId = deviceInfo["deviceId"].as<String>();
+      device.deviceType = deviceInfo["deviceType"].as<String>();
+      device.description = deviceInfo["description"].as<String>();
+      device.firmwareVersion = deviceInfo["firmwareVersion"].as<String>();
+      device.hardwareVersion = deviceInfo["hardwareVersion"].as<String>();
+      device.configured = deviceInfo["configured"];
+      device.rssi = WiFi.RSSI();
+      
+      // Store device ID and password for future use
+      if (!found && device.deviceId != "") {
+        KnownDevice known;
+        known.deviceId = device.deviceId;
+        known.password = password;
+        knownDevices.push_back(known);
+      }
+      
+      Serial.println("Device info retrieved successfully");
+      http.end();
+      WiFi.disconnect();
+      
+      return true;
+    }
+  }
+  
+  http.end();
+  WiFi.disconnect();
+  
+  return false;
+}
+
+// Configuration with secure password
+bool configureDeviceSecure(DiscoveredDevice& device, String deviceName, String deviceType, int readInterval) {
+  Serial.println("Configuring device: " + device.deviceId);
+  
+  // Find password for this device
+  String password = "12345678"; // Default
+  for (auto& known : knownDevices) {
+    if (known.deviceId == device.deviceId) {
+      password = known.password;
+      break;
+    }
+  }
+  
+  WiFi.begin(device.ssid.c_str(), password.c_str());
+  
+  int attempts = 0;
+  while (WiFi.status() != WL_CONNECTED && attempts < 10) {
+    delay(500);
+    attempts++;
+  }
+  
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("Failed to connect to device for configuration");
+    WiFi.disconnect();
+    return false;
+  }
+  
+  HTTPClient http;
+  String url = "http://192.168.4.1/api/config";
+  
+  http.begin(url);
+  http.addHeader("Content-Type", "application/json");
+  
+  // Generate new password for this device
+  String newPassword = generateDevicePassword(device.deviceId);
+  
+  StaticJsonDocument<512> configPayload;
+  configPayload["deviceName"] = deviceName;
+  configPayload["deviceType"] = deviceType;
+  configPayload["wifiSSID"] = "ESP32-IoT-Server";
+  configPayload["wifiPassword"] = "12345678"; // Control plane password
+  configPayload["controlPlaneIP"] = WiFi.softAPIP().toString();
+  configPayload["controlPlanePort"] = 80;
+  configPayload["readInterval"] = readInterval;
+  configPayload["newAPPassword"] = newPassword; // Tell device to change its AP password
+  
+  String payload;
+  serializeJson(configPayload, payload);
+  
+  int httpCode = http.POST(payload);
+  
+  bool success = (httpCode == 200);
+  
+  if (success) {
+    Serial.println("Device configured successfully");
+    
+    // Update known password for this device
+    bool updated = false;
+    for (auto& known : knownDevices) {
+      if (known.deviceId == device.deviceId) {
+        known.password = newPassword;
+        updated = true;
+        break;
+      }
+    }
+    
+    if (!updated) {
+      KnownDevice known;
+      known.deviceId = device.deviceId;
+      known.password = newPassword;
+      knownDevices.push_back(known);
+    }
+    
+    // Save known devices to SD card
+    saveKnownDevices();
+  } else {
+    Serial.println("Device configuration failed: " + String(httpCode));
+  }
+  
+  http.end();
+  WiFi.disconnect();
+  
+  return success;
+}
+
+// Save and load known devices
+void saveKnownDevices() {
+  File file = SD.open("/config/known_devices.json", FILE_WRITE);
+  if (!file) return;
+  
+  unsigned long start = micros();
+  JsonArrayWriter writer(file);
+  writer.beginArray("knownDevices");
+  for (auto& known : knownDevices) {
+    StaticJsonDocument<256> device;
+    device["deviceId"] = known.deviceId;
+    device["password"] = known.password;
+    writer.add(device);
+  }
+  writer.end();
+  file.close();
+  metrics.sdWrite.observe(micros() - start);
+  metrics.sdWriteBytes += writer.written;
+}
+
+void loadKnownDevices() {
+  knownDevices.clear();
+  scanJsonArray("/config/known_devices.json", "knownDevices", nullptr, [](JsonObject device) {
+    KnownDevice known;
+    known.deviceId = device["deviceId"].as<String>();
+    known.password = device["password"].as<String>();
+    knownDevices.push_back(known);
+    return true;
+  });
+}
+
+// ==================== DEVICE CONFIGURATION ====================
+bool configureDevice(DiscoveredDevice& device, String deviceName, String deviceType, int readInterval) {
+  Serial.println("Configuring device: " + device.deviceId);
+  
+  WiFi.begin(device.ssid.c_str(), "12345678");
+  
+  int attempts = 0;
   while (WiFi.status() != WL_CONNECTED && attempts < 10) {
     delay(500);
     attempts++;
   }
   
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("Failed to connect to " + ssid);
-    WiFi.disconnect();
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("Failed to connect to device for configuration");
+    WiFi.softAP("ESP32-IoT-Server", "12345678");
+    return false;
+  }
+  
+  HTTPClient http;
+  String url = "http://192.168.4.1/api/config";
+  
+  http.begin(url);
+  http.addHeader("Content-Type", "application/json");
+  
+  StaticJsonDocument<512> configPayload;
+  configPayload["deviceName"] = deviceName;
+  configPayload["deviceType"] = deviceType;
+  configPayload["wifiSSID"] = "ESP32-IoT-Server";
+  configPayload["wifiPassword"] = "12345678";
+  configPayload["controlPlaneIP"] = WiFi.softAPIP().toString();
+  configPayload["controlPlanePort"] = 80;
+  configPayload["readInterval"] = readInterval;
+  
+  String payload;
+  serializeJson(configPayload, payload);
+  
+  int httpCode = http.POST(payload);
+  
+  bool success = (httpCode == 200);
+  
+  if (success) {
+    Serial.println("Device configured successfully");
+  } else {
+    Serial.println("Device configuration failed: " + String(httpCode));
+  }
+  
+  http.end();
+  WiFi.disconnect();
+  WiFi.softAP("ESP32-IoT-Server", "12345678");
+  
+  return success;
+}
+
+void saveConfiguredDevice(DiscoveredDevice& device, String deviceName, String deviceType, int readInterval) {
+  StaticJsonDocument<512> newDevice;
+  newDevice["id"] = device.deviceId;
+  newDevice["name"] = deviceName;
+  newDevice["type"] = deviceType;
+  newDevice["ip"] = "pending";
+  newDevice["readInterval"] = readInterval;
+  newDevice["connected"] = false;
+  newDevice["configured"] = true;
+  newDevice["lastSeen"] = "";
+  newDevice["firmwareVersion"] = device.firmwareVersion;
+  newDevice["hardwareVersion"] = device.hardwareVersion;
+  
+  if (appendJsonArray("/config/devices.json", "devices", newDevice)) {
+    trackDevice(device.deviceId.c_str(), livenessTimeout(readInterval, deviceType == "sensor"));
+    Serial.println("Device saved to database");
+  }
+}
+
+void handleDeviceConfiguration() {
+  if (server.method() == HTTP_POST) {
+    String body = server.arg("plain");
+    
+    StaticJsonDocument<512> configData;
+    DeserializationError error = parseJson(configData, body);
+    
+    if (error) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
+      return;
+    }
+    
+    String targetDeviceId = configData["deviceId"];
+    String deviceName = configData["deviceName"];
+    String deviceType = configData["deviceType"];
+    int readInterval = configData["readInterval"];
+    
+    DiscoveredDevice* targetDevice = nullptr;
+    for (auto& device : discoveredDevices) {
+      if (device.deviceId == targetDeviceId) {
+        targetDevice = &device;
+        break;
+      }
+    }
+    
+    if (!targetDevice) {
+      server.send(404, "application/json", "{\"success\":false,\"message\":\"Device not found\"}");
+      return;
+    }
+    
+    if (configureDevice(*targetDevice, deviceName, deviceType, readInterval)) {
+      saveConfiguredDevice(*targetDevice, deviceName, deviceType, readInterval);
+      server.send(200, "application/json", "{\"success\":true,\"message\":\"Device configured successfully\"}");
+    } else {
+      server.send(500, "application/json", "{\"success\":false,\"message\":\"Configuration failed\"}");
+    }
+  } else {
+    server.send(405, "text/plain", "Method Not Allowed");
+  }
+}
+
+// ==================== LIVENESS ====================
+// Every registered device has a deadline: its expected reporting interval
+// plus LIVENESS_GRACE_MS after its last traffic of any kind (data,
+// heartbeat, registration, command ack). Deadlines sit in a two-level
+// hierarchical timer wheel of LIVENESS_TICK_MS ticks: level 0 has one slot
+// per tick of the current revolution, level 1 one slot per revolution.
+// Refreshing a device relinks it in O(1); a tick visits one level-0 slot,
+// and the first tick of a revolution cascades one level-1 slot down. A
+// device whose deadline passes goes offline and its next traffic brings it
+// back. Transitions are kept as events for GET /api/devices/events?since=<seq>.
+// The wheel is the live state (GET /api/devices overlays it); the
+// registry's "connected" flag follows in one rewrite at most every
+// LIVENESS_PERSIST_MS, so an AP drop costs one rewrite, not one per device.
+#define LIVENESS_MAX_DEVICES 64
+#define LIVENESS_TICK_MS 250
+#define LIVENESS_SLOTS 64             // Level 0 spans 16 s, level 1 about 17 min
+#define LIVENESS_GRACE_MS 5000
+#define LIVENESS_HEARTBEAT_MS 30000UL // Data plane heartbeat interval
+#define LIVENESS_EVENT_COUNT 32
+#define LIVENESS_PERSIST_MS 60000
+#define LIVENESS_NONE 0xFF
+
+struct DeviceLiveness {
+  char deviceId[24];
+  uint32_t timeoutMs;
+  uint32_t deadline;      // Wheel tick
+  unsigned long lastSeen; // millis() of the last traffic, 0 if none yet
+  bool online;
+  bool scheduled;         // Linked into slots[level][slot]
+  uint8_t level;
+  uint8_t slot;
+  uint8_t prev;
+  uint8_t next;
+};
+
+struct LivenessEvent {
+  uint32_t seq;
+  unsigned long at;
+  char deviceId[24];
+  bool online;
+};
+
+struct LivenessWheel {
+  DeviceLiveness devices[LIVENESS_MAX_DEVICES];
+  int count = 0;
+  uint8_t slots[2][LIVENESS_SLOTS]; // First device of each slot
+  uint32_t tick = 0;
+  unsigned long tickAt = 0;
+  LivenessEvent events[LIVENESS_EVENT_COUNT];
+  uint32_t eventSeq = 0;
+  uint32_t wentOffline = 0;
+  uint32_t cameOnline = 0;
+  bool dirty = false;          // Transitions not yet in the registry
+  unsigned long persistedAt = 0;
+};
+
+LivenessWheel liveness;
+
+// Longest expected gap between two messages of a device, plus grace.
+// Sensors send data every readInterval and every device heartbeats.
+uint32_t livenessTimeout(int readIntervalSeconds, bool sensor) {
+  uint32_t interval = LIVENESS_HEARTBEAT_MS;
+  if (sensor && readIntervalSeconds > 0) {
+    interval = std::min<uint32_t>(interval, readIntervalSeconds * 1000UL);
+  }
+  return interval + LIVENESS_GRACE_MS;
+}
+
+DeviceLiveness* findLiveness(const char* deviceId) {
+  for (int i = 0; i < liveness.count; i++) {
+    if (strcmp(liveness.devices[i].deviceId, deviceId) == 0) return &liveness.devices[i];
+  }
+  return nullptr;
+}
+
+// Links a device into the slot for its deadline: level 0 within the
+// current revolution, otherwise level 1 (capped at its last slot, which
+// cascades it again later)
+void linkLiveness(uint8_t index) {
+  DeviceLiveness& device = liveness.devices[index];
+  uint32_t revolution = liveness.tick / LIVENESS_SLOTS;
+  uint32_t target = device.deadline / LIVENESS_SLOTS;
+  if (target <= revolution) {
+    device.level = 0;
+    device.slot = device.deadline % LIVENESS_SLOTS;
+  } else {
+    device.level = 1;
+    device.slot = std::min(target, revolution + LIVENESS_SLOTS - 1) % LIVENESS_SLOTS;
+  }
+
+  uint8_t& head = liveness.slots[device.level][device.slot];
+  device.prev = LIVENESS_NONE;
+  device.next = head;
+  if (head != LIVENESS_NONE) liveness.devices[head].prev = index;
+  head = index;
+  device.scheduled = true;
+}
+
+void unlinkLiveness(uint8_t index) {
+  DeviceLiveness& device = liveness.devices[index];
+  if (!device.scheduled) return;
+  if (device.prev != LIVENESS_NONE) {
+    liveness.devices[device.prev].next = device.next;
+  } else {
+    liveness.slots[device.level][device.slot] = device.next;
+  }
+  if (device.next != LIVENESS_NONE) liveness.devices[device.next].prev = device.prev;
+  device.scheduled = false;
+}
+
+void recordLivenessEvent(DeviceLiveness& device) {
+  LivenessEvent& event = liveness.events[liveness.eventSeq % LIVENESS_EVENT_COUNT];
+  event.seq = ++liveness.eventSeq;
+  event.at = millis();
+  strlcpy(event.deviceId, device.deviceId, sizeof(event.deviceId));
+  event.online = device.online;
+  if (device.online) liveness.cameOnline++;
+  else liveness.wentOffline++;
+  liveness.dirty = true;
+}
+
+// Copies the devices' connectivity into the registry
+void persistLiveness() {
+  if (!liveness.dirty || millis() - liveness.persistedAt < LIVENESS_PERSIST_MS) return;
+  liveness.persistedAt = millis();
+  liveness.dirty = !rewriteJsonArray("/config/devices.json", "devices", [](JsonObject entry) {
+    DeviceLiveness* device = findLiveness(entry["id"] | "");
+    if (!device || entry["connected"] == device->online) return JSON_KEEP;
+    entry["connected"] = device->online;
+    entry["lastHeartbeat"] = String(device->lastSeen != 0 ? epochAt(device->lastSeen) : 0);
+    return JSON_CHANGED;
+  }, nullptr);
+}
+
+// Adds or updates a device's timeout. New devices start offline until
+// they are heard from.
+DeviceLiveness* trackDevice(const char* deviceId, uint32_t timeoutMs) {
+  DeviceLiveness* device = findLiveness(deviceId);
+  if (!device) {
+    if (liveness.count >= LIVENESS_MAX_DEVICES) return nullptr;
+    device = &liveness.devices[liveness.count++];
+    memset(device, 0, sizeof(*device));
+    strlcpy(device->deviceId, deviceId, sizeof(device->deviceId));
+  }
+  device->timeoutMs = timeoutMs;
+  return device;
+}
+
+// Any traffic from a device pushes its deadline out. Returns false for
+// devices that are not registered.
+bool touchDevice(const char* deviceId) {
+  DeviceLiveness* device = findLiveness(deviceId);
+  if (!device) return false;
+
+  uint8_t index = device - liveness.devices;
+  unlinkLiveness(index);
+  device->lastSeen = millis();
+  device->deadline = liveness.tick + (device->timeoutMs + LIVENESS_TICK_MS - 1) / LIVENESS_TICK_MS;
+  linkLiveness(index);
+
+  if (!device->online) {
+    device->online = true;
+    recordLivenessEvent(*device);
+  }
+  return true;
+}
+
+// Seeds the wheel from the registry at boot. Devices the registry has as
+// connected get one full timeout to be heard from.
+void loadDeviceLiveness() {
+  liveness.count = 0;
+  memset(liveness.slots, LIVENESS_NONE, sizeof(liveness.slots));
+  liveness.tickAt = millis();
+
+  StaticJsonDocument<128> filter;
+  filter["id"] = true;
+  filter["type"] = true;
+  filter["readInterval"] = true;
+  filter["connected"] = true;
+  scanJsonArray("/config/devices.json", "devices", &filter, [](JsonObject entry) {
+    const char* id = entry["id"] | "";
+    if (id[0] == '\0') return true;
+    DeviceLiveness* device = trackDevice(id, livenessTimeout(entry["readInterval"] | 0, entry["type"] == "sensor"));
+    if (device && entry["connected"] == true) {
+      device->online = true;
+      device->deadline = liveness.tick + device->timeoutMs / LIVENESS_TICK_MS;
+      linkLiveness(device - liveness.devices);
+    }
+    return true;
+  });
+}
+
+// Advances the wheel to the current time. Each tick costs one slot visit;
+// the devices found there have expired.
+void runLiveness() {
+  while (millis() - liveness.tickAt >= LIVENESS_TICK_MS) {
+    liveness.tickAt += LIVENESS_TICK_MS;
+    liveness.tick++;
+
+    if (liveness.tick % LIVENESS_SLOTS == 0) {
+      // New revolution: move its level-1 slot down (or on, if parked)
+      uint8_t& head = liveness.slots[1][(liveness.tick / LIVENESS_SLOTS) % LIVENESS_SLOTS];
+      uint8_t index = head;
+      head = LIVENESS_NONE;
+      while (index != LIVENESS_NONE) {
+        uint8_t next = liveness.devices[index].next;
+        linkLiveness(index);
+        index = next;
+      }
+    }
+
+    uint8_t& head = liveness.slots[0][liveness.tick % LIVENESS_SLOTS];
+    while (head != LIVENESS_NONE) {
+      DeviceLiveness& device = liveness.devices[head];
+      unlinkLiveness(head);
+      device.online = false;
+      recordLivenessEvent(device);
+    }
+  }
+  persistLiveness();
+}
+
+// GET /api/devices/events?since=<seq> lists the online/offline
+// transitions after seq that are still kept
+void handleLivenessEvents() {
+  uint32_t since = strtoul(server.arg("since").c_str(), nullptr, 10);
+  uint32_t oldest = liveness.eventSeq > LIVENESS_EVENT_COUNT ? liveness.eventSeq - LIVENESS_EVENT_COUNT : 0;
+
+  DynamicJsonDocument response(256 + LIVENESS_EVENT_COUNT * 96);
+  response["seq"] = liveness.eventSeq;
+  response["missed"] = since < oldest; // Older events were overwritten
+  JsonArray events = response.createNestedArray("events");
+  for (uint32_t seq = std::max(since, oldest) + 1; seq <= liveness.eventSeq; seq++) {
+    const LivenessEvent& event = liveness.events[(seq - 1) % LIVENESS_EVENT_COUNT];
+    JsonObject entry = events.createNestedObject();
+    entry["seq"] = event.seq;
+    entry["deviceId"] = (const char*)event.deviceId;
+    entry["state"] = event.online ? "online" : "offline";
+    entry["at"] = event.at;
+  }
+
+  String responseStr;
+  serializeJson(response, responseStr);
+  server.send(200, "application/json", responseStr);
+}
+
+// ==================== DEVICE MANAGEMENT ====================
+void handleDeviceConfig() {
+  if (server.method() == HTTP_POST) {
+    String body = server.arg("plain");
+
+    StaticJsonDocument<256> newDevice;
+    DeserializationError error = parseJson(newDevice, body);
+    if (error) {
+      server.send(400, "application/json", "{\"success\":false, \"message\":\"Invalid JSON\"}");
+      return;
+    }
+
+    if (!appendJsonArray("/config/devices.json", "devices", newDevice)) {
+      server.send(500, "application/json", "{\"success\":false, \"message\":\"Save failed\"}");
+      return;
+    }
+    trackDevice(newDevice["id"] | "", livenessTimeout(newDevice["readInterval"] | 0, newDevice["type"] == "sensor"));
+
+    server.send(200, "application/json", "{\"success\":true}");
+  }
+  else if (server.method() == HTTP_GET) {
+    // Registry entries with connectivity from the liveness wheel
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "application/json", "");
+    ChunkedWriter out;
+    out.printf("{\"devices\":[");
+
+    int count = 0;
+    scanJsonArray("/config/devices.json", "devices", nullptr, [&](JsonObject device) {
+      DeviceLiveness* live = findLiveness(device["id"] | "");
+      if (live) {
+        device["connected"] = live->online;
+        if (live->lastSeen != 0) device["lastHeartbeat"] = String(epochAt(live->lastSeen));
+      }
+      if (count++ > 0) out.write(',');
+      serializeJson(device, out);
+      return true;
+    });
+
+    out.printf("]}");
+    out.flush();
+    server.sendContent("");
+  }
+  else {
+    server.send(405, "text/plain", "Method Not Allowed");
+  }
+}
+
+bool updateDeviceIP(String deviceId, String newIP) {
+  bool found = false;
+  bool saved = rewriteJsonArray("/config/devices.json", "devices", [&](JsonObject device) {
+    if (found || device["id"] != deviceId) return JSON_KEEP;
+    device["ip"] = newIP;
+    device["connected"] = true;
+    device["lastSeen"] = String(epochNow());
+    found = true;
+    return JSON_CHANGED;
+  }, nullptr);
+  
+  return saved && found;
+}
+
+// Registry address of a device, or an empty string if it is not registered
+String lookupDeviceIp(const char* deviceId) {
+  StaticJsonDocument<64> filter;
+  filter["id"] = true;
+  filter["ip"] = true;
+  
+  String ip;
+  scanJsonArray("/config/devices.json", "devices", &filter, [&](JsonObject device) {
+    if (device["id"] != deviceId) return true;
+    ip = device["ip"].as<String>();
+    return false;
+  });
+  return ip;
+}
+
+// ==================== ENHANCED DEVICE REGISTRATION ====================
+void handleDeviceRegistration() {
+  if (server.method() == HTTP_POST) {
+    String body = server.arg("plain");
+    
+    StaticJsonDocument<512> regData;
+    DeserializationError error = parseJson(regData, body);
+    
+    if (error) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
+      return;
+    }
+    
+    String deviceId = regData["deviceId"];
+    String deviceIP = regData["ip"];
+    String deviceName = regData["name"];
+    String deviceType = regData["type"];
+    int readInterval = regData["readInterval"];
+    
+    // Update or create device entry
+    if (updateOrCreateDevice(deviceId, deviceIP, deviceName, deviceType, readInterval)) {
+      trackDevice(deviceId.c_str(), livenessTimeout(readInterval, deviceType == "sensor"));
+      touchDevice(deviceId.c_str());
+      server.send(200, "application/json", "{\"success\":true}");
+      Serial.println("Device registered: " + deviceId + " at " + deviceIP);
+    } else {
+      server.send(500, "application/json", "{\"success\":false,\"message\":\"Registration failed\"}");
+    }
+  } else {
+    server.send(405, "text/plain", "Method Not Allowed");
+  }
+}
+
+bool updateOrCreateDevice(String deviceId, String newIP, String deviceName, String deviceType, int readInterval) {
+  bool found = false;
+  
+  // Update the existing entry, or add one at the end
+  return rewriteJsonArray("/config/devices.json", "devices", [&](JsonObject device) {
+    if (found || device["id"] != deviceId) return JSON_KEEP;
+    device["ip"] = newIP;
+    device["name"] = deviceName;
+    device["type"] = deviceType;
+    device["readInterval"] = readInterval;
+    device["connected"] = true;
+    device["lastSeen"] = String(epochNow());
+    device["configured"] = true;
+    found = true;
+    Serial.println("Updated existing device: " + deviceId);
+    return JSON_CHANGED;
+  }, [&](JsonArrayWriter& writer) {
+    if (found) return;
+    StaticJsonDocument<512> newDevice;
+    newDevice["id"] = deviceId;
+    newDevice["name"] = deviceName;
+    newDevice["type"] = deviceType;
+    newDevice["ip"] = newIP;
+    newDevice["readInterval"] = readInterval;
+    newDevice["connected"] = true;
+    newDevice["configured"] = true;
+    newDevice["lastSeen"] = String(epochNow());
+    writer.add(newDevice);
+    Serial.println("Created new device entry: " + deviceId);
+  });
+}
+
+// Enhanced heartbeat with connection tracking
+// Besides liveness, a heartbeat is a clock sample for the data plane: the
+// reply carries the receive (t1) and send (t2) times, in milliseconds after
+// `epoch` seconds, and the device combines them with its own send and
+// receive times NTP-style (see SDNDataPlane::updateClock()). Sent only once
+// this clock is seeded. A heartbeat of an unknown device (e.g. after the
+// registry was reset) is answered with "registered":false, asking the
+// device to register again: fast-booting devices skip registration.
+void handleHeartbeat() {
+  uint64_t receivedAt = epochMillisNow();
+  if (server.method() == HTTP_POST) {
+    String body = server.arg("plain");
+    
+    StaticJsonDocument<1024> heartbeatData;
+    // FIX: Parameter order should be (destination, source)
+    DeserializationError error = parseJson(heartbeatData, body);
+    bool registered;
+    
+    if (error) {
+      // Try simple form data
+      String deviceId = server.arg("deviceId");
+      if (deviceId.isEmpty()) {
+        server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing deviceId\"}");
+        return;
+      }
+      registered = updateDeviceHeartbeat(deviceId);
+    } else {
+      // JSON data
+      String deviceId = heartbeatData["deviceId"];
+      if (deviceId.isEmpty()) {
+        server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing deviceId in JSON\"}");
+        return;
+      }
+      registered = updateDeviceHeartbeat(deviceId);
+      recordStageTimings(deviceId, heartbeatData["timing"]);
+      recordFirmwareVersion(deviceId, heartbeatData["firmwareVersion"] | "");
+      recordClockEstimate(deviceId, heartbeatData["clock"]);
+      recordCommandResults(deviceId, heartbeatData["commands"]);
+    }
+    
+    char response[136];
+    const char* unknown = registered ? "" : ",\"registered\":false";
+    if (clockSynced()) {
+      uint32_t epoch = receivedAt / 1000;
+      snprintf(response, sizeof(response), "{\"success\":true,\"serverTime\":\"%lu\",\"epoch\":%lu,\"t1\":%u,\"t2\":%u%s}",
+               (unsigned long)epochNow(), (unsigned long)epoch, (unsigned)(receivedAt - epoch * 1000ULL),
+               (unsigned)(epochMillisNow() - epoch * 1000ULL), unknown);
+    } else {
+      snprintf(response, sizeof(response), "{\"success\":true,\"serverTime\":\"%lu\"%s}", (unsigned long)epochNow(),
+               unknown);
+    }
+    server.send(200, "application/json", response);
+  } else {
+    server.send(405, "text/plain", "Method Not Allowed");
+  }
+}
+
+
+// False if the device is not in the registry
+bool updateDeviceHeartbeat(String deviceId) {
+  if (deviceId.isEmpty()) {
+    Serial.println("Error: Empty deviceId in heartbeat");
     return false;
   }
   
-  // Get device info via HTTP
-  HTTPClient http;
-  String url = "http://192.168.4.1/api/info";
-  
-  http.begin(url);
-  http.setTimeout(5000);
-  
-  int httpCode = http.GET();
-  
-  if (httpCode == 200) {
-    String payload = http.getString();
+  // Liveness is kept in RAM; the registry follows in persistLiveness()
+  if (!touchDevice(deviceId.c_str())) {
+    Serial.println("Warning: Device not found in heartbeat: " + deviceId);
+    return false;
+  }
+  return true;
+}
+
+
+
+void handleDeviceStatus() {
+  if (server.method() == HTTP_POST) {
+    String deviceId = server.arg("deviceId");
+    String status = server.arg("status");
+    String lastSeen = server.arg("lastSeen");
     
-    StaticJsonDocument<1024> deviceInfo;
-    DeserializationError error = deserializeJson(deviceInfo, payload);
+    if (deviceId.isEmpty() || status.isEmpty()) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing parameters\"}");
+      return;
+    }
     
-    if (!error) {
-      device.ssid = ssid;
-      device.deviceId = deviceInfo["deviceId"].as<String>();
-      device.deviceType = deviceInfo["deviceType"].as<String>();
-      device.description = deviceInfo["description"].as<String>();
-      device.firmwareVersion = deviceInfo["firmwareVersion"].as<String>();
-      device.hardwareVersion = deviceInfo["hardwareVersion"].as<String>();
-      device.configured = deviceInfo["configured"];
-      device.rssi = WiFi.RSSI();
-      
-      // Store device ID and password for future use
-      if (!found && device.deviceId != "") {
-        KnownDevice known;
-        known.deviceId = device.deviceId;
-        known.password = password;
-        knownDevices.push_back(known);
+    bool found = false;
+    bool saved = rewriteJsonArray("/config/devices.json", "devices", [&](JsonObject device) {
+      if (found || device["id"] != deviceId) return JSON_KEEP;
+      device["connected"] = (status == "connected");
+      if (!lastSeen.isEmpty()) {
+        device["lastSeen"] = lastSeen;
+      }
+      found = true;
+      return JSON_CHANGED;
+    }, nullptr);
+    
+    if (!saved) {
+      server.send(500, "application/json", "{\"success\":false,\"message\":\"Save failed\"}");
+    } else if (!found) {
+      server.send(404, "application/json", "{\"success\":false,\"message\":\"Device not found\"}");
+    } else {
+      server.send(200, "application/json", "{\"success\":true}");
+    }
+  } else {
+    server.send(405, "text/plain", "Method Not Allowed");
+  }
+}
+
+// ==================== DATA MANAGEMENT ====================
+#define DELIVERY_WINDOW 64 // Payload numbers below the highest still told apart
+#define DELIVERY_MAX_DEVICES 1024
+
+// Per-device ingest state: payload numbering (see acceptSequence()) and
+// the newest reading stored. The table grows with the devices heard from,
+// up to DELIVERY_MAX_DEVICES; past that the device heard from longest ago
+// gives way (sdn_delivery_evictions_total) and starts a new baseline when
+// it is next heard.
+struct DeviceDelivery {
+  char deviceId[24];
+  unsigned long lastHeard;  // millis()
+  bool sequenced;           // A numbered payload has been seen
+  uint32_t sequenceHigh;    // Highest payload number seen
+  uint64_t sequenceSeen;    // Bit i: sequenceHigh - i was received
+  uint32_t delivered;
+  uint32_t missing;         // Numbers jumped over and not (yet) received
+  uint32_t duplicates;
+  uint32_t lastReadingAt;   // Newest reading stored, epoch seconds
+};
+
+std::vector<DeviceDelivery> deliveries;
+
+DeviceDelivery& findDeviceDelivery(const String& deviceId) {
+  unsigned long now = millis();
+  DeviceDelivery* oldest = nullptr;
+  for (DeviceDelivery& entry : deliveries) {
+    if (deviceId == entry.deviceId) {
+      entry.lastHeard = now;
+      return entry;
+    }
+    if (!oldest || now - entry.lastHeard > now - oldest->lastHeard) oldest = &entry;
+  }
+
+  DeviceDelivery* entry;
+  if (deliveries.size() < DELIVERY_MAX_DEVICES) {
+    deliveries.push_back(DeviceDelivery());
+    entry = &deliveries.back();
+  } else {
+    entry = oldest;
+    *entry = DeviceDelivery();
+    metrics.deliveryEvictions++;
+  }
+  strlcpy(entry->deviceId, deviceId.c_str(), sizeof(entry->deviceId));
+  entry->lastHeard = now;
+  return *entry;
+}
+
+// Decides whether a numbered payload is new. Per device the highest number
+// seen and a bitmap of the DELIVERY_WINDOW numbers below it tell a retry or
+// replay (bit set, or too old to tell: dropped) from a late arrival (bit
+// clear: kept, and no longer missing). Numbers jumped over count as missing
+// until they arrive. A restarted device skips the rest of the number block
+// it had reserved, so its first payload starts a new baseline without
+// counting the jump (or the step back, if its flash was wiped).
+bool acceptSequence(const String& deviceId, uint32_t sequence, bool restart) {
+  DeviceDelivery* entry = &findDeviceDelivery(deviceId);
+
+  if (entry->sequenced && sequence <= entry->sequenceHigh) {
+    uint32_t age = entry->sequenceHigh - sequence;
+    bool inWindow = age < DELIVERY_WINDOW;
+    if ((inWindow && ((entry->sequenceSeen >> age) & 1)) || (!inWindow && !restart)) {
+      entry->duplicates++;
+      metrics.duplicatePayloads++;
+      return false;
+    }
+    if (inWindow && !restart) {
+      entry->sequenceSeen |= 1ULL << age;
+      if (entry->missing > 0) entry->missing--;
+      entry->delivered++;
+      return true;
+    }
+  }
+
+  if (!entry->sequenced || restart) {
+    // New baseline: nothing older is expected any more
+    entry->sequenced = true;
+    entry->sequenceSeen = ~0ULL;
+  } else {
+    uint32_t jump = sequence - entry->sequenceHigh;
+    if (!restart) {
+      entry->missing += jump - 1;
+      metrics.payloadGaps += jump - 1;
+    }
+    entry->sequenceSeen = jump >= DELIVERY_WINDOW ? 1 : (entry->sequenceSeen << jump) | 1;
+  }
+  entry->sequenceHigh = sequence;
+  entry->delivered++;
+  return true;
+}
+
+#define INGEST_DOC_CAPACITY 2048 // Filtered payload of INGEST_MAX_READINGS readings
+#define INGEST_MAX_FUTURE_S 300   // Device stamps further ahead are not trusted
+#define INGEST_MAX_PAST_S 604800  // Nor ones older than a week
+
+// Epoch seconds of a reading. A payload's "timestamp" is epoch milliseconds
+// once the data plane has synced its clock, and each reading may carry a
+// compact "dt" in milliseconds relative to it (batches of samples). Stamps
+// from unsynced devices (uptime) and stamps out of range use the receive
+// time instead. Before this clock is seeded a device stamp after the build
+// date is kept as it is, and the receive time is boot-relative (below
+// clockValidEpoch(), so the reading is held).
+uint32_t normalizeTimestamp(uint64_t stampMs, int32_t dtMs, uint32_t receivedAt) {
+  if (stampMs < (uint64_t)clockValidEpoch() * 1000) {
+    return receivedAt + dtMs / 1000;
+  }
+  uint32_t epoch = (stampMs + dtMs) / 1000;
+  if (!clockSynced()) return epoch;
+  if (epoch > receivedAt + INGEST_MAX_FUTURE_S || epoch + INGEST_MAX_PAST_S < receivedAt) {
+    metrics.timestampsRejected++;
+    return receivedAt;
+  }
+  return epoch;
+}
+
+// Decodes a data plane payload in one parse and normalizes every element
+// of readings[] into the payload; the flat type/value/unit of older
+// firmware becomes a single reading. Elements past INGEST_MAX_READINGS and
+// elements without a type are dropped.
+DeserializationError parseSensorPayload(const String& body, SensorPayload& payload) {
+  static StaticJsonDocument<256> filter;
+  if (filter.isNull()) {
+    filter["deviceId"] = true;
+    filter["deviceName"] = true;
+    filter["timestamp"] = true;
+    filter["seq"] = true;
+    filter["seqRestart"] = true;
+    filter["type"] = true;
+    filter["value"] = true;
+    filter["unit"] = true;
+    JsonObject element = filter["readings"].createNestedObject();
+    element["type"] = true;
+    element["value"] = true;
+    element["unit"] = true;
+    element["status"] = true;
+    element["dt"] = true;
+  }
+
+  DynamicJsonDocument doc(INGEST_DOC_CAPACITY);
+  DeserializationError error = deserializeJson(doc, body, DeserializationOption::Filter(filter));
+  if (error) {
+    metrics.jsonParseFailuresRequest++;
+    return error;
+  }
+
+  payload.deviceId = doc["deviceId"] | "";
+  payload.deviceName = doc["deviceName"] | "";
+  // Epoch milliseconds from a synced data plane, its uptime otherwise;
+  // a string, or a number (exact as a double)
+  JsonVariantConst timestamp = doc["timestamp"];
+  uint64_t stampMs = timestamp.is<const char*>() ? strtoull(timestamp.as<const char*>(), nullptr, 10)
+                                                 : (uint64_t)(timestamp | 0.0);
+  uint32_t receivedAt = epochNow();
+  payload.sequenced = doc.containsKey("seq");
+  payload.sequence = doc["seq"] | 0UL;
+  payload.sequenceRestart = doc["seqRestart"] | false;
+
+  auto add = [&](JsonObjectConst element) {
+    const char* type = element["type"] | "";
+    if (type[0] == '\0' || payload.count >= INGEST_MAX_READINGS) return;
+    SensorReading& reading = payload.readings[payload.count++];
+    strlcpy(reading.type, type, sizeof(reading.type));
+    reading.value = element["value"] | 0.0f;
+    strlcpy(reading.unit, element["unit"] | "", sizeof(reading.unit));
+    strlcpy(reading.status, element["status"] | "ok", sizeof(reading.status));
+    reading.timestamp = normalizeTimestamp(stampMs, element["dt"] | 0L, receivedAt);
+  };
+
+  payload.count = 0;
+  JsonArrayConst readings = doc["readings"];
+  if (readings) {
+    for (JsonObjectConst element : readings) {
+      add(element);
+    }
+  } else {
+    add(doc.as<JsonObjectConst>());
+  }
+  return error;
+}
+
+// Files readings of one device: one append each to the day file, the
+// device partition and the cloud queue per day the readings fall in
+// (normally one), and the rollups. False if the day file write failed.
+bool storeReadings(const String& deviceId, const String& deviceName, SensorReading* readings, int count) {
+  // A device's readings are stored in time order, which its partition
+  // index relies on; late ones take the time of the newest
+  DeviceDelivery& entry = findDeviceDelivery(deviceId);
+  for (int i = 0; i < count; i++) {
+    readings[i].timestamp = std::max(readings[i].timestamp, entry.lastReadingAt);
+    entry.lastReadingAt = readings[i].timestamp;
+  }
+
+  for (int start = 0, end; start < count; start = end) {
+    uint32_t day = readings[start].timestamp / 86400;
+    for (end = start + 1; end < count && readings[end].timestamp / 86400 == day; end++) {}
+    String date = dateString(readings[start].timestamp);
+    if (!saveSensorData(date, deviceId, deviceName, readings + start, end - start)) return false;
+    if (!appendDeviceReadings(deviceId, date, readings + start, end - start)) {
+      requestMaintenance();
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    updateRollups(deviceId, readings[i].type, readings[i].value, readings[i].timestamp);
+  }
+  addToCloudQueue(deviceId, readings, count);
+  return true;
+}
+
+// ==================== UNSYNCED READINGS ====================
+// A reading stamped before clockValidEpoch() (boot-relative time(), when
+// neither this clock nor the device's is set) has no date to be filed
+// under. It is held in UNSYNCED_PATH, one NDJSON line per reading with its
+// deviceId and deviceName, and stored once the clock is seeded, shifted by
+// heldShift, a few per loop pass. While readings are held, later payloads
+// are held behind them so every partition stays in time order. Held
+// readings of an earlier boot cannot be dated any more and are kept aside
+// as /data/sensors/unsynced.<n>.log.
+#define UNSYNCED_PATH "/data/sensors/unsynced.log"
+#define UNSYNCED_REPLAY_STEP 8 // Held readings stored per loop pass
+
+bool readingsHeld = false; // UNSYNCED_PATH has readings left to store
+uint32_t heldPosition = 0; // Offset of the next one
+
+void initHeldReadings() {
+  if (!SD.exists(UNSYNCED_PATH)) return;
+  String aside = freePath("/data/sensors/unsynced", ".log");
+  SD.rename(UNSYNCED_PATH, aside);
+  Serial.printf("Undated readings of an earlier boot kept in %s\n", aside.c_str());
+}
+
+bool holdReadings(const SensorPayload& payload) {
+  for (int i = 0; i < payload.count; i++) {
+    const SensorReading& reading = payload.readings[i];
+    StaticJsonDocument<256> record;
+    record["timestamp"] = reading.timestamp;
+    record["deviceId"] = payload.deviceId;
+    record["deviceName"] = payload.deviceName;
+    record["type"] = reading.type;
+    record["value"] = reading.value;
+    record["unit"] = reading.unit;
+    record["status"] = reading.status;
+    char line[320];
+    size_t length = serializeJson(record, line, sizeof(line) - 1);
+    line[length++] = '\n';
+    if (!storage.append(UNSYNCED_PATH, (const uint8_t*)line, length)) return false;
+  }
+  readingsHeld = true;
+  metrics.readingsHeld += payload.count;
+  return true;
+}
+
+// Stores the next held readings once the clock is seeded; call from loop()
+void replayHeldReadings() {
+  if (!readingsHeld || !clockSynced()) return;
+
+  // Reopened each pass: a handle opened earlier would not see the appends
+  storage.sync(UNSYNCED_PATH);
+  File file = SD.open(UNSYNCED_PATH, FILE_READ);
+  if (!file) return;
+  file.setTimeout(0); // Stream reads would otherwise wait a second at EOF
+  file.seek(heldPosition);
+
+  uint32_t startPosition = heldPosition;
+  int replayed = 0;
+  for (; replayed < UNSYNCED_REPLAY_STEP; replayed++) {
+    char line[320];
+    size_t length = file.readBytesUntil('\n', line, sizeof(line) - 1);
+    if (length == 0) break;
+
+    StaticJsonDocument<384> record;
+    if (!deserializeJson(record, line, length)) {
+      SensorReading reading;
+      uint32_t timestamp = record["timestamp"];
+      reading.timestamp = timestamp < clockValidEpoch() ? timestamp + heldShift : timestamp;
+      strlcpy(reading.type, record["type"] | "", sizeof(reading.type));
+      reading.value = record["value"];
+      strlcpy(reading.unit, record["unit"] | "", sizeof(reading.unit));
+      strlcpy(reading.status, record["status"] | "ok", sizeof(reading.status));
+      if (!storeReadings(record["deviceId"] | "", record["deviceName"] | "", &reading, 1)) break;
+    }
+    heldPosition += length + 1;
+  }
+  file.close();
+  metrics.sdReadBytes += heldPosition - startPosition;
+
+  if (replayed < UNSYNCED_REPLAY_STEP && heldPosition >= storage.size(UNSYNCED_PATH)) {
+    storage.close(UNSYNCED_PATH);
+    SD.remove(UNSYNCED_PATH);
+    readingsHeld = false;
+    heldPosition = 0;
+    Serial.println("Held readings stored");
+  }
+}
+
+// POST /api/data. All readings of a payload are stored together: one
+// parse and one storeReadings(), or held while they cannot be dated.
+void handleSensorData() {
+  if (server.method() == HTTP_POST) {
+    SensorPayload payload;
+    DeserializationError error = parseSensorPayload(server.arg("plain"), payload);
+    
+    if (error == DeserializationError::NoMemory) {
+      server.send(413, "application/json", "{\"success\":false,\"message\":\"Payload too large\"}");
+      return;
+    }
+    if (error) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
+      return;
+    }
+    if (payload.count == 0) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"No readings\"}");
+      return;
+    }
+    
+    touchDevice(payload.deviceId.c_str());
+    if (payload.sequenced && !acceptSequence(payload.deviceId, payload.sequence, payload.sequenceRestart)) {
+      // Already stored; acknowledge so the device does not send it again
+      server.send(200, "application/json", "{\"success\":true,\"duplicate\":true}");
+      return;
+    }
+    
+    bool held = readingsHeld;
+    for (int i = 0; i < payload.count; i++) {
+      SensorReading& reading = payload.readings[i];
+      if (reading.timestamp < clockValidEpoch()) held = true;
+      updateLatestValue(payload.deviceId, payload.deviceName, reading.type, reading.value, reading.unit,
+                        String(reading.timestamp));
+    }
+    
+    bool stored = held ? holdReadings(payload) : storeReadings(payload.deviceId, payload.deviceName,
+                                                               payload.readings, payload.count);
+    if (stored) {
+      for (int i = 0; i < payload.count; i++) {
+        evaluateRules(payload.deviceId, payload.readings[i].type, payload.readings[i].value);
+      }
+      server.send(200, "application/json", "{\"success\":true,\"stored\":" + String(payload.count) +
+                                           (held ? ",\"held\":true}" : "}"));
+    } else {
+      requestMaintenance();
+      server.send(500, "application/json", "{\"success\":false,\"message\":\"Storage failed\"}");
+    }
+  } else {
+    server.send(405, "text/plain", "Method Not Allowed");
+  }
+}
+
+void handleLogData() {
+  if (server.method() == HTTP_GET) {
+    // Without a date, the day `from` (epoch seconds) falls in, else today
+    String date = server.arg("date");
+    if (date.isEmpty()) {
+      date = server.hasArg("from") ? dateString(strtoul(server.arg("from").c_str(), nullptr, 10))
+                                   : getTodayDateString();
+    }
+    
+    // One device's history comes from its partition, and its archive once
+    // the day is archived: ?deviceId=&from=&to=
+    String deviceId = server.arg("deviceId");
+    if (!deviceId.isEmpty()) {
+      if (!isSafePathPart(deviceId) || !isSafePathPart(date)) {
+        server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid deviceId or date\"}");
+        return;
+      }
+      uint32_t from = server.hasArg("from") ? strtoul(server.arg("from").c_str(), nullptr, 10) : 0;
+      uint32_t to = server.hasArg("to") ? strtoul(server.arg("to").c_str(), nullptr, 10) : UINT32_MAX;
+      int limit = server.hasArg("limit") ? server.arg("limit").toInt() : SENSOR_QUERY_LIMIT;
+      if (SD.exists(archivePath(date))) {
+        streamArchivedDay(date, deviceId.c_str(), from, to, limit);
+      } else {
+        streamDeviceHistory(deviceId, date, from, to, limit);
+      }
+      return;
+    }
+    
+    String filename = "/data/sensors/" + date + ".json";
+    
+    if (isSafePathPart(date) && SD.exists(archivePath(date))) {
+      streamArchivedDay(date, nullptr, 0, UINT32_MAX, INT32_MAX);
+    } else if (SD.exists(filename)) {
+      storage.sync(filename.c_str());
+      File file = SD.open(filename, FILE_READ);
+      if (file) {
+        streamSdFile(file, "application/json");
+        file.close();
+      } else {
+        server.send(500, "application/json", "{\"success\":false,\"message\":\"File read error\"}");
+      }
+    } else {
+      server.send(200, "application/json", "{\"date\":\"" + date + "\",\"data\":[]}");
+    }
+  } else {
+    server.send(405, "text/plain", "Method Not Allowed");
+  }
+}
+
+
+// ==================== COMMAND MANAGEMENT ====================
+// Commands carry a correlation ID from accept to device ack. Each one gets
+// a timeline in control plane millis():
+//   acceptedAt   POST /api/commands stored it
+//   dispatchedAt sent to the device's /api/command
+//   receivedAt   device received it (estimated, see recordCommandAck())
+//   startedAt / finishedAt  executeCommand() ran on the device (estimated)
+//   ackedAt      device response arrived
+//   completedAt  outcome reported by the device (queued commands)
+// Data planes with a command queue ack on receipt ("queued") and send the
+// outcome on their next heartbeat once the command ran or was superseded
+// by a newer one; until then it stays in pending.json as "queued". They
+// drop a command id they already have, so a retry after a lost ack is
+// acked again rather than run twice. Each device gets at most one
+// dispatch per pass, so a burst for one device, or one that is down,
+// holds the loop for one timeout rather than a batch of them.
+// Finished commands move from pending.json to history.json.
+#define COMMAND_DISPATCH_INTERVAL 1000
+#define COMMAND_TIMEOUT_MS 1500 // Queueing data planes ack on receipt
+#define COMMAND_RESULT_TIMEOUT_MS 60000 // Queued commands without an outcome fail after this
+#define COMMAND_MAX_ATTEMPTS 3
+#define COMMAND_HISTORY_SIZE 256
+#define COMMAND_DISPATCH_BATCH 8 // Commands sent per dispatch pass
+#define COMMAND_CAPACITY 512 // A command body plus the fields enqueueCommand adds
+
+// IDs are "<boot>-<seq>": the boot tag keeps IDs from separate control
+// plane runs apart, seq orders commands within one run
+uint32_t commandBootTag = 0;
+uint32_t commandSequence = 0;
+
+void formatCommandId(char* buffer, size_t size) {
+  if (commandBootTag == 0) {
+    commandBootTag = esp_random() & 0xFFFFFF;
+  }
+  snprintf(buffer, size, "%06lx-%lu", (unsigned long)commandBootTag, (unsigned long)++commandSequence);
+}
+
+// Fills in the device-side timeline from the ack. The device reports how
+// long the command waited (queueUs) and ran (execUs); the rest of the round
+// trip is split evenly between the two network legs.
+void recordCommandAck(JsonObject cmd, JsonDocument& ack, unsigned long ackedAt) {
+  unsigned long dispatchedAt = cmd["dispatchedAt"];
+  unsigned long queueMs = (ack["queueUs"] | 0UL) / 1000;
+  unsigned long execMs = (ack["execUs"] | 0UL) / 1000;
+  unsigned long roundTrip = ackedAt - dispatchedAt;
+  unsigned long network = roundTrip > queueMs + execMs ? roundTrip - queueMs - execMs : 0;
+
+  cmd["receivedAt"] = dispatchedAt + network / 2;
+  cmd["startedAt"] = dispatchedAt + network / 2 + queueMs;
+  cmd["finishedAt"] = dispatchedAt + network / 2 + queueMs + execMs;
+  cmd["queueUs"] = ack["queueUs"] | 0UL;
+  cmd["execUs"] = ack["execUs"] | 0UL;
+
+  DeviceMetrics* entry = findDeviceMetrics(cmd["deviceId"].as<String>());
+  if (entry) {
+    unsigned long acceptedAt = cmd["acceptedAt"];
+    entry->actuation.observe(((unsigned long)cmd["finishedAt"] - acceptedAt) * 1000UL);
+  }
+}
+
+// POSTs one command to its device. Returns true once the command is done
+// (acked, rejected or out of attempts) and can leave the pending list.
+bool dispatchCommand(JsonObject cmd, const String& ip) {
+  StaticJsonDocument<256> request;
+  request["id"] = cmd["id"];
+  request["command"] = cmd["command"];
+  request["value"] = cmd["value"] | "";
+  request["timestamp"] = cmd["timestamp"];
+  if (cmd.containsKey("priority")) request["priority"] = cmd["priority"];
+  char body[256];
+  size_t length = serializeJson(request, body, sizeof(body));
+
+  cmd["attempts"] = (cmd["attempts"] | 0) + 1;
+  cmd["dispatchedAt"] = millis();
+
+  httpClient.begin("http://" + ip + "/api/command");
+  httpClient.setTimeout(COMMAND_TIMEOUT_MS);
+  httpClient.addHeader("Content-Type", "application/json");
+  int httpCode = httpClient.POST((uint8_t*)body, length);
+  String response = httpCode > 0 ? httpClient.getString() : String();
+  httpClient.end();
+  unsigned long ackedAt = millis();
+  if (httpCode > 0) touchDevice(cmd["deviceId"] | "");
+
+  if (httpCode <= 0 || httpCode == 503) { // Unreachable, or its queue is full
+    if (cmd["attempts"] < COMMAND_MAX_ATTEMPTS) return false;
+    cmd["status"] = "failed";
+    cmd["error"] = httpCode <= 0 ? "unreachable" : "queue full";
+    return true;
+  }
+
+  // Firmware from before command ids acks without one; its 2xx is success
+  StaticJsonDocument<256> ack;
+  bool parsed = !parseJson(ack, response);
+  bool legacy = httpCode >= 200 && httpCode < 300 && (!parsed || !ack.containsKey("id"));
+  if (!legacy && (!parsed || ack["id"] != cmd["id"])) {
+    cmd["status"] = "failed";
+    cmd["error"] = "bad ack";
+    cmd["ackedAt"] = ackedAt;
+    return true;
+  }
+
+  cmd["ackedAt"] = ackedAt;
+  if (ack["queued"] == true) {
+    // Received; the outcome follows. Of the round trip, queueUs was spent
+    // on the device and the rest is split between the network legs.
+    unsigned long dispatchedAt = cmd["dispatchedAt"];
+    unsigned long handling = (ack["queueUs"] | 0UL) / 1000;
+    unsigned long roundTrip = ackedAt - dispatchedAt;
+    cmd["status"] = "queued";
+    cmd["receivedAt"] = dispatchedAt + (roundTrip > handling ? roundTrip - handling : 0) / 2;
+    if (ack.containsKey("supersedes")) cmd["supersedes"] = ack["supersedes"];
+    return false;
+  }
+  // A repeated delivery of a command that already ran acks its outcome
+  const char* status = legacy || ack["success"] == true ? "acked" : "failed";
+  cmd["status"] = ack["status"] | status;
+  recordCommandAck(cmd, ack, ackedAt);
+  return true;
+}
+
+// Finishes a queued command's timeline from the outcome its device posted:
+// the time it waited in the device queue (queueUs, from receipt) and ran
+// (execUs). Superseded commands never ran and stay out of the latency
+// histogram.
+void recordCommandResult(JsonObject cmd, JsonVariantConst result, unsigned long completedAt) {
+  // Without an ack (it was lost) the dispatch stands in for receipt
+  unsigned long receivedAt = cmd["receivedAt"] | cmd["dispatchedAt"].as<unsigned long>();
+  unsigned long queueMs = (result["queueUs"] | 0UL) / 1000;
+  unsigned long execMs = (result["execUs"] | 0UL) / 1000;
+  const char* status = result["status"] | "failed";
+
+  cmd["status"] = status;
+  cmd["completedAt"] = completedAt;
+  cmd["queueUs"] = result["queueUs"] | 0UL;
+  if (strcmp(status, "superseded") == 0) return;
+  cmd["startedAt"] = receivedAt + queueMs;
+  cmd["finishedAt"] = receivedAt + queueMs + execMs;
+  cmd["execUs"] = result["execUs"] | 0UL;
+  if (result["late"] == true) cmd["late"] = true;
+
+  DeviceMetrics* entry = findDeviceMetrics(cmd["deviceId"].as<String>());
+  if (entry) {
+    unsigned long acceptedAt = cmd["acceptedAt"];
+    entry->actuation.observe(((unsigned long)cmd["finishedAt"] - acceptedAt) * 1000UL);
+  }
+}
+
+int commandHistoryCount = -1; // Entries in history.json, counted on first use
+
+// Appends a finished command to history.json. Once the file holds twice
+// COMMAND_HISTORY_SIZE entries, one rewrite drops the oldest down to
+// COMMAND_HISTORY_SIZE.
+void appendCommandHistory(JsonObject cmd) {
+  const char* path = "/data/commands/history.json";
+  if (commandHistoryCount < 0) {
+    commandHistoryCount = countJsonArray(path, "commands");
+  }
+  if (!appendJsonArray(path, "commands", cmd)) return;
+  if (++commandHistoryCount < 2 * COMMAND_HISTORY_SIZE) return;
+
+  int drop = commandHistoryCount - COMMAND_HISTORY_SIZE;
+  int index = 0;
+  auto dropOldest = [&](JsonObject) { return index++ < drop ? JSON_DROP : JSON_KEEP; };
+  if (rewriteJsonArray(path, "commands", dropOldest, nullptr)) {
+    commandHistoryCount = std::max(index - drop, 0);
+  }
+}
+
+// Set when a command is queued so the next loop dispatches it right away
+bool commandDispatchDue = false;
+
+// Assigns a correlation ID and appends the command to pending.json.
+// Returns false if the added fields did not fit in the document (it is
+// then overflowed() and nothing is stored) or the pending list could not
+// be saved.
+bool enqueueCommand(JsonDocument& newCommand, char* commandId, size_t idSize) {
+  formatCommandId(commandId, idSize);
+  newCommand["id"] = commandId;
+  newCommand["timestamp"] = String(millis());
+  newCommand["status"] = "pending";
+  newCommand["acceptedAt"] = millis();
+  if (newCommand.overflowed()) return false;
+  
+  if (!appendJsonArray("/data/commands/pending.json", "commands", newCommand)) return false;
+  commandDispatchDue = true;
+  return true;
+}
+
+// Sends pending commands to their devices, at most once per interval
+// unless a command was just queued
+void dispatchPendingCommands() {
+  static unsigned long lastDispatch = 0;
+  if (!commandDispatchDue && millis() - lastDispatch < COMMAND_DISPATCH_INTERVAL) return;
+  lastDispatch = millis();
+  commandDispatchDue = false;
+
+  // Cheap check first, so an idle queue (or one only waiting on device
+  // outcomes) is never rewritten
+  const char* path = "/data/commands/pending.json";
+  StaticJsonDocument<64> filter;
+  filter["status"] = true;
+  filter["ackedAt"] = true;
+  auto resultOverdue = [](JsonObject cmd) {
+    return cmd["status"] == "queued" && millis() - (unsigned long)cmd["ackedAt"] > COMMAND_RESULT_TIMEOUT_MS;
+  };
+  bool anyPending = false;
+  scanJsonArray(path, "commands", &filter, [&](JsonObject cmd) {
+    anyPending = cmd["status"] == "pending" || resultOverdue(cmd);
+    return !anyPending;
+  });
+  if (!anyPending) return;
+
+  // Oldest first, so a device sees its commands in the order they arrived.
+  // Finished commands move to the history as they complete. A device's
+  // later commands wait for the next pass: right away, unless it did not
+  // take this one.
+  int dispatched = 0;
+  std::vector<String> sentTo;
+  std::vector<String> stalled;
+  rewriteJsonArray(path, "commands", [&](JsonObject cmd) {
+    if (resultOverdue(cmd)) {
+      cmd["status"] = "failed";
+      cmd["error"] = "no result";
+      appendCommandHistory(cmd);
+      return JSON_DROP;
+    }
+    if (cmd["status"] != "pending") return JSON_KEEP;
+    String deviceId = cmd["deviceId"] | "";
+    if (std::find(stalled.begin(), stalled.end(), deviceId) != stalled.end()) return JSON_KEEP;
+    if (dispatched >= COMMAND_DISPATCH_BATCH || std::find(sentTo.begin(), sentTo.end(), deviceId) != sentTo.end()) {
+      commandDispatchDue = true; // Rest on the next pass
+      return JSON_KEEP;
+    }
+    dispatched++;
+    sentTo.push_back(deviceId);
+
+    String ip = lookupDeviceIp(deviceId.c_str());
+    bool done;
+    if (ip.isEmpty()) {
+      cmd["status"] = "failed";
+      cmd["error"] = "unknown device";
+      done = true;
+    } else {
+      done = dispatchCommand(cmd, ip);
+    }
+
+    if (!done) {
+      if (cmd["status"] == "pending") stalled.push_back(deviceId); // Unreachable or queue full
+      return JSON_CHANGED;
+    }
+    appendCommandHistory(cmd);
+    return JSON_DROP;
+  }, nullptr);
+}
+
+// Outcomes from a heartbeat's "commands",
+// [{"id","status":"done"|"failed"|"superseded","queueUs","execUs"}]. One
+// can overtake the ack of a dispatch that timed out, so commands still
+// pending after a dispatch match as well as queued ones.
+void recordCommandResults(const String& deviceId, JsonArrayConst results) {
+  if (results.size() == 0) return;
+  unsigned long completedAt = millis();
+  rewriteJsonArray("/data/commands/pending.json", "commands", [&](JsonObject cmd) {
+    if (cmd["deviceId"] != deviceId.c_str()) return JSON_KEEP;
+    if (cmd["status"] != "queued" && !(cmd["status"] == "pending" && cmd.containsKey("dispatchedAt"))) return JSON_KEEP;
+    for (JsonVariantConst result : results) {
+      if (result["id"] != cmd["id"]) continue;
+      recordCommandResult(cmd, result, completedAt);
+      appendCommandHistory(cmd);
+      return JSON_DROP;
+    }
+    return JSON_KEEP;
+  }, nullptr);
+}
+
+// GET /api/commands/trace?id=<id> returns one command's timeline;
+// ?deviceId=<id> returns that device's recent timelines and its actuation
+// latency histogram (milliseconds, cumulative per bucket)
+void handleCommandTrace() {
+  String id = server.arg("id");
+  String deviceId = server.arg("deviceId");
+  if (id.isEmpty() && deviceId.isEmpty()) {
+    server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing id or deviceId\"}");
+    return;
+  }
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  ChunkedWriter out;
+  out.printf("{\"commands\":[");
+
+  int matches = 0;
+  const char* sources[] = {"/data/commands/pending.json", "/data/commands/history.json"};
+  for (const char* path : sources) {
+    scanJsonArray(path, "commands", nullptr, [&](JsonObject cmd) {
+      bool match = id.isEmpty() ? cmd["deviceId"] == deviceId : cmd["id"] == id;
+      if (match) {
+        if (matches++ > 0) out.write(',');
+        serializeJson(cmd, out);
+      }
+      return true;
+    });
+  }
+  out.printf("]");
+
+  if (!deviceId.isEmpty()) {
+    DeviceMetrics* entry = findDeviceMetrics(deviceId);
+    StaticJsonDocument<1024> latency;
+    latency.to<JsonObject>();
+    if (entry) {
+      latency["count"] = entry->actuation.count;
+      latency["sumMs"] = (unsigned long)(entry->actuation.sumMicros / 1000);
+      JsonArray buckets = latency.createNestedArray("buckets");
+      uint32_t cumulative = 0;
+      for (int i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+        cumulative += entry->actuation.buckets[i];
+        JsonObject bucket = buckets.createNestedObject();
+        bucket["leMs"] = LATENCY_BUCKETS_US[i] / 1000;
+        bucket["count"] = cumulative;
+      }
+    }
+    out.printf(",\"actuationLatency\":");
+    serializeJson(latency, out);
+  }
+
+  out.printf("}");
+  out.flush();
+  server.sendContent("");
+}
+
+void handleDeviceCommands() {
+  if (server.method() == HTTP_GET) {
+    String deviceId = server.arg("deviceId");
+    
+    if (deviceId.isEmpty()) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing deviceId\"}");
+      return;
+    }
+    
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "application/json", "");
+    ChunkedWriter out;
+    out.printf("{\"commands\":[");
+    
+    int matches = 0;
+    scanJsonArray("/data/commands/pending.json", "commands", nullptr, [&](JsonObject cmd) {
+      if (cmd["deviceId"] == deviceId) {
+        if (matches++ > 0) out.write(',');
+        serializeJson(cmd, out);
       }
-      
-      Serial.println("Device info retrieved successfully");
-      http.end();
-      WiFi.disconnect();
-      
       return true;
+    });
+    
+    out.printf("]}");
+    out.flush();
+    server.sendContent("");
+    
+  } else if (server.method() == HTTP_POST) {
+    String body = server.arg("plain");
+    
+    StaticJsonDocument<COMMAND_CAPACITY> newCommand;
+    DeserializationError error = parseJson(newCommand, body);
+    
+    if (error == DeserializationError::NoMemory) {
+      server.send(413, "application/json", "{\"success\":false,\"message\":\"Command too large\"}");
+      return;
+    }
+    if (error || !newCommand.is<JsonObject>()) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
+      return;
+    }
+    
+    char commandId[24];
+    if (enqueueCommand(newCommand, commandId, sizeof(commandId))) {
+      server.send(200, "application/json", "{\"success\":true,\"id\":\"" + String(commandId) + "\"}");
+    } else if (newCommand.overflowed()) {
+      server.send(413, "application/json", "{\"success\":false,\"message\":\"Command too large\"}");
+    } else {
+      server.send(500, "application/json", "{\"success\":false,\"message\":\"Save failed\"}");
     }
+  } else {
+    server.send(405, "text/plain", "Method Not Allowed");
   }
-  
-  http.end();
-  WiFi.disconnect();
-  
-  return false;
 }
 
-// Configuration with secure password
-bool configureDeviceSecure(DiscoveredDevice& device, String deviceName, String deviceType, int readInterval) {
-  Serial.println("Configuring device: " + device.deviceId);
-  
-  // Find password for this device
-  String password = "12345678"; // Default
-  for (auto& known : knownDevices) {
-    if (known.deviceId == device.deviceId) {
-      password = known.password;
-      break;
-    }
+// ==================== RULE ENGINE ====================
+// Closed-loop rules evaluated on ingest. /config/rules.json holds
+//   {"rules":[{"id":"fan-on","when":"temperature > 30","for":60,
+//              "source":"ESP32_A1B2C3","then":{"deviceId":"ESP32_D4E5F6",
+//              "command":"fan","value":"on"}}]}
+// "when" is compiled once at load into a small stack bytecode over the
+// reading's value; comparisons (> >= < <= == !=), && || ! and parentheses
+// are supported, and every identifier must name the same sensor type.
+// "for" (seconds) is how long the condition must hold, "source" limits the
+// rule to one device. Holding is tracked per device: a rule fires once per
+// period its condition holds on one device, whatever the others read.
+#define RULE_MAX_CODE 32
+#define RULE_MAX_CONSTS 8
+#define RULE_STACK_SIZE 8
+#define RULE_HOLD_SLOTS 8 // Devices per rule whose condition can hold at once
+#define RULES_PATH "/config/rules.json"
+
+enum RuleOp : uint8_t {
+  RULE_OP_VALUE,  // Push the reading's value
+  RULE_OP_CONST,  // Push consts[next byte]
+  RULE_OP_GT, RULE_OP_GE, RULE_OP_LT, RULE_OP_LE, RULE_OP_EQ, RULE_OP_NE,
+  RULE_OP_AND, RULE_OP_OR, RULE_OP_NOT
+};
+
+// One device whose readings currently satisfy a rule
+struct RuleHold {
+  uint32_t deviceHash;      // 0 marks a free slot
+  unsigned long since;
+  unsigned long lastSeen;
+  bool fired;
+};
+
+struct CompiledRule {
+  char id[24];
+  uint32_t sensorHash;      // Rules are sorted by this for lookup
+  char sensorType[16];
+  char source[24];          // Empty matches any device
+  uint8_t code[RULE_MAX_CODE];
+  uint8_t codeLength;
+  float consts[RULE_MAX_CONSTS];
+  uint8_t constCount;
+  unsigned long holdMs;
+  RuleHold holds[RULE_HOLD_SLOTS];
+  char targetDevice[24];
+  char command[32];
+  char value[48];
+};
+
+std::vector<CompiledRule> rules;
+
+// FNV-1a string hash; pass a previous result as `hash` to chain fields
+uint32_t fnv1aHash(const char* text, uint32_t hash = 2166136261UL) {
+  while (*text) {
+    hash = (hash ^ (uint8_t)*text++) * 16777619UL;
   }
-  
-  WiFi.begin(device.ssid.c_str(), password.c_str());
-  
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 10) {
-    delay(500);
-    attempts++;
+  return hash;
+}
+
+// Recursive descent compiler from a "when" expression to RuleOp bytecode
+struct RuleCompiler {
+  CompiledRule& rule;
+  const char* p;
+  const char* error;
+  int depth;
+  int maxDepth;
+
+  RuleCompiler(CompiledRule& target, const char* source)
+    : rule(target), p(source), error(nullptr), depth(0), maxDepth(0) {}
+
+  void skipSpaces() {
+    while (*p == ' ' || *p == '\t') p++;
   }
-  
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("Failed to connect to device for configuration");
-    WiFi.disconnect();
-    return false;
+
+  bool accept(const char* token) {
+    skipSpaces();
+    size_t length = strlen(token);
+    if (strncmp(p, token, length) != 0) return false;
+    p += length;
+    return true;
   }
-  
-  HTTPClient http;
-  String url = "http://192.168.4.1/api/config";
-  
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  
-  // Generate new password for this device
-  String newPassword = generateDevicePassword(device.deviceId);
-  
-  StaticJsonDocument<512> configPayload;
-  configPayload["deviceName"] = deviceName;
-  configPayload["deviceType"] = deviceType;
-  configPayload["wifiSSID"] = "ESP32-IoT-Server";
-  configPayload["wifiPassword"] = "12345678"; // Control plane password
-  configPayload["controlPlaneIP"] = WiFi.softAPIP().toString();
-  configPayload["controlPlanePort"] = 80;
-  configPayload["readInterval"] = readInterval;
-  configPayload["newAPPassword"] = newPassword; // Tell device to change its AP password
-  
-  String payload;
-  serializeJson(configPayload, payload);
-  
-  int httpCode = http.POST(payload);
-  
-  bool success = (httpCode == 200);
-  
-  if (success) {
-    Serial.println("Device configured successfully");
-    
-    // Update known password for this device
-    bool updated = false;
-    for (auto& known : knownDevices) {
-      if (known.deviceId == device.deviceId) {
-        known.password = newPassword;
-        updated = true;
-        break;
+
+  void emit(uint8_t op, int stackDelta) {
+    if (rule.codeLength >= RULE_MAX_CODE) {
+      error = "expression too long";
+      return;
+    }
+    rule.code[rule.codeLength++] = op;
+    depth += stackDelta;
+    if (depth > maxDepth) maxDepth = depth;
+  }
+
+  void parseOperand() {
+    skipSpaces();
+    if (isalpha(*p) || *p == '_') {
+      const char* start = p;
+      while (isalnum(*p) || *p == '_') p++;
+      size_t length = p - start;
+      if (rule.sensorType[0] == '\0') {
+        if (length >= sizeof(rule.sensorType)) {
+          error = "sensor type too long";
+          return;
+        }
+        memcpy(rule.sensorType, start, length);
+        rule.sensorType[length] = '\0';
+      } else if (strlen(rule.sensorType) != length || strncmp(rule.sensorType, start, length) != 0) {
+        error = "rules may only reference one sensor type";
+        return;
       }
+      emit(RULE_OP_VALUE, 1);
+      return;
     }
-    
-    if (!updated) {
-      KnownDevice known;
-      known.deviceId = device.deviceId;
-      known.password = newPassword;
-      knownDevices.push_back(known);
+
+    char* end;
+    float number = strtof(p, &end);
+    if (end == p) {
+      error = "expected sensor type or number";
+      return;
     }
-    
-    // Save known devices to SD card
-    saveKnownDevices();
-  } else {
-    Serial.println("Device configuration failed: " + String(httpCode));
+    p = end;
+    if (rule.constCount >= RULE_MAX_CONSTS) {
+      error = "too many constants";
+      return;
+    }
+    rule.consts[rule.constCount] = number;
+    emit(RULE_OP_CONST, 1);
+    emit(rule.constCount++, 0);
   }
-  
-  http.end();
-  WiFi.disconnect();
-  
-  return success;
+
+  void parseComparison() {
+    parseOperand();
+    if (error) return;
+
+    uint8_t op;
+    if (accept(">=")) op = RULE_OP_GE;
+    else if (accept("<=")) op = RULE_OP_LE;
+    else if (accept("==")) op = RULE_OP_EQ;
+    else if (accept("!=")) op = RULE_OP_NE;
+    else if (accept(">")) op = RULE_OP_GT;
+    else if (accept("<")) op = RULE_OP_LT;
+    else {
+      error = "expected comparison";
+      return;
+    }
+
+    parseOperand();
+    if (!error) emit(op, -1);
+  }
+
+  void parseUnary() {
+    if (accept("!")) {
+      parseUnary();
+      if (!error) emit(RULE_OP_NOT, 0);
+    } else if (accept("(")) {
+      parseOr();
+      if (!error && !accept(")")) error = "expected )";
+    } else {
+      parseComparison();
+    }
+  }
+
+  void parseAnd() {
+    parseUnary();
+    while (!error && accept("&&")) {
+      parseUnary();
+      if (!error) emit(RULE_OP_AND, -1);
+    }
+  }
+
+  void parseOr() {
+    parseAnd();
+    while (!error && accept("||")) {
+      parseAnd();
+      if (!error) emit(RULE_OP_OR, -1);
+    }
+  }
+
+  // Returns nullptr on success, otherwise a description of the problem
+  const char* compile() {
+    parseOr();
+    skipSpaces();
+    if (!error && *p != '\0') error = "unexpected trailing input";
+    if (!error && maxDepth > RULE_STACK_SIZE) error = "expression nests too deeply";
+    if (!error && rule.sensorType[0] == '\0') error = "no sensor type referenced";
+    return error;
+  }
+};
+
+// Compiles one rules.json entry. Returns nullptr on success.
+const char* compileRule(JsonObject source, CompiledRule& rule) {
+  memset(&rule, 0, sizeof(rule));
+  strlcpy(rule.id, source["id"] | "", sizeof(rule.id));
+  strlcpy(rule.source, source["source"] | "", sizeof(rule.source));
+  strlcpy(rule.targetDevice, source["then"]["deviceId"] | "", sizeof(rule.targetDevice));
+  strlcpy(rule.command, source["then"]["command"] | "", sizeof(rule.command));
+  strlcpy(rule.value, source["then"]["value"] | "", sizeof(rule.value));
+  rule.holdMs = (source["for"] | 0UL) * 1000UL;
+
+  if (rule.targetDevice[0] == '\0' || rule.command[0] == '\0') {
+    return "missing then.deviceId or then.command";
+  }
+
+  RuleCompiler compiler(rule, source["when"] | "");
+  const char* error = compiler.compile();
+  if (error) return error;
+
+  rule.sensorHash = fnv1aHash(rule.sensorType);
+  return nullptr;
 }
 
-// Save and load known devices
-void saveKnownDevices() {
-  StaticJsonDocument<2048> doc;
-  JsonArray devices = doc.createNestedArray("knownDevices");
-  
-  for (auto& known : knownDevices) {
-    JsonObject device = devices.createNestedObject();
-    device["deviceId"] = known.deviceId;
-    device["password"] = known.password;
+// Logs a rejected rule and lists it in `errors` when given
+void addRuleError(JsonArray* errors, const char* id, const char* error) {
+  Serial.printf("Rule %s rejected: %s\n", id, error);
+  if (!errors) return;
+  JsonObject item = errors->createNestedObject();
+  item["id"] = id;
+  item["error"] = error;
+}
+
+// Compiles a rules document one rule at a time, so memory stays bounded
+// however many rules there are, into `compiled` sorted for lookup.
+// Problems go to `errors` when given. Returns false if the document has
+// no "rules" array or does not parse, or a rule does not compile.
+bool compileRules(const char* path, std::vector<CompiledRule>& compiled, JsonArray* errors) {
+  File file = SD.open(path, FILE_READ);
+  if (!file) {
+    addRuleError(errors, "", "cannot open rules file");
+    return false;
   }
-  
-  File file = SD.open("/config/known_devices.json", FILE_WRITE);
-  if (file) {
-    serializeJson(doc, file);
-    file.close();
+
+  JsonArrayReader reader(file);
+  StaticJsonDocument<512> entry;
+  bool found = reader.begin("rules");
+  bool valid = true;
+  while (found && reader.next(entry)) {
+    CompiledRule rule;
+    const char* error = compileRule(entry.as<JsonObject>(), rule);
+    if (error) {
+      addRuleError(errors, rule.id, error);
+      valid = false;
+      continue;
+    }
+    compiled.push_back(rule);
   }
+  file.close();
+
+  if (reader.error()) {
+    metrics.jsonParseFailuresFile++;
+    char where[24];
+    snprintf(where, sizeof(where), "rules[%u]", (unsigned)reader.count);
+    addRuleError(errors, where, reader.error() == DeserializationError::NoMemory ? "rule too large" : reader.error().c_str());
+    valid = false;
+  } else if (!found) {
+    addRuleError(errors, "", "expected {\"rules\":[...]}");
+    valid = false;
+  }
+
+  std::sort(compiled.begin(), compiled.end(), [](const CompiledRule& a, const CompiledRule& b) {
+    return a.sensorHash < b.sensorHash;
+  });
+  return valid;
 }
 
-void loadKnownDevices() {
-  File file = SD.open("/config/known_devices.json", FILE_READ);
-  if (file) {
-    StaticJsonDocument<2048> doc;
-    DeserializationError error = deserializeJson(doc, file);
-    file.close();
-    
-    if (!error) {
-      knownDevices.clear();
-      JsonArray devices = doc["knownDevices"];
-      
-      for (JsonObject device : devices) {
-        KnownDevice known;
-        known.deviceId = device["deviceId"].as<String>();
-        known.password = device["password"].as<String>();
-        knownDevices.push_back(known);
-      }
+// Loads RULES_PATH at boot. It was checked before it was saved, and a
+// missing file means no rules.
+void loadRules() {
+  std::vector<CompiledRule> compiled;
+  if (SD.exists(RULES_PATH)) compileRules(RULES_PATH, compiled, nullptr);
+  rules.swap(compiled);
+  Serial.printf("Loaded %u rules\n", (unsigned)rules.size());
+}
+
+bool runRule(const CompiledRule& rule, float value) {
+  float stack[RULE_STACK_SIZE];
+  int top = 0;
+
+  for (uint8_t pc = 0; pc < rule.codeLength; pc++) {
+    switch (rule.code[pc]) {
+      case RULE_OP_VALUE: stack[top++] = value; break;
+      case RULE_OP_CONST: stack[top++] = rule.consts[rule.code[++pc]]; break;
+      case RULE_OP_GT: top--; stack[top - 1] = stack[top - 1] > stack[top]; break;
+      case RULE_OP_GE: top--; stack[top - 1] = stack[top - 1] >= stack[top]; break;
+      case RULE_OP_LT: top--; stack[top - 1] = stack[top - 1] < stack[top]; break;
+      case RULE_OP_LE: top--; stack[top - 1] = stack[top - 1] <= stack[top]; break;
+      case RULE_OP_EQ: top--; stack[top - 1] = stack[top - 1] == stack[top]; break;
+      case RULE_OP_NE: top--; stack[top - 1] = stack[top - 1] != stack[top]; break;
+      case RULE_OP_AND: top--; stack[top - 1] = stack[top - 1] != 0 && stack[top] != 0; break;
+      case RULE_OP_OR: top--; stack[top - 1] = stack[top - 1] != 0 || stack[top] != 0; break;
+      case RULE_OP_NOT: stack[top - 1] = stack[top - 1] == 0; break;
     }
   }
+  return top > 0 && stack[top - 1] != 0;
 }
 
-// ==================== DEVICE CONFIGURATION ====================
-bool configureDevice(DiscoveredDevice& device, String deviceName, String deviceType, int readInterval) {
-  Serial.println("Configuring device: " + device.deviceId);
-  
-  WiFi.begin(device.ssid.c_str(), "12345678");
-  
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 10) {
-    delay(500);
-    attempts++;
+void fireRule(const CompiledRule& rule) {
+  StaticJsonDocument<COMMAND_CAPACITY> command;
+  command["deviceId"] = rule.targetDevice;
+  command["command"] = rule.command;
+  command["value"] = rule.value;
+  command["ruleId"] = rule.id;
+
+  char commandId[24];
+  if (enqueueCommand(command, commandId, sizeof(commandId))) {
+    metrics.ruleFirings++;
+    Serial.printf("Rule %s fired command %s\n", rule.id, commandId);
+  } else {
+    Serial.printf("Rule %s could not queue its command\n", rule.id);
   }
-  
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("Failed to connect to device for configuration");
-    WiFi.softAP("ESP32-IoT-Server", "12345678");
-    return false;
+}
+
+// Finds the hold slot of a device. With `claim`, a device without one
+// takes a free slot, or that of the device not heard from for longest.
+RuleHold* findRuleHold(CompiledRule& rule, uint32_t deviceHash, bool claim, unsigned long now) {
+  for (RuleHold& hold : rule.holds) {
+    if (hold.deviceHash == deviceHash) return &hold;
   }
-  
-  HTTPClient http;
-  String url = "http://192.168.4.1/api/config";
-  
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  
-  StaticJsonDocument<512> configPayload;
-  configPayload["deviceName"] = deviceName;
-  configPayload["deviceType"] = deviceType;
-  configPayload["wifiSSID"] = "ESP32-IoT-Server";
-  configPayload["wifiPassword"] = "12345678";
-  configPayload["controlPlaneIP"] = WiFi.softAPIP().toString();
-  configPayload["controlPlanePort"] = 80;
-  configPayload["readInterval"] = readInterval;
-  
-  String payload;
-  serializeJson(configPayload, payload);
-  
-  int httpCode = http.POST(payload);
-  
-  bool success = (httpCode == 200);
-  
-  if (success) {
-    Serial.println("Device configured successfully");
-  } else {
-    Serial.println("Device configuration failed: " + String(httpCode));
+  if (!claim) return nullptr;
+
+  RuleHold* slot = &rule.holds[0];
+  for (RuleHold& hold : rule.holds) {
+    if (hold.deviceHash == 0) {
+      slot = &hold;
+      break;
+    }
+    if (now - hold.lastSeen > now - slot->lastSeen) slot = &hold;
   }
-  
-  http.end();
-  WiFi.disconnect();
-  WiFi.softAP("ESP32-IoT-Server", "12345678");
-  
-  return success;
+  slot->deviceHash = deviceHash;
+  slot->since = now;
+  slot->lastSeen = now;
+  slot->fired = false;
+  return slot;
 }
 
-void saveConfiguredDevice(DiscoveredDevice& device, String deviceName, String deviceType, int readInterval) {
-  File file = SD.open("/config/devices.json", FILE_READ);
-  StaticJsonDocument<2048> data;
-  
-  if (file) {
-    DeserializationError error = deserializeJson(data, file);
-    file.close();
-    if (error) {
-      data["devices"] = JsonArray();
+// Runs the rules triggered by one reading. Only rules for this sensor type
+// are visited, found by binary search over the sorted table.
+void evaluateRules(const String& deviceId, const String& sensorType, float value) {
+  uint32_t hash = fnv1aHash(sensorType.c_str());
+  size_t low = 0;
+  size_t high = rules.size();
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (rules[mid].sensorHash < hash) low = mid + 1;
+    else high = mid;
+  }
+
+  unsigned long now = millis();
+  uint32_t deviceHash = fnv1aHash(deviceId.c_str());
+  if (deviceHash == 0) deviceHash = 1;
+  for (size_t i = low; i < rules.size() && rules[i].sensorHash == hash; i++) {
+    CompiledRule& rule = rules[i];
+    if (rule.source[0] != '\0' && deviceId != rule.source) continue;
+    if (sensorType != rule.sensorType) continue;
+
+    metrics.ruleEvaluations++;
+    bool matched = runRule(rule, value);
+    RuleHold* hold = findRuleHold(rule, deviceHash, matched, now);
+    if (!matched) {
+      if (hold) hold->deviceHash = 0;
+      continue;
+    }
+
+    hold->lastSeen = now;
+    if (!hold->fired && now - hold->since >= rule.holdMs) {
+      hold->fired = true;
+      fireRule(rule);
     }
-  } else {
-    data["devices"] = JsonArray();
-  }
-  
-  JsonArray devices = data["devices"].as<JsonArray>();
-  JsonObject newDevice = devices.createNestedObject();
-  
-  newDevice["id"] = device.deviceId;
-  newDevice["name"] = deviceName;
-  newDevice["type"] = deviceType;
-  newDevice["ip"] = "pending";
-  newDevice["readInterval"] = readInterval;
-  newDevice["connected"] = false;
-  newDevice["configured"] = true;
-  newDevice["lastSeen"] = "";
-  newDevice["firmwareVersion"] = device.firmwareVersion;
-  newDevice["hardwareVersion"] = device.hardwareVersion;
-  
-  File saveFile = SD.open("/config/devices.json", FILE_WRITE);
-  if (saveFile) {
-    serializeJson(data, saveFile);
-    saveFile.close();
-    Serial.println("Device saved to database");
   }
 }
 
-void handleDeviceConfiguration() {
-  if (server.method() == HTTP_POST) {
-    String body = server.arg("plain");
-    
-    StaticJsonDocument<512> configData;
-    DeserializationError error = deserializeJson(configData, body);
-    
-    if (error) {
-      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
+// GET /api/rules returns rules.json. POST compiles the new document from
+// a temporary file and only replaces rules.json, and the loaded rules, if
+// every rule compiled; otherwise the old rules stay and `errors` says why.
+void handleRules() {
+  if (server.method() == HTTP_GET) {
+    File file = SD.open(RULES_PATH, FILE_READ);
+    if (!file) {
+      server.send(200, "application/json", "{\"rules\":[]}");
       return;
     }
-    
-    String targetDeviceId = configData["deviceId"];
-    String deviceName = configData["deviceName"];
-    String deviceType = configData["deviceType"];
-    int readInterval = configData["readInterval"];
-    
-    DiscoveredDevice* targetDevice = nullptr;
-    for (auto& device : discoveredDevices) {
-      if (device.deviceId == targetDeviceId) {
-        targetDevice = &device;
-        break;
-      }
+    streamSdFile(file, "application/json");
+    file.close();
+  } else if (server.method() == HTTP_POST) {
+    String body = server.arg("plain");
+    const char* tempPath = RULES_PATH ".tmp";
+    File saveFile = SD.open(tempPath, FILE_WRITE);
+    size_t written = saveFile ? saveFile.print(body) : 0;
+    if (saveFile) saveFile.close();
+    if (written != body.length()) {
+      SD.remove(tempPath);
+      server.send(500, "application/json", "{\"success\":false,\"message\":\"Save failed\"}");
+      return;
     }
-    
-    if (!targetDevice) {
-      server.send(404, "application/json", "{\"success\":false,\"message\":\"Device not found\"}");
+
+    DynamicJsonDocument response(2048);
+    JsonArray errors = response.createNestedArray("errors");
+    std::vector<CompiledRule> compiled;
+    if (!compileRules(tempPath, compiled, &errors)) {
+      SD.remove(tempPath);
+      response["success"] = false;
+      response["loaded"] = 0;
+      String responseStr;
+      serializeJson(response, responseStr);
+      server.send(400, "application/json", responseStr);
       return;
     }
-    
-    if (configureDevice(*targetDevice, deviceName, deviceType, readInterval)) {
-      saveConfiguredDevice(*targetDevice, deviceName, deviceType, readInterval);
-      server.send(200, "application/json", "{\"success\":true,\"message\":\"Device configured successfully\"}");
-    } else {
-      server.send(500, "application/json", "{\"success\":false,\"message\":\"Configuration failed\"}");
+
+    SD.remove(RULES_PATH);
+    if (!SD.rename(tempPath, RULES_PATH)) {
+      server.send(500, "application/json", "{\"success\":false,\"message\":\"Save failed\"}");
+      return;
     }
+    rules.swap(compiled);
+    Serial.printf("Loaded %u rules\n", (unsigned)rules.size());
+    response["success"] = true;
+    response["loaded"] = rules.size();
+
+    String responseStr;
+    serializeJson(response, responseStr);
+    server.send(200, "application/json", responseStr);
   } else {
     server.send(405, "text/plain", "Method Not Allowed");
   }
 }
 
-// ==================== DEVICE MANAGEMENT ====================
-void handleDeviceConfig() {
-  if (server.method() == HTTP_POST) {
-    String body = server.arg("plain");
+// ==================== FIRMWARE UPDATE ====================
+// /firmware/firmware.bin is the image named by /firmware/version.txt. It is
+// served with a strong ETag (its MD5, which data planes verify) and, for
+// Range requests, in pieces of at most FIRMWARE_MAX_RANGE bytes, so one
+// download never holds the server for long and a dropped one resumes where
+// it stopped.
+//
+// Downloads are limited two ways. A device (X-Device-Id) needs one of
+// rollout.maxConcurrent slots; its slot is freed once it has fetched the
+// last byte or has been quiet for FIRMWARE_SLOT_IDLE_MS. A token bucket
+// caps firmware traffic at FIRMWARE_RATE_BPS. Refused requests get a 503
+// with Retry-After.
+//
+// POST /api/firmware/rollout {"maxConcurrent":2,"staggerSeconds":30[,"devices":["id",...]]}
+// starts a staged rollout of the current image to registered devices: each
+// is told to update (POST /api/ota) in turn, staggerSeconds apart and only
+// while a slot is free. A device is done once its heartbeat reports the
+// new firmwareVersion. GET /api/firmware/rollout reports progress.
+#define FIRMWARE_PATH "/firmware/firmware.bin"
+#define FIRMWARE_MAX_RANGE 16384
+#define FIRMWARE_MAX_SLOTS 8
+#define FIRMWARE_SLOT_IDLE_MS 60000UL
+#define FIRMWARE_RATE_BPS 65536
+#define FIRMWARE_RETRY_SECONDS 10
+#define ROLLOUT_NOTIFY_TIMEOUT_MS 3000
+#define ROLLOUT_NOTIFY_ATTEMPTS 3
+#define ROLLOUT_DEVICE_TIMEOUT_MS 600000UL
 
-    StaticJsonDocument<256> newDevice;
-    DeserializationError error = deserializeJson(newDevice, body);
-    if (error) {
-      server.send(400, "application/json", "{\"success\":false, \"message\":\"Invalid JSON\"}");
-      return;
-    }
+enum RolloutStatus : uint8_t {ROLLOUT_PENDING, ROLLOUT_NOTIFIED, ROLLOUT_DONE, ROLLOUT_FAILED};
+const char* ROLLOUT_STATUS_NAMES[] = {"pending", "notified", "done", "failed"};
 
-    File file = SD.open("/config/devices.json", FILE_READ);
-    StaticJsonDocument<1024> data;
+struct FirmwareSlot {
+  char deviceId[24]; // Empty when free
+  unsigned long lastActivity;
+};
 
-    if (file) {
-      DeserializationError err = deserializeJson(data, file);
-      file.close();
-      if (err) {
-        data["devices"] = JsonArray();
-      }
-    } else {
-      data["devices"] = JsonArray();
+struct RolloutDevice {
+  char deviceId[24];
+  char ip[16];
+  RolloutStatus status;
+  uint8_t attempts;
+  unsigned long notifiedAt;
+};
+
+struct FirmwareRollout {
+  bool active = false;
+  char version[24] = "";
+  uint8_t maxConcurrent = 2;
+  unsigned long staggerMs = 30000;
+  unsigned long lastNotify = 0;
+  std::vector<RolloutDevice> devices;
+  FirmwareSlot slots[FIRMWARE_MAX_SLOTS] = {};
+  float tokens = FIRMWARE_RATE_BPS;
+  unsigned long tokensAt = 0;
+  char md5[33] = "";  // Of the image as it was at imageSize
+  uint32_t imageSize = 0;
+  uint64_t bytesServed = 0;
+  uint32_t refused = 0;
+};
+
+FirmwareRollout rollout;
+
+// First line of version.txt
+String readFirmwareVersion() {
+  File versionFile = SD.open("/firmware/version.txt", FILE_READ);
+  if (!versionFile) return String();
+  versionFile.setTimeout(0);
+  String version = versionFile.readStringUntil('\n');
+  versionFile.close();
+  version.trim();
+  return version;
+}
+
+// Hashes the image again if its size changed or `force` is set
+bool refreshFirmwareDigest(bool force) {
+  File image = SD.open(FIRMWARE_PATH, FILE_READ);
+  if (!image) return false;
+
+  uint32_t size = image.size();
+  if (force || size != rollout.imageSize || rollout.md5[0] == '\0') {
+    unsigned long start = micros();
+    MD5Builder md5;
+    md5.begin();
+    md5.addStream(image, size);
+    md5.calculate();
+    md5.getChars(rollout.md5);
+    rollout.imageSize = size;
+    metrics.sdRead.observe(micros() - start);
+    metrics.sdReadBytes += size;
+  }
+  image.close();
+  return size > 0;
+}
+
+// Finds the device's download slot, claiming a free one if `claim` is set
+// and fewer than maxConcurrent are busy. Idle slots are freed on the way.
+FirmwareSlot* findFirmwareSlot(const char* deviceId, bool claim) {
+  unsigned long now = millis();
+  FirmwareSlot* freeSlot = nullptr;
+  int busy = 0;
+  for (FirmwareSlot& slot : rollout.slots) {
+    if (slot.deviceId[0] != '\0' && now - slot.lastActivity > FIRMWARE_SLOT_IDLE_MS) {
+      slot.deviceId[0] = '\0';
+    }
+    if (slot.deviceId[0] == '\0') {
+      if (!freeSlot) freeSlot = &slot;
+      continue;
     }
+    if (strcmp(slot.deviceId, deviceId) == 0) {
+      slot.lastActivity = now;
+      return &slot;
+    }
+    busy++;
+  }
 
-    JsonArray devices = data["devices"].as<JsonArray>();
-    devices.add(newDevice);
+  if (!claim || !freeSlot || busy >= rollout.maxConcurrent) return nullptr;
+  strlcpy(freeSlot->deviceId, deviceId, sizeof(freeSlot->deviceId));
+  freeSlot->lastActivity = now;
+  return freeSlot;
+}
 
-    File saveFile = SD.open("/config/devices.json", FILE_WRITE);
-    if (!saveFile) {
-      server.send(500, "application/json", "{\"success\":false, \"message\":\"Save failed\"}");
+int busyFirmwareSlots() {
+  int busy = 0;
+  for (const FirmwareSlot& slot : rollout.slots) {
+    if (slot.deviceId[0] != '\0' && millis() - slot.lastActivity <= FIRMWARE_SLOT_IDLE_MS) busy++;
+  }
+  return busy;
+}
+
+// Takes `bytes` from the bandwidth bucket (one second deep)
+bool takeFirmwareTokens(uint32_t bytes) {
+  unsigned long now = millis();
+  rollout.tokens = min((float)FIRMWARE_RATE_BPS, rollout.tokens + (now - rollout.tokensAt) * (FIRMWARE_RATE_BPS / 1000.0f));
+  rollout.tokensAt = now;
+  if (rollout.tokens < bytes) return false;
+  rollout.tokens -= bytes;
+  return true;
+}
+
+void refuseFirmwareDownload(int retrySeconds) {
+  rollout.refused++;
+  server.sendHeader("Retry-After", String(retrySeconds));
+  server.send(503, "text/plain", "Firmware download busy");
+}
+
+void handleFirmwareUpdate() {
+  if (!refreshFirmwareDigest(false)) {
+    server.send(404, "text/plain", "Firmware not found");
+    return;
+  }
+
+  char etag[36];
+  snprintf(etag, sizeof(etag), "\"%s\"", rollout.md5);
+  uint32_t size = rollout.imageSize;
+  uint32_t first = 0;
+  uint32_t last = size - 1;
+
+  // A Range is honored unless If-Range names another image
+  String range = server.header("Range");
+  String ifRange = server.header("If-Range");
+  bool ranged = range.startsWith("bytes=") && (ifRange.isEmpty() || ifRange == etag);
+  if (ranged) {
+    char* end;
+    first = strtoul(range.c_str() + 6, &end, 10);
+    if (*end == '-' && isdigit(end[1])) {
+      last = std::min((uint32_t)strtoul(end + 1, nullptr, 10), size - 1);
+    }
+    if (*end != '-' || first > last) {
+      server.sendHeader("Content-Range", "bytes */" + String(size));
+      server.send(416, "text/plain", "Range Not Satisfiable");
       return;
     }
+    last = std::min(last, first + FIRMWARE_MAX_RANGE - 1);
+  }
 
-    serializeJson(data, saveFile);
-    saveFile.close();
+  String deviceId = server.header("X-Device-Id");
+  if (deviceId.isEmpty()) deviceId = server.client().remoteIP().toString();
+  FirmwareSlot* slot = findFirmwareSlot(deviceId.c_str(), true);
+  if (!slot) {
+    refuseFirmwareDownload(FIRMWARE_RETRY_SECONDS);
+    return;
+  }
+  uint32_t length = last - first + 1;
+  if (ranged && !takeFirmwareTokens(length)) {
+    refuseFirmwareDownload(1);
+    return;
+  }
 
-    server.send(200, "application/json", "{\"success\":true}");
+  File image = SD.open(FIRMWARE_PATH, FILE_READ);
+  if (!image || !image.seek(first)) {
+    server.send(500, "text/plain", "Firmware read error");
+    return;
   }
-  else if (server.method() == HTTP_GET) {
-    File file = SD.open("/config/devices.json", FILE_READ);
-    if (file) {
-      server.streamFile(file, "application/json");
-      file.close();
-    } else {
-      server.send(200, "application/json", "{\"devices\":[]}");
-    }
+
+  server.sendHeader("ETag", etag);
+  server.sendHeader("Accept-Ranges", "bytes");
+  if (ranged) {
+    server.sendHeader("Content-Range", "bytes " + String(first) + "-" + String(last) + "/" + String(size));
   }
-  else {
-    server.send(405, "text/plain", "Method Not Allowed");
+  server.setContentLength(length);
+  server.send(ranged ? 206 : 200, "application/octet-stream", "");
+
+  unsigned long start = micros();
+  uint8_t buffer[1024];
+  uint32_t remaining = length;
+  while (remaining > 0 && server.client().connected()) {
+    size_t n = image.read(buffer, std::min<uint32_t>(remaining, sizeof(buffer)));
+    if (n == 0) break;
+    server.sendContent((const char*)buffer, n);
+    remaining -= n;
+  }
+  image.close();
+  metrics.sdRead.observe(micros() - start);
+  metrics.sdReadBytes += length - remaining;
+  rollout.bytesServed += length - remaining;
+
+  if (last == size - 1) {
+    slot->deviceId[0] = '\0'; // Image complete
   }
 }
 
-bool updateDeviceIP(String deviceId, String newIP) {
-  File file = SD.open("/config/devices.json", FILE_READ);
-  StaticJsonDocument<2048> data;
-  
-  if (file) {
-    DeserializationError error = deserializeJson(data, file);
-    file.close();
-    if (error) return false;
-  } else {
-    return false;
+void handleFirmwareVersion() {
+  File versionFile = SD.open("/firmware/version.txt", FILE_READ);
+  if (!versionFile) {
+    server.send(404, "text/plain", "Version file not found");
+    return;
   }
-  
-  JsonArray devices = data["devices"].as<JsonArray>();
-  bool found = false;
-  
-  for (JsonObject device : devices) {
-    if (device["id"] == deviceId) {
-      device["ip"] = newIP;
-      device["connected"] = true;
-      device["lastSeen"] = String(millis());
-      found = true;
-      break;
+  streamSdFile(versionFile, "text/plain");
+  versionFile.close();
+}
+
+// Marks a rollout device done once it runs the rolled out version
+void recordFirmwareVersion(const String& deviceId, const char* version) {
+  if (!rollout.active || version[0] == '\0' || strcmp(version, rollout.version) != 0) return;
+  for (RolloutDevice& device : rollout.devices) {
+    if (deviceId == device.deviceId && device.status != ROLLOUT_DONE) {
+      device.status = ROLLOUT_DONE;
+      Serial.printf("Rollout: %s runs %s\n", device.deviceId, version);
     }
   }
-  
-  if (!found) return false;
-  
-  File saveFile = SD.open("/config/devices.json", FILE_WRITE);
-  if (saveFile) {
-    serializeJson(data, saveFile);
-    saveFile.close();
-    return true;
+}
+
+// Tells the next pending device to update, keeping to the stagger and the
+// download slots
+void runFirmwareRollout() {
+  if (!rollout.active) return;
+
+  unsigned long now = millis();
+  bool remaining = false;
+  RolloutDevice* next = nullptr;
+  for (RolloutDevice& device : rollout.devices) {
+    if (device.status == ROLLOUT_NOTIFIED && now - device.notifiedAt > ROLLOUT_DEVICE_TIMEOUT_MS) {
+      device.status = ROLLOUT_FAILED;
+    }
+    if (device.status == ROLLOUT_PENDING || device.status == ROLLOUT_NOTIFIED) remaining = true;
+    if (device.status == ROLLOUT_PENDING && !next) next = &device;
+  }
+  if (!remaining) {
+    rollout.active = false;
+    Serial.printf("Rollout of %s finished\n", rollout.version);
+    return;
+  }
+  if (!next || now - rollout.lastNotify < rollout.staggerMs) return;
+
+  FirmwareSlot* slot = findFirmwareSlot(next->deviceId, true);
+  if (!slot) return;
+  rollout.lastNotify = now;
+  next->attempts++;
+
+  char body[64];
+  size_t length = snprintf(body, sizeof(body), "{\"version\":\"%s\"}", rollout.version);
+  httpClient.begin("http://" + String(next->ip) + "/api/ota");
+  httpClient.setTimeout(ROLLOUT_NOTIFY_TIMEOUT_MS);
+  httpClient.addHeader("Content-Type", "application/json");
+  int httpCode = httpClient.POST((uint8_t*)body, length);
+  httpClient.end();
+
+  if (httpCode >= 200 && httpCode < 300) {
+    next->status = ROLLOUT_NOTIFIED;
+    next->notifiedAt = now;
+  } else {
+    slot->deviceId[0] = '\0';
+    if (next->attempts >= ROLLOUT_NOTIFY_ATTEMPTS) next->status = ROLLOUT_FAILED;
   }
-  
-  return false;
 }
 
-// ==================== ENHANCED DEVICE REGISTRATION ====================
-void handleDeviceRegistration() {
+void handleFirmwareRollout() {
   if (server.method() == HTTP_POST) {
-    String body = server.arg("plain");
-    
-    StaticJsonDocument<512> regData;
-    DeserializationError error = deserializeJson(regData, body);
-    
-    if (error) {
+    StaticJsonDocument<1024> request;
+    if (parseJson(request, server.arg("plain"))) {
       server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
       return;
     }
-    
-    String deviceId = regData["deviceId"];
-    String deviceIP = regData["ip"];
-    String deviceName = regData["name"];
-    String deviceType = regData["type"];
-    int readInterval = regData["readInterval"];
-    
-    // Update or create device entry
-    if (updateOrCreateDevice(deviceId, deviceIP, deviceName, deviceType, readInterval)) {
-      server.send(200, "application/json", "{\"success\":true}");
-      Serial.println("Device registered: " + deviceId + " at " + deviceIP);
-    } else {
-      server.send(500, "application/json", "{\"success\":false,\"message\":\"Registration failed\"}");
+    String version = readFirmwareVersion();
+    if (version.isEmpty() || !refreshFirmwareDigest(true)) {
+      server.send(404, "application/json", "{\"success\":false,\"message\":\"No firmware image\"}");
+      return;
     }
-  } else {
+
+    strlcpy(rollout.version, version.c_str(), sizeof(rollout.version));
+    rollout.maxConcurrent = constrain(request["maxConcurrent"] | 2, 1, FIRMWARE_MAX_SLOTS);
+    rollout.staggerMs = (request["staggerSeconds"] | 30UL) * 1000UL;
+    JsonArray only = request["devices"].as<JsonArray>();
+
+    StaticJsonDocument<64> filter;
+    filter["id"] = true;
+    filter["ip"] = true;
+    rollout.devices.clear();
+    scanJsonArray("/config/devices.json", "devices", &filter, [&](JsonObject entry) {
+      const char* id = entry["id"] | "";
+      const char* ip = entry["ip"] | "";
+      if (id[0] == '\0' || ip[0] == '\0') return true;
+      if (!only.isNull()) {
+        bool listed = false;
+        for (const char* wanted : only) listed = listed || strcmp(wanted, id) == 0;
+        if (!listed) return true;
+      }
+      RolloutDevice device = {};
+      strlcpy(device.deviceId, id, sizeof(device.deviceId));
+      strlcpy(device.ip, ip, sizeof(device.ip));
+      rollout.devices.push_back(device);
+      return true;
+    });
+    rollout.active = !rollout.devices.empty();
+    rollout.lastNotify = millis() - rollout.staggerMs;
+  } else if (server.method() != HTTP_GET) {
     server.send(405, "text/plain", "Method Not Allowed");
+    return;
   }
+
+  DynamicJsonDocument response(512 + rollout.devices.size() * 96);
+  response["active"] = rollout.active;
+  response["version"] = (const char*)rollout.version;
+  response["md5"] = (const char*)rollout.md5;
+  response["size"] = rollout.imageSize;
+  response["maxConcurrent"] = rollout.maxConcurrent;
+  response["staggerSeconds"] = rollout.staggerMs / 1000;
+  response["busySlots"] = busyFirmwareSlots();
+  JsonArray devices = response.createNestedArray("devices");
+  for (const RolloutDevice& device : rollout.devices) {
+    JsonObject entry = devices.createNestedObject();
+    entry["deviceId"] = (const char*)device.deviceId;
+    entry["status"] = ROLLOUT_STATUS_NAMES[device.status];
+    entry["attempts"] = device.attempts;
+  }
+
+  String responseStr;
+  serializeJson(response, responseStr);
+  server.send(200, "application/json", responseStr);
 }
 
-bool updateOrCreateDevice(String deviceId, String newIP, String deviceName, String deviceType, int readInterval) {
-  File file = SD.open("/config/devices.json", FILE_READ);
-  StaticJsonDocument<2048> data;
-  
-  if (file) {
-    DeserializationError error = deserializeJson(data, file);
-    file.close();
-    if (error) {
-      data["devices"] = JsonArray();
-    }
-  } else {
-    data["devices"] = JsonArray();
+// ==================== METRICS ENDPOINT ====================
+void writeHistogram(ChunkedWriter& out, const char* name, const char* labels, const LatencyHistogram& histogram) {
+  const char* separator = labels[0] ? "," : "";
+  uint32_t cumulative = 0;
+  for (int i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+    cumulative += histogram.buckets[i];
+    out.printf("%s_bucket{%s%sle=\"%s\"} %u\n", name, labels, separator, LATENCY_BUCKET_LABELS[i], cumulative);
   }
-  
-  JsonArray devices = data["devices"].as<JsonArray>();
-  bool found = false;
-  
-  // Check if device already exists
-  for (JsonObject device : devices) {
-    if (device["id"] == deviceId) {
-      // Update existing device
-      device["ip"] = newIP;
-      device["name"] = deviceName;
-      device["type"] = deviceType;
-      device["readInterval"] = readInterval;
-      device["connected"] = true;
-      device["lastSeen"] = String(millis());
-      device["configured"] = true;
-      found = true;
-      Serial.println("Updated existing device: " + deviceId);
-      break;
-    }
+  cumulative += histogram.buckets[LATENCY_BUCKET_COUNT];
+  out.printf("%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, separator, cumulative);
+  out.printf("%s_sum{%s} %.6f\n", name, labels, histogram.sumMicros / 1000000.0);
+  out.printf("%s_count{%s} %u\n", name, labels, histogram.count);
+}
+
+// Counts the entries of an array in an SD document, and how many of them
+// satisfy match(). Only `field` is kept in memory, so large files stay cheap.
+int countJsonEntries(const char* path, const char* arrayKey, const char* field,
+                     bool (*match)(JsonObject entry), int* matched) {
+  StaticJsonDocument<64> filter;
+  filter[field] = true;
+
+  int count = 0;
+  scanJsonArray(path, arrayKey, &filter, [&](JsonObject entry) {
+    count++;
+    if (match && matched && match(entry)) (*matched)++;
+    return true;
+  });
+  return count;
+}
+
+// GET /api/metrics - Prometheus text exposition format
+void handleMetrics() {
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain; version=0.0.4", "");
+
+  ChunkedWriter out;
+  char labels[96];
+
+  out.printf("# TYPE sdn_http_request_duration_seconds histogram\n");
+  for (int i = 0; i < metrics.routeCount; i++) {
+    snprintf(labels, sizeof(labels), "route=\"%s\"", metrics.routes[i].uri);
+    writeHistogram(out, "sdn_http_request_duration_seconds", labels, metrics.routes[i].latency);
   }
-  
-  // If not found, create new device entry
-  if (!found) {
-    JsonObject newDevice = devices.createNestedObject();
-    newDevice["id"] = deviceId;
-    newDevice["name"] = deviceName;
-    newDevice["type"] = deviceType;
-    newDevice["ip"] = newIP;
-    newDevice["readInterval"] = readInterval;
-    newDevice["connected"] = true;
-    newDevice["configured"] = true;
-    newDevice["lastSeen"] = String(millis());
-    Serial.println("Created new device entry: " + deviceId);
+
+  out.printf("# TYPE sdn_sd_read_duration_seconds histogram\n");
+  writeHistogram(out, "sdn_sd_read_duration_seconds", "", metrics.sdRead);
+  out.printf("# TYPE sdn_sd_write_duration_seconds histogram\n");
+  writeHistogram(out, "sdn_sd_write_duration_seconds", "", metrics.sdWrite);
+  out.printf("# TYPE sdn_sd_read_bytes_total counter\nsdn_sd_read_bytes_total %llu\n", metrics.sdReadBytes);
+  out.printf("# TYPE sdn_sd_write_bytes_total counter\nsdn_sd_write_bytes_total %llu\n", metrics.sdWriteBytes);
+  out.printf("# TYPE sdn_storage_writes_total counter\nsdn_storage_writes_total %lu\n",
+             (unsigned long)storage.stats.writes);
+  out.printf("# TYPE sdn_storage_sector_writes_total counter\nsdn_storage_sector_writes_total %lu\n",
+             (unsigned long)storage.stats.sectorWrites);
+  out.printf("# TYPE sdn_storage_partial_sector_writes_total counter\nsdn_storage_partial_sector_writes_total %lu\n",
+             (unsigned long)storage.stats.partialWrites);
+  out.printf("# TYPE sdn_storage_syncs_total counter\nsdn_storage_syncs_total %lu\n",
+             (unsigned long)storage.stats.syncs);
+  out.printf("# TYPE sdn_storage_write_errors_total counter\nsdn_storage_write_errors_total %lu\n",
+             (unsigned long)storage.stats.writeErrors);
+  out.printf("# TYPE sdn_storage_opens_total counter\nsdn_storage_opens_total %lu\n",
+             (unsigned long)storage.stats.opens);
+  out.printf("# TYPE sdn_storage_evictions_total counter\nsdn_storage_evictions_total %lu\n",
+             (unsigned long)storage.stats.evictions);
+  out.printf("# TYPE sdn_storage_open_handles gauge\nsdn_storage_open_handles %u\n",
+             (unsigned)storage.openHandles());
+  out.printf("# TYPE sdn_storage_buffered_bytes gauge\nsdn_storage_buffered_bytes %u\n",
+             (unsigned)storage.bufferedBytes());
+
+  out.printf("# TYPE sdn_sd_total_bytes gauge\nsdn_sd_total_bytes %llu\n", maintenance.totalBytes);
+  out.printf("# TYPE sdn_sd_used_bytes gauge\nsdn_sd_used_bytes %llu\n", maintenance.usedBytes);
+  out.printf("# TYPE sdn_storage_class_bytes gauge\n");
+  for (int i = 0; i < STORAGE_CLASS_COUNT; i++) {
+    out.printf("sdn_storage_class_bytes{class=\"%s\"} %llu\n", STORAGE_CLASS_NAMES[i], maintenance.classBytes[i]);
   }
-  
-  // Save back to file
-  File saveFile = SD.open("/config/devices.json", FILE_WRITE);
-  if (saveFile) {
-    serializeJson(data, saveFile);
-    saveFile.close();
-    return true;
+  out.printf("# TYPE sdn_maintenance_removed_files_total counter\nsdn_maintenance_removed_files_total %u\n",
+             maintenance.filesRemoved);
+  out.printf("# TYPE sdn_maintenance_slice_seconds histogram\n");
+  writeHistogram(out, "sdn_maintenance_slice_seconds", "", metrics.maintenanceSlice);
+
+  out.printf("# TYPE sdn_json_parse_failures_total counter\n");
+  out.printf("sdn_json_parse_failures_total{source=\"file\"} %u\n", metrics.jsonParseFailuresFile);
+  out.printf("sdn_json_parse_failures_total{source=\"request\"} %u\n", metrics.jsonParseFailuresRequest);
+
+  int registered = countJsonArray("/config/devices.json", "devices");
+  int connected = 0;
+  for (int i = 0; i < liveness.count; i++) {
+    if (liveness.devices[i].online) connected++;
+  }
+  out.printf("# TYPE sdn_registry_devices gauge\nsdn_registry_devices %d\n", registered);
+  out.printf("# TYPE sdn_registry_connected_devices gauge\nsdn_registry_connected_devices %d\n", connected);
+  out.printf("# TYPE sdn_device_transitions_total counter\n");
+  out.printf("sdn_device_transitions_total{state=\"offline\"} %u\n", liveness.wentOffline);
+  out.printf("sdn_device_transitions_total{state=\"online\"} %u\n", liveness.cameOnline);
+
+  int pendingCommands = 0;
+  countJsonEntries("/data/commands/pending.json", "commands", "status",
+                   [](JsonObject command) { return command["status"] == "pending"; }, &pendingCommands);
+  out.printf("# TYPE sdn_queue_depth gauge\n");
+  out.printf("sdn_queue_depth{queue=\"cloud\"} %u\n", uplink.backlogRecords);
+  out.printf("sdn_queue_depth{queue=\"commands\"} %d\n", pendingCommands);
+
+  out.printf("# TYPE sdn_cloud_backlog_bytes gauge\nsdn_cloud_backlog_bytes %u\n", cloudBacklogBytes());
+  out.printf("# TYPE sdn_cloud_dropped_records_total counter\nsdn_cloud_dropped_records_total %llu\n",
+             uplink.droppedRecords);
+  out.printf("# TYPE sdn_cloud_sent_records_total counter\nsdn_cloud_sent_records_total %llu\n", uplink.sentRecords);
+  out.printf("# TYPE sdn_cloud_sent_bytes_total counter\nsdn_cloud_sent_bytes_total %llu\n", uplink.sentBytes);
+  out.printf("# TYPE sdn_cloud_raw_bytes_total counter\nsdn_cloud_raw_bytes_total %llu\n", uplink.rawBytes);
+  out.printf("# TYPE sdn_cloud_batches_total counter\n");
+  out.printf("sdn_cloud_batches_total{result=\"ok\"} %u\n", uplink.batchesOk);
+  out.printf("sdn_cloud_batches_total{result=\"failed\"} %u\n", uplink.batchesFailed);
+  out.printf("# TYPE sdn_cloud_upload_duration_seconds histogram\n");
+  writeHistogram(out, "sdn_cloud_upload_duration_seconds", "", uplink.uploadTime);
+
+  out.printf("# TYPE sdn_firmware_served_bytes_total counter\nsdn_firmware_served_bytes_total %llu\n",
+             rollout.bytesServed);
+  out.printf("# TYPE sdn_firmware_refused_total counter\nsdn_firmware_refused_total %u\n", rollout.refused);
+  out.printf("# TYPE sdn_firmware_busy_slots gauge\nsdn_firmware_busy_slots %d\n", busyFirmwareSlots());
+
+  out.printf("# TYPE sdn_heap_free_bytes gauge\nsdn_heap_free_bytes %u\n", ESP.getFreeHeap());
+  out.printf("# TYPE sdn_heap_min_free_bytes gauge\nsdn_heap_min_free_bytes %u\n", ESP.getMinFreeHeap());
+  out.printf("# TYPE sdn_psram_free_bytes gauge\nsdn_psram_free_bytes %u\n", ESP.getFreePsram());
+  out.printf("# TYPE sdn_psram_min_free_bytes gauge\nsdn_psram_min_free_bytes %u\n", ESP.getMinFreePsram());
+
+  out.printf("# TYPE sdn_loop_duration_seconds histogram\n");
+  writeHistogram(out, "sdn_loop_duration_seconds", "", metrics.loopTime);
+
+  out.printf("# TYPE sdn_rules_loaded gauge\nsdn_rules_loaded %u\n", (unsigned)rules.size());
+  out.printf("# TYPE sdn_rule_evaluations_total counter\nsdn_rule_evaluations_total %u\n", metrics.ruleEvaluations);
+  out.printf("# TYPE sdn_rule_firings_total counter\nsdn_rule_firings_total %u\n", metrics.ruleFirings);
+
+  out.printf("# TYPE sdn_ingest_duplicate_payloads_total counter\nsdn_ingest_duplicate_payloads_total %u\n",
+             metrics.duplicatePayloads);
+  out.printf("# TYPE sdn_ingest_payload_gaps_total counter\nsdn_ingest_payload_gaps_total %u\n", metrics.payloadGaps);
+  out.printf("# TYPE sdn_delivery_evictions_total counter\nsdn_delivery_evictions_total %u\n",
+             metrics.deliveryEvictions);
+  out.printf("# TYPE sdn_ingest_timestamps_rejected_total counter\nsdn_ingest_timestamps_rejected_total %u\n",
+             metrics.timestampsRejected);
+  out.printf("# TYPE sdn_ingest_readings_held_total counter\nsdn_ingest_readings_held_total %u\n",
+             metrics.readingsHeld);
+  out.printf("# TYPE sdn_clock_synced gauge\nsdn_clock_synced{source=\"%s\"} %d\n",
+             CLOCK_SOURCE_NAMES[controlClock.source], clockSynced() ? 1 : 0);
+  out.printf("# TYPE sdn_device_clock_error_seconds gauge\n");
+  for (int i = 0; i < deviceMetricsCount; i++) {
+    DeviceMetrics& entry = deviceMetrics[i];
+    if (!entry.clockReported || !entry.clockSynced) continue;
+    out.printf("sdn_device_clock_error_seconds{device=\"%s\"} %.3f\n", entry.deviceId, entry.clockErrorMs / 1000.0);
+  }
+  out.printf("# TYPE sdn_device_clock_drift_ppm gauge\n");
+  for (int i = 0; i < deviceMetricsCount; i++) {
+    DeviceMetrics& entry = deviceMetrics[i];
+    if (!entry.clockReported || !entry.clockSynced) continue;
+    out.printf("sdn_device_clock_drift_ppm{device=\"%s\"} %.2f\n", entry.deviceId, entry.clockDriftPpm);
+  }
+  out.printf("# TYPE sdn_device_delivery_completeness gauge\n");
+  for (const DeviceDelivery& entry : deliveries) {
+    if (!entry.sequenced) continue;
+    // Share of numbered payloads received, of those sent since tracking began
+    out.printf("sdn_device_delivery_completeness{device=\"%s\"} %.4f\n", entry.deviceId,
+               (double)entry.delivered / (entry.delivered + entry.missing));
+  }
+  out.printf("# TYPE sdn_device_delivery_payloads_total counter\n");
+  for (const DeviceDelivery& entry : deliveries) {
+    if (!entry.sequenced) continue;
+    out.printf("sdn_device_delivery_payloads_total{device=\"%s\",result=\"delivered\"} %u\n",
+               entry.deviceId, entry.delivered);
+    out.printf("sdn_device_delivery_payloads_total{device=\"%s\",result=\"duplicate\"} %u\n",
+               entry.deviceId, entry.duplicates);
+  }
+  out.printf("# TYPE sdn_device_delivery_missing_payloads gauge\n");
+  for (const DeviceDelivery& entry : deliveries) {
+    if (!entry.sequenced) continue;
+    out.printf("sdn_device_delivery_missing_payloads{device=\"%s\"} %u\n", entry.deviceId, entry.missing);
+  }
+
+  out.printf("# TYPE sdn_device_stage_duration_seconds gauge\n");
+  for (int i = 0; i < deviceMetricsCount; i++) {
+    DeviceMetrics& entry = deviceMetrics[i];
+    for (int stage = 0; stage < DEVICE_STAGE_COUNT; stage++) {
+      if (!entry.stageReported[stage]) continue;
+      for (int stat = 0; stat < 4; stat++) {
+        out.printf("sdn_device_stage_duration_seconds{device=\"%s\",stage=\"%s\",stat=\"%s\"} %.6f\n",
+                   entry.deviceId, DEVICE_STAGE_NAMES[stage], DEVICE_STAGE_STATS[stat],
+                   entry.stageStats[stage][stat] / 1000000.0);
+      }
+    }
+  }
+
+  out.printf("# TYPE sdn_command_actuation_seconds histogram\n");
+  for (int i = 0; i < deviceMetricsCount; i++) {
+    if (deviceMetrics[i].actuation.count == 0) continue;
+    snprintf(labels, sizeof(labels), "device=\"%s\"", deviceMetrics[i].deviceId);
+    writeHistogram(out, "sdn_command_actuation_seconds", labels, deviceMetrics[i].actuation);
   }
-  
-  return false;
+
+  out.flush();
+  server.sendContent("");
 }
 
-// Enhanced heartbeat with connection tracking
-void handleHeartbeat() {
-  if (server.method() == HTTP_POST) {
-    String body = server.arg("plain");
-    
-    StaticJsonDocument<512> heartbeatData;
-    // FIX: Parameter order should be (destination, source)
-    DeserializationError error = deserializeJson(heartbeatData, body);
-    
-    if (error) {
-      // Try simple form data
-      String deviceId = server.arg("deviceId");
-      if (deviceId.isEmpty()) {
-        server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing deviceId\"}");
-        return;
-      }
-      updateDeviceHeartbeat(deviceId);
-    } else {
-      // JSON data
-      String deviceId = heartbeatData["deviceId"];
-      if (deviceId.isEmpty()) {
-        server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing deviceId in JSON\"}");
-        return;
-      }
-      updateDeviceHeartbeat(deviceId);
+// ==================== LATEST VALUES ====================
+// Most recent reading per device and sensor, kept in a fixed RAM table so
+// current values are served without touching the SD card. When the table
+// is full the entry updated longest ago is reused.
+#define MAX_LATEST_VALUES 128
+
+struct LatestValue {
+  uint32_t key;           // 0 marks a free slot
+  char deviceId[24];
+  char deviceName[32];
+  char sensorType[16];
+  char unit[12];
+  char timestamp[24];
+  float value;
+  unsigned long receivedAt;
+};
+
+LatestValue latestValues[MAX_LATEST_VALUES];
+
+uint32_t latestKey(const char* deviceId, const char* sensorType) {
+  uint32_t key = fnv1aHash(sensorType, fnv1aHash(deviceId));
+  return key ? key : 1;
+}
+
+void updateLatestValue(const String& deviceId, const String& deviceName, const String& sensorType,
+                       float value, const String& unit, const String& timestamp) {
+  uint32_t key = latestKey(deviceId.c_str(), sensorType.c_str());
+  LatestValue* slot = nullptr;
+  LatestValue* spare = nullptr;
+
+  for (LatestValue& entry : latestValues) {
+    if (entry.key == key && deviceId == entry.deviceId && sensorType == entry.sensorType) {
+      slot = &entry;
+      break;
     }
-    
-    server.send(200, "application/json", "{\"success\":true,\"serverTime\":\"" + String(millis()) + "\"}");
-  } else {
-    server.send(405, "text/plain", "Method Not Allowed");
+    if (!spare || (spare->key != 0 && (entry.key == 0 || entry.receivedAt < spare->receivedAt))) {
+      spare = &entry;
+    }
+  }
+
+  if (!slot) {
+    slot = spare;
+    slot->key = key;
+    strlcpy(slot->deviceId, deviceId.c_str(), sizeof(slot->deviceId));
+    strlcpy(slot->sensorType, sensorType.c_str(), sizeof(slot->sensorType));
   }
+  strlcpy(slot->deviceName, deviceName.c_str(), sizeof(slot->deviceName));
+  strlcpy(slot->unit, unit.c_str(), sizeof(slot->unit));
+  strlcpy(slot->timestamp, timestamp.c_str(), sizeof(slot->timestamp));
+  slot->value = value;
+  slot->receivedAt = millis();
 }
 
+// GET /api/latest - current value of every sensor of every device
+void handleLatest() {
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+
+  ChunkedWriter out;
+  out.printf("{\"latest\":[");
+  bool first = true;
+  for (const LatestValue& entry : latestValues) {
+    if (entry.key == 0) continue;
 
-void updateDeviceHeartbeat(String deviceId) {
+    StaticJsonDocument<256> item;
+    item["deviceId"] = entry.deviceId;
+    item["deviceName"] = entry.deviceName;
+    item["type"] = entry.sensorType;
+    item["value"] = entry.value;
+    item["unit"] = entry.unit;
+    item["timestamp"] = entry.timestamp;
+    item["ageMs"] = millis() - entry.receivedAt;
+
+    if (!first) out.write(',');
+    serializeJson(item, out);
+    first = false;
+  }
+  out.printf("]}");
+  out.flush();
+  server.sendContent("");
+}
+
+// GET /api/device-data?deviceId= - one device's current values, newest first
+void handleDeviceData() {
+  String deviceId = server.arg("deviceId");
   if (deviceId.isEmpty()) {
-    Serial.println("Error: Empty deviceId in heartbeat");
+    server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing deviceId\"}");
     return;
   }
-  
-  File file = SD.open("/config/devices.json", FILE_READ);
-  StaticJsonDocument<2048> data;
-  
-  if (file) {
-    DeserializationError error = deserializeJson(data, file);
-    file.close();
-    if (!error) {
-      JsonArray devices = data["devices"].as<JsonArray>();
-      bool found = false;
-      
-      for (JsonObject device : devices) {
-        if (device["id"] == deviceId) {
-          device["lastHeartbeat"] = String(millis());
-          device["connected"] = true;
-          found = true;
-          
-          File saveFile = SD.open("/config/devices.json", FILE_WRITE);
-          if (saveFile) {
-            serializeJson(data, saveFile);
-            saveFile.close();
-            Serial.println("Heartbeat updated for device: " + deviceId);
-          } else {
-            Serial.println("Error: Could not save heartbeat for device: " + deviceId);
-          }
-          break;
-        }
-      }
-      
-      if (!found) {
-        Serial.println("Warning: Device not found in heartbeat: " + deviceId);
-      }
-    } else {
-      Serial.println("Error: Could not parse devices.json for heartbeat");
+
+  const LatestValue* matches[MAX_LATEST_VALUES];
+  int count = 0;
+  for (const LatestValue& entry : latestValues) {
+    if (entry.key != 0 && deviceId == entry.deviceId) {
+      matches[count++] = &entry;
     }
-  } else {
-    Serial.println("Error: Could not open devices.json for heartbeat");
   }
+  std::sort(matches, matches + count, [](const LatestValue* a, const LatestValue* b) {
+    return a->receivedAt > b->receivedAt;
+  });
+
+  DynamicJsonDocument response(256 + count * 160);
+  response["success"] = true;
+  response["deviceId"] = deviceId;
+  JsonArray data = response.createNestedArray("data");
+  for (int i = 0; i < count; i++) {
+    JsonObject record = data.createNestedObject();
+    record["timestamp"] = matches[i]->timestamp;
+    JsonObject reading = record.createNestedObject("data");
+    reading["type"] = matches[i]->sensorType;
+    reading["value"] = matches[i]->value;
+    reading["unit"] = matches[i]->unit;
+  }
+
+  String responseStr;
+  serializeJson(response, responseStr);
+  server.send(200, "application/json", responseStr);
 }
 
+// ==================== BENCHMARKS ====================
+#ifdef SDN_ENABLE_BENCHMARKS
+// Micro-benchmarks for the ingest/storage hot paths. Every case runs against
+// synthetic fixtures; the live registry, queue and day log are stashed before
+// a run and restored afterwards. Results are emitted as NDJSON, one line per
+// case, so runs can be diffed between commits. Timings are only comparable
+// between runs on the same board and card.
 
-// Monitor device connectivity
-void checkDeviceConnectivity() {
-  static unsigned long lastCheck = 0;
-  unsigned long now = millis();
-  
-  // Check every 30 seconds
-  if (now - lastCheck < 30000) {
-    return;
+const int BENCH_FLEET_SIZES[] = {1, 10, 100, 1000};
+const int BENCH_LOG_HOURS[] = {1, 24, 168};
+const int BENCH_SAMPLE_SECONDS = 10; // Default data plane read interval
+
+const char* BENCH_FLAT_PAYLOAD =
+  "{\"deviceId\":\"ESP32_BENCH\",\"deviceName\":\"Bench Sensor\",\"type\":\"temperature\","
+  "\"value\":24.5,\"unit\":\"C\",\"timestamp\":\"123456\"}";
+const char* BENCH_READINGS_PAYLOAD =
+  "{\"deviceId\":\"ESP32_BENCH\",\"deviceName\":\"Bench Sensor\",\"timestamp\":123456,"
+  "\"readings\":[{\"type\":\"temperature\",\"value\":24.5,\"unit\":\"C\",\"status\":\"ok\"},"
+  "{\"type\":\"humidity\",\"value\":51.2,\"unit\":\"%\",\"status\":\"ok\"}],"
+  "\"metadata\":{\"dataSource\":\"dummy\",\"sampleTime\":123456}}";
+const SensorReading BENCH_READING = {"temperature", 24.5, "C", "ok"};
+
+struct BenchResult {
+  String name;
+  int fleet;
+  int logHours;
+  int iterations;
+  unsigned long nsPerOp;
+  long netBytesPerOp;   // Heap still held after the op (leak/growth)
+  long netAllocsPerOp;  // Heap blocks still held after the op
+};
+
+// Samples time and heap around a batch of iterations. The ESP32 heap only
+// exposes totals, so allocations are reported net of frees.
+struct BenchProbe {
+  unsigned long startMicros;
+  multi_heap_info_t startHeap;
+
+  void start() {
+    heap_caps_get_info(&startHeap, MALLOC_CAP_8BIT);
+    startMicros = micros();
   }
-  lastCheck = now;
-  
-  File file = SD.open("/config/devices.json", FILE_READ);
-  StaticJsonDocument<2048> data;
-  
-  if (file) {
-    DeserializationError error = deserializeJson(data, file);
-    file.close();
-    if (!error) {
-      JsonArray devices = data["devices"].as<JsonArray>();
-      bool hasChanges = false;
-      
-      unsigned long timeout = 60000; // 60 seconds timeout
-      
-      for (JsonObject device : devices) {
-        if (device["connected"] == true) {
-          String lastHeartbeatStr = device["lastHeartbeat"];
-          if (!lastHeartbeatStr.isEmpty()) {
-            unsigned long lastHeartbeat = lastHeartbeatStr.toInt();
-            
-            if (now - lastHeartbeat > timeout) {
-              device["connected"] = false;
-              hasChanges = true;
-              Serial.println("Device " + device["id"].as<String>() + " marked as disconnected");
-            }
-          }
-        }
-      }
-      
-      if (hasChanges) {
-        File saveFile = SD.open("/config/devices.json", FILE_WRITE);
-        if (saveFile) {
-          serializeJson(data, saveFile);
-          saveFile.close();
-        }
-      }
-    }
+
+  void stop(BenchResult& result) {
+    unsigned long elapsed = micros() - startMicros;
+    multi_heap_info_t endHeap;
+    heap_caps_get_info(&endHeap, MALLOC_CAP_8BIT);
+
+    int n = result.iterations > 0 ? result.iterations : 1;
+    result.nsPerOp = (unsigned long)((uint64_t)elapsed * 1000 / n);
+    result.netBytesPerOp = ((long)endHeap.total_allocated_bytes - (long)startHeap.total_allocated_bytes) / n;
+    result.netAllocsPerOp = ((long)endHeap.allocated_blocks - (long)startHeap.allocated_blocks) / n;
   }
+};
+
+String benchTodayLogPath() {
+  return "/data/sensors/" + getTodayDateString() + ".json";
 }
 
+void benchStash(const String& path) {
+  String backup = path + ".bak";
+  if (SD.exists(backup)) SD.remove(backup);
+  if (SD.exists(path)) SD.rename(path, backup);
+}
 
-void handleDeviceStatus() {
-  if (server.method() == HTTP_POST) {
-    String deviceId = server.arg("deviceId");
-    String status = server.arg("status");
-    String lastSeen = server.arg("lastSeen");
-    
-    if (deviceId.isEmpty() || status.isEmpty()) {
-      server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing parameters\"}");
-      return;
-    }
-    
-    File file = SD.open("/config/devices.json", FILE_READ);
-    StaticJsonDocument<2048> data;
-    
-    if (file) {
-      DeserializationError error = deserializeJson(data, file);
-      file.close();
-      if (error) {
-        data["devices"] = JsonArray();
-      }
-    } else {
-      data["devices"] = JsonArray();
-    }
-    
-    JsonArray devices = data["devices"].as<JsonArray>();
-    bool found = false;
-    
-    for (JsonObject device : devices) {
-      if (device["id"] == deviceId) {
-        device["connected"] = (status == "connected");
-        if (!lastSeen.isEmpty()) {
-          device["lastSeen"] = lastSeen;
-        }
-        found = true;
-        break;
-      }
-    }
-    
-    if (!found) {
-      server.send(404, "application/json", "{\"success\":false,\"message\":\"Device not found\"}");
-      return;
-    }
-    
-    File saveFile = SD.open("/config/devices.json", FILE_WRITE);
-    if (saveFile) {
-      serializeJson(data, saveFile);
-      saveFile.close();
-      server.send(200, "application/json", "{\"success\":true}");
-    } else {
-      server.send(500, "application/json", "{\"success\":false,\"message\":\"Save failed\"}");
-    }
-  } else {
-    server.send(405, "text/plain", "Method Not Allowed");
+void benchRestore(const String& path) {
+  String backup = path + ".bak";
+  if (SD.exists(path)) SD.remove(path);
+  if (SD.exists(backup)) SD.rename(backup, path);
+}
+
+void benchWriteRegistry(int fleet) {
+  File file = SD.open("/config/devices.json", FILE_WRITE);
+  if (!file) return;
+
+  file.print("{\"devices\":[");
+  for (int i = 0; i < fleet; i++) {
+    if (i > 0) file.print(",");
+    file.printf("{\"id\":\"BENCH_%04d\",\"name\":\"Bench %d\",\"type\":\"sensor\",\"ip\":\"192.168.4.%d\","
+                "\"readInterval\":%d,\"connected\":true,\"configured\":true,\"lastSeen\":\"0\",\"lastHeartbeat\":\"0\"}",
+                i, i, 2 + (i % 250), BENCH_SAMPLE_SECONDS);
   }
+  file.print("]}");
+  file.close();
 }
 
-// ==================== DATA MANAGEMENT ====================
-void handleSensorData() {
-  if (server.method() == HTTP_POST) {
-    String body = server.arg("plain");
-    
-    StaticJsonDocument<512> sensorData;
-    DeserializationError error = deserializeJson(sensorData, body);
-    
-    if (error) {
-      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
-      return;
-    }
-    
-    String deviceId = sensorData["deviceId"];
-    String deviceName = sensorData["deviceName"];
-    String sensorType = sensorData["type"];
-    float value = sensorData["value"];
-    String unit = sensorData["unit"];
-    String timestamp = sensorData["timestamp"];
-    
-    if (saveSensorData(deviceId, deviceName, sensorType, value, unit, timestamp)) {
-      // Fixed: Convert to JsonObject before passing
-      JsonObject sensorObj = sensorData.as<JsonObject>();
-      addToCloudQueue(sensorObj);
-      server.send(200, "application/json", "{\"success\":true}");
-    } else {
-      server.send(500, "application/json", "{\"success\":false,\"message\":\"Storage failed\"}");
-    }
-  } else {
-    server.send(405, "text/plain", "Method Not Allowed");
+void benchWriteRecords(const String& path, const char* header, const char* arrayKey, int records) {
+  File file = SD.open(path, FILE_WRITE);
+  if (!file) return;
+
+  file.printf("{%s\"%s\":[", header, arrayKey);
+  for (int i = 0; i < records; i++) {
+    if (i > 0) file.print(",");
+    file.printf("{\"timestamp\":\"%d\",\"deviceId\":\"BENCH_%04d\",\"deviceName\":\"Bench\",\"type\":\"temperature\","
+                "\"value\":%d.5,\"unit\":\"C\",\"status\":\"ok\"}",
+                i * BENCH_SAMPLE_SECONDS * 1000, i % 10, 20 + (i % 10));
   }
+  file.print("]}");
+  file.close();
 }
 
-void handleLogData() {
-  if (server.method() == HTTP_GET) {
-    String date = server.arg("date");
-    if (date.isEmpty()) {
-      date = getTodayDateString();
-    }
-    
-    String filename = "/data/sensors/" + date + ".json";
-    
-    if (SD.exists(filename)) {
-      File file = SD.open(filename, FILE_READ);
-      if (file) {
-        server.streamFile(file, "application/json");
-        file.close();
-      } else {
-        server.send(500, "application/json", "{\"success\":false,\"message\":\"File read error\"}");
-      }
-    } else {
-      server.send(200, "application/json", "{\"date\":\"" + date + "\",\"data\":[]}");
-    }
-  } else {
-    server.send(405, "text/plain", "Method Not Allowed");
+void benchEmit(const BenchResult& result) {
+  StaticJsonDocument<256> line;
+  line["bench"] = result.name;
+  line["fleet"] = result.fleet;
+  line["logHours"] = result.logHours;
+  line["iterations"] = result.iterations;
+  line["nsPerOp"] = result.nsPerOp;
+  line["netBytesPerOp"] = result.netBytesPerOp;
+  line["netAllocsPerOp"] = result.netAllocsPerOp;
+
+  String out;
+  serializeJson(line, out);
+  out += "\n";
+  Serial.print(out);
+  server.sendContent(out);
+}
+
+void benchParsePayload(const char* name, const char* payload, int iterations) {
+  BenchResult result = {name, 1, 0, iterations, 0, 0, 0};
+  BenchProbe probe;
+
+  probe.start();
+  for (int i = 0; i < iterations; i++) {
+    SensorPayload parsed;
+    parseSensorPayload(payload, parsed);
   }
+  probe.stop(result);
+  benchEmit(result);
 }
 
+void benchSaveSensorData(int logHours, int iterations) {
+  String path = benchTodayLogPath();
+  storage.close(path.c_str());
+  benchWriteRecords(path, "\"date\":\"bench\",", "data", logHours * 3600 / BENCH_SAMPLE_SECONDS);
 
-// ==================== COMMAND MANAGEMENT ====================
-void handleDeviceCommands() {
-  if (server.method() == HTTP_GET) {
-    String deviceId = server.arg("deviceId");
-    
-    if (deviceId.isEmpty()) {
-      server.send(400, "application/json", "{\"success\":false,\"message\":\"Missing deviceId\"}");
-      return;
-    }
-    
-    File file = SD.open("/data/commands/pending.json", FILE_READ);
-    StaticJsonDocument<1024> commandData;
-    
-    if (file) {
-      DeserializationError error = deserializeJson(commandData, file);
-      file.close();
-      if (error) {
-        commandData["commands"] = JsonArray();
-      }
-    } else {
-      commandData["commands"] = JsonArray();
-    }
-    
-    JsonArray commands = commandData["commands"].as<JsonArray>();
-    StaticJsonDocument<512> response;
-    JsonArray deviceCommands = response.createNestedArray("commands");
-    
-    for (JsonObject cmd : commands) {
-      if (cmd["deviceId"] == deviceId) {
-        deviceCommands.add(cmd);
-      }
-    }
-    
-    String responseStr;
-    serializeJson(response, responseStr);
-    server.send(200, "application/json", responseStr);
-    
-  } else if (server.method() == HTTP_POST) {
-    String body = server.arg("plain");
-    
-    StaticJsonDocument<256> newCommand;
-    DeserializationError error = deserializeJson(newCommand, body);
-    
-    if (error) {
-      server.send(400, "application/json", "{\"success\":false,\"message\":\"Invalid JSON\"}");
-      return;
-    }
-    
-    newCommand["id"] = String(millis());
-    newCommand["timestamp"] = String(millis());
-    newCommand["status"] = "pending";
-    
-    File file = SD.open("/data/commands/pending.json", FILE_READ);
-    StaticJsonDocument<1024> commandData;
-    
-    if (file) {
-      DeserializationError err = deserializeJson(commandData, file);
-      file.close();
-      if (err) {
-        commandData["commands"] = JsonArray();
-      }
-    } else {
-      commandData["commands"] = JsonArray();
-    }
-    
-    JsonArray commands = commandData["commands"].as<JsonArray>();
-    commands.add(newCommand);
-    
-    File saveFile = SD.open("/data/commands/pending.json", FILE_WRITE);
-    if (saveFile) {
-      serializeJson(commandData, saveFile);
-      saveFile.close();
-      server.send(200, "application/json", "{\"success\":true}");
-    } else {
-      server.send(500, "application/json", "{\"success\":false,\"message\":\"Save failed\"}");
-    }
-  } else {
-    server.send(405, "text/plain", "Method Not Allowed");
+  BenchResult result = {"saveSensorData", 1, logHours, iterations, 0, 0, 0};
+  BenchProbe probe;
+
+  probe.start();
+  for (int i = 0; i < iterations; i++) {
+    saveSensorData(getTodayDateString(), "BENCH_0000", "Bench", &BENCH_READING, 1);
   }
+  probe.stop(result);
+  benchEmit(result);
 }
 
-// ==================== FIRMWARE UPDATE ====================
-void handleFirmwareUpdate() {
-  File updateFile = SD.open("/firmware/firmware.bin", FILE_READ);
-  if (!updateFile) {
-    server.send(404, "text/plain", "Firmware not found");
-    return;
+void benchUpdateDeviceHeartbeat(int fleet, int iterations) {
+  benchWriteRegistry(fleet);
+  loadDeviceLiveness();
+
+  char deviceId[16];
+  snprintf(deviceId, sizeof(deviceId), "BENCH_%04d", fleet - 1); // Worst case: last entry
+
+  BenchResult result = {"updateDeviceHeartbeat", fleet, 0, iterations, 0, 0, 0};
+  BenchProbe probe;
+
+  probe.start();
+  for (int i = 0; i < iterations; i++) {
+    updateDeviceHeartbeat(deviceId);
   }
-  server.streamFile(updateFile, "application/octet-stream");
-  updateFile.close();
+  probe.stop(result);
+  benchEmit(result);
 }
 
-void handleFirmwareVersion() {
-  File versionFile = SD.open("/firmware/version.txt", FILE_READ);
-  if (!versionFile) {
-    server.send(404, "text/plain", "Version file not found");
-    return;
+void benchAddToCloudQueue(int logHours, int iterations) {
+  String path = cloudSegmentPath(cloudHeadGeneration());
+  storage.close(path.c_str());
+  File log = SD.open(path, FILE_WRITE);
+  if (log) {
+    for (int i = 0; i < logHours * 3600 / BENCH_SAMPLE_SECONDS; i++) {
+      log.printf("{\"timestamp\":%d,\"deviceId\":\"BENCH_0000\",\"type\":\"temperature\",\"value\":24.5,\"unit\":\"C\"}\n", i);
+    }
+    log.close();
   }
-  server.streamFile(versionFile, "text/plain");
-  versionFile.close();
+
+  // Appends go to the prepared head segment; initCloudUplink() restores
+  // the real queue state once the benchmarks are done
+  if (uplink.endpoint.isEmpty()) uplink.endpoint = "http://bench.invalid/";
+  uplink.segments.back() = {0, 0};
+
+  BenchResult result = {"addToCloudQueue", 1, logHours, iterations, 0, 0, 0};
+  BenchProbe probe;
+
+  probe.start();
+  for (int i = 0; i < iterations; i++) {
+    addToCloudQueue("BENCH_0000", &BENCH_READING, 1);
+  }
+  probe.stop(result);
+  benchEmit(result);
+}
+
+// GET /api/bench[?case=&fleet=&hours=&iterations=]
+// Without a case the full fleet/log matrix is run.
+void handleBenchmark() {
+  String benchCase = server.arg("case");
+  int iterations = server.hasArg("iterations") ? server.arg("iterations").toInt() : 0;
+  int fleet = server.hasArg("fleet") ? server.arg("fleet").toInt() : 0;
+  int hours = server.hasArg("hours") ? server.arg("hours").toInt() : 0;
+
+  String logPath = benchTodayLogPath();
+  String queuePath = cloudSegmentPath(cloudHeadGeneration());
+  storage.closeAll(); // Cached handles would outlive the stashed files
+  benchStash("/config/devices.json");
+  benchStash(queuePath);
+  benchStash(logPath);
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/x-ndjson", "");
+
+  bool all = benchCase.isEmpty();
+  int storageIterations = iterations > 0 ? iterations : 5;
+
+  if (all || benchCase == "parse") {
+    int parseIterations = iterations > 0 ? iterations : 1000;
+    benchParsePayload("parseSensorData.flat", BENCH_FLAT_PAYLOAD, parseIterations);
+    benchParsePayload("parseSensorData.readings", BENCH_READINGS_PAYLOAD, parseIterations);
+  }
+
+  for (int fleetSize : BENCH_FLEET_SIZES) {
+    if (fleet > 0 && fleet != fleetSize) continue;
+    if (all || benchCase == "heartbeat") benchUpdateDeviceHeartbeat(fleetSize, storageIterations);
+  }
+
+  for (int logHours : BENCH_LOG_HOURS) {
+    if (hours > 0 && hours != logHours) continue;
+    if (all || benchCase == "save") benchSaveSensorData(logHours, storageIterations);
+    if (all || benchCase == "queue") benchAddToCloudQueue(logHours, storageIterations);
+  }
+
+  server.sendContent("");
+
+  storage.closeAll();
+  benchRestore("/config/devices.json");
+  loadDeviceLiveness();
+  benchRestore(queuePath);
+  initCloudUplink();
+  benchRestore(logPath);
 }
+#endif
 
 // ==================== SETUP & LOOP ====================
 void setup() {
@@ -1337,42 +5964,71 @@ void setup() {
   Serial.println("=== SDN Control Plane Starting ===");
   
   setupWiFiAP();
+  initClock();
   initSDCard();
   initOfflineStorage();
+  restoreRollups();
+  initHeldReadings();
+  loadRules();
+  loadRetentionConfig();
+  initCloudUplink();
   loadKnownDevices();
+  loadDeviceLiveness();
 
   // Authentication endpoints
-  server.on("/login", handleLogin);
-  server.on("/logout", handleLogout);
+  addRoute("/login", handleLogin);
+  addRoute("/logout", handleLogout);
   
   // Device discovery and configuration
-  server.on("/api/scan", HTTP_POST, handleWiFiScan);
-  server.on("/api/scan/advanced", HTTP_POST, handleAdvancedWiFiScan);
-  server.on("/api/configure", HTTP_POST, handleDeviceConfiguration);
-  server.on("/api/register", HTTP_POST, handleDeviceRegistration);
+  addRoute("/api/scan", HTTP_POST, handleWiFiScan);
+  addRoute("/api/scan/advanced", HTTP_POST, handleAdvancedWiFiScan);
+  addRoute("/api/configure", HTTP_POST, handleDeviceConfiguration);
+  addRoute("/api/register", HTTP_POST, handleDeviceRegistration);
   
   // Device management
-  server.on("/api/devices", handleDeviceConfig);
-  server.on("/api/devices/status", handleDeviceStatus);
+  addRoute("/api/devices", handleDeviceConfig);
+  addRoute("/api/devices/status", handleDeviceStatus);
+  addRoute("/api/devices/events", HTTP_GET, handleLivenessEvents);
   
   // Data management
-  server.on("/api/data", handleSensorData);
-  server.on("/api/logdata", handleLogData);
-  server.on("/api/heartbeat", handleHeartbeat);
+  addRoute("/api/data", handleSensorData);
+  addRoute("/api/time", handleTime);
+  addRoute("/api/logdata", handleLogData);
+  addRoute("/api/latest", HTTP_GET, handleLatest);
+  addRoute("/api/device-data", HTTP_GET, handleDeviceData);
+  addRoute("/api/history", HTTP_GET, handleHistory);
+  addRoute("/api/export", HTTP_GET, handleExport);
+  addRoute("/api/heartbeat", handleHeartbeat);
   
   // Command management
-  server.on("/api/commands", handleDeviceCommands);
+  addRoute("/api/commands", handleDeviceCommands);
+  addRoute("/api/commands/trace", HTTP_GET, handleCommandTrace);
+  addRoute("/api/rules", handleRules);
+  addRoute("/api/cloud", handleCloud);
   
   // Firmware management
-  server.on("/firmware/version.txt", HTTP_GET, handleFirmwareVersion);
-  server.on("/firmware/firmware.bin", HTTP_GET, handleFirmwareUpdate);
+  addRoute("/firmware/version.txt", HTTP_GET, handleFirmwareVersion);
+  addRoute("/firmware/firmware.bin", HTTP_GET, handleFirmwareUpdate);
+  addRoute("/api/firmware/rollout", handleFirmwareRollout);
+
+#ifdef SDN_ENABLE_BENCHMARKS
+  addRoute("/api/bench", HTTP_GET, handleBenchmark);
+#endif
+
+  // Metrics
+  addRoute("/api/metrics", HTTP_GET, handleMetrics);
+  addRoute("/api/storage", handleStorage);
+  
+  // Request headers the handlers read (WebServer drops all others)
+  const char* collectedHeaders[] = {"Range", "If-Range", "X-Device-Id"};
+  server.collectHeaders(collectedHeaders, 3);
   
   // File serving
-  server.onNotFound([]() {
+  server.onNotFound(instrumentRoute("/*", []() {
     if (!handleFileRead(server.uri())) {
       server.send(404, "text/plain", "File Not Found");
     }
-  });
+  }));
 
   server.begin();
   Serial.println("=== SDN Control Plane Ready ===");
@@ -1382,8 +6038,17 @@ void setup() {
 }
 
 void loop() {
+  unsigned long loopStart = micros();
   server.handleClient();
-  checkDeviceConnectivity();
+  runLiveness();
+  dispatchPendingCommands();
+  runMaintenance();
+  runRollupCheckpoint();
+  replayHeldReadings();
+  runCloudUplink();
+  runFirmwareRollout();
+  storage.loop();
   // Add any periodic tasks here
+  metrics.loopTime.observe(micros() - loopStart);
   delay(100);
 }
@@ -7,6 +7,28 @@
 
 #include "ESP8266SDNDataPlane.h"
 
+// Signal conditioning, run in fixed point by the library (see SDNFilter.h)
+// gain, offset, outlierLimit, medianWindow, kalmanProcess, kalmanMeasurement, emaShift
+static constexpr FilterSpec TEMPERATURE_FILTER SDN_CAPABILITY_TABLE = {1.0, 0.0, 5.0, 3, 0.0, 0.0, 2};
+static constexpr FilterSpec HUMIDITY_FILTER SDN_CAPABILITY_TABLE = {1.0, 0.0, 0.0, 0, 0.05, 1.5, 0};
+
+// Sensor capabilities, declared at compile time and kept in flash
+static constexpr SensorCapability SENSORS[] SDN_CAPABILITY_TABLE = {
+  // type, dataType, unit, min, max, accuracy, sampleInterval (ms), warmupTime (ms), filter
+  {"temperature", "float", "°C", -40.0, 85.0, 0.5, 5000, 0, &TEMPERATURE_FILTER},
+  {"humidity", "float", "%", 0.0, 100.0, 2.0, 0, 250, &HUMIDITY_FILTER}, // DHT-class conversion, at the read interval
+};
+
+// Commands, queued by the library and run by executeCommand(). A set point
+// sent again before the last one ran replaces it.
+static constexpr ActuatorCapability COMMANDS[] SDN_CAPABILITY_TABLE = {
+  // command, valueType, supportedValues, responseTime (ms), flags
+  {"reset", "none", "", 500, 0},
+  {"set_temp", "float", "-40..85", 1000, SDN_COMMAND_COALESCE},
+  {"set_humidity", "float", "0..100", 1000, SDN_COMMAND_COALESCE},
+  {"calibrate", "none", "", 5000, 0},
+};
+
 // Create specialized sensor class
 class TemperatureHumiditySensor : public SDNDataPlane {
 private:
@@ -15,6 +37,29 @@ private:
   float tempTrend = 0.1;     // Temperature change trend
   float humidityTrend = 0.5; // Humidity change trend
   
+  // One driver per capability sensor, each sampled on its own schedule.
+  // Humidity mimics a DHT-class part: start() triggers a conversion that
+  // the library polls for once warmupTime has passed.
+  struct TemperatureDriver : SensorDriver {
+    TemperatureHumiditySensor& device;
+    TemperatureDriver(TemperatureHumiditySensor& device) : device(device) {}
+    bool start() override { return true; }
+    bool complete(float& value) override {
+      value = device.stepTemperature();
+      return true;
+    }
+  } temperatureDriver{*this};
+  
+  struct HumidityDriver : SensorDriver {
+    TemperatureHumiditySensor& device;
+    HumidityDriver(TemperatureHumiditySensor& device) : device(device) {}
+    bool start() override { return true; }
+    bool complete(float& value) override {
+      value = device.stepHumidity();
+      return true;
+    }
+  } humidityDriver{*this};
+  
 public:
   TemperatureHumiditySensor() : SDNDataPlane(80) {}
   
@@ -27,35 +72,21 @@ public:
     cap.firmwareVersion = "1.0.0";
     cap.hardwareVersion = "ESP8266-12E";
     
-    // Allocate sensor array
-    cap.sensorCount = 2;
-    cap.sensors = new SensorCapability[2];
+    // Reference the capability table in place
+    cap.sensors = SENSORS;
+    cap.sensorCount = sdnTableSize(SENSORS);
     
-    // Temperature sensor capability
-    cap.sensors[0].sensorType = "temperature";
-    cap.sensors[0].dataType = "float";
-    cap.sensors[0].unit = "°C";
-    cap.sensors[0].minValue = -40.0;
-    cap.sensors[0].maxValue = 85.0;
-    cap.sensors[0].accuracy = 0.5;
-    
-    // Humidity sensor capability
-    cap.sensors[1].sensorType = "humidity";
-    cap.sensors[1].dataType = "float";
-    cap.sensors[1].unit = "%";
-    cap.sensors[1].minValue = 0.0;
-    cap.sensors[1].maxValue = 100.0;
-    cap.sensors[1].accuracy = 2.0;
-    
-    // No actuators for sensor device
-    cap.actuatorCount = 0;
-    cap.actuators = nullptr;
+    // Commands of the simulation (see executeCommand())
+    cap.actuators = COMMANDS;
+    cap.actuatorCount = sdnTableSize(COMMANDS);
     
     // Default read interval
     cap.readInterval = 10; // seconds
     
-    // Set the capability
+    // Set the capability, then drive its sensors
     setCapability(cap);
+    attachDriver("temperature", &temperatureDriver);
+    attachDriver("humidity", &humidityDriver);
     
     Serial.println("Temperature & Humidity Sensor initialized");
     Serial.println("Mode: DUMMY DATA (no real sensors)");
@@ -64,32 +95,20 @@ public:
     randomSeed(analogRead(A0));
   }
   
-  // Override the virtual method collectSensorData() from base class
-  String collectSensorData() override {
-    // Generate dummy sensor values
-    generateDummyReadings();
-    
+  // Override the virtual method collectSensorData() from base class. The
+  // library samples the sensors; this adds the device's metadata.
+  size_t collectSensorData(char* buffer, size_t size) override {
     // Create sensor data response
     StaticJsonDocument<1024> data;
     data["deviceId"] = getDeviceId();
     data["deviceName"] = "Temperature & Humidity Sensor";
-    data["timestamp"] = millis();
+    char timestamp[24];
+    formatTimestamp(timestamp, sizeof(timestamp));
+    data["timestamp"] = timestamp; // Epoch ms once synced by heartbeats
     
+    // Temperature and humidity samples taken since the last payload
     JsonArray readings = data.createNestedArray("readings");
-    
-    // Temperature reading
-    JsonObject tempReading = readings.createNestedObject();
-    tempReading["type"] = "temperature";
-    tempReading["value"] = roundToDecimals(temperature, 2);
-    tempReading["unit"] = "°C";
-    tempReading["status"] = "ok";
-    
-    // Humidity reading
-    JsonObject humReading = readings.createNestedObject();
-    humReading["type"] = "humidity";
-    humReading["value"] = roundToDecimals(humidity, 1);
-    humReading["unit"] = "%";
-    humReading["status"] = "ok";
+    addSensorReadings(readings);
     
     // Add metadata
     JsonObject metadata = data.createNestedObject("metadata");
@@ -97,16 +116,15 @@ public:
     metadata["sampleTime"] = millis();
     metadata["freeHeap"] = ESP.getFreeHeap();
     
-    String response;
-    serializeJson(data, response);
-    return response;
+    if (measureJson(data) >= size) return 0;
+    return serializeJson(data, buffer, size);
   }
   
   // Override executeCommand for actuator functionality
-  bool executeCommand(String command, String value) override {
-    Serial.println("Sensor received command: " + command + " = " + value);
+  bool executeCommand(const char* command, const char* value) override {
+    Serial.printf("Sensor received command: %s = %s\n", command, value);
     
-    if (command == "reset") {
+    if (strcmp(command, "reset") == 0) {
       // Reset to default values
       temperature = 25.0;
       humidity = 50.0;
@@ -114,19 +132,19 @@ public:
       humidityTrend = 0.5;
       Serial.println("Sensor values reset to defaults");
       return true;
-    } else if (command == "set_temp") {
+    } else if (strcmp(command, "set_temp") == 0) {
       // Set temperature to specific value
-      temperature = value.toFloat();
+      temperature = atof(value);
       temperature = constrain(temperature, -40.0, 85.0);
-      Serial.println("Temperature set to: " + String(temperature, 2) + "°C");
+      Serial.printf("Temperature set to: %.2f°C\n", temperature);
       return true;
-    } else if (command == "set_humidity") {
+    } else if (strcmp(command, "set_humidity") == 0) {
       // Set humidity to specific value
-      humidity = value.toFloat();
+      humidity = atof(value);
       humidity = constrain(humidity, 0.0, 100.0);
-      Serial.println("Humidity set to: " + String(humidity, 1) + "%");
+      Serial.printf("Humidity set to: %.1f%%\n", humidity);
       return true;
-    } else if (command == "calibrate") {
+    } else if (strcmp(command, "calibrate") == 0) {
       // Dummy calibration
       Serial.println("Calibration command received (dummy implementation)");
       return true;
@@ -136,7 +154,7 @@ public:
   }
   
 private:
-  void generateDummyReadings() {
+  float stepTemperature() {
     // Simulate realistic temperature variations
     // Temperature follows a daily pattern with random variations
     
@@ -161,6 +179,11 @@ private:
     // Constrain to realistic range
     temperature = constrain(temperature, 15.0, 35.0);
     
+    Serial.printf("Dummy temperature: %.2f°C\n", temperature);
+    return temperature;
+  }
+  
+  float stepHumidity() {
     // Humidity inversely related to temperature with random variations
     float targetHumidity = 80.0 - (temperature - 15.0) * 2.0;
     
@@ -178,15 +201,8 @@ private:
     // Constrain to valid range
     humidity = constrain(humidity, 20.0, 90.0);
     
-    Serial.println("Dummy Sensor Readings:");
-    Serial.println("  Temperature: " + String(temperature, 2) + "°C");
-    Serial.println("  Humidity: " + String(humidity, 1) + "%");
-    Serial.println("  Free Heap: " + String(ESP.getFreeHeap()) + " bytes");
-  }
-  
-  float roundToDecimals(float value, int decimals) {
-    float multiplier = pow(10.0, decimals);
-    return round(value * multiplier) / multiplier;
+    Serial.printf("Dummy humidity: %.1f%%\n", humidity);
+    return humidity;
   }
 };
 
@@ -194,23 +210,22 @@ private:
 TemperatureHumiditySensor sensor;
 
 // Callback functions (optional)
-void onCommandReceived(Command cmd) {
-  Serial.println("Command callback: " + cmd.command + " = " + cmd.value);
+void onCommandReceived(const Command& cmd) {
+  Serial.printf("Command callback: %s = %s\n", cmd.command, cmd.value);
 }
 
-void onStatusChanged(String status) {
-  Serial.println("Status changed: " + status);
+void onStatusChanged(const char* status) {
+  Serial.printf("Status changed: %s\n", status);
 }
 
-bool onSensorRead(String sensorType, float& value, String& unit) {
-  // This callback can be used for custom sensor reading logic
-  // Return false to use default implementation
+bool onSensorRead(const char* sensorType, float& value, const char*& unit) {
+  // Called on the schedule of sensors without a driver (none here);
+  // return false when there is no value for sensorType
   return false;
 }
 
 void setup() {
   Serial.begin(115200);
-  delay(1000); // Wait for serial to initialize
   
   Serial.println("\n=== Temperature & Humidity Sensor Starting ===");
   Serial.println("=== ESP8266 Version ===");
@@ -222,12 +237,17 @@ void setup() {
   // Set callbacks (optional)
   sensor.setCallbacks(onCommandReceived, onStatusChanged, onSensorRead);
   
+#ifdef SDN_ENABLE_BENCHMARKS
+  // Hot path micro-benchmarks, one NDJSON line per case on Serial
+  sensor.runBenchmarks(Serial);
+#endif
+  
   // Start SDN Data Plane
   sensor.begin();
   
   Serial.println("\nSensor ready!");
   Serial.println("Initial Mode: AP (waiting for Control Plane discovery)");
-  Serial.println("Device ID: " + sensor.getDeviceId());
+  Serial.printf("Device ID: %s\n", sensor.getDeviceId());
   Serial.println("Free Heap: " + String(ESP.getFreeHeap()) + " bytes");
   Serial.println("\nDummy data will be generated with realistic patterns:");
   Serial.println("- Temperature follows daily cycle (cooler at night)");
@@ -264,6 +284,10 @@ void loop() {
  * - Humidity: 20-90% range, inversely related to temperature
  * - Realistic variations and noise
  * - Gradual changes (no sudden jumps)
+ * - Temperature sampled every 5 s, humidity at the read interval after a
+ *   250 ms conversion; a payload carries the samples taken since the previous one
+ * - Temperature drops 5°C spikes, then takes a 3-sample median and an EMA;
+ *   humidity goes through a Kalman filter
  * 
  * COMMANDS SUPPORTED:
  * - reset: Reset to default values (25°C, 50%)
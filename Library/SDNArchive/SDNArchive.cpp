@@ -0,0 +1,326 @@
+/*
+ * SDN Archive Library Implementation
+ * Delta-of-delta timestamps and Gorilla XOR floats, one series per block
+ */
+
+#include "SDNArchive.h"
+
+// Worst case bits of one point: 4 + 32 timestamp, 2 + 5 + 5 + 32 value
+#define POINT_MAX_BITS 80
+#define NO_WINDOW 0xFF
+
+static void writeU16(Print& out, uint16_t value) {
+    uint8_t bytes[2] = {(uint8_t)value, (uint8_t)(value >> 8)};
+    out.write(bytes, sizeof(bytes));
+}
+
+static void writeU32(Print& out, uint32_t value) {
+    uint8_t bytes[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+    out.write(bytes, sizeof(bytes));
+}
+
+static bool readBytes(File& file, uint8_t* buffer, size_t length) {
+    return file.read(buffer, length) == length;
+}
+
+static uint16_t toU16(const uint8_t* bytes) {
+    return bytes[0] | (bytes[1] << 8);
+}
+
+static uint32_t toU32(const uint8_t* bytes) {
+    return bytes[0] | (bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+// ==================== BIT STREAMS ====================
+
+BitWriter::BitWriter(uint8_t* buffer, size_t capacity) : buffer(buffer), capacity(capacity), bits(0) {
+}
+
+void BitWriter::reset() {
+    memset(buffer, 0, capacity);
+    bits = 0;
+}
+
+void BitWriter::write(uint32_t value, uint8_t count) {
+    for (int i = count - 1; i >= 0; i--) {
+        if ((value >> i) & 1) {
+            buffer[bits >> 3] |= 0x80 >> (bits & 7);
+        }
+        bits++;
+    }
+}
+
+BitReader::BitReader(const uint8_t* buffer, size_t length) : buffer(buffer), length(length), position(0) {
+}
+
+uint32_t BitReader::read(uint8_t count) {
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        value <<= 1;
+        if (position < length * 8 && (buffer[position >> 3] & (0x80 >> (position & 7)))) {
+            value |= 1;
+        }
+        position++;
+    }
+    return value;
+}
+
+// ==================== ENCODER ====================
+
+SeriesEncoder::SeriesEncoder() : bits(payload, sizeof(payload)) {
+    begin(0);
+}
+
+void SeriesEncoder::begin(uint16_t seriesId) {
+    header.seriesId = seriesId;
+    header.count = 0;
+    header.minTime = 0;
+    header.maxTime = 0;
+    header.length = 0;
+    bits.reset();
+}
+
+bool SeriesEncoder::append(uint32_t timestamp, float value) {
+    if (header.count >= SDN_ARCHIVE_MAX_POINTS || bits.remainingBits() < POINT_MAX_BITS) {
+        return false;
+    }
+
+    uint32_t valueBits;
+    memcpy(&valueBits, &value, sizeof(valueBits));
+
+    if (header.count == 0) {
+        bits.write(timestamp, 32);
+        bits.write(valueBits, 32);
+        header.minTime = timestamp;
+        header.maxTime = timestamp;
+        previousDelta = 0;
+        previousLeading = NO_WINDOW;
+        previousTrailing = 0;
+    } else {
+        writeTimestamp(timestamp);
+        writeValue(valueBits);
+        if (timestamp < header.minTime) header.minTime = timestamp;
+        if (timestamp > header.maxTime) header.maxTime = timestamp;
+    }
+
+    previousTime = timestamp;
+    previousValue = valueBits;
+    header.count++;
+    return true;
+}
+
+// Delta-of-delta of epoch seconds: a steady interval costs 1 bit, a point a
+// minute early or late 9 bits, a gap of up to half an hour 16 bits
+void SeriesEncoder::writeTimestamp(uint32_t timestamp) {
+    int32_t delta = (int32_t)(timestamp - previousTime);
+    int32_t deltaOfDelta = delta - previousDelta;
+    previousDelta = delta;
+
+    if (deltaOfDelta == 0) {
+        bits.write(0, 1);
+    } else if (deltaOfDelta >= -63 && deltaOfDelta <= 64) {
+        bits.write(0b10, 2);
+        bits.write(deltaOfDelta + 63, 7);
+    } else if (deltaOfDelta >= -255 && deltaOfDelta <= 256) {
+        bits.write(0b110, 3);
+        bits.write(deltaOfDelta + 255, 9);
+    } else if (deltaOfDelta >= -2047 && deltaOfDelta <= 2048) {
+        bits.write(0b1110, 4);
+        bits.write(deltaOfDelta + 2047, 12);
+    } else {
+        bits.write(0b1111, 4);
+        bits.write((uint32_t)deltaOfDelta, 32);
+    }
+}
+
+// Gorilla XOR: identical values cost 1 bit; otherwise only the meaningful
+// bits are stored, reusing the previous leading/trailing window if it fits
+void SeriesEncoder::writeValue(uint32_t value) {
+    uint32_t xored = value ^ previousValue;
+    if (xored == 0) {
+        bits.write(0, 1);
+        return;
+    }
+    bits.write(1, 1);
+
+    uint8_t leading = __builtin_clz(xored);
+    uint8_t trailing = __builtin_ctz(xored);
+    if (leading > 31) leading = 31;
+
+    if (previousLeading != NO_WINDOW && leading >= previousLeading && trailing >= previousTrailing) {
+        bits.write(0, 1);
+        bits.write(xored >> previousTrailing, 32 - previousLeading - previousTrailing);
+    } else {
+        uint8_t meaningful = 32 - leading - trailing;
+        bits.write(1, 1);
+        bits.write(leading, 5);
+        bits.write(meaningful - 1, 5);
+        bits.write(xored >> trailing, meaningful);
+        previousLeading = leading;
+        previousTrailing = trailing;
+    }
+}
+
+size_t SeriesEncoder::writeTo(Print& out) {
+    if (empty()) return 0;
+
+    header.length = bits.byteLength();
+    out.write((uint8_t)'B');
+    writeU16(out, header.seriesId);
+    writeU16(out, header.count);
+    writeU32(out, header.minTime);
+    writeU32(out, header.maxTime);
+    writeU16(out, header.length);
+    out.write(payload, header.length);
+
+    size_t written = 15 + header.length;
+    begin(header.seriesId);
+    return written;
+}
+
+// ==================== WRITER ====================
+
+ArchiveWriter::ArchiveWriter(Print& out) : out(out) {
+}
+
+size_t ArchiveWriter::begin() {
+    return out.write((const uint8_t*)SDN_ARCHIVE_MAGIC, 4);
+}
+
+size_t ArchiveWriter::defineSeries(uint16_t id, const char* deviceId, const char* sensorType, const char* unit) {
+    out.write((uint8_t)'S');
+    writeU16(out, id);
+    size_t written = 3;
+    const char* fields[] = {deviceId, sensorType, unit};
+    for (const char* field : fields) {
+        size_t length = strlen(field);
+        out.write((const uint8_t*)field, length + 1);
+        written += length + 1;
+    }
+    return written;
+}
+
+size_t ArchiveWriter::writeBlock(SeriesEncoder& encoder) {
+    return encoder.writeTo(out);
+}
+
+// ==================== READER ====================
+
+ArchiveReader::ArchiveReader(File& file) : blocksDecoded(0), blocksSkipped(0), file(file) {
+}
+
+bool ArchiveReader::begin() {
+    uint8_t magic[4];
+    return readBytes(file, magic, sizeof(magic)) && memcmp(magic, SDN_ARCHIVE_MAGIC, 4) == 0;
+}
+
+static void readString(File& file, char* buffer, size_t size) {
+    size_t length = 0;
+    int c;
+    while ((c = file.read()) > 0) {
+        if (length + 1 < size) buffer[length++] = c;
+    }
+    buffer[length] = '\0';
+}
+
+// Ids are handed out in order, so a new id is the next one; anything
+// further is corrupt and fails the read before it can size the dictionary
+bool ArchiveReader::readSeries() {
+    uint8_t bytes[2];
+    if (!readBytes(file, bytes, sizeof(bytes))) return false;
+    uint16_t id = toU16(bytes);
+    if (id > series.size()) return false;
+
+    ArchiveSeries entry;
+    readString(file, entry.deviceId, sizeof(entry.deviceId));
+    readString(file, entry.sensorType, sizeof(entry.sensorType));
+    readString(file, entry.unit, sizeof(entry.unit));
+
+    if (id == series.size()) {
+        series.push_back(entry);
+    } else {
+        series[id] = entry;
+    }
+    return true;
+}
+
+bool ArchiveReader::readHeader(ArchiveBlockHeader& header) {
+    uint8_t bytes[14];
+    if (!readBytes(file, bytes, sizeof(bytes))) return false;
+    header.seriesId = toU16(bytes);
+    header.count = toU16(bytes + 2);
+    header.minTime = toU32(bytes + 4);
+    header.maxTime = toU32(bytes + 8);
+    header.length = toU16(bytes + 12);
+    return header.length <= SDN_ARCHIVE_BLOCK_BYTES && header.seriesId < series.size();
+}
+
+bool ArchiveReader::decodeBlock(const ArchiveBlockHeader& header, uint32_t from, uint32_t to, ArchiveVisitor& visit) {
+    if (!readBytes(file, payload, header.length)) return false;
+    blocksDecoded++;
+
+    const ArchiveSeries& key = series[header.seriesId];
+    BitReader bits(payload, header.length);
+    uint32_t timestamp = bits.read(32);
+    uint32_t value = bits.read(32);
+    int32_t delta = 0;
+    uint8_t leading = 0;
+    uint8_t trailing = 0;
+
+    for (uint16_t i = 0; i < header.count; i++) {
+        if (i > 0) {
+            int32_t deltaOfDelta;
+            if (bits.read(1) == 0) {
+                deltaOfDelta = 0;
+            } else if (bits.read(1) == 0) {
+                deltaOfDelta = (int32_t)bits.read(7) - 63;
+            } else if (bits.read(1) == 0) {
+                deltaOfDelta = (int32_t)bits.read(9) - 255;
+            } else if (bits.read(1) == 0) {
+                deltaOfDelta = (int32_t)bits.read(12) - 2047;
+            } else {
+                deltaOfDelta = (int32_t)bits.read(32);
+            }
+            delta += deltaOfDelta;
+            timestamp += delta;
+
+            if (bits.read(1) == 1) {
+                if (bits.read(1) == 1) {
+                    leading = bits.read(5);
+                    uint8_t meaningful = bits.read(5) + 1;
+                    trailing = 32 - leading - meaningful;
+                }
+                value ^= bits.read(32 - leading - trailing) << trailing;
+            }
+        }
+
+        if (timestamp < from || timestamp > to) continue;
+        float decoded;
+        memcpy(&decoded, &value, sizeof(decoded));
+        if (!visit(key, timestamp, decoded)) return false;
+    }
+    return true;
+}
+
+void ArchiveReader::read(uint32_t from, uint32_t to, const char* deviceId, ArchiveVisitor visit) {
+    int type;
+    while ((type = file.read()) >= 0) {
+        if (type == 'S') {
+            if (!readSeries()) return;
+        } else if (type == 'B') {
+            ArchiveBlockHeader header;
+            if (!readHeader(header)) return;
+
+            bool wanted = header.maxTime >= from && header.minTime <= to &&
+                          (!deviceId || strcmp(series[header.seriesId].deviceId, deviceId) == 0);
+            if (!wanted) {
+                blocksSkipped++;
+                file.seek(file.position() + header.length);
+                continue;
+            }
+            if (!decodeBlock(header, from, to, visit)) return;
+        } else {
+            return; // Corrupt or truncated
+        }
+    }
+}
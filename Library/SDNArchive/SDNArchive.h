@@ -0,0 +1,139 @@
+/*
+ * SDN Archive Library
+ * Compressed columnar block format for closed sensor history
+ *
+ * File layout (little-endian):
+ *   "SDB1"
+ *   'S' u16 id, deviceId\0, sensorType\0, unit\0     series dictionary entry
+ *   'B' u16 seriesId, u16 count, u32 minTime, u32 maxTime, u16 length,
+ *       <length payload bytes>                         block of one series
+ *
+ * A series is defined before its first block. Ids are handed out from 0 in
+ * order; an id defined again applies to the blocks that follow it, so an
+ * archive extended with later points restarts its new series at 0. Block
+ * payloads are a bit stream: the first timestamp and value raw (32 bits
+ * each), then per point a delta-of-delta timestamp and a Gorilla
+ * XOR-encoded float.
+ * Readers skip blocks by header (time range, series) without decoding.
+ */
+
+#ifndef SDN_ARCHIVE_H
+#define SDN_ARCHIVE_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include <functional>
+#include <vector>
+
+#define SDN_ARCHIVE_MAGIC "SDB1"
+#define SDN_ARCHIVE_BLOCK_BYTES 512   // Payload size limit of one block
+#define SDN_ARCHIVE_MAX_POINTS 1024   // Point limit of one block
+
+struct ArchiveSeries {
+    char deviceId[24];
+    char sensorType[16];
+    char unit[12];
+};
+
+struct ArchiveBlockHeader {
+    uint16_t seriesId;
+    uint16_t count;
+    uint32_t minTime;
+    uint32_t maxTime;
+    uint16_t length;
+};
+
+// Return false to stop reading
+typedef std::function<bool(const ArchiveSeries& series, uint32_t timestamp, float value)> ArchiveVisitor;
+
+// MSB-first bit packing into a caller-owned buffer
+class BitWriter {
+public:
+    BitWriter(uint8_t* buffer, size_t capacity);
+    void reset();
+    void write(uint32_t value, uint8_t bits);
+    size_t bitLength() const { return bits; }
+    size_t byteLength() const { return (bits + 7) / 8; }
+    size_t remainingBits() const { return capacity * 8 - bits; }
+
+private:
+    uint8_t* buffer;
+    size_t capacity;
+    size_t bits;
+};
+
+class BitReader {
+public:
+    BitReader(const uint8_t* buffer, size_t length);
+    uint32_t read(uint8_t bits);
+    bool exhausted() const { return position >= length * 8; }
+
+private:
+    const uint8_t* buffer;
+    size_t length;
+    size_t position;
+};
+
+// Encodes the points of one series into a block
+class SeriesEncoder {
+public:
+    SeriesEncoder();
+    SeriesEncoder(const SeriesEncoder&) = delete; // bits points into payload
+    SeriesEncoder& operator=(const SeriesEncoder&) = delete;
+    void begin(uint16_t seriesId);
+
+    // Returns false once the block is full; write it and begin again
+    bool append(uint32_t timestamp, float value);
+    bool empty() const { return header.count == 0; }
+
+    // Writes the block record and starts a new block for the same series
+    size_t writeTo(Print& out);
+
+private:
+    ArchiveBlockHeader header;
+    uint8_t payload[SDN_ARCHIVE_BLOCK_BYTES];
+    BitWriter bits;
+    uint32_t previousTime;
+    int32_t previousDelta;
+    uint32_t previousValue;
+    uint8_t previousLeading;
+    uint8_t previousTrailing;
+
+    void writeTimestamp(uint32_t timestamp);
+    void writeValue(uint32_t value);
+};
+
+class ArchiveWriter {
+public:
+    ArchiveWriter(Print& out);
+    size_t begin();
+    size_t defineSeries(uint16_t id, const char* deviceId, const char* sensorType, const char* unit);
+    size_t writeBlock(SeriesEncoder& encoder);
+
+private:
+    Print& out;
+};
+
+class ArchiveReader {
+public:
+    ArchiveReader(File& file);
+    bool begin();
+
+    // Decodes the points in [from, to], optionally of one device only, in
+    // file order. Blocks outside the range or for other devices are skipped.
+    void read(uint32_t from, uint32_t to, const char* deviceId, ArchiveVisitor visit);
+
+    size_t blocksDecoded;
+    size_t blocksSkipped;
+
+private:
+    File& file;
+    std::vector<ArchiveSeries> series;
+    uint8_t payload[SDN_ARCHIVE_BLOCK_BYTES];
+
+    bool readSeries();
+    bool readHeader(ArchiveBlockHeader& header);
+    bool decodeBlock(const ArchiveBlockHeader& header, uint32_t from, uint32_t to, ArchiveVisitor& visit);
+};
+
+#endif
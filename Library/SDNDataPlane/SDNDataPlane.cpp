@@ -5,6 +5,20 @@
  */
 
 #include "SDNDataPlane.h"
+#include <algorithm>
+#include <stddef.h>
+
+// CRC-32 (IEEE) of the fast boot record and of registration payloads
+static uint32_t fastBootCrc(const uint8_t* data, size_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
 
 SDNDataPlane::SDNDataPlane(int port) {
     server = new WebServer(port);
@@ -14,9 +28,51 @@ SDNDataPlane::SDNDataPlane(int port) {
     heartbeatInterval = 30000; // 30 seconds default
     lastDataSend = 0;
     lastHeartbeat = 0;
+    dataUrl[0] = '\0';
+    heartbeatUrl[0] = '\0';
+    registerUrl[0] = '\0';
+    versionUrl[0] = '\0';
+    firmwareUrl[0] = '\0';
+    otaDownloading = false;
+    otaCheckDue = false;
+    nextOtaCheck = SDN_OTA_CHECK_INTERVAL;
+    otaRetryAt = 0;
+    otaSize = 0;
+    otaWritten = 0;
+    otaFailures = 0;
+    otaEtag[0] = '\0';
+    sequence = 0;
+    sequenceCeiling = 0;
+    sequenceRestarted = true;
+    memset(&fastBoot, 0, sizeof(fastBoot)); // Padding is covered by the CRC
+    fastBootSavedCrc = 0;
+    fastConnect = false;
+    connectStartedAt = 0;
+    clockSampleNext = 0;
+    clockSampleCount = 0;
+    clockValid = false;
+    clockOffset = 0;
+    clockOffsetAt = 0;
+    clockError = 0;
+    clockDriftPpm = 0;
+    driftBaseOffset = 0;
+    driftBaseAt = 0;
+    postDoneAt = 0;
+    heapMinFree = ESP.getFreeHeap();
+    heapFragmentation = 0;
+    heapFragmentationPeak = 0;
+    heapFragmentationEvents = 0;
+    memset(stageNext, 0, sizeof(stageNext));
+    memset(stageCount, 0, sizeof(stageCount));
+    stageLap = 0;
+    http.setReuse(true); // Keep the Control Plane connection alive between posts
     onCommandReceived = nullptr;
     onStatusChanged = nullptr;
     onSensorRead = nullptr;
+    memset(sensorSlots, 0, sizeof(sensorSlots));
+    memset(commandQueue, 0, sizeof(commandQueue));
+    memset(recentCommands, 0, sizeof(recentCommands));
+    recentNext = 0;
 }
 
 SDNDataPlane::~SDNDataPlane() {
@@ -25,11 +81,11 @@ SDNDataPlane::~SDNDataPlane() {
 
 void SDNDataPlane::begin() {
     Serial.begin(115200);
-    Serial.println("SDN Data Plane Starting...");
+    SDN_LOG("SDN Data Plane Starting...");
     
     // Initialize SPIFFS
     if (!SPIFFS.begin(true)) {
-        Serial.println("SPIFFS initialization failed");
+        SDN_LOG("SPIFFS initialization failed");
         currentState = ERROR_STATE;
         return;
     }
@@ -37,15 +93,21 @@ void SDNDataPlane::begin() {
     // Generate device ID
     capability.deviceId = generateDeviceId();
     
-    // Load configuration
-    loadConfig();
+    // Load configuration: the binary record, or /config.json when it is
+    // missing or stale (first boot after an update), which then seeds it
+    if (!loadFastBoot() && loadConfig() && config.configured) {
+        recordConfig();
+        saveFastBoot();
+    }
+    loadSequence();
+    buildDeviceInfo(infoPayload);
     
     // Start in appropriate mode
     if (config.configured) {
-        Serial.println("Configuration found, starting in operational mode");
+        SDN_LOG("Configuration found, starting in operational mode");
         startSTAMode();
     } else {
-        Serial.println("No configuration found, starting in discovery mode");
+        SDN_LOG("No configuration found, starting in discovery mode");
         startAPMode();
     }
 }
@@ -71,7 +133,12 @@ void SDNDataPlane::loop() {
 
 void SDNDataPlane::setCapability(DeviceCapability cap) {
     capability = cap;
+    memset(sensorSlots, 0, sizeof(sensorSlots)); // Drivers are attached to entries of the old table
+    for (int i = 0; i < capability.sensorCount && i < SDN_MAX_SENSORS; i++) {
+        sensorSlots[i].filter.begin(capability.sensors[i].filter);
+    }
     capability.deviceId = generateDeviceId();
+    buildDeviceInfo(infoPayload);
 }
 
 void SDNDataPlane::setCallbacks(CommandCallback cmdCallback, StatusCallback statusCallback, SensorReadCallback sensorCallback) {
@@ -80,8 +147,20 @@ void SDNDataPlane::setCallbacks(CommandCallback cmdCallback, StatusCallback stat
     onSensorRead = sensorCallback;
 }
 
-String SDNDataPlane::getDeviceId() {
-    return capability.deviceId;
+bool SDNDataPlane::attachDriver(const char* sensorType, SensorDriver* driver) {
+    for (int i = 0; i < capability.sensorCount && i < SDN_MAX_SENSORS; i++) {
+        if (strcmp(capability.sensors[i].sensorType, sensorType) == 0) {
+            sensorSlots[i].driver = driver;
+            sensorSlots[i].state = SAMPLE_IDLE;
+            sensorSlots[i].scheduled = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* SDNDataPlane::getDeviceId() {
+    return capability.deviceId.c_str();
 }
 
 SDNDataPlane::DeviceState SDNDataPlane::getState() {
@@ -106,12 +185,12 @@ void SDNDataPlane::startAPMode() {
     String apName = "ESP32_Device_" + String(macStr).substring(6); // Use last 6 chars of MAC
     String apPassword = "12345678";
     
-    Serial.println("Starting AP Mode: " + apName);
+    SDN_LOGF("Starting AP Mode: %s\n", apName.c_str());
     
     WiFi.mode(WIFI_AP);
     WiFi.softAP(apName.c_str(), apPassword.c_str());
     
-    Serial.println("AP IP: " + WiFi.softAPIP().toString());
+    SDN_LOGF("AP IP: %s\n", WiFi.softAPIP().toString().c_str());
     
     setupDiscoveryEndpoints();
     server->begin();
@@ -121,17 +200,29 @@ void SDNDataPlane::startAPMode() {
 }
 
 void SDNDataPlane::startSTAMode() {
-    Serial.println("Starting STA Mode...");
+    SDN_LOG("Starting STA Mode...");
     
+    WiFi.persistent(false); // The record has the credentials; no SDK flash writes per join
     WiFi.mode(WIFI_STA);
-    WiFi.begin(config.wifiSSID.c_str(), config.wifiPassword.c_str());
+    
+    // Rejoin the last access point on its channel with the last address:
+    // no scan and no DHCP. handleConfiguring() falls back to both.
+    fastConnect = config.configured && fastBoot.channel != 0 && fastBoot.localIP != 0;
+    if (fastConnect) {
+        WiFi.config(IPAddress(fastBoot.localIP), IPAddress(fastBoot.gateway), IPAddress(fastBoot.subnet),
+                    IPAddress(fastBoot.dns));
+        WiFi.begin(config.wifiSSID.c_str(), config.wifiPassword.c_str(), fastBoot.channel, fastBoot.bssid);
+    } else {
+        WiFi.begin(config.wifiSSID.c_str(), config.wifiPassword.c_str());
+    }
+    connectStartedAt = millis();
     
     currentState = CONFIGURING;
     notifyStatusChange("connecting");
 }
 
 void SDNDataPlane::switchToSTAMode() {
-    Serial.println("Switching from AP to STA mode...");
+    SDN_LOG("Switching from AP to STA mode...");
     
     // Stop AP mode
     WiFi.softAPdisconnect(true);
@@ -161,8 +252,8 @@ void SDNDataPlane::setupOperationalEndpoints() {
     // Data endpoint for Control Plane to get sensor data
     server->on("/api/data", HTTP_GET, [this]() {
         if (capability.deviceType == "sensor") {
-            String sensorData = collectSensorData();
-            server->send(200, "application/json", sensorData);
+            size_t length = collectPayload();
+            server->send_P(200, "application/json", payloadBuffer, length);
         } else {
             server->send(400, "application/json", "{\"error\":\"Not a sensor device\"}");
         }
@@ -177,6 +268,12 @@ void SDNDataPlane::setupOperationalEndpoints() {
     server->on("/api/status", HTTP_GET, [this]() {
         handleStatus();
     });
+    
+    // Firmware rollout: look for new firmware on the next loop pass
+    server->on("/api/ota", HTTP_POST, [this]() {
+        otaCheckDue = true;
+        server->send(202, "application/json", "{\"success\":true}");
+    });
 }
 
 void SDNDataPlane::handleDiscoveryMode() {
@@ -186,49 +283,88 @@ void SDNDataPlane::handleDiscoveryMode() {
 
 void SDNDataPlane::handleConfiguring() {
     // Check WiFi connection
-    if (WiFi.status() == WL_CONNECTED) {
-        Serial.println("Connected to WiFi: " + WiFi.localIP().toString());
+    wl_status_t status = WiFi.status();
+    if (status == WL_CONNECTED) {
+        SDN_LOGF("Connected to WiFi: %s\n", WiFi.localIP().toString().c_str());
         
         // Setup operational endpoints
         setupOperationalEndpoints();
         server->begin();
         
-        // Register with Control Plane
-        registerWithControlPlane();
+        // Register with Control Plane, unless it already has this exact
+        // registration (a fast boot that kept its address)
+        buildRegistrationPayload();
+        if (fastBootCrc((const uint8_t*)registrationPayload.c_str(), registrationPayload.length()) !=
+            fastBoot.registrationCrc) {
+            registerWithControlPlane();
+        }
+        recordAssociation();
+        saveFastBoot();
         
         currentState = OPERATIONAL;
+        lastDataSend = millis() - dataInterval - 1; // First reading on the next pass
         notifyStatusChange("operational");
         
-        Serial.println("Device is now operational");
-    } else if (WiFi.status() == WL_CONNECT_FAILED) {
-        Serial.println("WiFi connection failed, reverting to AP mode");
+        SDN_LOG("Device is now operational");
+    } else if (fastConnect && (status == WL_CONNECT_FAILED || status == WL_NO_SSID_AVAIL ||
+                               millis() - connectStartedAt > SDN_FASTBOOT_TIMEOUT_MS)) {
+        // The access point moved or the address is gone: scan and use DHCP
+        SDN_LOG("Fast connect failed, scanning");
+        fastConnect = false;
+        fastBoot.channel = 0;
+        WiFi.disconnect();
+        WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+        WiFi.begin(config.wifiSSID.c_str(), config.wifiPassword.c_str());
+        connectStartedAt = millis();
+    } else if (status == WL_CONNECT_FAILED) {
+        SDN_LOG("WiFi connection failed, reverting to AP mode");
         config.configured = false;
         startAPMode();
     }
     
-    delay(500);
+    delay(SDN_CONNECT_POLL_MS);
 }
 
 void SDNDataPlane::handleOperational() {
     unsigned long now = millis();
+    uint32_t cycleStart = ESP.getCycleCount();
+    bool sent = false;
     
-    // Send sensor data periodically
-    if (capability.deviceType == "sensor" && now - lastDataSend > dataInterval) {
-        sendSensorData();
-        lastDataSend = now;
+    // Sample on each sensor's schedule, send periodically. Past the
+    // interval the payload waits for a sensor to have a new sample.
+    if (capability.deviceType == "sensor") {
+        pollSensors();
+        if (now - lastDataSend > dataInterval && sensorDataReady()) {
+            sendSensorData();
+            lastDataSend = now;
+            sampleHeap();
+            sent = true;
+        }
     }
     
-    // Send heartbeat
-    if (now - lastHeartbeat > heartbeatInterval) {
+    // Send heartbeat, soon after a command outcome is ready to ride on it
+    unsigned long heartbeatDue = commandResultsPending() ? SDN_COMMAND_REPORT_MS : heartbeatInterval;
+    if (now - lastHeartbeat > heartbeatDue) {
         sendHeartbeat();
         lastHeartbeat = now;
+        sampleHeap();
+        sent = true;
     }
     
-    delay(100);
+    if (sent) {
+        recordStage(STAGE_CYCLE, cycleStart);
+    }
+    
+    handleOta();
+    
+    // No pause while commands wait, so a burst drains at loop speed
+    if (!runCommands()) {
+        delay(100);
+    }
 }
 
 void SDNDataPlane::handleErrorState() {
-    Serial.println("Device in error state, attempting recovery...");
+    SDN_LOG("Device in error state, attempting recovery...");
     delay(5000);
     
     // Attempt to recover
@@ -240,6 +376,10 @@ void SDNDataPlane::handleErrorState() {
 }
 
 void SDNDataPlane::handleDeviceInfo() {
+    server->send(200, "application/json", infoPayload);
+}
+
+void SDNDataPlane::buildDeviceInfo(String& response) {
     StaticJsonDocument<1024> info;
     
     info["deviceId"] = capability.deviceId;
@@ -261,9 +401,16 @@ void SDNDataPlane::handleDeviceInfo() {
             sensor["minValue"] = capability.sensors[i].minValue;
             sensor["maxValue"] = capability.sensors[i].maxValue;
             sensor["accuracy"] = capability.sensors[i].accuracy;
+            if (capability.sensors[i].sampleInterval > 0) {
+                sensor["sampleInterval"] = capability.sensors[i].sampleInterval;
+            }
         }
-    } else if (capability.deviceType == "actuator") {
-        JsonArray actuators = info.createNestedArray("capability");
+    }
+    
+    // What handleCommand() accepts: the capability of an actuator device,
+    // or "actuators" beside the sensors of a sensor device
+    if (capability.deviceType == "actuator" || capability.actuatorCount > 0) {
+        JsonArray actuators = info.createNestedArray(capability.deviceType == "sensor" ? "actuators" : "capability");
         for (int i = 0; i < capability.actuatorCount; i++) {
             JsonObject actuator = actuators.createNestedObject();
             actuator["command"] = capability.actuators[i].command;
@@ -273,9 +420,9 @@ void SDNDataPlane::handleDeviceInfo() {
         }
     }
     
-    String response;
+    response = "";
+    response.reserve(measureJson(info));
     serializeJson(info, response);
-    server->send(200, "application/json", response);
 }
 
 void SDNDataPlane::handleConfiguration() {
@@ -302,8 +449,12 @@ void SDNDataPlane::handleConfiguration() {
     capability.deviceName = config.deviceName;
     capability.deviceType = config.deviceType;
     capability.readInterval = config.readInterval;
+    formatEndpoints();
+    buildDeviceInfo(infoPayload);
     
-    // Save to SPIFFS
+    // Save to SPIFFS, and to the fast boot record
+    recordConfig();
+    saveFastBoot();
     if (saveConfig()) {
         server->send(200, "application/json", "{\"success\":true,\"message\":\"Configuration saved\"}");
         
@@ -315,12 +466,18 @@ void SDNDataPlane::handleConfiguration() {
     }
 }
 
+// Queues the command and acks at once; runCommands() executes it. A
+// command flagged SDN_COMMAND_COALESCE replaces a queued one of the same
+// name, which is reported "superseded", and keeps the earlier deadline. A
+// command id seen before is acked again, with its outcome if it ran.
 void SDNDataPlane::handleCommand() {
-    if (capability.deviceType != "actuator") {
+    if (capability.deviceType != "actuator" && capability.actuatorCount == 0) {
         server->send(400, "application/json", "{\"error\":\"Not an actuator device\"}");
         return;
     }
     
+    uint32_t commandStart = ESP.getCycleCount();
+    unsigned long receivedAt = micros();
     String body = server->arg("plain");
     StaticJsonDocument<256> commandData;
     
@@ -330,35 +487,197 @@ void SDNDataPlane::handleCommand() {
         return;
     }
     
-    Command cmd;
-    cmd.id = commandData["id"].as<String>();
-    cmd.command = commandData["command"].as<String>();
-    cmd.value = commandData["value"].as<String>();
-    cmd.timestamp = commandData["timestamp"].as<String>();
+    const char* id = commandData["id"] | "";
+    RecentCommand* recent = id[0] != '\0' ? findRecentCommand(id) : nullptr;
+    if (recent) {
+        StaticJsonDocument<128> ack;
+        ack["success"] = !recent->outcome || strcmp(recent->outcome, "failed") != 0;
+        ack["id"] = id;
+        ack["duplicate"] = true;
+        if (recent->outcome) {
+            ack["status"] = recent->outcome;
+        } else {
+            ack["queued"] = true;
+        }
+        char response[128];
+        serializeJson(ack, response, sizeof(response));
+        server->send(recent->outcome ? 200 : 202, "application/json", response);
+        return;
+    }
+    
+    QueuedCommand* queued = nullptr;
+    for (QueuedCommand& slot : commandQueue) {
+        if (slot.state == COMMAND_FREE) {
+            queued = &slot;
+            break;
+        }
+    }
+    if (!queued) {
+        server->send(503, "application/json", "{\"success\":false,\"message\":\"Command queue full\"}");
+        return;
+    }
+    
+    RecentCommand& entry = recentCommands[recentNext];
+    recentNext = (recentNext + 1) % SDN_COMMAND_RECENT;
+    strlcpy(entry.id, id, sizeof(entry.id));
+    entry.outcome = nullptr;
+    
+    Command& cmd = queued->cmd;
+    strlcpy(cmd.id, id, sizeof(cmd.id));
+    strlcpy(cmd.command, commandData["command"] | "", sizeof(cmd.command));
+    strlcpy(cmd.value, commandData["value"] | "", sizeof(cmd.value));
+    strlcpy(cmd.timestamp, commandData["timestamp"] | "", sizeof(cmd.timestamp));
     
-    // Execute command
-    bool success = executeCommand(cmd.command, cmd.value);
+    unsigned long responseTime = SDN_COMMAND_DEADLINE_MS;
+    queued->coalesce = false;
+    for (int i = 0; i < capability.actuatorCount; i++) {
+        if (strcmp(capability.actuators[i].command, cmd.command) == 0) {
+            if (capability.actuators[i].responseTime > 0) responseTime = capability.actuators[i].responseTime;
+            queued->coalesce = capability.actuators[i].flags & SDN_COMMAND_COALESCE;
+            break;
+        }
+    }
+    queued->priority = constrain(commandData["priority"] | SDN_COMMAND_PRIORITY, 0, 255);
+    queued->deadline = millis() + responseTime;
+    queued->receivedAt = receivedAt;
+    queued->attempts = 0;
+    queued->late = false;
+    
+    const char* superseded = nullptr;
+    if (queued->coalesce) {
+        for (QueuedCommand& slot : commandQueue) {
+            if (&slot == queued || slot.state != COMMAND_QUEUED || strcmp(slot.cmd.command, cmd.command) != 0) continue;
+            if ((long)(slot.deadline - queued->deadline) < 0) queued->deadline = slot.deadline;
+            slot.queueUs = micros() - slot.receivedAt;
+            slot.execUs = 0;
+            setOutcome(slot, "superseded");
+            superseded = slot.cmd.id;
+        }
+    }
+    queued->state = COMMAND_QUEUED;
+    
+    int depth = 0;
+    for (const QueuedCommand& slot : commandQueue) {
+        if (slot.state == COMMAND_QUEUED) depth++;
+    }
+    
+    // "queued" tells the Control Plane that the outcome follows on a
+    // heartbeat; queueUs is the time to this ack
+    StaticJsonDocument<192> ack;
+    ack["success"] = true;
+    ack["id"] = (const char*)cmd.id;
+    ack["queued"] = true;
+    ack["queueDepth"] = depth;
+    ack["queueUs"] = (ESP.getCycleCount() - commandStart) / ESP.getCpuFreqMHz();
+    if (superseded) {
+        ack["supersedes"] = superseded;
+    }
+    
+    char response[192];
+    serializeJson(ack, response, sizeof(response));
+    server->send(202, "application/json", response);
+    recordStage(STAGE_COMMAND, commandStart);
+}
+
+// Runs the most urgent queued command. True while commands are still
+// queued.
+bool SDNDataPlane::runCommands() {
+    QueuedCommand* next = nullptr;
+    int queued = 0;
+    for (QueuedCommand& slot : commandQueue) {
+        if (slot.state != COMMAND_QUEUED) continue;
+        queued++;
+        if (!next || slot.priority > next->priority ||
+            (slot.priority == next->priority && (long)(slot.deadline - next->deadline) < 0)) {
+            next = &slot;
+        }
+    }
+    
+    if (next) {
+        executeQueued(*next);
+        queued--;
+    }
+    return queued > 0;
+}
+
+void SDNDataPlane::executeQueued(QueuedCommand& queued) {
+    queued.late = (long)(millis() - queued.deadline) > 0;
+    queued.queueUs = micros() - queued.receivedAt;
+    
+    uint32_t execStart = ESP.getCycleCount();
+    bool success = executeCommand(queued.cmd.command, queued.cmd.value);
+    queued.execUs = (ESP.getCycleCount() - execStart) / ESP.getCpuFreqMHz();
     
     // Notify callback
     if (onCommandReceived) {
-        onCommandReceived(cmd);
+        onCommandReceived(queued.cmd);
     }
     
-    if (success) {
-        server->send(200, "application/json", "{\"success\":true}");
-    } else {
-        server->send(500, "application/json", "{\"success\":false,\"message\":\"Command failed\"}");
+    setOutcome(queued, success ? "done" : "failed");
+    if (queued.late) {
+        SDN_LOGF("Command %s missed its deadline\n", queued.cmd.command);
+    }
+}
+
+void SDNDataPlane::setOutcome(QueuedCommand& queued, const char* outcome) {
+    queued.outcome = outcome;
+    queued.state = COMMAND_REPORTING;
+    RecentCommand* recent = findRecentCommand(queued.cmd.id);
+    if (recent) recent->outcome = outcome;
+}
+
+SDNDataPlane::RecentCommand* SDNDataPlane::findRecentCommand(const char* id) {
+    for (RecentCommand& recent : recentCommands) {
+        if (strcmp(recent.id, id) == 0) return &recent;
+    }
+    return nullptr;
+}
+
+bool SDNDataPlane::commandResultsPending() {
+    for (const QueuedCommand& slot : commandQueue) {
+        if (slot.state == COMMAND_REPORTING) return true;
+    }
+    return false;
+}
+
+// An outcome with the time the command waited and ran, so the Control
+// Plane can finish its timeline
+void SDNDataPlane::writeCommandResult(JsonObject result, const QueuedCommand& queued) {
+    result["id"] = (const char*)queued.cmd.id;
+    result["status"] = queued.outcome;
+    result["queueUs"] = queued.queueUs;
+    result["execUs"] = queued.execUs;
+    if (queued.late) {
+        result["late"] = true;
     }
 }
 
 void SDNDataPlane::handleStatus() {
-    StaticJsonDocument<256> status;
+    StaticJsonDocument<1024> status;
     
     status["deviceId"] = capability.deviceId;
     status["state"] = currentState;
     status["configured"] = config.configured;
     status["uptime"] = millis() / 1000;
     status["freeMemory"] = ESP.getFreeHeap();
+    status["heapMinFree"] = heapMinFree;
+    status["heapFragmentation"] = heapFragmentation;
+    status["heapFragmentationPeak"] = heapFragmentationPeak;
+    status["heapFragmentationEvents"] = heapFragmentationEvents;
+    writeStageTimings(status.createNestedObject("timing"));
+    
+    int queuedCommands = 0;
+    for (const QueuedCommand& slot : commandQueue) {
+        if (slot.state == COMMAND_QUEUED) queuedCommands++;
+    }
+    status["queuedCommands"] = queuedCommands;
+    
+    if (otaDownloading) {
+        JsonObject ota = status.createNestedObject("ota");
+        ota["written"] = otaWritten;
+        ota["size"] = otaSize;
+        ota["failures"] = otaFailures;
+    }
     
     if (currentState == OPERATIONAL) {
         status["mode"] = "STA";
@@ -377,59 +696,325 @@ void SDNDataPlane::handleStatus() {
 void SDNDataPlane::sendSensorData() {
     if (currentState != OPERATIONAL) return;
     
-    HTTPClient http;
-    String url = "http://" + config.controlPlaneIP + ":" + String(config.controlPlanePort) + "/api/data";
-    
-    http.begin(url);
-    http.addHeader("Content-Type", "application/json");
-    
-    String sensorData = collectSensorData();
-    int httpCode = http.POST(sensorData);
+    uint32_t firstSequence = sequence;
+    size_t length = stampSequence(collectPayload());
+    if (length == 0) {
+        SDN_LOG("Sensor payload did not fit buffer");
+        return;
+    }
     
-    if (httpCode == 200) {
-        Serial.println("Sensor data sent");
-    } else {
-        Serial.println("Failed to send sensor data: " + String(httpCode));
+    uint32_t postStart = ESP.getCycleCount();
+    bool sent = postPayload(dataUrl, payloadBuffer, length);
+    recordStage(STAGE_POST, postStart);
+    if (sent) {
+        if (sequence != firstSequence) sequenceRestarted = false; // Numbered
+        SDN_LOG("Sensor data sent");
+    }
+}
+
+// Advances every sensor's read by at most one step per loop pass, so a
+// slow conversion only delays its own sensor. The next sample is due an
+// interval after the previous due time, not after the read, so sampling
+// does not drift; a sensor more than an interval behind skips ahead.
+void SDNDataPlane::pollSensors() {
+    unsigned long now = millis();
+    for (int i = 0; i < capability.sensorCount && i < SDN_MAX_SENSORS; i++) {
+        const SensorCapability& sensor = capability.sensors[i];
+        SensorSlot& slot = sensorSlots[i];
+        
+        if (slot.state == SAMPLE_IDLE) {
+            if ((long)(now - slot.dueAt) < 0) continue;
+            unsigned long interval = sensor.sampleInterval > 0 ? sensor.sampleInterval : dataInterval;
+            slot.dueAt += interval;
+            if ((long)(now - slot.dueAt) >= 0) slot.dueAt = now + interval;
+            
+            if (!slot.driver) {
+                float value;
+                const char* unit = sensor.unit;
+                uint32_t readStart = ESP.getCycleCount();
+                if (onSensorRead && onSensorRead(sensor.sensorType, value, unit)) {
+                    recordStage(STAGE_READ, readStart);
+                    slot.scheduled = true;
+                    slot.unit = unit;
+                    storeSample(slot, value);
+                }
+                continue;
+            }
+            if (!slot.driver->start()) {
+                SDN_LOGF("Sensor %s did not start\n", sensor.sensorType);
+                continue;
+            }
+            slot.state = SAMPLE_WARMING;
+            slot.startedAt = now;
+        }
+        
+        if (slot.state == SAMPLE_WARMING) {
+            if (now - slot.startedAt < sensor.warmupTime) continue;
+            slot.state = SAMPLE_POLLING;
+        }
+        
+        uint32_t readStart = ESP.getCycleCount();
+        if (slot.driver->poll()) {
+            float value;
+            slot.state = SAMPLE_IDLE;
+            slot.unit = sensor.unit;
+            if (slot.driver->complete(value)) {
+                recordStage(STAGE_READ, readStart);
+                storeSample(slot, value);
+            } else {
+                SDN_LOGF("Sensor %s read failed\n", sensor.sensorType);
+            }
+        } else if (now - slot.startedAt > sensor.warmupTime + SDN_SENSOR_TIMEOUT_MS) {
+            slot.state = SAMPLE_IDLE;
+            SDN_LOGF("Sensor %s timed out\n", sensor.sensorType);
+        }
+    }
+}
+
+// Filters the sample in; an outlier leaves the sensor as it was
+void SDNDataPlane::storeSample(SensorSlot& slot, float value) {
+    if (!slot.filter.update(value, slot.value)) return;
+    slot.sampledAt = localMillis();
+    slot.fresh = true;
+}
+
+// True once a sensor has a new sample, or when no sensor is scheduled
+// (collectSensorData() reads the hardware itself)
+bool SDNDataPlane::sensorDataReady() {
+    bool scheduled = false;
+    for (int i = 0; i < capability.sensorCount && i < SDN_MAX_SENSORS; i++) {
+        if (sensorSlots[i].fresh) return true;
+        scheduled |= sensorSlots[i].scheduled;
+    }
+    return !scheduled;
+}
+
+int SDNDataPlane::addSensorReadings(JsonArray readings) {
+    uint64_t now = localMillis();
+    int added = 0;
+    for (int i = 0; i < capability.sensorCount && i < SDN_MAX_SENSORS; i++) {
+        SensorSlot& slot = sensorSlots[i];
+        if (!slot.fresh) continue;
+        JsonObject reading = readings.createNestedObject();
+        reading["type"] = capability.sensors[i].sensorType;
+        reading["value"] = slot.value;
+        reading["unit"] = slot.unit;
+        reading["status"] = "ok";
+        if (now - slot.sampledAt > 0) {
+            reading["dt"] = -(int32_t)(now - slot.sampledAt);
+        }
+        slot.fresh = false;
+        added++;
+    }
+    return added;
+}
+
+// Resumes numbering at the ceiling stored by the previous boot
+void SDNDataPlane::loadSequence() {
+    File file = SPIFFS.open(SDN_SEQUENCE_PATH, "r");
+    if (file) {
+        if (file.read((uint8_t*)&sequenceCeiling, sizeof(sequenceCeiling)) != sizeof(sequenceCeiling)) {
+            sequenceCeiling = 0;
+        }
+        file.close();
+    }
+    sequence = sequenceCeiling;
+    sequenceRestarted = true;
+}
+
+bool SDNDataPlane::reserveSequence() {
+    uint32_t ceiling = sequence + SDN_SEQUENCE_BLOCK;
+    File file = SPIFFS.open(SDN_SEQUENCE_PATH, "w");
+    if (!file) return false;
+    bool saved = file.write((const uint8_t*)&ceiling, sizeof(ceiling)) == sizeof(ceiling);
+    file.close();
+    if (saved) sequenceCeiling = ceiling;
+    return saved;
+}
+
+// Inserts "seq" (and "seqRestart" until a numbered payload of this boot got
+// through) at the start of the sensor payload, whatever collectSensorData()
+// wrote. Every posted payload takes a new number, delivered or not, so the
+// Control Plane can count the ones it never saw. Numbers are only used
+// below the ceiling saved in flash, or the next boot would reuse them:
+// while a reservation fails, payloads go out unnumbered (the Control Plane
+// takes those as they come). Returns the new length.
+size_t SDNDataPlane::stampSequence(size_t length) {
+    if (length < 2 || payloadBuffer[0] != '{') return length;
+    if (sequence >= sequenceCeiling && !reserveSequence()) {
+        SDN_LOG("Sequence reservation failed");
+        return length;
     }
     
-    http.end();
+    char field[48];
+    int fieldLength = snprintf(field, sizeof(field), "\"seq\":%lu,%s", (unsigned long)sequence,
+                               sequenceRestarted ? "\"seqRestart\":true," : "");
+    if (payloadBuffer[1] == '}') fieldLength--; // No members to separate
+    if (length + fieldLength >= sizeof(payloadBuffer)) return 0;
+    
+    memmove(payloadBuffer + 1 + fieldLength, payloadBuffer + 1, length); // Includes the terminator
+    memcpy(payloadBuffer + 1, field, fieldLength);
+    sequence++;
+    return length + fieldLength;
 }
 
 void SDNDataPlane::sendHeartbeat() {
     if (currentState != OPERATIONAL) return;
     
-    HTTPClient http;
-    String url = "http://" + config.controlPlaneIP + ":" + String(config.controlPlanePort) + "/api/heartbeat";
-    
-    http.begin(url);
-    http.addHeader("Content-Type", "application/json");
+    uint32_t heartbeatStart = ESP.getCycleCount();
+    char timestamp[24];
+    formatTimestamp(timestamp, sizeof(timestamp));
     
-    StaticJsonDocument<256> heartbeat;
-    heartbeat["deviceId"] = capability.deviceId;
-    heartbeat["timestamp"] = getCurrentTimestamp();
+    StaticJsonDocument<768> heartbeat;
+    heartbeat["deviceId"] = capability.deviceId.c_str();
+    heartbeat["timestamp"] = (const char*)timestamp;
     heartbeat["status"] = "online";
     heartbeat["uptime"] = millis() / 1000;
     heartbeat["freeMemory"] = ESP.getFreeHeap();
+    heartbeat["firmwareVersion"] = capability.firmwareVersion;
     
-    String payload;
-    serializeJson(heartbeat, payload);
+    // Command outcomes take the place of the stage stats, which are also
+    // on /api/status. One not sent after SDN_COMMAND_REPORT_ATTEMPTS
+    // heartbeats is dropped; the Control Plane then times the command out.
+    QueuedCommand* reported[SDN_COMMAND_REPORT_BATCH];
+    int reportCount = 0;
+    for (QueuedCommand& slot : commandQueue) {
+        if (slot.state == COMMAND_REPORTING && reportCount < SDN_COMMAND_REPORT_BATCH) {
+            reported[reportCount++] = &slot;
+        }
+    }
+    if (reportCount > 0) {
+        JsonArray commands = heartbeat.createNestedArray("commands");
+        for (int i = 0; i < reportCount; i++) {
+            writeCommandResult(commands.createNestedObject(), *reported[i]);
+        }
+    } else {
+        writeStageTimings(heartbeat.createNestedObject("timing"));
+    }
+    JsonObject clock = heartbeat.createNestedObject("clock");
+    clock["synced"] = clockValid;
+    if (clockValid) {
+        clock["errorMs"] = clockError;
+        clock["driftPpm"] = clockDriftPpm;
+    }
     
-    int httpCode = http.POST(payload);
+    // A full stage window outgrows payloadBuffer; the stats are also on
+    // /api/status, so they go before the heartbeat gets truncated
+    if (measureJson(heartbeat) >= sizeof(payloadBuffer)) {
+        heartbeat.remove("timing");
+    }
+    while (reportCount > 0 && measureJson(heartbeat) >= sizeof(payloadBuffer)) {
+        heartbeat["commands"].as<JsonArray>().remove(--reportCount); // Next heartbeat
+    }
+    if (heartbeat.overflowed() || measureJson(heartbeat) >= sizeof(payloadBuffer)) {
+        SDN_LOG("Heartbeat did not fit buffer");
+        return;
+    }
+    size_t length = serializeJson(heartbeat, payloadBuffer, sizeof(payloadBuffer));
+    StaticJsonDocument<256> reply;
+    uint64_t sentAt = localMillis();
+    bool sent = postPayload(heartbeatUrl, payloadBuffer, length, &reply);
+    for (int i = 0; i < reportCount; i++) {
+        if (sent || ++reported[i]->attempts >= SDN_COMMAND_REPORT_ATTEMPTS) {
+            reported[i]->state = COMMAND_FREE;
+        }
+    }
+    if (sent) {
+        updateClock(sentAt, reply);
+        if (!(reply["registered"] | true)) {
+            // The Control Plane lost this device (e.g. registry reset)
+            buildRegistrationPayload();
+            registerWithControlPlane();
+            saveFastBoot();
+        }
+    }
+    recordStage(STAGE_HEARTBEAT, heartbeatStart);
+}
+
+// NTP-style sample from a heartbeat reply: with t0/t3 our send/receive and
+// t1/t2 the Control Plane's receive/send times, the offset is
+// ((t1 - t0) + (t2 - t3)) / 2, off by at most half the network delay. Of
+// the last SDN_CLOCK_SAMPLES samples the one with the lowest delay is
+// used, and successive best offsets give the drift of the local clock.
+void SDNDataPlane::updateClock(uint64_t sentAt, JsonDocument& reply) {
+    if (!reply.containsKey("epoch")) return; // Control Plane clock not seeded
     
-    if (httpCode != 200) {
-        Serial.println("Heartbeat failed: " + String(httpCode));
+    int64_t base = (int64_t)reply["epoch"].as<uint32_t>() * 1000;
+    int64_t t1 = base + (reply["t1"] | 0UL);
+    int64_t t2 = base + (reply["t2"] | 0UL);
+    int64_t t0 = sentAt;
+    int64_t t3 = postDoneAt;
+    int64_t delay = (t3 - t0) - (t2 - t1);
+    
+    ClockSample sample = {((t1 - t0) + (t2 - t3)) / 2, (uint32_t)(delay > 0 ? delay : 0), postDoneAt};
+    
+    // A jump well past the error means the Control Plane clock was set;
+    // older samples and the drift baseline no longer apply
+    if (clockValid && llabs((int64_t)epochMillis() - (sample.offset + t3)) > SDN_CLOCK_STEP_MS + sample.delay) {
+        clockSampleCount = 0;
+        clockSampleNext = 0;
+        clockDriftPpm = 0;
+        driftBaseAt = 0;
     }
+    clockSamples[clockSampleNext] = sample;
+    clockSampleNext = (clockSampleNext + 1) % SDN_CLOCK_SAMPLES;
+    if (clockSampleCount < SDN_CLOCK_SAMPLES) clockSampleCount++;
     
-    http.end();
+    const ClockSample* best = &clockSamples[0];
+    for (int i = 1; i < clockSampleCount; i++) {
+        if (clockSamples[i].delay < best->delay) best = &clockSamples[i];
+    }
+    
+    if (driftBaseAt == 0) {
+        driftBaseOffset = best->offset;
+        driftBaseAt = best->at;
+    } else if (best->at - driftBaseAt >= SDN_CLOCK_DRIFT_BASE_MS) {
+        float ppm = (float)(best->offset - driftBaseOffset) * 1e6f / (float)(best->at - driftBaseAt);
+        if (fabsf(ppm) < SDN_CLOCK_MAX_DRIFT_PPM) {
+            clockDriftPpm = clockDriftPpm == 0 ? ppm : 0.75f * clockDriftPpm + 0.25f * ppm;
+        }
+        driftBaseOffset = best->offset;
+        driftBaseAt = best->at;
+    }
+    
+    clockOffset = best->offset;
+    clockOffsetAt = best->at;
+    clockError = best->delay / 2;
+    clockValid = true;
 }
 
-void SDNDataPlane::registerWithControlPlane() {
-    HTTPClient http;
-    String url = "http://" + config.controlPlaneIP + ":" + String(config.controlPlanePort) + "/api/register";
-    
+uint64_t SDNDataPlane::epochMillis() {
+    if (!clockValid) return 0;
+    uint64_t now = localMillis();
+    float elapsed = (float)(int64_t)(now - clockOffsetAt);
+    return now + clockOffset + (int64_t)(elapsed * clockDriftPpm / 1e6f);
+}
+
+// millis() wraps after 49 days; offsets need a clock that does not
+uint64_t SDNDataPlane::localMillis() {
+    return esp_timer_get_time() / 1000;
+}
+
+// POSTs a prepared body to a preformatted endpoint, reusing the connection
+bool SDNDataPlane::postPayload(const char* url, const char* body, size_t length, JsonDocument* reply) {
     http.begin(url);
     http.addHeader("Content-Type", "application/json");
     
+    int httpCode = http.POST((uint8_t*)body, length);
+    postDoneAt = localMillis();
+    if (httpCode == 200 && reply) {
+        deserializeJson(*reply, http.getString());
+    }
+    http.end();
+    
+    if (httpCode != 200) {
+        SDN_LOGF("POST %s failed: %d\n", url, httpCode);
+        return false;
+    }
+    return true;
+}
+
+void SDNDataPlane::buildRegistrationPayload() {
     StaticJsonDocument<512> registration;
     registration["deviceId"] = capability.deviceId;
     registration["name"] = config.deviceName;
@@ -437,18 +1022,185 @@ void SDNDataPlane::registerWithControlPlane() {
     registration["ip"] = WiFi.localIP().toString();
     registration["readInterval"] = config.readInterval;
     
-    String payload;
-    serializeJson(registration, payload);
+    registrationPayload = "";
+    registrationPayload.reserve(measureJson(registration));
+    serializeJson(registration, registrationPayload);
+}
+
+void SDNDataPlane::registerWithControlPlane() {
+    fastBoot.registrationCrc = 0;
+    if (postPayload(registerUrl, registrationPayload.c_str(), registrationPayload.length())) {
+        fastBoot.registrationCrc = fastBootCrc((const uint8_t*)registrationPayload.c_str(), registrationPayload.length());
+        SDN_LOG("Registered with Control Plane");
+    }
+}
+
+void SDNDataPlane::checkForUpdate() {
+    otaCheckDue = true;
+}
+
+// Polls version.txt every SDN_OTA_CHECK_INTERVAL, or on the next pass after
+// the Control Plane's rollout POSTs /api/ota. A newer image is fetched one
+// Range piece per pass straight into the update partition, so the device
+// keeps reporting while it downloads and a dropped connection only costs
+// the piece in flight.
+void SDNDataPlane::handleOta() {
+    unsigned long now = millis();
+    if (otaRetryAt != 0) {
+        if ((long)(now - otaRetryAt) < 0) return;
+        otaRetryAt = 0;
+    }
+    
+    if (!otaDownloading) {
+        if (!otaCheckDue && (long)(now - nextOtaCheck) < 0) return;
+        otaCheckDue = false;
+        nextOtaCheck = now + SDN_OTA_CHECK_INTERVAL + random(SDN_OTA_CHECK_INTERVAL / 4);
+        if (!firmwareUpdateAvailable()) return;
+        
+        SDN_LOG("Firmware update available");
+        notifyStatusChange("updating");
+        otaDownloading = true;
+        otaSize = 0;
+        otaWritten = 0;
+        otaFailures = 0;
+        otaEtag[0] = '\0';
+    }
+    downloadFirmwareChunk();
+}
+
+bool SDNDataPlane::firmwareUpdateAvailable() {
+    HTTPClient ota; // Own connection and timeout, apart from the posts
+    ota.begin(versionUrl);
+    ota.setTimeout(SDN_OTA_TIMEOUT_MS);
+    int httpCode = ota.GET();
+    String version = httpCode == 200 ? ota.getString() : String();
+    ota.end();
     
-    int httpCode = http.POST(payload);
+    version.trim();
+    return version.length() > 0 && version != (capability.firmwareVersion ? capability.firmwareVersion : "");
+}
+
+// Fetches the piece after otaWritten. If-Range makes the server answer 200
+// instead of 206 if the image changed since the first piece.
+void SDNDataPlane::downloadFirmwareChunk() {
+    static const char* headers[] = {"ETag", "Content-Range", "Retry-After"};
+    char range[32];
+    snprintf(range, sizeof(range), "bytes=%lu-%lu", (unsigned long)otaWritten,
+             (unsigned long)(otaWritten + SDN_OTA_CHUNK - 1));
     
-    if (httpCode == 200) {
-        Serial.println("Registered with Control Plane");
-    } else {
-        Serial.println("Registration failed: " + String(httpCode));
+    HTTPClient ota; // Own connection and timeout, apart from the posts
+    ota.begin(firmwareUrl);
+    ota.setTimeout(SDN_OTA_TIMEOUT_MS);
+    ota.collectHeaders(headers, 3);
+    ota.addHeader("Range", range);
+    ota.addHeader("X-Device-Id", capability.deviceId);
+    if (otaEtag[0] != '\0') {
+        ota.addHeader("If-Range", otaEtag);
     }
+    int httpCode = ota.GET();
     
-    http.end();
+    if (httpCode == 503) {
+        // Download slots or bandwidth are taken; not a failure
+        int retrySeconds = ota.header("Retry-After").toInt();
+        ota.end();
+        otaRetryAt = millis() + max(retrySeconds, 1) * 1000UL;
+        return;
+    }
+    if (httpCode == 200 && otaWritten > 0) {
+        ota.end();
+        SDN_LOG("Firmware image changed, restarting download");
+        Update.abort();
+        otaSize = 0;
+        otaWritten = 0;
+        otaEtag[0] = '\0';
+        return;
+    }
+    
+    unsigned long first, last, total;
+    String contentRange = ota.header("Content-Range");
+    if (httpCode != 206 || sscanf(contentRange.c_str(), "bytes %lu-%lu/%lu", &first, &last, &total) != 3 ||
+        first != otaWritten) {
+        ota.end();
+        retryFirmwareDownload("unexpected response");
+        return;
+    }
+    
+    if (otaWritten == 0) {
+        String etag = ota.header("ETag");
+        if (etag.length() != 34 || !Update.begin(total)) {
+            ota.end();
+            abortFirmwareUpdate("cannot start update");
+            return;
+        }
+        strlcpy(otaEtag, etag.c_str(), sizeof(otaEtag));
+        Update.setMD5(etag.substring(1, 33).c_str());
+        otaSize = total;
+    }
+    
+    // Copy the piece; whatever arrived before a drop is kept
+    WiFiClient* stream = ota.getStreamPtr();
+    uint32_t expected = last - first + 1;
+    uint32_t received = 0;
+    uint8_t buffer[1024];
+    unsigned long lastData = millis();
+    while (received < expected && millis() - lastData < SDN_OTA_TIMEOUT_MS) {
+        size_t available = stream->available();
+        if (available == 0) {
+            if (!stream->connected()) break;
+            delay(1);
+            continue;
+        }
+        size_t n = stream->readBytes(buffer, std::min({available, sizeof(buffer), (size_t)(expected - received)}));
+        if (Update.write(buffer, n) != n) {
+            ota.end();
+            abortFirmwareUpdate("flash write failed");
+            return;
+        }
+        received += n;
+        lastData = millis();
+    }
+    ota.end();
+    otaWritten += received;
+    
+    if (received < expected) {
+        retryFirmwareDownload("connection dropped");
+        return;
+    }
+    otaFailures = 0;
+    
+    if (otaWritten >= otaSize) {
+        // end() checks the image against the MD5 from the ETag
+        if (!Update.end()) {
+            abortFirmwareUpdate("image verification failed");
+            return;
+        }
+        SDN_LOG("Firmware updated, restarting");
+        notifyStatusChange("updated");
+        delay(100);
+        ESP.restart();
+    }
+}
+
+// Keeps what was written and tries the same piece again after a backoff
+void SDNDataPlane::retryFirmwareDownload(const char* reason) {
+    if (++otaFailures > SDN_OTA_MAX_FAILURES) {
+        abortFirmwareUpdate(reason);
+        return;
+    }
+    unsigned long backoff = std::min(1000UL << otaFailures, 60000UL);
+    SDN_LOGF("Firmware download %s at %lu, retry in %lu ms\n", reason, (unsigned long)otaWritten, backoff);
+    otaRetryAt = millis() + backoff;
+}
+
+// Drops the partial image; the running firmware is untouched
+void SDNDataPlane::abortFirmwareUpdate(const char* reason) {
+    SDN_LOGF("Firmware update aborted: %s\n", reason);
+    Update.abort();
+    otaDownloading = false;
+    otaSize = 0;
+    otaWritten = 0;
+    otaEtag[0] = '\0';
+    notifyStatusChange("update_failed");
 }
 
 bool SDNDataPlane::saveConfig() {
@@ -489,12 +1241,99 @@ bool SDNDataPlane::loadConfig() {
             config.configured = configDoc["configured"];
             
             dataInterval = config.readInterval * 1000;
+            formatEndpoints();
             return true;
         }
     }
     return false;
 }
 
+// Applies a valid record to the configuration. False (and /config.json is
+// used) if it is missing, of another firmware or fails its CRC.
+bool SDNDataPlane::loadFastBoot() {
+    FastBootRecord record;
+    if (!readFastBoot(record) || record.version != SDN_FASTBOOT_VERSION || record.size != sizeof(record) ||
+        record.crc != fastBootCrc((const uint8_t*)&record, offsetof(FastBootRecord, crc))) {
+        return false;
+    }
+    fastBoot = record;
+    fastBootSavedCrc = record.crc;
+    
+    config.deviceName = record.deviceName;
+    config.deviceType = record.deviceType;
+    config.wifiSSID = record.wifiSSID;
+    config.wifiPassword = record.wifiPassword;
+    config.controlPlaneIP = record.controlPlaneIP;
+    config.controlPlanePort = record.controlPlanePort;
+    config.readInterval = record.readInterval;
+    config.configured = true;
+    
+    dataInterval = config.readInterval * 1000;
+    formatEndpoints();
+    return true;
+}
+
+// Stores the record if it changed, so a boot that changed nothing costs no
+// flash write
+void SDNDataPlane::saveFastBoot() {
+    fastBoot.version = SDN_FASTBOOT_VERSION;
+    fastBoot.size = sizeof(fastBoot);
+    fastBoot.crc = fastBootCrc((const uint8_t*)&fastBoot, offsetof(FastBootRecord, crc));
+    if (fastBoot.crc == fastBootSavedCrc) return;
+    if (writeFastBoot(fastBoot)) {
+        fastBootSavedCrc = fastBoot.crc;
+    } else {
+        SDN_LOG("Fast boot record save failed");
+    }
+}
+
+// One NVS entry; NVS does its own wear levelling
+bool SDNDataPlane::readFastBoot(FastBootRecord& record) {
+    Preferences prefs;
+    if (!prefs.begin(SDN_FASTBOOT_NAMESPACE, true)) return false;
+    size_t length = prefs.getBytes("record", &record, sizeof(record));
+    prefs.end();
+    return length == sizeof(record);
+}
+
+bool SDNDataPlane::writeFastBoot(const FastBootRecord& record) {
+    Preferences prefs;
+    if (!prefs.begin(SDN_FASTBOOT_NAMESPACE, false)) return false;
+    bool saved = prefs.putBytes("record", &record, sizeof(record)) == sizeof(record);
+    prefs.end();
+    return saved;
+}
+
+// Copies the configuration into the record. Other WiFi or Control Plane
+// settings make the stored association and registration useless.
+void SDNDataPlane::recordConfig() {
+    if (config.wifiSSID != fastBoot.wifiSSID || config.controlPlaneIP != fastBoot.controlPlaneIP ||
+        config.controlPlanePort != fastBoot.controlPlanePort) {
+        memset(fastBoot.bssid, 0, sizeof(fastBoot.bssid));
+        fastBoot.channel = 0;
+        fastBoot.localIP = 0;
+        fastBoot.registrationCrc = 0;
+    }
+    strlcpy(fastBoot.deviceName, config.deviceName.c_str(), sizeof(fastBoot.deviceName));
+    strlcpy(fastBoot.deviceType, config.deviceType.c_str(), sizeof(fastBoot.deviceType));
+    strlcpy(fastBoot.wifiSSID, config.wifiSSID.c_str(), sizeof(fastBoot.wifiSSID));
+    strlcpy(fastBoot.wifiPassword, config.wifiPassword.c_str(), sizeof(fastBoot.wifiPassword));
+    strlcpy(fastBoot.controlPlaneIP, config.controlPlaneIP.c_str(), sizeof(fastBoot.controlPlaneIP));
+    fastBoot.controlPlanePort = config.controlPlanePort;
+    fastBoot.readInterval = config.readInterval;
+}
+
+// Remembers the association just made for the next boot's fast connect
+void SDNDataPlane::recordAssociation() {
+    const uint8_t* bssid = WiFi.BSSID();
+    if (bssid) memcpy(fastBoot.bssid, bssid, sizeof(fastBoot.bssid));
+    fastBoot.channel = WiFi.channel();
+    fastBoot.localIP = WiFi.localIP();
+    fastBoot.gateway = WiFi.gatewayIP();
+    fastBoot.subnet = WiFi.subnetMask();
+    fastBoot.dns = WiFi.dnsIP();
+}
+
 String SDNDataPlane::generateDeviceId() {
     // For ESP32, use MAC address to generate unique ID
     uint8_t mac[6];
@@ -504,48 +1343,176 @@ String SDNDataPlane::generateDeviceId() {
     return String(deviceId);
 }
 
-String SDNDataPlane::getCurrentTimestamp() {
-    return String(millis());
+void SDNDataPlane::formatTimestamp(char* buffer, size_t size) {
+    uint64_t epoch = epochMillis();
+    if (epoch == 0) {
+        snprintf(buffer, size, "%lu", millis());
+    } else {
+        snprintf(buffer, size, "%lu%03u", (unsigned long)(epoch / 1000), (unsigned)(epoch % 1000));
+    }
 }
 
-void SDNDataPlane::notifyStatusChange(String status) {
+void SDNDataPlane::notifyStatusChange(const char* status) {
     if (onStatusChanged) {
         onStatusChanged(status);
     }
 }
 
+void SDNDataPlane::formatEndpoints() {
+    const char* ip = config.controlPlaneIP.c_str();
+    int port = config.controlPlanePort;
+    snprintf(dataUrl, sizeof(dataUrl), "http://%s:%d/api/data", ip, port);
+    snprintf(heartbeatUrl, sizeof(heartbeatUrl), "http://%s:%d/api/heartbeat", ip, port);
+    snprintf(registerUrl, sizeof(registerUrl), "http://%s:%d/api/register", ip, port);
+    snprintf(versionUrl, sizeof(versionUrl), "http://%s:%d/firmware/version.txt", ip, port);
+    snprintf(firmwareUrl, sizeof(firmwareUrl), "http://%s:%d/firmware/firmware.bin", ip, port);
+}
+
+void SDNDataPlane::sampleHeap() {
+    uint32_t freeHeap = ESP.getFreeHeap();
+    if (freeHeap < heapMinFree) {
+        heapMinFree = freeHeap;
+    }
+    
+    // Share of free heap not usable as one block
+    uint32_t maxBlock = ESP.getMaxAllocHeap();
+    heapFragmentation = freeHeap > 0 ? 100 - (maxBlock * 100 / freeHeap) : 0;
+    if (heapFragmentation > heapFragmentationPeak) {
+        heapFragmentationPeak = heapFragmentation;
+    }
+    if (heapFragmentation >= SDN_HEAP_FRAG_WARN) {
+        heapFragmentationEvents++;
+    }
+}
+
+// Records the time since startCycles into the stage's rolling window
+void SDNDataPlane::recordStage(Stage stage, uint32_t startCycles) {
+    uint32_t elapsed = (ESP.getCycleCount() - startCycles) / ESP.getCpuFreqMHz();
+    stageSamples[stage][stageNext[stage]] = elapsed;
+    stageNext[stage] = (stageNext[stage] + 1) % SDN_STAGE_WINDOW;
+    if (stageCount[stage] < SDN_STAGE_WINDOW) {
+        stageCount[stage]++;
+    }
+}
+
+// Adds "stage":[min,avg,max,p95] in microseconds for every stage with samples
+void SDNDataPlane::writeStageTimings(JsonObject timings) {
+    static const char* const names[STAGE_COUNT] = {"read", "encode", "post", "heartbeat", "command", "cycle"};
+    uint32_t sorted[SDN_STAGE_WINDOW];
+    
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        int count = stageCount[stage];
+        if (count == 0) continue;
+        
+        uint64_t sum = 0;
+        for (int i = 0; i < count; i++) {
+            sorted[i] = stageSamples[stage][i];
+            sum += sorted[i];
+        }
+        std::sort(sorted, sorted + count);
+        
+        JsonArray stats = timings.createNestedArray(names[stage]);
+        stats.add(sorted[0]);
+        stats.add((uint32_t)(sum / count));
+        stats.add(sorted[count - 1]);
+        stats.add(sorted[(count * 95 + 99) / 100 - 1]); // Nearest-rank p95
+    }
+}
+
+// Collects the sensor payload into payloadBuffer, timing read and encode
+size_t SDNDataPlane::collectPayload() {
+    stageLap = ESP.getCycleCount();
+    size_t length = collectSensorData(payloadBuffer, sizeof(payloadBuffer));
+    recordStage(STAGE_ENCODE, stageLap);
+    stageLap = 0;
+    return length;
+}
+
+void SDNDataPlane::sensorReadDone() {
+    if (stageLap == 0) return; // Not called from collectPayload()
+    recordStage(STAGE_READ, stageLap);
+    stageLap = ESP.getCycleCount();
+}
+
 // Virtual methods - to be overridden by specific implementations
-String SDNDataPlane::collectSensorData() {
-    StaticJsonDocument<256> data;
-    data["deviceId"] = capability.deviceId;
-    data["deviceName"] = config.deviceName;
-    data["timestamp"] = getCurrentTimestamp();
+size_t SDNDataPlane::collectSensorData(char* buffer, size_t size) {
+    StaticJsonDocument<768> data;
+    char timestamp[24];
+    formatTimestamp(timestamp, sizeof(timestamp));
     
-    // Default implementation - should be overridden
+    data["deviceId"] = capability.deviceId.c_str();
+    data["deviceName"] = config.deviceName.c_str();
+    data["timestamp"] = (const char*)timestamp;
+    
+    // Scheduled samples; without drivers, a placeholder that should be
+    // overridden
     JsonArray readings = data.createNestedArray("readings");
-    JsonObject reading = readings.createNestedObject();
-    reading["type"] = "generic";
-    reading["value"] = random(0, 100);
-    reading["unit"] = "units";
-    reading["status"] = "ok";
+    if (addSensorReadings(readings) == 0) {
+        JsonObject reading = readings.createNestedObject();
+        reading["type"] = "generic";
+        reading["value"] = random(0, 100);
+        reading["unit"] = "units";
+        reading["status"] = "ok";
+    }
     
-    String response;
-    serializeJson(data, response);
-    return response;
+    if (measureJson(data) >= size) return 0;
+    return serializeJson(data, buffer, size);
 }
 
-bool SDNDataPlane::executeCommand(String command, String value) {
-    Serial.println("Executing command: " + command + " with value: " + value);
+bool SDNDataPlane::executeCommand(const char* command, const char* value) {
+    SDN_LOGF("Executing command: %s with value: %s\n", command, value);
     // Default implementation - should be overridden
     return true;
 }
 
+#ifdef SDN_ENABLE_BENCHMARKS
+// Prints one NDJSON line per case. The heap only exposes totals, so bytes and
+// blocks are reported net of frees (i.e. what an op leaves allocated).
+void SDNDataPlane::runBenchmarks(Print& out, int iterations) {
+    const char* names[] = {"collectSensorData", "handleDeviceInfo", "sensorFilter"};
+    
+    // Every filter stage, on a sample stepping through 0.7 units
+    static constexpr FilterSpec BENCH_FILTER = {1.01f, -0.5f, 5.0f, 5, 0.01f, 0.25f, 2};
+    SensorFilter filter;
+    filter.begin(&BENCH_FILTER);
+    
+    for (int benchCase = 0; benchCase < 3; benchCase++) {
+        multi_heap_info_t before, after;
+        heap_caps_get_info(&before, MALLOC_CAP_8BIT);
+        unsigned long start = micros();
+        
+        for (int i = 0; i < iterations; i++) {
+            if (benchCase == 0) {
+                collectSensorData(payloadBuffer, sizeof(payloadBuffer));
+            } else if (benchCase == 1) {
+                String payload;
+                buildDeviceInfo(payload);
+            } else {
+                float value;
+                filter.update(20.0f + (i & 7) * 0.1f, value);
+            }
+        }
+        
+        unsigned long elapsed = micros() - start;
+        heap_caps_get_info(&after, MALLOC_CAP_8BIT);
+        
+        out.printf("{\"bench\":\"%s\",\"iterations\":%d,\"nsPerOp\":%lu,\"netBytesPerOp\":%ld,\"netAllocsPerOp\":%ld}\n",
+                   names[benchCase], iterations,
+                   (unsigned long)((uint64_t)elapsed * 1000 / iterations),
+                   ((long)after.total_allocated_bytes - (long)before.total_allocated_bytes) / iterations,
+                   ((long)after.allocated_blocks - (long)before.allocated_blocks) / iterations);
+    }
+}
+#endif
+
 void SDNDataPlane::reset() {
     ESP.restart();
 }
 
 void SDNDataPlane::factoryReset() {
     SPIFFS.remove("/config.json");
+    memset(&fastBoot, 0, sizeof(fastBoot)); // Stored as an invalid record
+    writeFastBoot(fastBoot);
     config.configured = false;
     ESP.restart();
 }
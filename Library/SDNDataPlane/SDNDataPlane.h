@@ -13,37 +13,115 @@
 #include <HTTPClient.h>
 #include <ArduinoJson.h>
 #include <SPIFFS.h>
+#include <Update.h>
+#include <Preferences.h>
+#include <SDNFilter.h>
 
-// Device capability structures (unchanged)
+// Uncomment to build runBenchmarks() (hot path micro-benchmarks)
+// #define SDN_ENABLE_BENCHMARKS
+
+// Uncomment to strip all library Serial output at compile time
+// #define SDN_DISABLE_LOGGING
+
+#ifdef SDN_DISABLE_LOGGING
+#define SDN_LOG(msg)
+#define SDN_LOGF(...)
+#else
+#define SDN_LOG(msg) Serial.println(msg)
+#define SDN_LOGF(...) Serial.printf(__VA_ARGS__)
+#endif
+
+// Fixed buffers for the operational loop (no heap use per cycle)
+#define SDN_URL_SIZE 64
+#define SDN_PAYLOAD_SIZE 512
+#define SDN_HEAP_FRAG_WARN 50 // Fragmentation % counted as an event
+#define SDN_STAGE_WINDOW 32 // Samples kept per timed stage
+
+// Firmware updates (see handleOta())
+#define SDN_OTA_CHUNK 16384                 // Bytes per Range request
+#define SDN_OTA_CHECK_INTERVAL 21600000UL   // Version poll without a rollout, 6 h
+#define SDN_OTA_TIMEOUT_MS 10000
+#define SDN_OTA_MAX_FAILURES 8              // Consecutive failures before giving up
+
+// Payload sequence numbers (see stampSequence())
+#define SDN_SEQUENCE_PATH "/sequence.bin"
+#define SDN_SEQUENCE_BLOCK 256              // Numbers reserved per flash write
+
+// Clock offset from heartbeat round-trips (see updateClock())
+#define SDN_CLOCK_SAMPLES 8                 // Round-trips the best one is picked from
+#define SDN_CLOCK_STEP_MS 1000              // Offset change taken as a Control Plane clock step
+#define SDN_CLOCK_DRIFT_BASE_MS 600000UL    // Shortest span a drift estimate is taken over
+#define SDN_CLOCK_MAX_DRIFT_PPM 500.0f      // Beyond any crystal; such estimates are dropped
+
+// Fast boot (see loadFastBoot())
+#define SDN_FASTBOOT_VERSION 1
+#define SDN_FASTBOOT_NAMESPACE "sdn"        // NVS namespace of the record
+#define SDN_FASTBOOT_TIMEOUT_MS 3000        // Join with the stored association before scanning
+#define SDN_CONNECT_POLL_MS 20              // WiFi status poll while connecting
+
+// Sensor drivers (see pollSensors())
+#define SDN_MAX_SENSORS 8                   // Capability entries that can be scheduled
+#define SDN_SENSOR_TIMEOUT_MS 2000          // Conversion not ready after warm-up plus this is dropped
+
+// Actuator command queue (see handleCommand())
+#define SDN_COMMAND_QUEUE_SIZE 8
+#define SDN_COMMAND_PRIORITY 1              // Of commands that name none; higher runs first
+#define SDN_COMMAND_DEADLINE_MS 1000        // For commands without a responseTime
+#define SDN_COMMAND_REPORT_ATTEMPTS 3       // Heartbeats an outcome is tried on before it is dropped
+#define SDN_COMMAND_REPORT_MS 500           // Heartbeat delay once an outcome waits for it
+#define SDN_COMMAND_REPORT_BATCH 3          // Outcomes per heartbeat
+#define SDN_COMMAND_RECENT 16               // Command ids remembered against repeated deliveries
+#define SDN_COMMAND_COALESCE 0x01           // ActuatorCapability flag: a new value replaces a queued one
+
+#ifdef SDN_ENABLE_BENCHMARKS
+#include <esp_heap_caps.h>
+#endif
+
+// Device capability structures. Sensor and actuator entries are literal
+// types so a device declares them as constexpr tables, e.g.
+//   static constexpr SensorCapability SENSORS[] SDN_CAPABILITY_TABLE = {...};
 struct SensorCapability {
-    String sensorType;
-    String dataType;
-    String unit;
+    const char* sensorType;
+    const char* dataType;
+    const char* unit;
     float minValue;
     float maxValue;
     float accuracy;
+    uint32_t sampleInterval;    // ms; 0 samples at the device read interval
+    uint32_t warmupTime;        // ms from SensorDriver::start() to the first poll()
+    const FilterSpec* filter;   // Applied to every sample; nullptr reports them as read
 };
 
 struct ActuatorCapability {
-    String command;
-    String valueType;
-    String supportedValues;
-    int responseTime;
+    const char* command;
+    const char* valueType;
+    const char* supportedValues;
+    int responseTime;           // ms; sets the deadline of a queued command
+    uint32_t flags;             // SDN_COMMAND_* bits
 };
 
+// Capability tables are const data; ESP32 keeps them in flash already
+#define SDN_CAPABILITY_TABLE
+
+// Entry count of a capability table, evaluated at compile time
+template <typename T, size_t N>
+constexpr int sdnTableSize(const T (&)[N]) {
+    return N;
+}
+
 struct DeviceCapability {
     String deviceId;
     String deviceName;
     String deviceType;
-    String description;
-    String firmwareVersion;
-    String hardwareVersion;
+    const char* description;
+    const char* firmwareVersion;
+    const char* hardwareVersion;
     
-    SensorCapability* sensors;
+    const SensorCapability* sensors;
     int sensorCount;
     int readInterval;
     
-    ActuatorCapability* actuators;
+    const ActuatorCapability* actuators;
     int actuatorCount;
 };
 
@@ -59,18 +137,55 @@ struct DeviceConfig {
     bool configured;
 };
 
+// Binary copy of the configuration plus the last WiFi association, kept in
+// NVS so a reboot skips the JSON config, the scan, DHCP and, when
+// nothing changed, registration. Fixed layout, so `size` and `version`
+// catch records of other firmware.
+struct FastBootRecord {
+    uint16_t version;
+    uint16_t size;
+    char deviceName[32];
+    char deviceType[16];
+    char wifiSSID[33];
+    char wifiPassword[65];
+    char controlPlaneIP[16];
+    uint16_t controlPlanePort;
+    uint16_t readInterval;
+    uint8_t bssid[6];           // Access point of the last association
+    uint8_t channel;            // 0 if there is none to reuse
+    uint32_t localIP;           // Last DHCP lease, reused as a static address
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+    uint32_t registrationCrc;   // Registration payload the Control Plane has, 0 if none
+    uint32_t crc;               // CRC-32 of the bytes before it
+};
+
 // Command structure
 struct Command {
-    String id;
-    String command;
-    String value;
-    String timestamp;
+    char id[24];
+    char command[32];
+    char value[48];
+    char timestamp[24];
 };
 
 // Callback types
-typedef void (*CommandCallback)(Command cmd);
-typedef void (*StatusCallback)(String status);
-typedef bool (*SensorReadCallback)(String sensorType, float& value, String& unit);
+typedef void (*CommandCallback)(const Command& cmd);
+typedef void (*StatusCallback)(const char* status);
+typedef bool (*SensorReadCallback)(const char* sensorType, float& value, const char*& unit);
+
+// Non-blocking driver of one capability sensor (see attachDriver()). A read
+// is split so a slow part (e.g. a DHT22's conversion) never holds up the
+// loop: start() triggers the conversion, poll() is called once per pass
+// from warmupTime on until it reports the result ready, and complete()
+// fetches it. Each call must return at once.
+class SensorDriver {
+public:
+    virtual ~SensorDriver() {}
+    virtual bool start() = 0;                   // False if the part is busy or absent
+    virtual bool poll() { return true; }        // True once complete() can read
+    virtual bool complete(float& value) = 0;    // False on a bad read (CRC, bus error)
+};
 
 class SDNDataPlane {
 private:
@@ -94,6 +209,137 @@ private:
     unsigned long dataInterval;
     unsigned long heartbeatInterval;
     
+    // Preformatted Control Plane endpoints and shared payload buffer
+    char dataUrl[SDN_URL_SIZE];
+    char heartbeatUrl[SDN_URL_SIZE];
+    char registerUrl[SDN_URL_SIZE];
+    char versionUrl[SDN_URL_SIZE];
+    char firmwareUrl[SDN_URL_SIZE];
+    char payloadBuffer[SDN_PAYLOAD_SIZE];
+    
+    // Discovery and registration payloads, built once and served as-is
+    String infoPayload;
+    String registrationPayload;
+    HTTPClient http;
+    
+    // Firmware download in progress, resumed piece by piece
+    bool otaDownloading;
+    bool otaCheckDue;
+    unsigned long nextOtaCheck;
+    unsigned long otaRetryAt;
+    uint32_t otaSize;
+    uint32_t otaWritten;
+    uint8_t otaFailures;
+    char otaEtag[36];           // Quoted image MD5, sent back as If-Range
+    
+    // Sequence number of the next sensor payload. Flash holds a ceiling
+    // reserved SDN_SEQUENCE_BLOCK ahead, so numbers never repeat after a
+    // reboot; the numbers skipped then are announced with "seqRestart".
+    uint32_t sequence;
+    uint32_t sequenceCeiling;
+    bool sequenceRestarted;
+    
+    // Fast boot record and the state of a join with its association
+    FastBootRecord fastBoot;
+    uint32_t fastBootSavedCrc;  // Of the stored copy, 0 if none
+    bool fastConnect;           // Joining with the stored BSSID, channel and IP
+    unsigned long connectStartedAt;
+    
+    // Epoch time as the Control Plane sees it, estimated NTP-style from the
+    // heartbeat round-trip. Offsets are epoch ms minus localMillis().
+    struct ClockSample {
+        int64_t offset;
+        uint32_t delay;         // Round-trip minus Control Plane processing
+        uint64_t at;            // localMillis() when taken
+    };
+    ClockSample clockSamples[SDN_CLOCK_SAMPLES];
+    uint8_t clockSampleNext;
+    uint8_t clockSampleCount;
+    bool clockValid;
+    int64_t clockOffset;        // From the best (lowest delay) recent sample
+    uint64_t clockOffsetAt;
+    uint32_t clockError;        // Half the best sample's delay
+    float clockDriftPpm;        // Offset change per local time, smoothed
+    int64_t driftBaseOffset;
+    uint64_t driftBaseAt;
+    uint64_t postDoneAt;        // localMillis() when the last POST returned
+    
+    // Heap health, sampled once per send cycle
+    uint32_t heapMinFree;
+    uint8_t heapFragmentation;
+    uint8_t heapFragmentationPeak;
+    unsigned long heapFragmentationEvents;
+    
+    // Per-stage timing from the CPU cycle counter, kept as a rolling window
+    // of microsecond samples and summarized on demand
+    enum Stage {
+        STAGE_READ,         // Sensor read (see sensorReadDone())
+        STAGE_ENCODE,       // Sensor payload JSON encode
+        STAGE_POST,         // Connect, send and Control Plane response
+        STAGE_HEARTBEAT,    // Whole heartbeat send
+        STAGE_COMMAND,      // Command parse, queue and ack
+        STAGE_CYCLE,        // Operational loop pass that sent something
+        STAGE_COUNT
+    };
+    uint32_t stageSamples[STAGE_COUNT][SDN_STAGE_WINDOW];
+    uint8_t stageNext[STAGE_COUNT];
+    uint8_t stageCount[STAGE_COUNT];
+    uint32_t stageLap;
+    
+    // Sampling schedule of each capability sensor. Sensors without a driver
+    // are read through onSensorRead, if it returns a value for them.
+    enum SampleState : uint8_t {
+        SAMPLE_IDLE,
+        SAMPLE_WARMING,         // start() done, waiting warmupTime
+        SAMPLE_POLLING
+    };
+    struct SensorSlot {
+        SensorDriver* driver;
+        SampleState state;
+        bool scheduled;         // Has a driver, or the callback gave a value
+        bool fresh;             // Sampled since the last payload
+        const char* unit;
+        float value;                // Filtered
+        SensorFilter filter;
+        unsigned long dueAt;
+        unsigned long startedAt;
+        uint64_t sampledAt;     // localMillis()
+    };
+    SensorSlot sensorSlots[SDN_MAX_SENSORS];
+    
+    // Commands are acked on receipt and run from the loop, highest priority
+    // first and then earliest deadline. Outcomes go to the Control Plane on
+    // the heartbeat, brought forward while one waits (see sendHeartbeat()).
+    enum CommandState : uint8_t {
+        COMMAND_FREE,
+        COMMAND_QUEUED,
+        COMMAND_REPORTING       // Run or superseded, outcome not yet on a heartbeat
+    };
+    struct QueuedCommand {
+        Command cmd;
+        CommandState state;
+        uint8_t priority;
+        uint8_t attempts;       // Heartbeats the outcome was sent on
+        bool coalesce;
+        const char* outcome;    // "done", "failed" or "superseded"
+        bool late;              // Started after its deadline
+        unsigned long deadline; // millis()
+        unsigned long receivedAt; // micros()
+        uint32_t queueUs;
+        uint32_t execUs;
+    };
+    QueuedCommand commandQueue[SDN_COMMAND_QUEUE_SIZE];
+    
+    // The last SDN_COMMAND_RECENT command ids received, with their outcome
+    // once run. A command delivered again (the Control Plane retrying after
+    // a lost ack) is acked from here instead of being run twice.
+    struct RecentCommand {
+        char id[24];
+        const char* outcome;    // nullptr while queued
+    };
+    RecentCommand recentCommands[SDN_COMMAND_RECENT];
+    uint8_t recentNext;
+    
     // Callbacks
     CommandCallback onCommandReceived;
     StatusCallback onStatusChanged;
@@ -111,16 +357,45 @@ public:
     void setCapability(DeviceCapability cap);
     void setCallbacks(CommandCallback cmdCallback, StatusCallback statusCallback, SensorReadCallback sensorCallback);
     
+    // Samples capability sensor `sensorType` with `driver` on the entry's
+    // own sampleInterval. Call after setCapability(); false if the device
+    // has no such sensor.
+    bool attachDriver(const char* sensorType, SensorDriver* driver);
+    
     // Status methods
-    String getDeviceId();
+    const char* getDeviceId();
     DeviceState getState();
     bool isConfigured();
     bool isOperational();
     
+    // Look for new firmware on the next loop pass
+    void checkForUpdate();
+    
     // Utility methods
     void reset();
     void factoryReset();
     
+#ifdef SDN_ENABLE_BENCHMARKS
+    // Time the payload builders and print one NDJSON line per case
+    void runBenchmarks(Print& out, int iterations = 100);
+#endif
+    
+protected:
+    // Call from collectSensorData() once the hardware has been read so the
+    // read and encode stages are timed separately
+    void sensorReadDone();
+    
+    // Writes the payload "timestamp": epoch milliseconds once the clock is
+    // synced, otherwise millis() (the Control Plane then uses receive time)
+    void formatTimestamp(char* buffer, size_t size);
+    
+    // Estimated epoch milliseconds, 0 until the first heartbeat reply
+    uint64_t epochMillis();
+    
+    // Adds one element per sensor sampled since the last payload, its "dt"
+    // the sample's age in ms, and returns how many were added
+    int addSensorReadings(JsonArray readings);
+    
 private:
     // State machine methods
     void handleDiscoveryMode();
@@ -138,26 +413,62 @@ private:
     void setupOperationalEndpoints();
     bool saveConfig();
     bool loadConfig();
+    bool loadFastBoot();
+    void saveFastBoot();
+    bool readFastBoot(FastBootRecord& record);
+    bool writeFastBoot(const FastBootRecord& record);
+    void recordConfig();
+    void recordAssociation();
+    void loadSequence();
+    bool reserveSequence();
     
     // Communication methods
     void sendSensorData();
     void sendHeartbeat();
     void registerWithControlPlane();
+    bool runCommands();
+    void executeQueued(QueuedCommand& queued);
+    void setOutcome(QueuedCommand& queued, const char* outcome);
+    void writeCommandResult(JsonObject result, const QueuedCommand& queued);
+    bool commandResultsPending();
+    RecentCommand* findRecentCommand(const char* id);
+    void pollSensors();
+    void storeSample(SensorSlot& slot, float value);
+    bool sensorDataReady();
+    void formatEndpoints();
+    void buildRegistrationPayload();
+    
+    // Firmware updates
+    void handleOta();
+    bool firmwareUpdateAvailable();
+    void downloadFirmwareChunk();
+    void retryFirmwareDownload(const char* reason);
+    void abortFirmwareUpdate(const char* reason);
+    bool postPayload(const char* url, const char* body, size_t length, JsonDocument* reply = nullptr);
     
     // HTTP handlers
     void handleDeviceInfo();
+    void buildDeviceInfo(String& response);
     void handleConfiguration();
     void handleCommand();
     void handleStatus();
     
     // Utility methods
     String generateDeviceId();
-    String getCurrentTimestamp();
-    void notifyStatusChange(String status);
+    void notifyStatusChange(const char* status);
+    void sampleHeap();
+    uint64_t localMillis();
+    void updateClock(uint64_t sentAt, JsonDocument& reply);
+    void recordStage(Stage stage, uint32_t startCycles);
+    void writeStageTimings(JsonObject timings);
+    size_t collectPayload();
+    size_t stampSequence(size_t length);
     
     // Virtual methods for device-specific implementation
-    virtual String collectSensorData();
-    virtual bool executeCommand(String command, String value);
+    // collectSensorData() serializes into the caller's buffer and returns
+    // the payload length (0 on failure)
+    virtual size_t collectSensorData(char* buffer, size_t size);
+    virtual bool executeCommand(const char* command, const char* value);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,51 @@
+/*
+ * SDN Filter Library Implementation
+ * FilterSpec chain of one sensor
+ */
+
+#include "SDNFilter.h"
+
+// Converts the spec to fixed point once, so update() needs no float math
+void SensorFilter::begin(const FilterSpec* spec) {
+    this->spec = spec;
+    stages = 0;
+    if (!spec) return;
+    if (spec->outlierLimit > 0) stages |= STAGE_OUTLIER;
+    if (spec->medianWindow > 1) stages |= STAGE_MEDIAN;
+    if (spec->kalmanProcess > 0) stages |= STAGE_KALMAN;
+    if (spec->emaShift > 0) stages |= STAGE_EMA;
+    calibration.begin(F::fromFloat(spec->gain != 0 ? spec->gain : 1.0f), F::fromFloat(spec->offset));
+    outlier.begin(F::fromFloat(spec->outlierLimit), SDN_FILTER_MAX_REJECTS);
+    median.begin(spec->medianWindow < SDN_FILTER_MEDIAN_MAX ? spec->medianWindow : SDN_FILTER_MEDIAN_MAX);
+    kalman.begin(F::fromFloat(spec->kalmanProcess), F::fromFloat(spec->kalmanMeasurement));
+    ema.begin(spec->emaShift < SDN_FILTER_Q ? spec->emaShift : SDN_FILTER_Q);
+}
+
+void SensorFilter::reset() {
+    begin(spec);
+}
+
+bool SensorFilter::update(float sample, float& value) {
+    if (!spec) {
+        value = sample;
+        return true;
+    }
+    int32_t filtered;
+    if (!update(F::fromFloat(sample), filtered)) return false;
+    value = F::toFloat(filtered);
+    return true;
+}
+
+bool SensorFilter::update(int32_t sample, int32_t& value) {
+    if (!spec) {
+        value = sample;
+        return true;
+    }
+    sample = calibration.update(sample);
+    if ((stages & STAGE_OUTLIER) && !outlier.accept(sample)) return false;
+    if (stages & STAGE_MEDIAN) sample = median.update(sample);
+    if (stages & STAGE_KALMAN) sample = kalman.update(sample);
+    if (stages & STAGE_EMA) sample = ema.update(sample);
+    value = sample;
+    return true;
+}
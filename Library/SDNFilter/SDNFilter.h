@@ -0,0 +1,254 @@
+/*
+ * SDN Filter Library
+ * Fixed-point streaming filters for sensor samples
+ *
+ * The ESP8266 has no FPU: every float multiply is a library call. The
+ * kernels here work on fixed-point samples instead, a T holding the value
+ * times 2^Q, with products in the next wider integer type. They are
+ * templates on T and Q; each keeps its state in a few words and is
+ * zero-initialized until begin(), so tables of them can be cleared with
+ * memset.
+ *
+ * SensorFilter chains the kernels for one capability sensor, in int32_t at
+ * SDN_FILTER_Q fraction bits (±32767 units in steps of 1/65536), as
+ * declared by a constexpr FilterSpec. Samples go through, in order:
+ *   calibration  value * gain + offset
+ *   outlier      a sample further than outlierLimit from the last accepted
+ *                one is dropped, unless SDN_FILTER_MAX_REJECTS in a row
+ *                were (then the signal has stepped and it is accepted)
+ *   median       moving median of medianWindow samples
+ *   kalman       1-D Kalman filter for a constant signal
+ *   ema          exponential moving average, new sample weight 2^-emaShift
+ * Stages left at zero in the spec are skipped. Floats are only touched
+ * converting the sample in and the result out.
+ */
+
+#ifndef SDN_FILTER_H
+#define SDN_FILTER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SDN_FILTER_Q 16           // Fraction bits of SensorFilter
+#define SDN_FILTER_MEDIAN_MAX 9   // Longest median window
+#define SDN_FILTER_MAX_REJECTS 3  // Outliers dropped in a row before a step is taken
+
+// Declarative filter of a capability sensor. A literal type of 32-bit
+// fields, so devices keep specs in flash next to their capability table:
+//   static constexpr FilterSpec SMOOTH SDN_CAPABILITY_TABLE = {...};
+struct FilterSpec {
+    float gain;                 // Calibration; 0 is taken as 1
+    float offset;
+    float outlierLimit;         // Units; 0 keeps every sample
+    uint32_t medianWindow;      // Samples; 0 or 1 is off
+    float kalmanProcess;        // Process noise variance per sample; 0 is off
+    float kalmanMeasurement;    // Measurement noise variance
+    uint32_t emaShift;          // 0 is off
+};
+
+// ==================== FIXED POINT ====================
+
+template <typename T> struct FixedWide;
+template <> struct FixedWide<int16_t> { typedef int32_t type; };
+template <> struct FixedWide<int32_t> { typedef int64_t type; };
+
+// Arithmetic on T holding value * 2^Q. Results saturate at the range of T.
+template <typename T, uint8_t Q>
+struct Fixed {
+    typedef typename FixedWide<T>::type Wide;
+    static constexpr Wide ONE = (Wide)1 << Q;
+    static constexpr T MAX = (T)(((Wide)1 << (sizeof(T) * 8 - 1)) - 1);
+    static constexpr T MIN = (T)(-MAX - 1);
+
+    static T saturate(Wide value) {
+        return value > MAX ? MAX : value < MIN ? MIN : (T)value;
+    }
+    static T fromFloat(float value) {
+        float scaled = value * ONE;
+        if (scaled >= MAX) return MAX;
+        if (scaled <= MIN) return MIN;
+        return (T)(scaled + (scaled < 0 ? -0.5f : 0.5f));
+    }
+    static float toFloat(T value) {
+        return value * (1.0f / ONE);
+    }
+    static T mul(T a, T b) {
+        return saturate(((Wide)a * b + (ONE >> 1)) >> Q);
+    }
+    static T div(T a, T b) {
+        return b == 0 ? (a < 0 ? MIN : MAX) : saturate(((Wide)a << Q) / b);
+    }
+};
+
+// ==================== KERNELS ====================
+
+// value * gain + offset
+template <typename T, uint8_t Q>
+struct CalibrationKernel {
+    T gain;
+    T offset;
+
+    void begin(T gain, T offset) {
+        this->gain = gain;
+        this->offset = offset;
+    }
+    T update(T sample) const {
+        typedef Fixed<T, Q> F;
+        return F::saturate((typename F::Wide)F::mul(sample, gain) + offset);
+    }
+};
+
+// Drops samples that jump further than `limit` from the last accepted one.
+// After maxRejects outliers in a row the signal has stepped, and the next
+// one is accepted.
+template <typename T>
+struct OutlierKernel {
+    T limit;
+    T last;
+    uint8_t rejects;
+    uint8_t maxRejects;
+    bool primed;
+
+    void begin(T limit, uint8_t maxRejects) {
+        this->limit = limit;
+        this->maxRejects = maxRejects;
+        rejects = 0;
+        primed = false;
+    }
+    bool accept(T sample) {
+        typedef typename FixedWide<T>::type Wide;
+        Wide step = (Wide)sample - last;
+        if (primed && (step > limit || -step > limit) && rejects++ < maxRejects) return false;
+        last = sample;
+        rejects = 0;
+        primed = true;
+        return true;
+    }
+};
+
+// Median of the last `size` samples (at most N); until the window has
+// filled, of those seen. Sorts a copy per sample, which for N <= 9 is
+// cheaper than keeping an ordered structure.
+template <typename T, uint8_t N>
+struct MedianKernel {
+    T window[N];
+    uint8_t size;
+    uint8_t next;
+    uint8_t count;
+
+    void begin(uint8_t size) {
+        this->size = size < N ? size : N;
+        next = 0;
+        count = 0;
+    }
+    T update(T sample) {
+        window[next] = sample;
+        next = next + 1 == size ? 0 : next + 1;
+        if (count < size) count++;
+
+        T sorted[N];
+        for (uint8_t i = 0; i < count; i++) {
+            T value = window[i];
+            uint8_t j = i;
+            for (; j > 0 && sorted[j - 1] > value; j--) {
+                sorted[j] = sorted[j - 1];
+            }
+            sorted[j] = value;
+        }
+        return sorted[count / 2];
+    }
+};
+
+// 1-D Kalman filter of a constant signal with process noise variance
+// `process` per sample and measurement noise variance `measurement`
+template <typename T, uint8_t Q>
+struct KalmanKernel {
+    T estimate;
+    T error;        // Estimate variance
+    T process;
+    T measurement;
+    bool primed;
+
+    void begin(T process, T measurement) {
+        this->process = process;
+        this->measurement = measurement;
+        primed = false;
+    }
+    T update(T sample) {
+        typedef Fixed<T, Q> F;
+        if (!primed) {
+            estimate = sample;
+            error = measurement;
+            primed = true;
+            return estimate;
+        }
+        error = F::saturate((typename F::Wide)error + process);
+        T gain = F::div(error, F::saturate((typename F::Wide)error + measurement));
+        estimate = F::saturate(estimate + (typename F::Wide)F::mul(gain, F::saturate((typename F::Wide)sample - estimate)));
+        error = F::mul(F::saturate(F::ONE - gain), error);
+        return estimate;
+    }
+};
+
+// Exponential moving average with weight 2^-shift of a new sample. The
+// state, in the wide type, keeps `shift` extra fraction bits so steps
+// smaller than 2^shift are not lost to truncation.
+template <typename T, uint8_t Q>
+struct EmaKernel {
+    typename FixedWide<T>::type state;
+    uint8_t shift;
+    bool primed;
+
+    void begin(uint8_t shift) {
+        this->shift = shift;
+        primed = false;
+    }
+    T update(T sample) {
+        typedef typename FixedWide<T>::type Wide;
+        if (!primed) {
+            state = (Wide)sample << shift;
+            primed = true;
+        } else {
+            state += (Wide)sample - ((state + ((Wide)1 << (shift - 1))) >> shift);
+        }
+        return (T)((state + ((Wide)1 << (shift - 1))) >> shift);
+    }
+};
+
+// ==================== SENSOR FILTER ====================
+
+// The FilterSpec chain of one sensor. All zero (or begin(nullptr)) passes
+// samples through unchanged.
+class SensorFilter {
+public:
+    void begin(const FilterSpec* spec);
+
+    // Restarts the stages from the next sample (e.g. after recalibration)
+    void reset();
+
+    // Filters `sample` into `value`. False if it was dropped as an outlier.
+    bool update(float sample, float& value);
+
+    // The same on a sample already in SDN_FILTER_Q fixed point
+    bool update(int32_t sample, int32_t& value);
+
+private:
+    typedef Fixed<int32_t, SDN_FILTER_Q> F;
+
+    enum Stage : uint8_t {
+        STAGE_OUTLIER = 1,
+        STAGE_MEDIAN = 2,
+        STAGE_KALMAN = 4,
+        STAGE_EMA = 8
+    };
+
+    const FilterSpec* spec;
+    uint8_t stages;             // Stage bits enabled by the spec
+    CalibrationKernel<int32_t, SDN_FILTER_Q> calibration;
+    OutlierKernel<int32_t> outlier;
+    MedianKernel<int32_t, SDN_FILTER_MEDIAN_MAX> median;
+    KalmanKernel<int32_t, SDN_FILTER_Q> kalman;
+    EmaKernel<int32_t, SDN_FILTER_Q> ema;
+};
+
+#endif
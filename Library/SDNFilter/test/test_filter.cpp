@@ -0,0 +1,208 @@
+/*
+ * SDNFilter host tests
+ * Step and outlier behaviour of the chain, accuracy of the fixed-point
+ * kernels against the same filters in double precision, and the cost of
+ * a sample (ns per sample on the host; compare builds, not boards).
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "SDNFilter.h"
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+// The stages of SensorFilter in double precision
+struct ReferenceFilter {
+    const FilterSpec* spec;
+    double last;
+    int rejects;
+    bool outlierPrimed;
+    std::vector<double> window;
+    size_t next;
+    double estimate;
+    double error;
+    bool kalmanPrimed;
+    double ema;
+    bool emaPrimed;
+
+    void begin(const FilterSpec* spec) {
+        this->spec = spec;
+        rejects = 0;
+        outlierPrimed = false;
+        window.clear();
+        next = 0;
+        kalmanPrimed = false;
+        emaPrimed = false;
+    }
+
+    bool update(double sample, double& value) {
+        sample = sample * (spec->gain != 0 ? spec->gain : 1.0) + spec->offset;
+        if (spec->outlierLimit > 0) {
+            if (outlierPrimed && fabs(sample - last) > spec->outlierLimit && rejects++ < SDN_FILTER_MAX_REJECTS) {
+                return false;
+            }
+            last = sample;
+            rejects = 0;
+            outlierPrimed = true;
+        }
+        if (spec->medianWindow > 1) {
+            if (window.size() < spec->medianWindow) {
+                window.push_back(sample);
+            } else {
+                window[next] = sample;
+            }
+            next = (next + 1) % spec->medianWindow;
+            std::vector<double> sorted = window;
+            std::sort(sorted.begin(), sorted.end());
+            sample = sorted[sorted.size() / 2];
+        }
+        if (spec->kalmanProcess > 0) {
+            if (!kalmanPrimed) {
+                estimate = sample;
+                error = spec->kalmanMeasurement;
+                kalmanPrimed = true;
+            } else {
+                error += spec->kalmanProcess;
+                double gain = error / (error + spec->kalmanMeasurement);
+                estimate += gain * (sample - estimate);
+                error *= 1 - gain;
+            }
+            sample = estimate;
+        }
+        if (spec->emaShift > 0) {
+            if (!emaPrimed) {
+                ema = sample;
+                emaPrimed = true;
+            } else {
+                ema += (sample - ema) / (1 << spec->emaShift);
+            }
+            sample = ema;
+        }
+        value = sample;
+        return true;
+    }
+};
+
+static const FilterSpec OUTLIER_ONLY = {1.0f, 0.0f, 2.0f, 0, 0.0f, 0.0f, 0};
+static const FilterSpec SMOOTH = {1.02f, -0.5f, 5.0f, 5, 0.01f, 0.25f, 3};
+
+// Three outliers in a row are dropped, the fourth is taken as a step
+static void testStep() {
+    printf("step\n");
+    SensorFilter filter;
+    filter.begin(&OUTLIER_ONLY);
+    float value;
+    for (int i = 0; i < 10; i++) {
+        CHECK(filter.update(10.0f, value));
+    }
+    for (int i = 0; i < SDN_FILTER_MAX_REJECTS; i++) {
+        CHECK(!filter.update(20.0f, value));
+    }
+    CHECK(filter.update(20.0f, value));
+    CHECK(value == 20.0f);
+    CHECK(filter.update(20.5f, value));
+}
+
+// A lone spike is dropped and does not count against the next one
+static void testOutlier() {
+    printf("outlier\n");
+    SensorFilter filter;
+    filter.begin(&OUTLIER_ONLY);
+    float value;
+    CHECK(filter.update(10.0f, value));
+    for (int i = 0; i < 5; i++) {
+        CHECK(!filter.update(50.0f, value));
+        CHECK(filter.update(10.5f, value));
+        CHECK(value == 10.5f);
+    }
+    CHECK(filter.update(12.0f, value));  // Within the limit of 10.5
+}
+
+// The fixed-point chain stays within a few steps of 2^-16 of double
+// precision, and smooths a noisy signal
+static void testAccuracy() {
+    printf("accuracy\n");
+    SensorFilter filter;
+    ReferenceFilter reference;
+    filter.begin(&SMOOTH);
+    reference.begin(&SMOOTH);
+
+    std::mt19937 random(1);
+    std::normal_distribution<double> noise(0.0, 0.5);
+    double maxError = 0;
+    double noiseSquares = 0;
+    double residualSquares = 0;
+    int compared = 0;
+    for (int i = 0; i < 20000; i++) {
+        double truth = 20.0 + 5.0 * sin(i * 0.001);
+        float sample = truth + noise(random);
+        float value;
+        double expected;
+        bool accepted = filter.update(sample, value);
+        CHECK(accepted == reference.update(sample, expected));
+        if (!accepted) continue;
+        maxError = fmax(maxError, fabs(value - expected));
+        if (i >= 100) {
+            double calibrated = truth * SMOOTH.gain + SMOOTH.offset;
+            noiseSquares += pow(sample * SMOOTH.gain + SMOOTH.offset - calibrated, 2);
+            residualSquares += pow(value - calibrated, 2);
+            compared++;
+        }
+    }
+    double noiseRms = sqrt(noiseSquares / compared);
+    double residualRms = sqrt(residualSquares / compared);
+    printf("  max error vs double %.6f, rms noise %.4f -> %.4f\n", maxError, noiseRms, residualRms);
+    CHECK(maxError < 0.001);
+    CHECK(residualRms < noiseRms / 2);
+}
+
+static void benchmark(const char* name, const FilterSpec* spec) {
+    const int samples = 2000000;
+    std::vector<int32_t> input(4096);
+    std::mt19937 random(2);
+    for (int32_t& sample : input) {
+        sample = (int32_t)((20.0 + std::normal_distribution<double>(0.0, 0.5)(random)) * 65536);
+    }
+
+    SensorFilter filter;
+    filter.begin(spec);
+    uint32_t sink = 0; // Keeps the loop from being optimized out
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < samples; i++) {
+        int32_t value;
+        if (filter.update(input[i & 4095], value)) sink += (uint32_t)value;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / samples;
+    printf("  %-8s %6.1f ns/sample (%d)\n", name, ns, (int)(sink & 1));
+}
+
+int main() {
+    testStep();
+    testOutlier();
+    testAccuracy();
+
+    printf("benchmark\n");
+    static const FilterSpec PASS = {};
+    static const FilterSpec MEDIAN = {1.0f, 0.0f, 0.0f, 9, 0.0f, 0.0f, 0};
+    static const FilterSpec KALMAN = {1.0f, 0.0f, 0.0f, 0, 0.01f, 0.25f, 0};
+    benchmark("pass", &PASS);
+    benchmark("median9", &MEDIAN);
+    benchmark("kalman", &KALMAN);
+    benchmark("smooth", &SMOOTH);
+
+    printf(failures == 0 ? "OK\n" : "%d FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,246 @@
+/*
+ * SDN JSON Stream Library Implementation
+ * A structural scanner finds the array; ArduinoJson parses each element
+ */
+
+#include "SDNJsonStream.h"
+
+static bool isJsonSpace(int c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// ==================== READER ====================
+
+JsonArrayReader::JsonArrayReader(Stream& in) : count(0), in(in), started(false), finished(true) {
+}
+
+// Next character after whitespace, not consumed; -1 at the end
+int JsonArrayReader::peekToken() {
+    int c;
+    while ((c = in.peek()) >= 0 && isJsonSpace(c)) {
+        in.read();
+    }
+    return c;
+}
+
+bool JsonArrayReader::fail(DeserializationError::Code code) {
+    lastError = DeserializationError(code);
+    finished = true;
+    return false;
+}
+
+bool JsonArrayReader::begin(const char* key) {
+    in.setTimeout(0); // Stream reads would otherwise wait at the end of file
+    count = 0;
+    started = false;
+    finished = true;
+    lastError = DeserializationError::Ok;
+
+    int first = peekToken();
+    if (first < 0) return false; // An empty file is an empty document
+    if (first != '{') return fail(DeserializationError::InvalidInput);
+    in.read();
+    if (peekToken() == '}') return false;
+
+    char name[SDN_JSON_KEY_SIZE];
+    while (true) {
+        if (peekToken() != '"' || !readKey(name, sizeof(name))) return fail(DeserializationError::InvalidInput);
+        if (peekToken() != ':') return fail(DeserializationError::InvalidInput);
+        in.read();
+
+        if (strcmp(name, key) == 0) {
+            if (peekToken() != '[') return fail(DeserializationError::InvalidInput);
+            in.read();
+            finished = false;
+            return true;
+        }
+
+        if (!skipValue()) return fail(DeserializationError::InvalidInput);
+        int c = peekToken();
+        if (c == '}') return false;
+        if (c != ',') {
+            return fail(c < 0 ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput);
+        }
+        in.read();
+    }
+}
+
+// Reads a member name; names too long for the buffer come back empty
+bool JsonArrayReader::readKey(char* buffer, size_t size) {
+    in.read(); // Opening quote
+    size_t length = 0;
+    bool overflow = false;
+    int c;
+    while ((c = in.read()) >= 0 && c != '"') {
+        if (c == '\\' && (c = in.read()) < 0) break;
+        if (length + 1 < size) buffer[length++] = c;
+        else overflow = true;
+    }
+    buffer[overflow ? 0 : length] = '\0';
+    return c == '"';
+}
+
+bool JsonArrayReader::skipString() {
+    in.read(); // Opening quote
+    int c;
+    while ((c = in.read()) >= 0) {
+        if (c == '"') return true;
+        if (c == '\\' && in.read() < 0) return false;
+    }
+    return false;
+}
+
+// Steps over one value by tracking nesting only; nothing is stored
+bool JsonArrayReader::skipValue() {
+    int depth = 0;
+    do {
+        int c = peekToken();
+        if (c < 0) return false;
+        if (c == '"') {
+            if (!skipString()) return false;
+        } else if (c == '{' || c == '[') {
+            in.read();
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (depth == 0) return false;
+            in.read();
+            depth--;
+        } else if (c == ',' || c == ':') {
+            if (depth == 0) return false;
+            in.read();
+        } else {
+            // Number or literal
+            while ((c = in.peek()) >= 0 && !isJsonSpace(c) && c != ',' && c != ':' && c != '}' && c != ']') {
+                in.read();
+            }
+        }
+    } while (depth > 0);
+    return true;
+}
+
+// Consumes the separator before the next element; false at the end
+bool JsonArrayReader::nextElement() {
+    if (finished) return false;
+
+    int c = peekToken();
+    if (c == ']') {
+        in.read();
+        finished = true;
+        return false;
+    }
+    if (started) {
+        if (c != ',') {
+            return fail(c < 0 ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput);
+        }
+        in.read();
+    }
+    if (peekToken() < 0) return fail(DeserializationError::IncompleteInput);
+    started = true;
+    return true;
+}
+
+bool JsonArrayReader::next(JsonDocument& element) {
+    if (!nextElement()) return false;
+    DeserializationError error = deserializeJson(element, in);
+    if (error) return fail(error.code());
+    count++;
+    return true;
+}
+
+bool JsonArrayReader::next(JsonDocument& element, JsonDocument& filter) {
+    if (!nextElement()) return false;
+    DeserializationError error = deserializeJson(element, in, DeserializationOption::Filter(filter));
+    if (error) return fail(error.code());
+    count++;
+    return true;
+}
+
+bool JsonArrayReader::skip() {
+    if (!nextElement()) return false;
+    if (!skipValue()) return fail(DeserializationError::InvalidInput);
+    count++;
+    return true;
+}
+
+// ==================== WRITER ====================
+
+JsonArrayWriter::JsonArrayWriter(Print& out) : count(0), written(0), out(out), opened(false) {
+}
+
+// Starts the document or separates the next member
+void JsonArrayWriter::open() {
+    written += out.write(opened ? ',' : '{');
+    opened = true;
+}
+
+void JsonArrayWriter::member(const char* key, JsonVariantConst value) {
+    open();
+    written += out.write('"');
+    written += out.print(key);
+    written += out.print("\":");
+    written += serializeJson(value, out);
+}
+
+void JsonArrayWriter::beginArray(const char* key) {
+    open();
+    written += out.write('"');
+    written += out.print(key);
+    written += out.print("\":[");
+}
+
+void JsonArrayWriter::add(JsonVariantConst element) {
+    if (count++ > 0) written += out.write(',');
+    written += serializeJson(element, out);
+}
+
+void JsonArrayWriter::end() {
+    written += out.print("]}");
+}
+
+// ==================== IN-PLACE APPEND ====================
+
+// Positions the file on the final "]" of a document ending in "]}"; false
+// if it does not end so. `empty` tells whether the array has no elements.
+static bool seekArrayEnd(File& file, bool& empty) {
+    char tail[16];
+    size_t size = file.size();
+    size_t length = size < sizeof(tail) ? size : sizeof(tail);
+    if (!file.seek(size - length) || file.read((uint8_t*)tail, length) != length) return false;
+
+    // Expect "]" then "}", each possibly followed by whitespace
+    int i = length - 1;
+    while (i >= 0 && isJsonSpace(tail[i])) i--;
+    if (i < 0 || tail[i] != '}') return false;
+    i--;
+    while (i >= 0 && isJsonSpace(tail[i])) i--;
+    if (i < 0 || tail[i] != ']') return false;
+
+    int before = i - 1;
+    while (before >= 0 && isJsonSpace(tail[before])) before--;
+    empty = before >= 0 && tail[before] == '[';
+
+    // Leftover bytes past the new "]}" can only be whitespace
+    return file.seek(size - length + i);
+}
+
+size_t appendJsonArrayElement(File& file, JsonVariantConst element) {
+    bool empty;
+    if (!seekArrayEnd(file, empty)) return 0;
+    size_t written = empty ? 0 : file.write(',');
+    written += serializeJson(element, file);
+    written += file.write((const uint8_t*)"]}", 2);
+    return written;
+}
+
+size_t appendJsonArrayElements(File& file, JsonArrayConst elements) {
+    bool empty;
+    if (elements.size() == 0 || !seekArrayEnd(file, empty)) return 0;
+    size_t written = 0;
+    for (JsonVariantConst element : elements) {
+        if (!empty) written += file.write(',');
+        written += serializeJson(element, file);
+        empty = false;
+    }
+    written += file.write((const uint8_t*)"]}", 2);
+    return written;
+}
@@ -0,0 +1,88 @@
+/*
+ * SDN JSON Stream Library
+ * Element-at-a-time reading and writing of {"key":[...]} documents
+ *
+ * Control plane files hold one large array of small objects (the device
+ * registry, the command lists, a day of readings). JsonArrayReader walks
+ * the array of one top-level member and deserializes a single element at a
+ * time; the other members are skipped unparsed. JsonArrayWriter produces
+ * the same shape incrementally. Memory is one element, whatever the size
+ * of the file.
+ */
+
+#ifndef SDN_JSON_STREAM_H
+#define SDN_JSON_STREAM_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <FS.h>
+
+#define SDN_JSON_KEY_SIZE 32 // Longer member names never match
+
+class JsonArrayReader {
+public:
+    JsonArrayReader(Stream& in);
+
+    // Moves to the array of the top-level member `key`. False if the
+    // document has no such array; an empty input is not an error.
+    bool begin(const char* key);
+
+    // Reads the next element, which must be an object, array or string.
+    // False at the end of the array or on error (see error()).
+    bool next(JsonDocument& element);
+    bool next(JsonDocument& element, JsonDocument& filter);
+
+    // Steps over the next element without parsing it
+    bool skip();
+
+    // Ok after a clean end of the array
+    DeserializationError error() const { return lastError; }
+
+    size_t count; // Elements read or skipped so far
+
+private:
+    Stream& in;
+    bool started;
+    bool finished;
+    DeserializationError lastError;
+
+    int peekToken();
+    bool readKey(char* buffer, size_t size);
+    bool skipString();
+    bool skipValue();
+    bool nextElement();
+    bool fail(DeserializationError::Code code);
+};
+
+class JsonArrayWriter {
+public:
+    JsonArrayWriter(Print& out);
+
+    // Members written before the array, e.g. "date" of a day file
+    void member(const char* key, JsonVariantConst value);
+
+    void beginArray(const char* key);
+    void add(JsonVariantConst element);
+
+    // Closes the array and the document
+    void end();
+
+    size_t count;   // Elements added
+    size_t written; // Bytes written
+
+private:
+    Print& out;
+    bool opened;
+
+    void open();
+};
+
+// Appends one element in place to the array that closes a document, by
+// rewriting its final "]}". The file must be open for reading and writing.
+// Returns the bytes written, or 0 (file unchanged) if it does not end so.
+size_t appendJsonArrayElement(File& file, JsonVariantConst element);
+
+// Same, for all elements of a batch in one write pass. 0 for an empty batch.
+size_t appendJsonArrayElements(File& file, JsonArrayConst elements);
+
+#endif
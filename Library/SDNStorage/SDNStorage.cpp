@@ -0,0 +1,214 @@
+/*
+ * SDN Storage Library Implementation
+ * Handle cache with sector-aligned append buffers
+ */
+
+#include "SDNStorage.h"
+
+StorageCache::StorageCache(FS& fs, const StoragePolicy& policy) : fs(fs), policy(policy) {
+    memset(&stats, 0, sizeof(stats));
+    for (Handle& handle : handles) {
+        handle.path[0] = '\0';
+        handle.buffered = 0;
+        handle.dirty = false;
+    }
+}
+
+// ==================== HANDLES ====================
+
+StorageCache::Handle* StorageCache::find(const char* path) {
+    for (Handle& handle : handles) {
+        if (handle.path[0] != '\0' && strcmp(handle.path, path) == 0) return &handle;
+    }
+    return nullptr;
+}
+
+// Returns the open handle of `path`, reopening it if it was opened for the
+// other kind of use, or opens it in a free or the least recently used slot
+StorageCache::Handle* StorageCache::acquire(const char* path, bool appending, const char* mode) {
+    if (strlen(path) >= SDN_STORAGE_PATH_SIZE) return nullptr;
+
+    Handle* handle = find(path);
+    if (handle && handle->appending != appending) {
+        release(*handle);
+        handle = nullptr;
+    }
+    if (!handle) {
+        Handle* oldest = nullptr;
+        for (Handle& candidate : handles) {
+            if (candidate.path[0] == '\0') {
+                handle = &candidate;
+                break;
+            }
+            if (!oldest || (long)(candidate.usedAt - oldest->usedAt) < 0) oldest = &candidate;
+        }
+        if (!handle) {
+            handle = oldest;
+            release(*handle);
+            stats.evictions++;
+        }
+
+        handle->file = fs.open(path, mode);
+        if (!handle->file) return nullptr;
+        strlcpy(handle->path, path, sizeof(handle->path));
+        handle->appending = appending;
+        handle->dirty = false;
+        handle->size = handle->file.size();
+        handle->buffered = 0;
+        stats.opens++;
+    }
+    handle->usedAt = millis();
+    return handle;
+}
+
+void StorageCache::release(Handle& handle) {
+    if (handle.path[0] == '\0') return;
+    writeBuffer(handle, false);
+    handle.file.close(); // Also syncs
+    if (handle.dirty) stats.syncs++;
+    handle.dirty = false;
+    handle.path[0] = '\0';
+}
+
+// ==================== WRITES ====================
+
+// Writes the buffer up to its last sector boundary, or all of it. Since
+// the first write after opening ends on a boundary, later whole-sector
+// writes start on one too.
+void StorageCache::writeBuffer(Handle& handle, bool wholeSectors) {
+    if (handle.buffered == 0) return;
+
+    uint32_t end = handle.size + handle.buffered;
+    if (wholeSectors) end -= end % SDN_SECTOR_SIZE;
+    if (end <= handle.size) return;
+
+    size_t length = end - handle.size;
+    size_t written = handle.file.write(handle.buffer, length);
+    stats.writes++;
+    if (written > 0) {
+        uint32_t last = handle.size + written - 1;
+        stats.sectorWrites += last / SDN_SECTOR_SIZE - handle.size / SDN_SECTOR_SIZE + 1;
+        if ((last + 1) % SDN_SECTOR_SIZE != 0) stats.partialWrites++;
+    }
+    stats.bytesWritten += written;
+
+    // A failed write drops the bytes rather than retrying them forever;
+    // the size follows what reached the card. bufferedAt is kept for what
+    // remains, so it is flushed early if at all.
+    if (written < length) stats.writeErrors++;
+    handle.size += written;
+    handle.buffered -= length;
+    memmove(handle.buffer, handle.buffer + length, handle.buffered);
+    if (!handle.dirty) {
+        handle.dirty = true;
+        handle.writtenAt = millis();
+    }
+}
+
+void StorageCache::syncHandle(Handle& handle) {
+    writeBuffer(handle, false);
+    if (!handle.dirty) return;
+    handle.file.flush();
+    handle.dirty = false;
+    stats.syncs++;
+}
+
+bool StorageCache::append(const char* path, const uint8_t* data, size_t length) {
+    Handle* handle = acquire(path, true, FILE_APPEND);
+    if (!handle) {
+        // Not cacheable: a plain append
+        if (strlen(path) < SDN_STORAGE_PATH_SIZE) return false;
+        File file = fs.open(path, FILE_APPEND);
+        if (!file) return false;
+        size_t written = file.write(data, length);
+        file.close();
+        if (written < length) stats.writeErrors++;
+        return written == length;
+    }
+
+    while (length > 0) {
+        if (handle->buffered == 0) handle->bufferedAt = millis();
+        size_t space = sizeof(handle->buffer) - handle->buffered;
+        size_t chunk = length < space ? length : space;
+        memcpy(handle->buffer + handle->buffered, data, chunk);
+        handle->buffered += chunk;
+        data += chunk;
+        length -= chunk;
+        if (handle->buffered == sizeof(handle->buffer)) writeBuffer(*handle, true);
+    }
+    return true;
+}
+
+uint32_t StorageCache::size(const char* path) {
+    Handle* handle = find(path);
+    if (!handle) handle = acquire(path, true, FILE_APPEND);
+    if (!handle) return 0;
+    return handle->appending ? handle->size + handle->buffered : handle->file.size();
+}
+
+File* StorageCache::edit(const char* path, bool create) {
+    Handle* handle = acquire(path, false, create ? "w+" : "r+");
+    if (!handle) return nullptr;
+    if (create && handle->file.size() > 0) {
+        // Already open "r+": reopen truncated
+        release(*handle);
+        handle = acquire(path, false, "w+");
+        if (!handle) return nullptr;
+    }
+    if (!handle->dirty) {
+        handle->dirty = true;
+        handle->writtenAt = millis();
+    }
+    return &handle->file;
+}
+
+// ==================== POLICY ====================
+
+void StorageCache::sync(const char* path) {
+    Handle* handle = find(path);
+    if (handle) syncHandle(*handle);
+}
+
+void StorageCache::close(const char* path) {
+    Handle* handle = find(path);
+    if (handle) release(*handle);
+}
+
+void StorageCache::closeAll() {
+    for (Handle& handle : handles) {
+        release(handle);
+    }
+}
+
+void StorageCache::loop() {
+    unsigned long now = millis();
+    for (Handle& handle : handles) {
+        if (handle.path[0] == '\0') continue;
+        if (now - handle.usedAt >= policy.idleMs) {
+            release(handle);
+            continue;
+        }
+        if (handle.buffered > 0 && now - handle.bufferedAt >= policy.flushMs) {
+            writeBuffer(handle, false);
+        }
+        if (handle.dirty && now - handle.writtenAt >= policy.syncMs) {
+            syncHandle(handle);
+        }
+    }
+}
+
+size_t StorageCache::openHandles() const {
+    size_t count = 0;
+    for (const Handle& handle : handles) {
+        if (handle.path[0] != '\0') count++;
+    }
+    return count;
+}
+
+size_t StorageCache::bufferedBytes() const {
+    size_t bytes = 0;
+    for (const Handle& handle : handles) {
+        if (handle.path[0] != '\0') bytes += handle.buffered;
+    }
+    return bytes;
+}
@@ -0,0 +1,106 @@
+/*
+ * SDN Storage Library
+ * Long-lived, sector-buffered handles for the hot files of ingest
+ *
+ * Opening a FAT file walks its directory, and each small write rewrites
+ * the partly filled last sector of the file (a read-modify-write of the
+ * card's erase block) and, on close, the directory entry. StorageCache
+ * keeps the files written on every payload open and collects appends in
+ * a sector-aligned buffer per file, so the card sees whole sectors at
+ * sector offsets:
+ *   size      a full buffer is written up to its last sector boundary
+ *   time      buffered bytes older than flushMs are written as they are
+ *   sync      files written to are synced (size in the directory entry)
+ *             at most syncMs after the write, so a power cut loses at most
+ *             flushMs + syncMs of appends
+ *   idle      handles unused for idleMs are closed; when all are taken the
+ *             least recently used one is closed
+ * Another handle on a cached file only sees what was synced: readers call
+ * sync(path) first, renames and removals close(path).
+ */
+
+#ifndef SDN_STORAGE_H
+#define SDN_STORAGE_H
+
+#include <Arduino.h>
+#include <FS.h>
+
+#define SDN_SECTOR_SIZE 512
+#define SDN_STORAGE_SECTORS 2    // Append buffer of each handle
+#define SDN_STORAGE_HANDLES 6    // Files kept open
+#define SDN_STORAGE_PATH_SIZE 48 // Longer paths are not cached
+
+struct StoragePolicy {
+    uint32_t flushMs; // Longest a byte stays buffered
+    uint32_t syncMs;  // Longest written data stays unsynced
+    uint32_t idleMs;  // Unused handles are closed after this
+};
+
+struct StorageStats {
+    uint32_t opens;
+    uint32_t evictions;     // Handles closed to make room for another file
+    uint32_t writes;        // Buffer writes reaching the card
+    uint32_t sectorWrites;  // Sectors those writes touched
+    uint32_t partialWrites; // Writes ending inside a sector (time, sync, close)
+    uint32_t syncs;
+    uint32_t writeErrors;   // Short writes; their missing bytes are dropped
+    uint64_t bytesWritten;
+};
+
+class StorageCache {
+public:
+    StorageCache(FS& fs, const StoragePolicy& policy);
+
+    // Appends to the end of `path`, creating the file. False if it cannot
+    // be opened (e.g. its directory does not exist).
+    bool append(const char* path, const uint8_t* data, size_t length);
+
+    // Size of `path` including buffered appends, 0 if it cannot be opened
+    uint32_t size(const char* path);
+
+    // Handle for in-place edits, opened "r+", or "w+" (truncated) when
+    // `create` is set. Counts as written to. nullptr if it cannot be
+    // opened. Valid until the next call on the cache.
+    File* edit(const char* path, bool create);
+
+    // Writes buffered bytes and syncs, so other handles see them
+    void sync(const char* path);
+
+    // Syncs and closes, before the file is renamed or removed
+    void close(const char* path);
+    void closeAll();
+
+    // Applies the time, sync and idle policy; call from loop()
+    void loop();
+
+    size_t openHandles() const;
+    size_t bufferedBytes() const;
+
+    StorageStats stats;
+
+private:
+    struct Handle {
+        char path[SDN_STORAGE_PATH_SIZE];
+        File file;
+        bool appending;           // Opened "a"; edit handles are "r+"
+        bool dirty;               // Written to since the last sync
+        uint32_t size;            // On the card, without the buffer
+        uint16_t buffered;
+        unsigned long bufferedAt; // millis() of the oldest buffered byte
+        unsigned long writtenAt;  // millis() of the oldest unsynced write
+        unsigned long usedAt;
+        alignas(4) uint8_t buffer[SDN_SECTOR_SIZE * SDN_STORAGE_SECTORS];
+    };
+
+    FS& fs;
+    StoragePolicy policy;
+    Handle handles[SDN_STORAGE_HANDLES];
+
+    Handle* find(const char* path);
+    Handle* acquire(const char* path, bool appending, const char* mode);
+    void writeBuffer(Handle& handle, bool wholeSectors);
+    void syncHandle(Handle& handle);
+    void release(Handle& handle);
+};
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ * Host stand-in for the Arduino core, as much as SDNStorage uses
+ */
+
+#ifndef ARDUINO_H_HOST
+#define ARDUINO_H_HOST
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+extern unsigned long fakeMillis;
+
+inline unsigned long millis() {
+    return fakeMillis;
+}
+
+inline size_t strlcpy(char* dst, const char* src, size_t size) {
+    size_t length = strlen(src);
+    if (size > 0) {
+        size_t copied = length < size - 1 ? length : size - 1;
+        memcpy(dst, src, copied);
+        dst[copied] = '\0';
+    }
+    return length;
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Host stand-in for the Arduino FS: files live in memory, and every write
+ * reaching a file is logged with its offset, so tests can tell which
+ * sectors the card would have been asked to program.
+ */
+
+#ifndef FS_H_HOST
+#define FS_H_HOST
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+struct FakeWrite {
+    std::string path;
+    uint32_t offset;
+    size_t length;
+};
+
+struct FakeFileData {
+    std::string path;
+    std::vector<uint8_t> bytes;
+};
+
+class FakeFS;
+
+class File {
+public:
+    File() : fs(nullptr), position(0) {}
+    File(FakeFS* fs, std::shared_ptr<FakeFileData> data, uint32_t position)
+        : fs(fs), data(data), position(position) {}
+
+    explicit operator bool() const { return data != nullptr; }
+    size_t write(const uint8_t* buffer, size_t length);
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t size() const { return data ? data->bytes.size() : 0; }
+    void flush() {}
+    void close() { data.reset(); }
+
+private:
+    FakeFS* fs;
+    std::shared_ptr<FakeFileData> data;
+    uint32_t position;
+};
+
+class FakeFS {
+public:
+    std::map<std::string, std::shared_ptr<FakeFileData>> files;
+    std::vector<FakeWrite> writes;
+    size_t writeBudget = SIZE_MAX;  // Bytes the card takes before writes come up short
+
+    File open(const char* path, const char* mode) {
+        std::string name(path);
+        auto found = files.find(name);
+        if (mode[0] == 'r' && found == files.end()) return File();
+        if (found == files.end() || mode[0] == 'w') {
+            auto data = std::make_shared<FakeFileData>();
+            data->path = name;
+            files[name] = data;
+            found = files.find(name);
+        }
+        uint32_t position = mode[0] == 'a' ? found->second->bytes.size() : 0;
+        return File(this, found->second, position);
+    }
+
+    std::string contents(const char* path) {
+        auto found = files.find(path);
+        if (found == files.end()) return "";
+        return std::string(found->second->bytes.begin(), found->second->bytes.end());
+    }
+};
+
+typedef FakeFS FS;
+
+inline size_t File::write(const uint8_t* buffer, size_t length) {
+    if (!data) return 0;
+    if (length > fs->writeBudget) length = fs->writeBudget;
+    fs->writeBudget -= fs->writeBudget == SIZE_MAX ? 0 : length;
+    if (length == 0) return 0;
+    if (data->bytes.size() < position + length) data->bytes.resize(position + length);
+    memcpy(data->bytes.data() + position, buffer, length);
+    fs->writes.push_back({data->path, position, length});
+    position += length;
+    return length;
+}
+
+#endif
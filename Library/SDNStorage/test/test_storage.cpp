@@ -0,0 +1,166 @@
+/*
+ * SDNStorage host tests
+ * StorageCache on an in-memory FS that logs every write reaching a file;
+ * the sector statistics must match what the log says the card was asked
+ * to program.
+ */
+
+#include <stdio.h>
+#include <string>
+#include "SDNStorage.h"
+
+unsigned long fakeMillis = 0;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static const StoragePolicy POLICY = {2000, 5000, 60000};
+
+struct SectorCount {
+    uint32_t writes;
+    uint32_t sectors;
+    uint32_t partial;
+    uint32_t unaligned;  // Writes starting inside a sector
+};
+
+static SectorCount countSectors(const FakeFS& fs) {
+    SectorCount count = {};
+    for (const FakeWrite& write : fs.writes) {
+        uint32_t last = write.offset + write.length - 1;
+        count.writes++;
+        count.sectors += last / SDN_SECTOR_SIZE - write.offset / SDN_SECTOR_SIZE + 1;
+        if ((last + 1) % SDN_SECTOR_SIZE != 0) count.partial++;
+        if (write.offset % SDN_SECTOR_SIZE != 0) count.unaligned++;
+    }
+    return count;
+}
+
+static void checkStats(const StorageCache& cache, const FakeFS& fs) {
+    SectorCount count = countSectors(fs);
+    CHECK(cache.stats.sectorWrites == count.sectors);
+    CHECK(cache.stats.partialWrites == count.partial);
+}
+
+static std::string record(int i) {
+    char line[48];
+    snprintf(line, sizeof(line), "{\"timestamp\":%d,\"value\":%d.5}\n", 1700000000 + i, i);
+    return line;
+}
+
+// Small appends reach the card as whole, aligned sectors
+static void testWholeSectors() {
+    printf("whole sectors\n");
+    FakeFS fs;
+    StorageCache cache(fs, POLICY);
+    std::string expected;
+    for (int i = 0; i < 400; i++) {
+        std::string line = record(i);
+        CHECK(cache.append("/data/a.log", (const uint8_t*)line.data(), line.size()));
+        expected += line;
+    }
+    SectorCount count = countSectors(fs);
+    CHECK(count.writes > 0);
+    CHECK(count.partial == 0);
+    CHECK(count.unaligned == 0);
+    CHECK(cache.size("/data/a.log") == expected.size());
+    checkStats(cache, fs);
+
+    cache.close("/data/a.log");
+    CHECK(fs.contents("/data/a.log") == expected);
+    CHECK(cache.stats.partialWrites == 1);
+    checkStats(cache, fs);
+}
+
+// Buffered bytes older than flushMs are written as they are, and later
+// whole-sector writes realign
+static void testTimeFlush() {
+    printf("time flush\n");
+    FakeFS fs;
+    StorageCache cache(fs, POLICY);
+    std::string line = record(1);
+    cache.append("/data/b.log", (const uint8_t*)line.data(), line.size());
+    cache.loop();
+    CHECK(fs.writes.empty());
+
+    fakeMillis += POLICY.flushMs;
+    cache.loop();
+    CHECK(fs.writes.size() == 1);
+    CHECK(cache.stats.partialWrites == 1);
+
+    for (int i = 0; i < 100; i++) {
+        line = record(i);
+        cache.append("/data/b.log", (const uint8_t*)line.data(), line.size());
+    }
+    CHECK(countSectors(fs).unaligned == 1);  // Only the write after the flush
+    checkStats(cache, fs);
+    cache.closeAll();
+}
+
+// A short write moves the size by what reached the card and is counted
+static void testShortWrite() {
+    printf("short write\n");
+    FakeFS fs;
+    StorageCache cache(fs, POLICY);
+    fs.writeBudget = 700;
+    for (int i = 0; i < 100; i++) {
+        std::string line = record(i);
+        cache.append("/data/c.log", (const uint8_t*)line.data(), line.size());
+    }
+    cache.sync("/data/c.log");
+    CHECK(cache.stats.writeErrors >= 1);
+    CHECK(cache.stats.bytesWritten == 700);
+    CHECK(fs.contents("/data/c.log").size() == 700);
+    CHECK(cache.size("/data/c.log") == 700);
+    checkStats(cache, fs);
+
+    fs.writeBudget = SIZE_MAX;
+    std::string line = record(100);
+    cache.append("/data/c.log", (const uint8_t*)line.data(), line.size());
+    CHECK(cache.size("/data/c.log") == 700 + line.size());
+    cache.close("/data/c.log");
+    CHECK(fs.contents("/data/c.log").size() == 700 + line.size());
+    checkStats(cache, fs);
+}
+
+// More files than handles: the least recently used is closed, nothing lost
+static void testEviction() {
+    printf("eviction\n");
+    FakeFS fs;
+    StorageCache cache(fs, POLICY);
+    std::string expected[SDN_STORAGE_HANDLES + 2];
+    for (int round = 0; round < 3; round++) {
+        for (int file = 0; file < SDN_STORAGE_HANDLES + 2; file++) {
+            char path[32];
+            snprintf(path, sizeof(path), "/data/%d.log", file);
+            std::string line = record(round * 100 + file);
+            cache.append(path, (const uint8_t*)line.data(), line.size());
+            expected[file] += line;
+            fakeMillis++;
+        }
+    }
+    CHECK(cache.openHandles() == SDN_STORAGE_HANDLES);
+    CHECK(cache.stats.evictions > 0);
+    cache.closeAll();
+    for (int file = 0; file < SDN_STORAGE_HANDLES + 2; file++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/data/%d.log", file);
+        CHECK(fs.contents(path) == expected[file]);
+    }
+    checkStats(cache, fs);
+}
+
+int main() {
+    testWholeSectors();
+    testTimeFlush();
+    testShortWrite();
+    testEviction();
+    printf(failures == 0 ? "OK\n" : "%d FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
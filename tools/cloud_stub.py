@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""
+Cloud uplink test receiver
+
+Stands in for the cloud endpoint of the control plane's uplink
+(/config/cloud.json). Accepts application/x-sdn-archive batches, checks
+the record structure, drops repeated X-Batch-Id values as the real
+receiver should, and prints per-batch and running totals. --fail and
+--delay simulate an unreliable or slow cloud to exercise the backoff.
+
+  python3 tools/cloud_stub.py --port 8080
+  {"endpoint":"http://192.168.4.2:8080/ingest","batchSize":200}
+"""
+
+import argparse
+import random
+import struct
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+MAGIC = b"SDB1"
+
+
+def parse_archive(data):
+    """Returns (series, blocks, points) of an archive, or raises ValueError."""
+    if data[:4] != MAGIC:
+        raise ValueError("bad magic")
+    position = 4
+    series = {}
+    blocks = 0
+    points = 0
+    while position < len(data):
+        kind = data[position:position + 1]
+        if kind == b"S":
+            (series_id,) = struct.unpack_from("<H", data, position + 1)
+            position += 3
+            fields = []
+            for _ in range(3):
+                end = data.index(b"\0", position)
+                fields.append(data[position:end].decode("utf-8", "replace"))
+                position = end + 1
+            series[series_id] = tuple(fields)
+        elif kind == b"B":
+            if position + 15 > len(data):
+                raise ValueError("truncated block header")
+            series_id, count, _, _, length = struct.unpack_from("<HHIIH", data, position + 1)
+            if series_id not in series:
+                raise ValueError("block of undefined series %d" % series_id)
+            position += 15 + length
+            if position > len(data):
+                raise ValueError("truncated block")
+            blocks += 1
+            points += count
+        else:
+            raise ValueError("unknown record at %d" % position)
+    return series, blocks, points
+
+
+class Handler(BaseHTTPRequestHandler):
+    seen = set()
+    batches = 0
+    points = 0
+    bytes = 0
+
+    def do_POST(self):
+        length = int(self.headers.get("Content-Length", 0))
+        data = self.rfile.read(length)
+        options = self.server.options
+        if options.delay > 0:
+            time.sleep(options.delay)
+        if random.random() < options.fail:
+            self.reply(503, "simulated failure")
+            return
+        try:
+            series, blocks, points = parse_archive(data)
+        except ValueError as error:
+            self.reply(400, str(error))
+            return
+
+        batch_id = self.headers.get("X-Batch-Id", "")
+        duplicate = batch_id in Handler.seen
+        if not duplicate:
+            Handler.seen.add(batch_id)
+            Handler.batches += 1
+            Handler.points += points
+            Handler.bytes += len(data)
+        print("batch %s: %d series, %d blocks, %d points, %d bytes%s | total %d batches, %d points, %d bytes"
+              % (batch_id, len(series), blocks, points, len(data), " (duplicate)" if duplicate else "",
+                 Handler.batches, Handler.points, Handler.bytes))
+        self.reply(200, "ok")
+
+    def reply(self, code, message):
+        body = message.encode()
+        self.send_response(code)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--fail", type=float, default=0.0, help="fraction of batches answered 503")
+    parser.add_argument("--delay", type=float, default=0.0, help="seconds before each reply")
+    options = parser.parse_args()
+
+    server = HTTPServer(("", options.port), Handler)
+    server.options = options
+    print("Listening on port %d" % options.port)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        sys.exit(0)
+
+
+if __name__ == "__main__":
+    main()
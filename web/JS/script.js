@@ -5,6 +5,12 @@
  * Version: 2.0
  */
 
+// Stored timestamps are epoch seconds; older rows may hold milliseconds
+function toDate(timestamp) {
+    const value = parseInt(timestamp);
+    return new Date(value < 1e11 ? value * 1000 : value);
+}
+
 class ESP32IoTSystem {
     constructor() {
         this.baseURL = '';  // Empty for same-origin requests
@@ -21,10 +27,29 @@ class ESP32IoTSystem {
 
     init() {
         this.setupEventListeners();
-        this.checkAuthentication();
+        if (this.checkAuthentication() && this.token) {
+            this.syncClock();
+        }
         this.startAutoRefresh();
     }
 
+    // The Control Plane runs in AP mode without NTP; the browser seeds its
+    // clock so readings are stored under epoch time
+    async syncClock() {
+        try {
+            await fetch('/api/time', {
+                method: 'POST',
+                headers: {
+                    'Content-Type': 'application/json',
+                    'Authorization': this.token
+                },
+                body: JSON.stringify({ epochMs: Date.now() })
+            });
+        } catch (error) {
+            console.error('Error syncing clock:', error);
+        }
+    }
+
     // ==================== AUTHENTICATION ====================
     
     async login(username, password) {
@@ -195,7 +220,7 @@ class ESP32IoTSystem {
                     'Content-Type': 'application/x-www-form-urlencoded',
                     'Authorization': this.token
                 },
-                body: `deviceId=${encodeURIComponent(deviceId)}&status=${encodeURIComponent(status)}&lastSeen=${Date.now()}`
+                body: `deviceId=${encodeURIComponent(deviceId)}&status=${encodeURIComponent(status)}&lastSeen=${Math.floor(Date.now() / 1000)}`
             });
 
             if (response.ok) {
@@ -473,7 +498,7 @@ class ESP32IoTSystem {
         
         tableBody.innerHTML = this.logData.map(item => `
             <tr>
-                <td>${new Date(parseInt(item.timestamp)).toLocaleString()}</td>
+                <td>${toDate(item.timestamp).toLocaleString()}</td>
                 <td>${item.deviceName}</td>
                 <td>${item.type}</td>
                 <td>${item.value}</td>
@@ -1064,7 +1089,7 @@ function displayDeviceList(devices) {
         deviceDiv.className = `device-card ${device.connected ? 'connected' : 'disconnected'}`;
         
         const lastSeenTime = device.lastHeartbeat ? 
-            new Date(parseInt(device.lastHeartbeat)).toLocaleString() : 
+            toDate(device.lastHeartbeat).toLocaleString() : 
             'Never';
         
         deviceDiv.innerHTML = `
@@ -1147,7 +1172,7 @@ function displayDeviceDataModal(device, data) {
         dataContainer.innerHTML = `
             <div class="data-summary">
                 <p><strong>Total Records:</strong> ${data.length}</p>
-                <p><strong>Latest Reading:</strong> ${new Date(data[0].timestamp).toLocaleString()}</p>
+                <p><strong>Latest Reading:</strong> ${toDate(data[0].timestamp).toLocaleString()}</p>
             </div>
             <div class="data-table-container">
                 <table class="data-table">
@@ -1160,7 +1185,7 @@ function displayDeviceDataModal(device, data) {
                     <tbody>
                         ${data.slice(0, 50).map(record => `
                             <tr>
-                                <td>${new Date(record.timestamp).toLocaleString()}</td>
+                                <td>${toDate(record.timestamp).toLocaleString()}</td>
                                 <td>${JSON.stringify(record.data, null, 2)}</td>
                             </tr>
                         `).join('')}